@@ -0,0 +1,855 @@
+/*
+ * Copyright 2014-2018, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define MONGO_LOG_DEFAULT_COMPONENT ::mongo::logger::LogComponent::kStorage
+
+#include "pmse_art.h"
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "mongo/bson/ordering.h"
+#include "mongo/db/storage/key_string.h"
+#include "mongo/stdx/mutex.h"
+#include "mongo/util/assert_util.h"
+#include "mongo/util/log.h"
+
+namespace mongo {
+
+namespace {
+const KeyString::Version kKeyStringVersion = KeyString::Version::V1;
+
+template <typename T>
+persistent_ptr<T> as(persistent_ptr<PmseArtNode> node) {
+    return persistent_ptr<T>(node.raw());
+}
+
+uint8_t byteAt(const char* data, size_t index) {
+    return static_cast<uint8_t>(data[index]);
+}
+}  // namespace
+
+StatusWith<bool> PmseArt::parseEnabled(const BSONObj& options) {
+    BSONElement elem = options["indexType"];
+    if (elem.eoo())
+        return false;
+    if (elem.type() != String)
+        return Status(ErrorCodes::BadValue, "indexType must be a string");
+    if (elem.valueStringData() == "art")
+        return true;
+    if (elem.valueStringData() == "btree")
+        return false;
+    return Status(ErrorCodes::BadValue, "indexType must be \"btree\" or \"art\"");
+}
+
+Status PmseArt::insert(pool_base pop, const BSONObj& key, const RecordId& loc,
+                       const BSONObj& ordering, bool dupsAllowed) {
+    Ordering order = Ordering::make(ordering);
+    KeyString keyString(kKeyStringVersion, key, order, loc);
+    StringData bytes(keyString.getBuffer(), keyString.getSize());
+    stdx::lock_guard<pmem::obj::shared_mutex> guard(_lock);
+    _version++;
+    if (!dupsAllowed) {
+        // Entries with same key start with KeyString of key alone
+        KeyString prefix(kKeyStringVersion, key, order);
+        auto first = successor(_root, StringData(prefix.getBuffer(), prefix.getSize()), 0, true);
+        if (first && first->keySize >= prefix.getSize() &&
+            memcmp(first->data.get(), prefix.getBuffer(), prefix.getSize()) == 0 &&
+            first->loc != loc.repr()) {
+            StringBuilder sb;
+            sb << "E11000 duplicate key error ";
+            sb << "dup key: " << key.toString();
+            return Status(ErrorCodes::DuplicateKey, sb.str());
+        }
+    }
+    try {
+        transaction::exec_tx(pop, [this, bytes, &key, &loc] {
+            auto leaf = make_persistent<PmseArtLeaf>();
+            leaf->data = pmemobj_tx_alloc(bytes.size() + key.objsize(), 1);
+            memcpy(static_cast<void*>(leaf->data.get()), bytes.rawData(), bytes.size());
+            memcpy(static_cast<void*>(leaf->data.get() + bytes.size()), key.objdata(),
+                   key.objsize());
+            leaf->keySize = bytes.size();
+            leaf->bsonSize = key.objsize();
+            leaf->loc = loc.repr();
+            if (insertAt(_root, leaf, bytes, 0))
+                _count = _count + 1;
+            else
+                freeNode(leaf);
+        });
+    } catch (std::exception &e) {
+        log() << "Index: " << e.what();
+        return Status(ErrorCodes::CommandFailed, e.what());
+    }
+    return Status::OK();
+}
+
+bool PmseArt::remove(const BSONObj& key, const RecordId& loc, const BSONObj& ordering) {
+    KeyString keyString(kKeyStringVersion, key, Ordering::make(ordering), loc);
+    stdx::lock_guard<pmem::obj::shared_mutex> guard(_lock);
+    _version++;
+    if (!removeAt(_root, StringData(keyString.getBuffer(), keyString.getSize()), 0))
+        return false;
+    _count = _count - 1;
+    return true;
+}
+
+bool PmseArt::next(StringData query, bool forward, bool inclusive, PmseArtEntry& entry,
+                   PmseArtPath* path) {
+    _lock.lock_shared();
+    persistent_ptr<PmseArtLeaf> leaf;
+    if (path && path->valid && path->version == _version) {
+        leaf = stepPath(*path, forward);
+    } else {
+        leaf = forward ? successor(_root, query, 0, inclusive)
+                       : predecessor(_root, query, 0, inclusive);
+        if (path && leaf)
+            buildPath(leaf, *path);
+    }
+    bool found = leaf != nullptr;
+    if (path) {
+        path->valid = found;
+        path->version = _version;
+    }
+    if (found) {
+        entry.keyString.assign(leaf->data.get(), leaf->keySize);
+        entry.key = BSONObj(leaf->data.get() + leaf->keySize).getOwned();
+        entry.loc = RecordId(leaf->loc);
+    }
+    _lock.unlock_shared();
+    return found;
+}
+
+uint64_t PmseArt::countRange(StringData start, StringData end) {
+    uint64_t count = 0;
+    _lock.lock_shared();
+    auto leaf = successor(_root, start, 0, true);
+    while (leaf && compareLeaf(leaf, end) <= 0) {
+        count++;
+        leaf = successor(_root, StringData(leaf->data.get(), leaf->keySize), 0, false);
+    }
+    _lock.unlock_shared();
+    return count;
+}
+
+uint64_t PmseArt::spaceUsed() {
+    _lock.lock_shared();
+    uint64_t size = nodeSpace(_root);
+    _lock.unlock_shared();
+    return size;
+}
+
+void PmseArt::freeAll() {
+    _version++;
+    if (_root)
+        freeTree(_root);
+    _root = nullptr;
+    _count = 0;
+}
+
+persistent_ptr<PmseArtLeaf> PmseArt::asLeaf(NodePtr node) {
+    return as<PmseArtLeaf>(node);
+}
+
+int PmseArt::compareLeaf(persistent_ptr<PmseArtLeaf> leaf, StringData key) {
+    size_t size = leaf->keySize;
+    int cmp = memcmp(leaf->data.get(), key.rawData(), std::min(size, key.size()));
+    if (cmp)
+        return cmp;
+    return size < key.size() ? -1 : (size > key.size() ? 1 : 0);
+}
+
+PmseArt::NodePtr* PmseArt::findChild(NodePtr node, uint8_t byte) {
+    switch (node->type) {
+        case ART_NODE4: {
+            auto n = as<PmseArtNode4>(node);
+            for (int i = 0; i < n->numChildren; i++) {
+                if (n->keys[i] == byte)
+                    return &n->children[i];
+            }
+            return nullptr;
+        }
+        case ART_NODE16: {
+            auto n = as<PmseArtNode16>(node);
+            for (int i = 0; i < n->numChildren; i++) {
+                if (n->keys[i] == byte)
+                    return &n->children[i];
+            }
+            return nullptr;
+        }
+        case ART_NODE48: {
+            auto n = as<PmseArtNode48>(node);
+            uint8_t index = n->childIndex[byte];
+            return index ? &n->children[index - 1] : nullptr;
+        }
+        case ART_NODE256: {
+            auto n = as<PmseArtNode256>(node);
+            return n->children[byte] != nullptr ? &n->children[byte] : nullptr;
+        }
+    }
+    return nullptr;
+}
+
+/*
+ * First child branching on byte greater than given one, -1 gives first child.
+ * Byte of child is stored in found.
+ */
+PmseArt::NodePtr PmseArt::childAfter(NodePtr node, int byte, int* found) {
+    int c = -1;
+    NodePtr child = nullptr;
+    switch (node->type) {
+        case ART_NODE4: {
+            auto n = as<PmseArtNode4>(node);
+            for (int i = 0; i < n->numChildren && child == nullptr; i++) {
+                if (n->keys[i] > byte) {
+                    c = n->keys[i];
+                    child = n->children[i];
+                }
+            }
+            break;
+        }
+        case ART_NODE16: {
+            auto n = as<PmseArtNode16>(node);
+            for (int i = 0; i < n->numChildren && child == nullptr; i++) {
+                if (n->keys[i] > byte) {
+                    c = n->keys[i];
+                    child = n->children[i];
+                }
+            }
+            break;
+        }
+        case ART_NODE48: {
+            auto n = as<PmseArtNode48>(node);
+            for (c = byte + 1; c < 256 && child == nullptr; c++) {
+                if (n->childIndex[c])
+                    child = n->children[n->childIndex[c] - 1];
+            }
+            c--;
+            break;
+        }
+        case ART_NODE256: {
+            auto n = as<PmseArtNode256>(node);
+            for (c = byte + 1; c < 256 && child == nullptr; c++)
+                child = n->children[c];
+            c--;
+            break;
+        }
+    }
+    if (found)
+        *found = c;
+    return child;
+}
+
+/*
+ * Last child branching on byte less than given one, 256 gives last child.
+ * Byte of child is stored in found.
+ */
+PmseArt::NodePtr PmseArt::childBefore(NodePtr node, int byte, int* found) {
+    int c = -1;
+    NodePtr child = nullptr;
+    switch (node->type) {
+        case ART_NODE4: {
+            auto n = as<PmseArtNode4>(node);
+            for (int i = n->numChildren - 1; i >= 0 && child == nullptr; i--) {
+                if (n->keys[i] < byte) {
+                    c = n->keys[i];
+                    child = n->children[i];
+                }
+            }
+            break;
+        }
+        case ART_NODE16: {
+            auto n = as<PmseArtNode16>(node);
+            for (int i = n->numChildren - 1; i >= 0 && child == nullptr; i--) {
+                if (n->keys[i] < byte) {
+                    c = n->keys[i];
+                    child = n->children[i];
+                }
+            }
+            break;
+        }
+        case ART_NODE48: {
+            auto n = as<PmseArtNode48>(node);
+            for (c = byte - 1; c >= 0 && child == nullptr; c--) {
+                if (n->childIndex[c])
+                    child = n->children[n->childIndex[c] - 1];
+            }
+            c++;
+            break;
+        }
+        case ART_NODE256: {
+            auto n = as<PmseArtNode256>(node);
+            for (c = byte - 1; c >= 0 && child == nullptr; c--)
+                child = n->children[c];
+            c++;
+            break;
+        }
+    }
+    if (found)
+        *found = c;
+    return child;
+}
+
+PmseArt::NodePtr PmseArt::minimum(NodePtr node) {
+    while (node != nullptr && node->type != ART_LEAF)
+        node = childAfter(node, -1);
+    return node;
+}
+
+PmseArt::NodePtr PmseArt::maximum(NodePtr node) {
+    while (node != nullptr && node->type != ART_LEAF)
+        node = childBefore(node, 256);
+    return node;
+}
+
+/*
+ * Smallest leaf of subtree after query, or equal to it when inclusive.
+ * Bytes of query before depth match path to node.
+ */
+persistent_ptr<PmseArtLeaf> PmseArt::successor(NodePtr node, StringData query, size_t depth,
+                                               bool inclusive) {
+    if (node == nullptr)
+        return nullptr;
+    if (node->type == ART_LEAF) {
+        auto leaf = asLeaf(node);
+        int cmp = compareLeaf(leaf, query);
+        return (cmp > 0 || (inclusive && cmp == 0)) ? leaf : nullptr;
+    }
+    const char* prefix = node->prefix.get();
+    for (size_t i = 0; i < node->prefixLen; i++) {
+        // Query is prefix of all keys in subtree, they are greater
+        if (depth + i >= query.size())
+            return asLeaf(minimum(node));
+        uint8_t pathByte = byteAt(prefix, i);
+        uint8_t queryByte = byteAt(query.rawData(), depth + i);
+        if (pathByte < queryByte)
+            return nullptr;
+        if (pathByte > queryByte)
+            return asLeaf(minimum(node));
+    }
+    depth += node->prefixLen;
+    if (depth >= query.size())
+        return asLeaf(minimum(node));
+    uint8_t byte = byteAt(query.rawData(), depth);
+    NodePtr* child = findChild(node, byte);
+    if (child) {
+        auto leaf = successor(*child, query, depth + 1, inclusive);
+        if (leaf)
+            return leaf;
+    }
+    return asLeaf(minimum(childAfter(node, byte)));
+}
+
+/*
+ * Largest leaf of subtree before query, or equal to it when inclusive
+ */
+persistent_ptr<PmseArtLeaf> PmseArt::predecessor(NodePtr node, StringData query, size_t depth,
+                                                 bool inclusive) {
+    if (node == nullptr)
+        return nullptr;
+    if (node->type == ART_LEAF) {
+        auto leaf = asLeaf(node);
+        int cmp = compareLeaf(leaf, query);
+        return (cmp < 0 || (inclusive && cmp == 0)) ? leaf : nullptr;
+    }
+    const char* prefix = node->prefix.get();
+    for (size_t i = 0; i < node->prefixLen; i++) {
+        if (depth + i >= query.size())
+            return nullptr;
+        uint8_t pathByte = byteAt(prefix, i);
+        uint8_t queryByte = byteAt(query.rawData(), depth + i);
+        if (pathByte < queryByte)
+            return asLeaf(maximum(node));
+        if (pathByte > queryByte)
+            return nullptr;
+    }
+    depth += node->prefixLen;
+    if (depth >= query.size())
+        return nullptr;
+    uint8_t byte = byteAt(query.rawData(), depth);
+    NodePtr* child = findChild(node, byte);
+    if (child) {
+        auto leaf = predecessor(*child, query, depth + 1, inclusive);
+        if (leaf)
+            return leaf;
+    }
+    return asLeaf(maximum(childBefore(node, byte)));
+}
+
+/*
+ * Leaf after last one of path in given direction. Goes up to first node
+ * with next child and down to its smallest or largest leaf.
+ */
+persistent_ptr<PmseArtLeaf> PmseArt::stepPath(PmseArtPath& path, bool forward) {
+    auto& nodes = path.nodes;
+    while (!nodes.empty()) {
+        int byte;
+        NodePtr child = forward ? childAfter(nodes.back().first, nodes.back().second, &byte)
+                                : childBefore(nodes.back().first, nodes.back().second, &byte);
+        if (child == nullptr) {
+            nodes.pop_back();
+            continue;
+        }
+        nodes.back().second = byte;
+        while (child->type != ART_LEAF) {
+            NodePtr next = forward ? childAfter(child, -1, &byte) : childBefore(child, 256, &byte);
+            nodes.emplace_back(child, byte);
+            child = next;
+        }
+        return asLeaf(child);
+    }
+    return nullptr;
+}
+
+/*
+ * Path from root to leaf. KeyString of leaf is not prefix of another one,
+ * so it has byte to branch on at every inner node.
+ */
+void PmseArt::buildPath(persistent_ptr<PmseArtLeaf> leaf, PmseArtPath& path) {
+    path.nodes.clear();
+    const char* key = leaf->data.get();
+    NodePtr node = _root;
+    size_t depth = 0;
+    while (node->type != ART_LEAF) {
+        depth += node->prefixLen;
+        uint8_t byte = byteAt(key, depth);
+        path.nodes.emplace_back(node, byte);
+        node = *findChild(node, byte);
+        depth++;
+    }
+}
+
+/*
+ * Number of bytes of node path matching key from depth
+ */
+size_t PmseArt::prefixMismatch(NodePtr node, StringData key, size_t depth) {
+    const char* prefix = node->prefix.get();
+    size_t i = 0;
+    while (i < node->prefixLen && depth + i < key.size() &&
+           prefix[i] == key.rawData()[depth + i])
+        i++;
+    return i;
+}
+
+persistent_ptr<char> PmseArt::copyBytes(const char* data, size_t size) {
+    persistent_ptr<char> copy = pmemobj_tx_alloc(size, 1);
+    memcpy(static_cast<void*>(copy.get()), data, size);
+    return copy;
+}
+
+/*
+ * Data may point into current prefix, it is copied before old one is freed
+ */
+void PmseArt::setPrefix(NodePtr node, const char* data, size_t size) {
+    persistent_ptr<char> old = node->prefix;
+    node->prefix = size ? copyBytes(data, size) : nullptr;
+    node->prefixLen = size;
+    if (old)
+        pmemobj_tx_free(old.raw());
+}
+
+/*
+ * Node replacing other one on growing or shrinking takes over its path
+ */
+void PmseArt::copyHeader(NodePtr from, NodePtr to) {
+    to->prefix = from->prefix;
+    to->prefixLen = from->prefixLen;
+    to->numChildren = from->numChildren;
+}
+
+/*
+ * Adds child to node in slot, full node is replaced by bigger one
+ */
+void PmseArt::addChild(NodePtr& slot, uint8_t byte, NodePtr child) {
+    NodePtr node = slot;
+    switch (node->type) {
+        case ART_NODE4: {
+            auto n = as<PmseArtNode4>(node);
+            if (n->numChildren < 4) {
+                int i = n->numChildren;
+                for (; i > 0 && n->keys[i - 1] > byte; i--) {
+                    n->keys[i] = n->keys[i - 1];
+                    n->children[i] = n->children[i - 1];
+                }
+                n->keys[i] = byte;
+                n->children[i] = child;
+                n->numChildren = n->numChildren + 1;
+                return;
+            }
+            auto grown = make_persistent<PmseArtNode16>();
+            copyHeader(node, grown);
+            for (int i = 0; i < 4; i++) {
+                grown->keys[i] = n->keys[i];
+                grown->children[i] = n->children[i];
+            }
+            slot = grown;
+            delete_persistent<PmseArtNode4>(n);
+            break;
+        }
+        case ART_NODE16: {
+            auto n = as<PmseArtNode16>(node);
+            if (n->numChildren < 16) {
+                int i = n->numChildren;
+                for (; i > 0 && n->keys[i - 1] > byte; i--) {
+                    n->keys[i] = n->keys[i - 1];
+                    n->children[i] = n->children[i - 1];
+                }
+                n->keys[i] = byte;
+                n->children[i] = child;
+                n->numChildren = n->numChildren + 1;
+                return;
+            }
+            auto grown = make_persistent<PmseArtNode48>();
+            copyHeader(node, grown);
+            for (int i = 0; i < 16; i++) {
+                grown->children[i] = n->children[i];
+                grown->childIndex[n->keys[i]] = i + 1;
+            }
+            slot = grown;
+            delete_persistent<PmseArtNode16>(n);
+            break;
+        }
+        case ART_NODE48: {
+            auto n = as<PmseArtNode48>(node);
+            if (n->numChildren < 48) {
+                int position = 0;
+                while (n->children[position] != nullptr)
+                    position++;
+                n->children[position] = child;
+                n->childIndex[byte] = position + 1;
+                n->numChildren = n->numChildren + 1;
+                return;
+            }
+            auto grown = make_persistent<PmseArtNode256>();
+            copyHeader(node, grown);
+            for (int c = 0; c < 256; c++) {
+                if (n->childIndex[c])
+                    grown->children[c] = n->children[n->childIndex[c] - 1];
+            }
+            slot = grown;
+            delete_persistent<PmseArtNode48>(n);
+            break;
+        }
+        case ART_NODE256: {
+            auto n = as<PmseArtNode256>(node);
+            n->children[byte] = child;
+            n->numChildren = n->numChildren + 1;
+            return;
+        }
+    }
+    addChild(slot, byte, child);
+}
+
+/*
+ * Removes child from node in slot. Node left with few children is replaced
+ * by smaller one, node with one child by that child.
+ */
+void PmseArt::removeChild(NodePtr& slot, uint8_t byte) {
+    NodePtr node = slot;
+    switch (node->type) {
+        case ART_NODE4: {
+            auto n = as<PmseArtNode4>(node);
+            int i = 0;
+            while (n->keys[i] != byte)
+                i++;
+            for (; i + 1 < n->numChildren; i++) {
+                n->keys[i] = n->keys[i + 1];
+                n->children[i] = n->children[i + 1];
+            }
+            n->numChildren = n->numChildren - 1;
+            if (n->numChildren > 1)
+                return;
+            NodePtr only = n->children[0];
+            if (only->type != ART_LEAF) {
+                // Path of child grows by path of node and byte it branched on
+                std::string path;
+                if (n->prefixLen)
+                    path.assign(n->prefix.get(), n->prefixLen);
+                path.push_back(static_cast<char>(static_cast<uint8_t>(n->keys[0])));
+                if (only->prefixLen)
+                    path.append(only->prefix.get(), only->prefixLen);
+                setPrefix(only, path.data(), path.size());
+            }
+            slot = only;
+            freeNode(node);
+            return;
+        }
+        case ART_NODE16: {
+            auto n = as<PmseArtNode16>(node);
+            int i = 0;
+            while (n->keys[i] != byte)
+                i++;
+            for (; i + 1 < n->numChildren; i++) {
+                n->keys[i] = n->keys[i + 1];
+                n->children[i] = n->children[i + 1];
+            }
+            n->numChildren = n->numChildren - 1;
+            if (n->numChildren > 3)
+                return;
+            auto shrunk = make_persistent<PmseArtNode4>();
+            copyHeader(node, shrunk);
+            for (i = 0; i < n->numChildren; i++) {
+                shrunk->keys[i] = n->keys[i];
+                shrunk->children[i] = n->children[i];
+            }
+            slot = shrunk;
+            delete_persistent<PmseArtNode16>(n);
+            return;
+        }
+        case ART_NODE48: {
+            auto n = as<PmseArtNode48>(node);
+            n->children[n->childIndex[byte] - 1] = nullptr;
+            n->childIndex[byte] = 0;
+            n->numChildren = n->numChildren - 1;
+            if (n->numChildren > 12)
+                return;
+            auto shrunk = make_persistent<PmseArtNode16>();
+            copyHeader(node, shrunk);
+            int position = 0;
+            for (int c = 0; c < 256; c++) {
+                if (n->childIndex[c]) {
+                    shrunk->keys[position] = c;
+                    shrunk->children[position] = n->children[n->childIndex[c] - 1];
+                    position++;
+                }
+            }
+            slot = shrunk;
+            delete_persistent<PmseArtNode48>(n);
+            return;
+        }
+        case ART_NODE256: {
+            auto n = as<PmseArtNode256>(node);
+            n->children[byte] = nullptr;
+            n->numChildren = n->numChildren - 1;
+            if (n->numChildren > 37)
+                return;
+            auto shrunk = make_persistent<PmseArtNode48>();
+            copyHeader(node, shrunk);
+            int position = 0;
+            for (int c = 0; c < 256; c++) {
+                if (n->children[c] != nullptr) {
+                    shrunk->children[position] = n->children[c];
+                    shrunk->childIndex[c] = position + 1;
+                    position++;
+                }
+            }
+            slot = shrunk;
+            delete_persistent<PmseArtNode256>(n);
+            return;
+        }
+    }
+}
+
+void PmseArt::children(NodePtr node, std::vector<NodePtr>& out) {
+    switch (node->type) {
+        case ART_NODE4: {
+            auto n = as<PmseArtNode4>(node);
+            for (int i = 0; i < n->numChildren; i++)
+                out.push_back(n->children[i]);
+            break;
+        }
+        case ART_NODE16: {
+            auto n = as<PmseArtNode16>(node);
+            for (int i = 0; i < n->numChildren; i++)
+                out.push_back(n->children[i]);
+            break;
+        }
+        case ART_NODE48: {
+            auto n = as<PmseArtNode48>(node);
+            for (int i = 0; i < 48; i++) {
+                if (n->children[i] != nullptr)
+                    out.push_back(n->children[i]);
+            }
+            break;
+        }
+        case ART_NODE256: {
+            auto n = as<PmseArtNode256>(node);
+            for (int c = 0; c < 256; c++) {
+                if (n->children[c] != nullptr)
+                    out.push_back(n->children[c]);
+            }
+            break;
+        }
+    }
+}
+
+/*
+ * Frees node with its path, children are kept
+ */
+void PmseArt::freeNode(NodePtr node) {
+    if (node->prefix)
+        pmemobj_tx_free(node->prefix.raw());
+    switch (node->type) {
+        case ART_LEAF: {
+            auto leaf = asLeaf(node);
+            if (leaf->data)
+                pmemobj_tx_free(leaf->data.raw());
+            delete_persistent<PmseArtLeaf>(leaf);
+            break;
+        }
+        case ART_NODE4:
+            delete_persistent<PmseArtNode4>(as<PmseArtNode4>(node));
+            break;
+        case ART_NODE16:
+            delete_persistent<PmseArtNode16>(as<PmseArtNode16>(node));
+            break;
+        case ART_NODE48:
+            delete_persistent<PmseArtNode48>(as<PmseArtNode48>(node));
+            break;
+        case ART_NODE256:
+            delete_persistent<PmseArtNode256>(as<PmseArtNode256>(node));
+            break;
+    }
+}
+
+void PmseArt::freeTree(NodePtr node) {
+    std::vector<NodePtr> nodes;
+    children(node, nodes);
+    for (auto& child : nodes)
+        freeTree(child);
+    freeNode(node);
+}
+
+uint64_t PmseArt::nodeSpace(NodePtr node) {
+    if (node == nullptr)
+        return 0;
+    uint64_t size = node->prefixLen;
+    switch (node->type) {
+        case ART_LEAF: {
+            auto leaf = asLeaf(node);
+            return sizeof(PmseArtLeaf) + leaf->keySize + leaf->bsonSize;
+        }
+        case ART_NODE4:
+            size += sizeof(PmseArtNode4);
+            break;
+        case ART_NODE16:
+            size += sizeof(PmseArtNode16);
+            break;
+        case ART_NODE48:
+            size += sizeof(PmseArtNode48);
+            break;
+        case ART_NODE256:
+            size += sizeof(PmseArtNode256);
+            break;
+    }
+    std::vector<NodePtr> nodes;
+    children(node, nodes);
+    for (auto& child : nodes)
+        size += nodeSpace(child);
+    return size;
+}
+
+/*
+ * Inserts leaf into subtree in slot, bytes of key before depth match path
+ * to it. Returns false when same entry is already there.
+ */
+bool PmseArt::insertAt(NodePtr& slot, persistent_ptr<PmseArtLeaf> leaf, StringData key,
+                       size_t depth) {
+    if (slot == nullptr) {
+        slot = leaf;
+        return true;
+    }
+    NodePtr node = slot;
+    if (node->type == ART_LEAF) {
+        auto existing = asLeaf(node);
+        const char* other = existing->data.get();
+        size_t otherSize = existing->keySize;
+        size_t i = depth;
+        while (i < otherSize && i < key.size() && other[i] == key.rawData()[i])
+            i++;
+        if (i == otherSize && i == key.size())
+            return false;
+        // KeyString with location is never prefix of another one
+        invariant(i < otherSize && i < key.size());
+        auto branch = make_persistent<PmseArtNode4>();
+        setPrefix(branch, key.rawData() + depth, i - depth);
+        slot = branch;
+        addChild(slot, byteAt(other, i), node);
+        addChild(slot, byteAt(key.rawData(), i), leaf);
+        return true;
+    }
+    size_t matched = prefixMismatch(node, key, depth);
+    if (matched < node->prefixLen) {
+        invariant(depth + matched < key.size());
+        auto branch = make_persistent<PmseArtNode4>();
+        const char* prefix = node->prefix.get();
+        uint8_t nodeByte = byteAt(prefix, matched);
+        setPrefix(branch, prefix, matched);
+        // Node keeps part of its path after byte it is branched on
+        setPrefix(node, prefix + matched + 1, node->prefixLen - matched - 1);
+        slot = branch;
+        addChild(slot, nodeByte, node);
+        addChild(slot, byteAt(key.rawData(), depth + matched), leaf);
+        return true;
+    }
+    depth += node->prefixLen;
+    invariant(depth < key.size());
+    uint8_t byte = byteAt(key.rawData(), depth);
+    NodePtr* child = findChild(node, byte);
+    if (child)
+        return insertAt(*child, leaf, key, depth + 1);
+    addChild(slot, byte, leaf);
+    return true;
+}
+
+/*
+ * Removes leaf with key from subtree in slot. Must be called within
+ * transaction.
+ */
+bool PmseArt::removeAt(NodePtr& slot, StringData key, size_t depth) {
+    NodePtr node = slot;
+    if (node == nullptr)
+        return false;
+    if (node->type == ART_LEAF) {
+        if (compareLeaf(asLeaf(node), key) != 0)
+            return false;
+        slot = nullptr;
+        freeNode(node);
+        return true;
+    }
+    if (prefixMismatch(node, key, depth) < node->prefixLen)
+        return false;
+    depth += node->prefixLen;
+    if (depth >= key.size())
+        return false;
+    uint8_t byte = byteAt(key.rawData(), depth);
+    NodePtr* child = findChild(node, byte);
+    if (!child || !removeAt(*child, key, depth + 1))
+        return false;
+    if (*child == nullptr)
+        removeChild(slot, byte);
+    return true;
+}
+
+}  // namespace mongo
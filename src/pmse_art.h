@@ -0,0 +1,236 @@
+/*
+ * Copyright 2014-2018, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SRC_PMSE_ART_H_
+#define SRC_PMSE_ART_H_
+
+#include <libpmemobj++/make_persistent.hpp>
+#include <libpmemobj++/p.hpp>
+#include <libpmemobj++/persistent_ptr.hpp>
+#include <libpmemobj++/pool.hpp>
+#include <libpmemobj++/shared_mutex.hpp>
+#include <libpmemobj++/transaction.hpp>
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "mongo/base/status_with.h"
+#include "mongo/base/string_data.h"
+#include "mongo/bson/bsonobj.h"
+#include "mongo/db/record_id.h"
+
+using namespace pmem::obj;
+
+namespace mongo {
+
+const uint8_t ART_LEAF = 0;
+const uint8_t ART_NODE4 = 1;
+const uint8_t ART_NODE16 = 2;
+const uint8_t ART_NODE48 = 3;
+const uint8_t ART_NODE256 = 4;
+
+/*
+ * Common header of adaptive radix tree nodes. Inner nodes skip prefixLen
+ * bytes of compressed path stored in prefix before branching on next byte.
+ */
+struct PmseArtNode {
+    explicit PmseArtNode(uint8_t nodeType = ART_LEAF)
+        : type(nodeType), numChildren(0), prefixLen(0) {
+        prefix = nullptr;
+    }
+
+    p<uint8_t> type;
+    p<uint16_t> numChildren;
+    p<uint32_t> prefixLen;
+    persistent_ptr<char> prefix;
+};
+
+/*
+ * Entry of index, data holds KeyString of key and location followed by
+ * key as BSON
+ */
+struct PmseArtLeaf : PmseArtNode {
+    PmseArtLeaf() : PmseArtNode(ART_LEAF), keySize(0), bsonSize(0), loc(0) {}
+
+    persistent_ptr<char> data;
+    p<uint32_t> keySize;
+    p<uint32_t> bsonSize;
+    p<int64_t> loc;
+};
+
+struct PmseArtNode4 : PmseArtNode {
+    PmseArtNode4() : PmseArtNode(ART_NODE4) {}
+
+    p<uint8_t> keys[4];
+    persistent_ptr<PmseArtNode> children[4];
+};
+
+struct PmseArtNode16 : PmseArtNode {
+    PmseArtNode16() : PmseArtNode(ART_NODE16) {}
+
+    p<uint8_t> keys[16];
+    persistent_ptr<PmseArtNode> children[16];
+};
+
+struct PmseArtNode48 : PmseArtNode {
+    PmseArtNode48() : PmseArtNode(ART_NODE48) {
+        for (int i = 0; i < 256; i++)
+            childIndex[i] = 0;
+    }
+
+    p<uint8_t> childIndex[256];  // Position in children plus one, 0 when no child
+    persistent_ptr<PmseArtNode> children[48];
+};
+
+struct PmseArtNode256 : PmseArtNode {
+    PmseArtNode256() : PmseArtNode(ART_NODE256) {}
+
+    persistent_ptr<PmseArtNode> children[256];
+};
+
+/*
+ * Entry copied out of tree
+ */
+struct PmseArtEntry {
+    std::string keyString;
+    BSONObj key;
+    RecordId loc;
+};
+
+/*
+ * Inner nodes from root to leaf of last entry found, with byte of child
+ * taken in each. Valid while version of tree is unchanged.
+ */
+struct PmseArtPath {
+    std::vector<std::pair<persistent_ptr<PmseArtNode>, int>> nodes;
+    uint64_t version = 0;
+    bool valid = false;
+};
+
+/*
+ * Adaptive radix tree over KeyString encoded (key, location) pairs, index
+ * variant for long keys like URLs or paths. Lookup walks key bytes once
+ * instead of comparing whole keys in every node. KeyString of key with
+ * location is unique and not prefix of another one, so every entry ends
+ * in its own leaf. Readers copy entries out under shared lock, cursors
+ * find next entry from KeyString of last one.
+ */
+class PmseArt {
+ public:
+    PmseArt() : _count(0) {}
+
+    /*
+     * Parses indexType from storageEngine.pmse index options, true for "art"
+     */
+    static StatusWith<bool> parseEnabled(const BSONObj& options);
+
+    Status insert(pool_base pop, const BSONObj& key, const RecordId& loc,
+                  const BSONObj& ordering, bool dupsAllowed);
+
+    /*
+     * Must be called within transaction
+     */
+    bool remove(const BSONObj& key, const RecordId& loc, const BSONObj& ordering);
+
+    /*
+     * Copies first entry after query in given direction, or equal to it when
+     * inclusive. False when there is none. With valid path query is ignored
+     * and entry after last one found is reached from its path without
+     * descending from root, path is updated to new entry.
+     */
+    bool next(StringData query, bool forward, bool inclusive, PmseArtEntry& entry,
+              PmseArtPath* path = nullptr);
+
+    /*
+     * Counts entries from start to end, both inclusive
+     */
+    uint64_t countRange(StringData start, StringData end);
+
+    uint64_t countElements() {
+        return _count;
+    }
+
+    bool isEmpty() {
+        return _root == nullptr;
+    }
+
+    uint64_t spaceUsed();
+
+    /*
+     * Frees all nodes. Must be called within transaction.
+     */
+    void freeAll();
+
+ private:
+    typedef persistent_ptr<PmseArtNode> NodePtr;
+
+    static persistent_ptr<PmseArtLeaf> asLeaf(NodePtr node);
+    static int compareLeaf(persistent_ptr<PmseArtLeaf> leaf, StringData key);
+    static NodePtr* findChild(NodePtr node, uint8_t byte);
+    static NodePtr childAfter(NodePtr node, int byte, int* found = nullptr);
+    static NodePtr childBefore(NodePtr node, int byte, int* found = nullptr);
+    static NodePtr minimum(NodePtr node);
+    static NodePtr maximum(NodePtr node);
+    static persistent_ptr<PmseArtLeaf> successor(NodePtr node, StringData query,
+                                                 size_t depth, bool inclusive);
+    static persistent_ptr<PmseArtLeaf> predecessor(NodePtr node, StringData query,
+                                                   size_t depth, bool inclusive);
+    static persistent_ptr<PmseArtLeaf> stepPath(PmseArtPath& path, bool forward);
+    void buildPath(persistent_ptr<PmseArtLeaf> leaf, PmseArtPath& path);
+    static size_t prefixMismatch(NodePtr node, StringData key, size_t depth);
+    static persistent_ptr<char> copyBytes(const char* data, size_t size);
+    static void setPrefix(NodePtr node, const char* data, size_t size);
+    static void copyHeader(NodePtr from, NodePtr to);
+    static void addChild(NodePtr& slot, uint8_t byte, NodePtr child);
+    static void removeChild(NodePtr& slot, uint8_t byte);
+    static void children(NodePtr node, std::vector<NodePtr>& out);
+    static void freeNode(NodePtr node);
+    static void freeTree(NodePtr node);
+    static uint64_t nodeSpace(NodePtr node);
+
+    static bool insertAt(NodePtr& slot, persistent_ptr<PmseArtLeaf> leaf, StringData key,
+                         size_t depth);
+    static bool removeAt(NodePtr& slot, StringData key, size_t depth);
+
+    NodePtr _root;
+    p<uint64_t> _count;
+    pmem::obj::shared_mutex _lock;
+    /*
+     * Changed under exclusive lock with every modification, paths of
+     * cursors taken at other version may point to freed nodes
+     */
+    uint64_t _version = 0;
+};
+
+}  // namespace mongo
+#endif  // SRC_PMSE_ART_H_
@@ -0,0 +1,142 @@
+/*
+ * Copyright 2014-2018, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define MONGO_LOG_DEFAULT_COMPONENT ::mongo::logger::LogComponent::kStorage
+
+#include "pmse_art_cursor.h"
+
+#include <string>
+
+#include "mongo/db/storage/index_entry_comparison.h"
+#include "mongo/util/log.h"
+
+namespace mongo {
+
+namespace {
+const KeyString::Version kKeyStringVersion = KeyString::Version::V1;
+}  // namespace
+
+PmseArtCursor::PmseArtCursor(OperationContext* txn, bool isForward,
+                             persistent_ptr<PmseArt> art, const BSONObj& ordering)
+    : _txn(txn), _forward(isForward), _ordering(Ordering::make(ordering)), _art(art) {}
+
+void PmseArtCursor::setEndPosition(const BSONObj& key, bool inclusive) {
+    if (key.isEmpty()) {
+        _end = boost::none;
+        return;
+    }
+    // End string sorts after last entry to return in direction of cursor
+    KeyString end(kKeyStringVersion, stripFieldNames(key), _ordering,
+                  _forward == inclusive ? KeyString::kExclusiveAfter
+                                        : KeyString::kExclusiveBefore);
+    _end = std::string(end.getBuffer(), end.getSize());
+}
+
+boost::optional<IndexKeyEntry> PmseArtCursor::next(RequestedInfo parts) {
+    if (_eof)
+        return {};
+    return advance(_position, parts);
+}
+
+boost::optional<IndexKeyEntry> PmseArtCursor::seek(const BSONObj& key, bool inclusive,
+                                                   RequestedInfo parts) {
+    KeyString query(kKeyStringVersion, stripFieldNames(key), _ordering,
+                    _forward == inclusive ? KeyString::kExclusiveBefore
+                                          : KeyString::kExclusiveAfter);
+    return seekTo(query, parts);
+}
+
+boost::optional<IndexKeyEntry> PmseArtCursor::seek(const IndexSeekPoint& seekPoint,
+                                                   RequestedInfo parts) {
+    const BSONObj key = IndexEntryComparison::makeQueryObject(seekPoint, _forward);
+    KeyString query(kKeyStringVersion, key, _ordering,
+                    _forward ? KeyString::kExclusiveBefore : KeyString::kExclusiveAfter);
+    return seekTo(query, parts);
+}
+
+boost::optional<IndexKeyEntry> PmseArtCursor::seekExact(const BSONObj& key,
+                                                        RequestedInfo parts) {
+    KeyString prefix(kKeyStringVersion, stripFieldNames(key), _ordering);
+    auto entry = seek(key, true, kKeyAndLoc);
+    // Entries with given key start with its KeyString
+    if (!entry || _entry.keyString.compare(0, prefix.getSize(), prefix.getBuffer(),
+                                           prefix.getSize()) != 0) {
+        _eof = true;
+        return {};
+    }
+    if (!(parts & kWantKey))
+        entry->key = BSONObj();
+    return entry;
+}
+
+boost::optional<IndexKeyEntry> PmseArtCursor::seekTo(const KeyString& query,
+                                                     RequestedInfo parts) {
+    _path.valid = false;
+    return advance(StringData(query.getBuffer(), query.getSize()), parts);
+}
+
+/*
+ * Seek queries carry discriminator and never equal entry, next queries
+ * equal last returned one, so search is always exclusive. Query of next
+ * is used only when path of last entry is not valid.
+ */
+boost::optional<IndexKeyEntry> PmseArtCursor::advance(StringData query, RequestedInfo parts) {
+    if (!_art->next(query, _forward, false, _entry, &_path)) {
+        _eof = true;
+        return {};
+    }
+    if (_end) {
+        int cmp = _entry.keyString.compare(*_end);
+        if (_forward ? cmp > 0 : cmp < 0) {
+            _eof = true;
+            return {};
+        }
+    }
+    _eof = false;
+    _position = _entry.keyString;
+    return IndexKeyEntry((parts & kWantKey) ? _entry.key : BSONObj(), _entry.loc);
+}
+
+BSONObj PmseArtCursor::stripFieldNames(const BSONObj& query) {
+    BSONForEach(e, query) {
+        if (e.fieldName()[0]) {
+            BSONObjBuilder bb;
+            BSONForEach(field, query) {
+                bb.appendAs(field, StringData());
+            }
+            return bb.obj();
+        }
+    }
+    return query;
+}
+
+}  // namespace mongo
@@ -0,0 +1,106 @@
+/*
+ * Copyright 2014-2018, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SRC_PMSE_ART_CURSOR_H_
+#define SRC_PMSE_ART_CURSOR_H_
+
+#include <string>
+
+#include "mongo/bson/ordering.h"
+#include "mongo/db/storage/key_string.h"
+#include "mongo/db/storage/sorted_data_interface.h"
+
+#include "pmse_art.h"
+
+namespace mongo {
+
+/*
+ * Cursor over adaptive radix tree index. Keeps path of inner nodes to last
+ * returned entry and steps to next entry from it while tree is unchanged.
+ * After restore or change of tree, entry after KeyString of last returned
+ * one is looked up from root.
+ */
+class PmseArtCursor final : public SortedDataInterface::Cursor {
+ public:
+    PmseArtCursor(OperationContext* txn, bool isForward,
+                  persistent_ptr<PmseArt> art, const BSONObj& ordering);
+
+    void setEndPosition(const BSONObj& key, bool inclusive);
+
+    boost::optional<IndexKeyEntry> next(RequestedInfo parts);
+
+    boost::optional<IndexKeyEntry> seek(const BSONObj& key, bool inclusive,
+                                        RequestedInfo parts);
+
+    boost::optional<IndexKeyEntry> seek(const IndexSeekPoint& seekPoint,
+                                        RequestedInfo parts);
+
+    boost::optional<IndexKeyEntry> seekExact(const BSONObj& key,
+                                             RequestedInfo parts);
+
+    void save() {}
+
+    void saveUnpositioned() {
+        _eof = true;
+    }
+
+    void restore() {
+        _path.valid = false;
+    }
+
+    void detachFromOperationContext() {
+        _txn = nullptr;
+        _path.valid = false;
+    }
+
+    void reattachToOperationContext(OperationContext* opCtx) {
+        _txn = opCtx;
+    }
+
+ private:
+    boost::optional<IndexKeyEntry> seekTo(const KeyString& query, RequestedInfo parts);
+    boost::optional<IndexKeyEntry> advance(StringData query, RequestedInfo parts);
+    BSONObj stripFieldNames(const BSONObj& query);
+
+    OperationContext* _txn;
+    const bool _forward;
+    const Ordering _ordering;
+    persistent_ptr<PmseArt> _art;
+    bool _eof = true;
+    std::string _position;  // KeyString of last returned entry
+    PmseArtPath _path;
+    boost::optional<std::string> _end;
+    PmseArtEntry _entry;
+};
+
+}  // namespace mongo
+#endif  // SRC_PMSE_ART_CURSOR_H_
@@ -0,0 +1,220 @@
+/*
+ * Copyright 2014-2018, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define MONGO_LOG_DEFAULT_COMPONENT ::mongo::logger::LogComponent::kStorage
+
+#include "pmse_buffered_cursor.h"
+
+#include "pmse_sorted_data_interface.h"
+#include "pmse_write_set.h"
+
+#include <iterator>
+
+#include "mongo/util/log.h"
+
+namespace mongo {
+
+PmseBufferedCursor::PmseBufferedCursor(OperationContext* txn, bool isForward,
+                                       const PmseSortedDataInterface* index,
+                                       std::unique_ptr<SortedDataInterface::Cursor> tree,
+                                       const BSONObj& ordering)
+    : _txn(txn),
+      _forward(isForward),
+      _index(index),
+      _tree(std::move(tree)),
+      _ordering(Ordering::make(ordering)),
+      _comparison(_ordering) {}
+
+void PmseBufferedCursor::setEndPosition(const BSONObj& key, bool inclusive) {
+    _tree->setEndPosition(key, inclusive);
+    if (key.isEmpty())
+        _end = boost::none;
+    else
+        _end = std::make_pair(stripFieldNames(key).getOwned(), inclusive);
+}
+
+boost::optional<IndexKeyEntry> PmseBufferedCursor::next(RequestedInfo parts) {
+    if (_eof)
+        return {};
+    return advance(parts);
+}
+
+boost::optional<IndexKeyEntry> PmseBufferedCursor::seek(const BSONObj& key, bool inclusive,
+                                                        RequestedInfo parts) {
+    const BSONObj query = stripFieldNames(key);
+    const RecordId loc = _forward == inclusive ? RecordId::min() : RecordId::max();
+    return seekTo(IndexKeyEntry(query, loc), true,
+                  _tree->seek(key, inclusive, kKeyAndLoc), parts);
+}
+
+boost::optional<IndexKeyEntry> PmseBufferedCursor::seek(const IndexSeekPoint& seekPoint,
+                                                        RequestedInfo parts) {
+    const BSONObj query = IndexEntryComparison::makeQueryObject(seekPoint, _forward);
+    const RecordId loc = _forward ? RecordId::min() : RecordId::max();
+    return seekTo(IndexKeyEntry(query, loc), true, _tree->seek(seekPoint, kKeyAndLoc), parts);
+}
+
+boost::optional<IndexKeyEntry> PmseBufferedCursor::seekExact(const BSONObj& key,
+                                                             RequestedInfo parts) {
+    auto kv = seek(key, true, kKeyAndLoc);
+    if (kv && kv->key.woCompare(key, BSONObj(), false) == 0) {
+        if (!(parts & kWantKey))
+            kv->key = BSONObj();
+        return kv;
+    }
+    return boost::none;
+}
+
+/*
+ * Tree cursor may have moved on while yielded, position it right after last
+ * returned entry again
+ */
+void PmseBufferedCursor::restore() {
+    _tree->restore();
+    if (_eof)
+        return;
+    auto entry = _tree->seek(_bound.key, true, kKeyAndLoc);
+    while (entry && !afterBound(*entry))
+        entry = _tree->next(kKeyAndLoc);
+    fetchTree(entry);
+}
+
+boost::optional<IndexKeyEntry> PmseBufferedCursor::seekTo(
+                const IndexKeyEntry& bound, bool inclusive,
+                boost::optional<IndexKeyEntry> treeEntry, RequestedInfo parts) {
+    _bound = bound;
+    _boundInclusive = inclusive;
+    _fromStart = bound.key.isEmpty();
+    _eof = false;
+    fetchTree(treeEntry);
+    return advance(parts);
+}
+
+boost::optional<IndexKeyEntry> PmseBufferedCursor::advance(RequestedInfo parts) {
+    const PmseIndexWriteSet* writeSet = _index->bufferedWrites(_txn);
+    // Unit may have removed lookahead since it was fetched
+    if (_treeNext && writeSet && writeSet->removed(*_treeNext))
+        fetchTree(_tree->next(kKeyAndLoc));
+    auto buffered = nextBuffered(writeSet);
+    boost::optional<IndexKeyEntry> result;
+    if (_treeNext && buffered) {
+        int c = _comparison.compare(*_treeNext, *buffered);
+        if (_forward ? c <= 0 : c >= 0)
+            result = _treeNext;
+        else
+            result = buffered;
+    } else {
+        result = _treeNext ? _treeNext : buffered;
+    }
+    if (!result) {
+        _eof = true;
+        return {};
+    }
+    if (_treeNext && _comparison.compare(*result, *_treeNext) == 0)
+        fetchTree(_tree->next(kKeyAndLoc));
+    _bound = *result;
+    _boundInclusive = false;
+    _fromStart = false;
+    if (!(parts & kWantKey))
+        result->key = BSONObj();
+    return result;
+}
+
+/*
+ * Copies tree entry, cursor batches are reused by next call
+ */
+void PmseBufferedCursor::fetchTree(boost::optional<IndexKeyEntry> entry) {
+    const PmseIndexWriteSet* writeSet = _index->bufferedWrites(_txn);
+    while (entry && writeSet && writeSet->removed(*entry))
+        entry = _tree->next(kKeyAndLoc);
+    if (entry)
+        _treeNext = IndexKeyEntry(entry->key.getOwned(), entry->loc);
+    else
+        _treeNext = boost::none;
+}
+
+boost::optional<IndexKeyEntry> PmseBufferedCursor::nextBuffered(
+                const PmseIndexWriteSet* writeSet) const {
+    if (!writeSet)
+        return {};
+    const auto& keys = writeSet->keys();
+    if (_forward) {
+        auto it = _fromStart ? keys.begin()
+                             : _boundInclusive ? keys.lower_bound(_bound)
+                                               : keys.upper_bound(_bound);
+        for (; it != keys.end() && !pastEnd(it->first.key); ++it) {
+            if (it->second.insert)
+                return it->first;
+        }
+    } else {
+        auto it = _fromStart ? keys.end()
+                             : _boundInclusive ? keys.upper_bound(_bound)
+                                               : keys.lower_bound(_bound);
+        while (it != keys.begin() && !pastEnd(std::prev(it)->first.key)) {
+            --it;
+            if (it->second.insert)
+                return it->first;
+        }
+    }
+    return {};
+}
+
+bool PmseBufferedCursor::afterBound(const IndexKeyEntry& entry) const {
+    int c = _comparison.compare(entry, _bound);
+    if (!_forward)
+        c = -c;
+    return c > 0 || (c == 0 && _boundInclusive);
+}
+
+bool PmseBufferedCursor::pastEnd(const BSONObj& key) const {
+    if (!_end)
+        return false;
+    int c = key.woCompare(_end->first, _ordering, false);
+    if (!_forward)
+        c = -c;
+    return c > 0 || (c == 0 && !_end->second);
+}
+
+BSONObj PmseBufferedCursor::stripFieldNames(const BSONObj& query) {
+    BSONForEach(e, query) {
+        if (e.fieldName()[0]) {
+            BSONObjBuilder bb;
+            BSONForEach(field, query) {
+                bb.appendAs(field, StringData());
+            }
+            return bb.obj();
+        }
+    }
+    return query;
+}
+
+}  // namespace mongo
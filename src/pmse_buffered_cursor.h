@@ -0,0 +1,120 @@
+/*
+ * Copyright 2014-2018, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SRC_PMSE_BUFFERED_CURSOR_H_
+#define SRC_PMSE_BUFFERED_CURSOR_H_
+
+#include <memory>
+#include <utility>
+
+#include "mongo/bson/ordering.h"
+#include "mongo/db/storage/index_entry_comparison.h"
+#include "mongo/db/storage/sorted_data_interface.h"
+
+namespace mongo {
+
+class PmseIndexWriteSet;
+class PmseSortedDataInterface;
+
+/*
+ * Cursor of index with deferred writes. Merges entries of tree cursor with
+ * keys buffered by its unit, skipping entries the unit removed. Position is
+ * last returned entry, so restore seeks tree cursor past it again.
+ */
+class PmseBufferedCursor final : public SortedDataInterface::Cursor {
+ public:
+    PmseBufferedCursor(OperationContext* txn, bool isForward,
+                       const PmseSortedDataInterface* index,
+                       std::unique_ptr<SortedDataInterface::Cursor> tree,
+                       const BSONObj& ordering);
+
+    void setEndPosition(const BSONObj& key, bool inclusive);
+
+    boost::optional<IndexKeyEntry> next(RequestedInfo parts);
+
+    boost::optional<IndexKeyEntry> seek(const BSONObj& key, bool inclusive,
+                                        RequestedInfo parts);
+
+    boost::optional<IndexKeyEntry> seek(const IndexSeekPoint& seekPoint,
+                                        RequestedInfo parts);
+
+    boost::optional<IndexKeyEntry> seekExact(const BSONObj& key,
+                                             RequestedInfo parts);
+
+    void save() {
+        _tree->save();
+    }
+
+    void saveUnpositioned() {
+        _tree->saveUnpositioned();
+        _eof = true;
+    }
+
+    void restore();
+
+    void detachFromOperationContext() {
+        _txn = nullptr;
+        _tree->detachFromOperationContext();
+    }
+
+    void reattachToOperationContext(OperationContext* opCtx) {
+        _txn = opCtx;
+        _tree->reattachToOperationContext(opCtx);
+    }
+
+ private:
+    boost::optional<IndexKeyEntry> seekTo(const IndexKeyEntry& bound, bool inclusive,
+                                          boost::optional<IndexKeyEntry> treeEntry,
+                                          RequestedInfo parts);
+    boost::optional<IndexKeyEntry> advance(RequestedInfo parts);
+    void fetchTree(boost::optional<IndexKeyEntry> entry);
+    boost::optional<IndexKeyEntry> nextBuffered(const PmseIndexWriteSet* writeSet) const;
+    bool afterBound(const IndexKeyEntry& entry) const;
+    bool pastEnd(const BSONObj& key) const;
+    static BSONObj stripFieldNames(const BSONObj& query);
+
+    OperationContext* _txn;
+    const bool _forward;
+    const PmseSortedDataInterface* _index;
+    std::unique_ptr<SortedDataInterface::Cursor> _tree;
+    const Ordering _ordering;
+    const IndexEntryComparison _comparison;
+    bool _eof = true;
+    boost::optional<IndexKeyEntry> _treeNext;  // Owned lookahead of tree cursor
+    IndexKeyEntry _bound = IndexKeyEntry(BSONObj(), RecordId());
+    bool _boundInclusive = false;
+    bool _fromStart = false;  // Seek without key, every buffered entry is after bound
+    boost::optional<std::pair<BSONObj, bool>> _end;
+};
+
+}  // namespace mongo
+#endif  // SRC_PMSE_BUFFERED_CURSOR_H_
@@ -0,0 +1,134 @@
+/*
+ * Copyright 2014-2018, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define MONGO_LOG_DEFAULT_COMPONENT ::mongo::logger::LogComponent::kStorage
+
+#include "pmse_catalog.h"
+#include "pmse_layout.h"
+#include "pmse_slab_allocator.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/filesystem/operations.hpp>
+#include <libpmemobj++/make_persistent.hpp>
+#include <libpmemobj++/transaction.hpp>
+
+#include <cstring>
+
+#include "mongo/util/assert_util.h"
+#include "mongo/util/log.h"
+
+namespace mongo {
+
+PmseCatalog::PmseCatalog(const std::string& path, uint64_t poolSize) {
+    if (!boost::filesystem::exists(path)) {
+        _pop = pool<PmseCatalogRoot>::create(path, PMSE_SHARED_LAYOUT, poolSize, 0664);
+        log() << "Shared pool created";
+    } else {
+        _pop = PmseLayout::open<PmseCatalogRoot>(path, PMSE_SHARED_LAYOUT,
+                                                 PMSE_SHARED_OLD_LAYOUT);
+        log() << "Shared pool opened";
+    }
+    PmseSlabAllocator::registerClasses(_pop);
+    for (auto entry = _pop.get_root()->head; entry != nullptr; entry = entry->next) {
+        _entries[std::string(entry->ident)] = entry;
+    }
+}
+
+PmseCatalog::~PmseCatalog() {
+    PmseSlabAllocator::unregisterClasses(_pop);
+    _pop.close();
+}
+
+bool PmseCatalog::hasEntry(StringData ident) {
+    stdx::lock_guard<stdx::mutex> lock(_mutex);
+    return _entries.count(ident.toString()) > 0;
+}
+
+persistent_ptr<PmseCatalogEntry> PmseCatalog::getEntry(StringData ident) {
+    stdx::lock_guard<stdx::mutex> lock(_mutex);
+    auto it = _entries.find(ident.toString());
+    if (it != _entries.end())
+        return it->second;
+    uassert(ErrorCodes::BadValue, "Ident too long for shared pool catalog",
+            ident.size() < static_cast<size_t>(CATALOG_IDENT_MAX_SIZE));
+    persistent_ptr<PmseCatalogEntry> entry;
+    auto root = _pop.get_root();
+    transaction::exec_tx(_pop, [&entry, &root, ident] {
+        entry = make_persistent<PmseCatalogEntry>();
+        memcpy(entry->ident, ident.rawData(), ident.size());
+        entry->ident[ident.size()] = '\0';
+        entry->next = root->head;
+        root->head = entry;
+    });
+    _entries[ident.toString()] = entry;
+    return entry;
+}
+
+void PmseCatalog::drop(StringData ident) {
+    stdx::lock_guard<stdx::mutex> lock(_mutex);
+    auto it = _entries.find(ident.toString());
+    if (it == _entries.end())
+        return;
+    persistent_ptr<PmseCatalogEntry> entry = it->second;
+    if (entry->mapper) {
+        auto mapper = entry->mapper;
+        for (uint64_t i = 0; i < static_cast<uint64_t>(mapper->getHashmapSize());
+             i += FREE_LISTS_PER_TX) {
+            transaction::exec_tx(_pop, [&mapper, i] {
+                mapper->freeLists(i, i + FREE_LISTS_PER_TX);
+            });
+        }
+    }
+    auto root = _pop.get_root();
+    transaction::exec_tx(_pop, [&entry, &root] {
+        if (entry->mapper) {
+            entry->mapper->freeAll();
+            delete_persistent<PmseMap<InitData>>(entry->mapper);
+        }
+        if (entry->tree) {
+            entry->tree->freeAll();
+            delete_persistent<PmseTree>(entry->tree);
+        }
+        if (root->head == entry) {
+            root->head = entry->next;
+        } else {
+            auto before = root->head;
+            while (before->next != entry)
+                before = before->next;
+            before->next = entry->next;
+        }
+        delete_persistent<PmseCatalogEntry>(entry);
+    });
+    _entries.erase(it);
+}
+
+}  // namespace mongo
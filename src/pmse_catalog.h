@@ -0,0 +1,99 @@
+/*
+ * Copyright 2014-2018, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SRC_PMSE_CATALOG_H_
+#define SRC_PMSE_CATALOG_H_
+
+#include "pmse_map.h"
+#include "pmse_tree.h"
+
+#include <libpmemobj++/p.hpp>
+#include <libpmemobj++/persistent_ptr.hpp>
+#include <libpmemobj++/pool.hpp>
+
+#include <string>
+#include <unordered_map>
+
+#include "mongo/base/string_data.h"
+#include "mongo/stdx/mutex.h"
+
+namespace mongo {
+
+const int CATALOG_IDENT_MAX_SIZE = 256;
+const char SHARED_POOL_FILENAME[] = "pmse_shared.pm";
+
+struct PmseCatalogEntry {
+    char ident[CATALOG_IDENT_MAX_SIZE];
+    persistent_ptr<PmseMap<InitData>> mapper;
+    persistent_ptr<PmseTree> tree;
+    persistent_ptr<PmseCatalogEntry> next;
+};
+
+struct PmseCatalogRoot {
+    persistent_ptr<PmseCatalogEntry> head;
+};
+
+/*
+ * Persistent catalog of idents living in one shared pool. Every ident gets
+ * an entry holding root of its record store or index.
+ */
+class PmseCatalog {
+ public:
+    PmseCatalog(const std::string& path, uint64_t poolSize);
+
+    ~PmseCatalog();
+
+    pool_base& getPool() {
+        return _pop;
+    }
+
+    bool hasEntry(StringData ident);
+
+    /*
+     * Returns entry of ident, creating an empty one when it does not exist
+     */
+    persistent_ptr<PmseCatalogEntry> getEntry(StringData ident);
+
+    /*
+     * Frees all structures of ident. Lists of its record store are freed
+     * in chunks, each in own transaction.
+     */
+    void drop(StringData ident);
+
+ private:
+    pool<PmseCatalogRoot> _pop;
+    stdx::mutex _mutex;
+    std::unordered_map<std::string, persistent_ptr<PmseCatalogEntry>> _entries;
+};
+
+}  // namespace mongo
+#endif  // SRC_PMSE_CATALOG_H_
@@ -38,36 +38,52 @@
 #include "mongo/db/storage/recovery_unit.h"
 #include "mongo/util/log.h"
 
+#include "pmse_catalog.h"
 #include "pmse_change.h"
 #include "pmse_map.h"
+#include "pmse_record_cache.h"
+#include "pmse_recovery_unit.h"
+#include "pmse_truncate_markers.h"
 
 namespace mongo {
 
-TruncateChange::TruncateChange(pool_base pop, PmseMap<InitData> *mapper,
-                               RecordId Id, InitData *data, uint64_t dataSize)
-        : _mapper(mapper), _Id(Id), _pop(pop), _dataSize(dataSize) {
-    _cachedData = static_cast<InitData*>(malloc(sizeof(InitData) + data->size));
-    memcpy(_cachedData->data, data->data, data->size);
-    _cachedData->size = data->size;
+namespace {
+
+InitData* copyToArena(PmseChangeArena& arena, InitData* data) {
+    auto copy = static_cast<InitData*>(arena.allocate(sizeof(InitData) + data->size));
+    memcpy(copy->data, data->data, data->size);
+    copy->size = data->size;
+    return copy;
+}
+
+/*
+ * Returned object views arena copy and does not own buffer
+ */
+BSONObj copyToArena(PmseChangeArena& arena, const BSONObj& obj) {
+    auto copy = static_cast<char*>(arena.allocate(obj.objsize()));
+    memcpy(copy, obj.objdata(), obj.objsize());
+    return BSONObj(copy);
+}
+
+}  // namespace
+
+TruncateChange::TruncateChange(PmseChangeArena& arena, pool_base pop, PmseMap<InitData> *mapper,
+                               RecordId Id, InitData *data, uint64_t dataSize, uint64_t flags)
+        : _mapper(mapper), _Id(Id), _pop(pop), _dataSize(dataSize), _flags(flags) {
+    _cachedData = copyToArena(arena, data);
 }
 
 void TruncateChange::commit() {}
 
 void TruncateChange::rollback() {
-    persistent_ptr<InitData> obj;
-    persistent_ptr<KVPair> temp = nullptr;
     try {
-       transaction::exec_tx(_pop, [this, &obj, &temp] {
-           obj = pmemobj_tx_alloc(sizeof(InitData::size) + _cachedData->size, 1);
-           obj->size = _cachedData->size;
-           memcpy(obj->data, _cachedData->data, _cachedData->size);
-           temp = make_persistent<KVPair>();
-           temp->idValue = static_cast<uint64_t>(_Id.repr());
+       transaction::exec_tx(_pop, [this] {
+           _mapper->insertToFront(static_cast<uint64_t>(_Id.repr()),
+                                  _cachedData->data, _cachedData->size, _flags);
        });
     } catch (std::exception &e) {
        log() << e.what();
     }
-    _mapper->insertToFrontKV(temp, obj);
     _mapper->changeSize(_dataSize);
 }
 
@@ -95,63 +111,80 @@ void InsertChange::rollback() {
     _mapper->changeSize(-_dataSize);
 }
 
-RemoveChange::RemoveChange(pool_base pop, InitData* data, uint64_t dataSize)
-    : _pop(pop), _dataSize(dataSize) {
-    _cachedData = static_cast<InitData*>(malloc(sizeof(InitData) + data->size));
-    memcpy(_cachedData->data, data->data, data->size);
-    _cachedData->size = data->size;
+CatalogEntryChange::CatalogEntryChange(PmseCatalog* catalog, StringData ident)
+    : _catalog(catalog), _ident(ident.toString()) {}
+
+void CatalogEntryChange::commit() {}
+
+void CatalogEntryChange::rollback() {
+    if (_catalog->hasEntry(_ident))
+        _catalog->drop(_ident);
 }
-RemoveChange::~RemoveChange() {
-    free(_cachedData);
+
+MarkerInsertChange::MarkerInsertChange(PmseTruncateMarkers* markers,
+                                       RecordId loc, int64_t dataSize)
+    : _markers(markers), _loc(loc), _dataSize(dataSize) {}
+
+void MarkerInsertChange::commit() {
+    _markers->recordInserted(_loc, _dataSize);
+}
+
+void MarkerInsertChange::rollback() {}
+
+RecordCacheInvalidateChange::RecordCacheInvalidateChange(PmseRecordCache* cache, RecordId loc)
+    : _cache(cache), _loc(loc) {}
+
+void RecordCacheInvalidateChange::commit() {
+    _cache->invalidate(_loc);
+}
+
+void RecordCacheInvalidateChange::rollback() {
+    _cache->invalidate(_loc);
+}
+
+RemoveChange::RemoveChange(PmseChangeArena& arena, pool_base pop, PmseMap<InitData> *mapper,
+                           InitData* data, uint64_t dataSize, uint64_t flags)
+    : _pop(pop), _dataSize(dataSize), _flags(flags), _mapper(mapper) {
+    _cachedData = copyToArena(arena, data);
 }
 void RemoveChange::commit() {}
 void RemoveChange::rollback() {
-    persistent_ptr<InitData> obj;
-    _mapper = pool<root>(_pop).get_root()->kvmap_root_ptr;
     try {
-        transaction::exec_tx(_pop, [this, &obj] {
-            obj = pmemobj_tx_alloc(sizeof(InitData::size) + _cachedData->size, 1);
-            obj->size = _cachedData->size;
-            memcpy(obj->data, _cachedData->data, _cachedData->size);
+        transaction::exec_tx(_pop, [this] {
+            _mapper->insert(_cachedData->data, _cachedData->size, _flags);
         });
     } catch (std::exception &e) {
         log() << e.what();
     }
-    _mapper->insert(obj);
     _mapper->changeSize(_dataSize);
 }
 
-UpdateChange::UpdateChange(pool_base pop, uint64_t key, InitData* data, uint64_t dataSize)
-        : _pop(pop), _key(key), _dataSize(dataSize) {
-    _cachedData = static_cast<InitData*>(malloc(sizeof(InitData) + data->size));
-    memcpy(_cachedData->data, data->data, data->size);
-    _cachedData->size = data->size;
-}
-UpdateChange::~UpdateChange() {
-    free(_cachedData);
+UpdateChange::UpdateChange(PmseChangeArena& arena, pool_base pop, PmseMap<InitData> *mapper,
+                           uint64_t key, InitData* data, uint64_t dataSize, uint64_t flags)
+        : _pop(pop), _key(key), _dataSize(dataSize), _flags(flags), _mapper(mapper) {
+    _cachedData = copyToArena(arena, data);
 }
 void UpdateChange::commit() {}
 void UpdateChange::rollback() {
-    persistent_ptr<InitData> obj;
+    int64_t replacedSize = -1;
     try {
-        _mapper = pool<root>(_pop).get_root()->kvmap_root_ptr;
-        transaction::exec_tx(_pop, [this, &obj] {
-            obj = pmemobj_tx_alloc(sizeof(InitData::size) + _cachedData->size, 1);
-            obj->size = _cachedData->size;
-            memcpy(obj->data, _cachedData->data, _cachedData->size);
+        stdx::lock_guard<pmem::obj::mutex> lock(
+            _mapper->_listMutex[_key % _mapper->getHashmapSize()]);
+        transaction::exec_tx(_pop, [this, &replacedSize] {
+            replacedSize = _mapper->updateKV(_key, _cachedData->data, _cachedData->size,
+                                             nullptr, _flags);
         });
-        _mapper->updateKV(_key, obj);
-        auto rd = RecordData(obj->data, obj->size);
-        _mapper->changeSize(rd.size() - _dataSize);
+        if (replacedSize >= 0)
+            _mapper->changeSize(static_cast<int64_t>(_dataSize) - replacedSize);
     } catch (std::exception &e) {
         log() << e.what();
     }
 }
-InsertIndexChange::InsertIndexChange(persistent_ptr<PmseTree> tree,
-                                     pool_base pop, BSONObj key,
+InsertIndexChange::InsertIndexChange(PmseChangeArena& arena, persistent_ptr<PmseTree> tree,
+                                     pool_base pop, const BSONObj& key,
                                      RecordId loc, bool dupsAllowed,
                                      const IndexDescriptor* desc)
-        : _tree(tree), _pop(pop), _key(key), _loc(loc),
+        : _tree(tree), _pop(pop), _key(copyToArena(arena, key)), _loc(loc),
           _dupsAllowed(dupsAllowed), _desc(desc) {}
 
 void InsertIndexChange::commit() {}
@@ -167,16 +200,17 @@ void InsertIndexChange::rollback() {
     }
 }
 
-RemoveIndexChange::RemoveIndexChange(persistent_ptr<PmseTree> tree, pool_base pop, BSONObj key, RecordId loc,
-                                     bool dupsAllowed, BSONObj ordering)
-        : _tree(tree), _pop(pop), _key(key), _loc(loc),
-          _dupsAllowed(dupsAllowed), _ordering(ordering) {}
+RemoveIndexChange::RemoveIndexChange(PmseChangeArena& arena, persistent_ptr<PmseTree> tree,
+                                     pool_base pop, const BSONObj& key, RecordId loc,
+                                     bool dupsAllowed, const IndexDescriptor* desc)
+        : _tree(tree), _pop(pop), _key(copyToArena(arena, key)), _loc(loc),
+          _dupsAllowed(dupsAllowed), _desc(desc) {}
 void RemoveIndexChange::commit() {}
 void RemoveIndexChange::rollback() {	
     try {
         transaction::exec_tx(_pop, [this] {
             IndexKeyEntry entry(_key.getOwned(), _loc);
-            _tree->insert(_pop, entry, _ordering, _dupsAllowed);
+            _tree->insert(_pop, entry, _desc->keyPattern(), _dupsAllowed);
         });
     } catch (std::exception &e) {
         log() << e.what();
@@ -39,6 +39,8 @@
 #include "pmse_list_int_ptr.h"
 #include "pmse_tree.h"
 
+#include <string>
+
 #include "mongo/db/index/index_descriptor.h"
 #include "mongo/db/storage/record_data.h"
 #include "mongo/db/record_id.h"
@@ -46,10 +48,21 @@
 namespace mongo {
 template<typename T>
 class PmseMap;
+class PmseTruncateMarkers;
+class PmseRecordCache;
+class PmseChangeArena;
+class PmseCatalog;
+
+/*
+ * Changes are constructed in arena of recovery unit with
+ * PmseRecoveryUnit::emplaceChange, so they must not own heap memory.
+ * Payload and index key copies are allocated from the same arena.
+ */
 
 class TruncateChange: public RecoveryUnit::Change {
  public:
-    TruncateChange(pool_base pop, PmseMap<InitData> *mapper, RecordId Id, InitData *data, uint64_t dataSize);
+    TruncateChange(PmseChangeArena& arena, pool_base pop, PmseMap<InitData> *mapper,
+                   RecordId Id, InitData *data, uint64_t dataSize, uint64_t flags);
     virtual void rollback();
     virtual void commit();
  private:
@@ -59,6 +72,7 @@ class TruncateChange: public RecoveryUnit::Change {
     pool_base _pop;
     persistent_ptr<KVPair> _key;
     uint64_t _dataSize;
+    uint64_t _flags;
 };
 
 class DropListChange: public RecoveryUnit::Change {
@@ -83,23 +97,59 @@ class InsertChange : public RecoveryUnit::Change {
     uint64_t _dataSize;
 };
 
+/*
+ * Drops catalog entry created by unit of work which rolls back, entry was
+ * committed to shared pool when collection or index was created
+ */
+class CatalogEntryChange : public RecoveryUnit::Change {
+ public:
+    CatalogEntryChange(PmseCatalog* catalog, StringData ident);
+    virtual void rollback();
+    virtual void commit();
+ private:
+    PmseCatalog* _catalog;
+    std::string _ident;
+};
+
+class MarkerInsertChange : public RecoveryUnit::Change {
+ public:
+    MarkerInsertChange(PmseTruncateMarkers* markers, RecordId loc, int64_t dataSize);
+    virtual void rollback();
+    virtual void commit();
+ private:
+    PmseTruncateMarkers* _markers;
+    const RecordId _loc;
+    int64_t _dataSize;
+};
+
+class RecordCacheInvalidateChange : public RecoveryUnit::Change {
+ public:
+    RecordCacheInvalidateChange(PmseRecordCache* cache, RecordId loc);
+    virtual void rollback();
+    virtual void commit();
+ private:
+    PmseRecordCache* _cache;
+    const RecordId _loc;
+};
+
 class RemoveChange : public RecoveryUnit::Change {
  public:
-    RemoveChange(pool_base pop, InitData* data, uint64_t dataSize);
-    ~RemoveChange();
+    RemoveChange(PmseChangeArena& arena, pool_base pop, PmseMap<InitData> *mapper,
+                 InitData* data, uint64_t dataSize, uint64_t flags);
     virtual void rollback();
     virtual void commit();
  private:
     pool_base _pop;
     InitData *_cachedData;
     uint64_t _dataSize;
-    persistent_ptr<PmseMap<InitData>> _mapper;
+    uint64_t _flags;
+    PmseMap<InitData> *_mapper;
 };
 
 class UpdateChange : public RecoveryUnit::Change {
  public:
-    UpdateChange(pool_base pop, uint64_t key, InitData* data, uint64_t dataSize);
-    ~UpdateChange();
+    UpdateChange(PmseChangeArena& arena, pool_base pop, PmseMap<InitData> *mapper,
+                 uint64_t key, InitData* data, uint64_t dataSize, uint64_t flags);
     virtual void rollback();
     virtual void commit();
  private:
@@ -107,13 +157,14 @@ class UpdateChange : public RecoveryUnit::Change {
     uint64_t _key;
     InitData *_cachedData;
     uint64_t _dataSize;
-    persistent_ptr<PmseMap<InitData>> _mapper;
+    uint64_t _flags;
+    PmseMap<InitData> *_mapper;
 };
 
 class InsertIndexChange : public RecoveryUnit::Change {
  public:
-    InsertIndexChange(persistent_ptr<PmseTree> tree, pool_base pop,
-                      BSONObj key, RecordId loc, bool dupsAllowed,
+    InsertIndexChange(PmseChangeArena& arena, persistent_ptr<PmseTree> tree, pool_base pop,
+                      const BSONObj& key, RecordId loc, bool dupsAllowed,
                       const IndexDescriptor* desc);
     virtual void rollback();
     virtual void commit();
@@ -128,8 +179,9 @@ class InsertIndexChange : public RecoveryUnit::Change {
 
 class RemoveIndexChange : public RecoveryUnit::Change {
  public:
-    RemoveIndexChange(persistent_ptr<PmseTree> tree, pool_base pop, BSONObj key, RecordId loc,
-                      bool dupsAllowed, BSONObj ordering);
+    RemoveIndexChange(PmseChangeArena& arena, persistent_ptr<PmseTree> tree, pool_base pop,
+                      const BSONObj& key, RecordId loc, bool dupsAllowed,
+                      const IndexDescriptor* desc);
     virtual void rollback();
     virtual void commit();
  private:
@@ -138,7 +190,7 @@ class RemoveIndexChange : public RecoveryUnit::Change {
     BSONObj _key;
     RecordId _loc;
     bool _dupsAllowed;
-    BSONObj _ordering;
+    const IndexDescriptor* _desc;
 };
 
 }  // namespace mongo
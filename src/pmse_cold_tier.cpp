@@ -0,0 +1,219 @@
+/*
+ * Copyright 2014-2018, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define MONGO_LOG_DEFAULT_COMPONENT ::mongo::logger::LogComponent::kStorage
+
+#include "pmse_cold_tier.h"
+#include "pmse_epoch.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+
+#include "mongo/bson/bsonelement.h"
+#include "mongo/util/errno_util.h"
+#include "mongo/util/log.h"
+
+namespace mongo {
+
+PmseColdTier::PmseColdTier(const std::string& path, uint64_t coldAfterSeconds)
+    : _path(path), _coldAfterSeconds(coldAfterSeconds) {
+    for (auto& bitmap : _accessed) {
+        bitmap.reset(new std::atomic<uint64_t>[COLD_ACCESS_BITMAP_WORDS]);
+        for (uint64_t i = 0; i < COLD_ACCESS_BITMAP_WORDS; i++)
+            bitmap[i].store(0, std::memory_order_relaxed);
+    }
+    _fd = open(_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0664);
+    if (_fd < 0) {
+        log() << "Cannot open cold tier file " << _path << ": " << errnoWithDescription();
+        return;
+    }
+    struct stat st;
+    if (fstat(_fd, &st) == 0)
+        _fileSize = st.st_size;
+}
+
+PmseColdTier::~PmseColdTier() {
+    if (_fd >= 0)
+        close(_fd);
+}
+
+StatusWith<uint64_t> PmseColdTier::parseColdAfter(const BSONObj& options) {
+    BSONElement elem = options["coldAfterSeconds"];
+    if (elem.eoo())
+        return 0;
+    if (!elem.isNumber() || elem.numberLong() < 0) {
+        return Status(ErrorCodes::BadValue, "coldAfterSeconds must be a non-negative number");
+    }
+    return static_cast<uint64_t>(elem.numberLong());
+}
+
+void PmseColdTier::startRevolution() {
+    int previous = 1 - _current.load();
+    for (uint64_t i = 0; i < COLD_ACCESS_BITMAP_WORDS; i++)
+        _accessed[previous][i].store(0, std::memory_order_relaxed);
+    _current = previous;
+    _live.clear();
+    _revolutionSize = _fileSize.load();
+}
+
+/*
+ * Extents which are already free are found again as gaps, so they wait for
+ * new epoch as well. Reader which copied locator before revolution ended
+ * is pinned in older epoch, so its extent is not overwritten under it.
+ */
+void PmseColdTier::endRevolution() {
+    std::sort(_live.begin(), _live.end());
+    _retired.clear();
+    _free.clear();
+    _freeBytes = 0;
+    uint64_t position = 0;
+    for (auto& extent : _live) {
+        if (extent.first >= _revolutionSize)
+            break;
+        if (extent.first > position)
+            _retired.emplace_back(position, extent.first - position);
+        position = std::max(position, extent.first + extent.second);
+    }
+    if (position < _revolutionSize)
+        _retired.emplace_back(position, _revolutionSize - position);
+    _retiredEpoch = PmseEpochManager::get().retireEpoch();
+    _live.clear();
+}
+
+/*
+ * Only migrator thread appends, so offset does not need to be reserved atomically
+ */
+bool PmseColdTier::append(const char* data, uint64_t size, uint64_t* offset) {
+    if (_fd < 0)
+        return false;
+    if (!_retired.empty() && PmseEpochManager::get().isSafe(_retiredEpoch)) {
+        for (auto& extent : _retired) {
+            _free.insert(extent);
+            _freeBytes += extent.second;
+        }
+        _retired.clear();
+    }
+    uint64_t position = _fileSize.load();
+    bool reused = false;
+    for (auto it = _free.begin(); it != _free.end(); ++it) {
+        if (it->second < size)
+            continue;
+        position = it->first;
+        if (it->second > size)
+            _free.emplace(it->first + size, it->second - size);
+        _free.erase(it);
+        _freeBytes -= size;
+        reused = true;
+        break;
+    }
+    uint64_t written = 0;
+    while (written < size) {
+        ssize_t ret = pwrite(_fd, data + written, size - written, position + written);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            log() << "Cold tier write failed: " << errnoWithDescription();
+            return false;
+        }
+        written += ret;
+    }
+    *offset = position;
+    if (!reused)
+        _fileSize = position + size;
+    noteLive(position, size);
+    return true;
+}
+
+bool PmseColdTier::sync() {
+    if (_fd < 0 || fdatasync(_fd) != 0) {
+        log() << "Cold tier sync failed: " << errnoWithDescription();
+        return false;
+    }
+    return true;
+}
+
+bool PmseColdTier::read(uint64_t offset, uint64_t size, char* out) {
+    if (_fd < 0)
+        return false;
+    uint64_t done = 0;
+    while (done < size) {
+        ssize_t ret = pread(_fd, out + done, size - done, offset + done);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return false;
+        done += ret;
+    }
+    _coldReads.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+bool PmseColdTier::waitForNextStep() {
+    stdx::unique_lock<stdx::mutex> lock(_mutex);
+    _condition.wait_for(lock, std::chrono::milliseconds(_coldAfterSeconds * 1000 / COLD_CLOCK_STEPS),
+                        [this] { return _dead; });
+    return !_dead;
+}
+
+void PmseColdTier::kill() {
+    stdx::lock_guard<stdx::mutex> lock(_mutex);
+    _dead = true;
+    _condition.notify_all();
+}
+
+bool PmseColdTier::isDead() {
+    stdx::lock_guard<stdx::mutex> lock(_mutex);
+    return _dead;
+}
+
+void PmseColdTier::recordMigrated(uint64_t records, uint64_t bytes) {
+    _migratedRecords.fetch_add(records);
+    _migratedBytes.fetch_add(bytes);
+}
+
+void PmseColdTier::appendStats(BSONObjBuilder* result) const {
+    BSONObjBuilder stats(result->subobjStart("coldTier"));
+    stats.appendNumber("coldAfterSeconds", static_cast<long long>(_coldAfterSeconds));
+    stats.appendNumber("fileSize", static_cast<long long>(_fileSize.load()));
+    stats.appendNumber("freeBytes", static_cast<long long>(_freeBytes.load()));
+    stats.appendNumber("migratedRecords", static_cast<long long>(_migratedRecords.load()));
+    stats.appendNumber("migratedBytes", static_cast<long long>(_migratedBytes.load()));
+    stats.appendNumber("coldReads", static_cast<long long>(_coldReads.load()));
+    stats.done();
+}
+
+}  // namespace mongo
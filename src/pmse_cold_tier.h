@@ -0,0 +1,162 @@
+/*
+ * Copyright 2014-2018, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SRC_PMSE_COLD_TIER_H_
+#define SRC_PMSE_COLD_TIER_H_
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "mongo/base/status_with.h"
+#include "mongo/bson/bsonobj.h"
+#include "mongo/bson/bsonobjbuilder.h"
+#include "mongo/db/record_id.h"
+#include "mongo/stdx/condition_variable.h"
+#include "mongo/stdx/mutex.h"
+
+namespace mongo {
+
+const uint64_t COLD_ACCESS_BITMAP_WORDS = 1 << 14;  // 1M bits, ids are hashed into it
+const uint64_t COLD_BATCH_BYTES = 4 * 1024 * 1024;  // Payloads written per fdatasync
+const uint64_t COLD_CLOCK_STEPS = 64;  // Steps of clock hand per coldAfterSeconds
+
+struct ColdCandidate {
+    uint64_t id;
+    uint64_t flags;
+    uint64_t dataSize;
+    std::string payload;
+    uint64_t offset;
+};
+
+/*
+ * File on regular filesystem keeping payloads which were not read for
+ * coldAfterSeconds. Migrator moves clock hand over record ids, one revolution
+ * takes coldAfterSeconds. Reads are tracked in two DRAM bitmaps swapped at
+ * every revolution, so record becomes cold when it was not read during the
+ * last whole revolution. Hand reports extents of cold records it passes,
+ * space not reported during revolution is reused once no reader is pinned
+ * in older epoch. Only migrator thread allocates.
+ */
+class PmseColdTier {
+ public:
+    PmseColdTier(const std::string& path, uint64_t coldAfterSeconds);
+
+    ~PmseColdTier();
+
+    /*
+     * Parses coldAfterSeconds from storageEngine.pmse collection options, 0 disables tiering
+     */
+    static StatusWith<uint64_t> parseColdAfter(const BSONObj& options);
+
+    void markAccessed(const RecordId& id) {
+        uint64_t bit = hashId(id);
+        _accessed[_current.load(std::memory_order_relaxed)][bit / 64].fetch_or(
+            1ull << (bit % 64), std::memory_order_relaxed);
+    }
+
+    bool wasAccessed(const RecordId& id) const {
+        uint64_t bit = hashId(id);
+        return (_accessed[0][bit / 64].load(std::memory_order_relaxed) |
+                _accessed[1][bit / 64].load(std::memory_order_relaxed)) &
+               (1ull << (bit % 64));
+    }
+
+    /*
+     * Forgets reads from before previous revolution and starts collecting
+     * extents in use
+     */
+    void startRevolution();
+
+    /*
+     * Space of file not reported by noteLive since startRevolution becomes
+     * free once readers pinned now are gone
+     */
+    void endRevolution();
+
+    void noteLive(uint64_t offset, uint64_t size) {
+        _live.emplace_back(offset, size);
+    }
+
+    /*
+     * Writes payload into free extent or at end of file
+     */
+    bool append(const char* data, uint64_t size, uint64_t* offset);
+
+    bool sync();
+
+    bool read(uint64_t offset, uint64_t size, char* out);
+
+    /*
+     * Sleeps until next step of clock hand, returns false when tier was killed
+     */
+    bool waitForNextStep();
+
+    void kill();
+
+    bool isDead();
+
+    void recordMigrated(uint64_t records, uint64_t bytes);
+
+    void appendStats(BSONObjBuilder* result) const;
+
+ private:
+    static uint64_t hashId(const RecordId& id) {
+        return (static_cast<uint64_t>(id.repr()) * 0x9E3779B97F4A7C15ull) %
+               (COLD_ACCESS_BITMAP_WORDS * 64);
+    }
+
+    const std::string _path;
+    const uint64_t _coldAfterSeconds;
+    int _fd;
+    std::atomic<uint64_t> _fileSize{0};
+    std::unique_ptr<std::atomic<uint64_t>[]> _accessed[2];
+    std::atomic<int> _current{0};  // Bitmap marked by readers
+    std::vector<std::pair<uint64_t, uint64_t>> _live;  // Extents passed by hand
+    uint64_t _revolutionSize = 0;  // File size when revolution started
+    std::vector<std::pair<uint64_t, uint64_t>> _retired;  // Free after _retiredEpoch
+    uint64_t _retiredEpoch = 0;
+    std::map<uint64_t, uint64_t> _free;  // Offset to size of reusable extents
+    std::atomic<uint64_t> _freeBytes{0};
+    stdx::mutex _mutex;
+    stdx::condition_variable _condition;
+    bool _dead = false;
+    std::atomic<uint64_t> _migratedRecords{0};
+    std::atomic<uint64_t> _migratedBytes{0};
+    std::atomic<uint64_t> _coldReads{0};
+};
+
+}  // namespace mongo
+#endif  // SRC_PMSE_COLD_TIER_H_
@@ -0,0 +1,151 @@
+/*
+ * Copyright 2014-2018, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define MONGO_LOG_DEFAULT_COMPONENT ::mongo::logger::LogComponent::kStorage
+
+#include "pmse_compression.h"
+
+#include <snappy.h>
+#include <zlib.h>
+
+#include <cstring>
+#include <limits>
+
+#include "mongo/bson/bsonelement.h"
+#include "mongo/util/mongoutils/str.h"
+
+namespace mongo {
+
+PmseCompression::PmseCompression(PmseCompressor compressor, uint64_t threshold)
+    : _compressor(compressor), _threshold(threshold) {}
+
+StatusWith<PmseCompression> PmseCompression::parse(const BSONObj& options) {
+    PmseCompressor compressor = PmseCompressor::kNone;
+    uint64_t threshold = COMPRESSION_DEFAULT_THRESHOLD;
+    for (auto&& elem : options) {
+        if (elem.fieldNameStringData() == "compressor") {
+            if (elem.type() != String) {
+                return Status(ErrorCodes::TypeMismatch, "compressor must be a string");
+            }
+            StringData name = elem.valueStringData();
+            if (name == "snappy") {
+                compressor = PmseCompressor::kSnappy;
+            } else if (name == "zlib") {
+                compressor = PmseCompressor::kZlib;
+            } else if (name != "none") {
+                return Status(ErrorCodes::BadValue,
+                              str::stream() << "Unknown compressor: " << name);
+            }
+        } else if (elem.fieldNameStringData() == "compressionThreshold") {
+            if (!elem.isNumber() || elem.numberLong() < 0) {
+                return Status(ErrorCodes::BadValue,
+                              "compressionThreshold must be a non-negative number");
+            }
+            threshold = elem.numberLong();
+        }
+    }
+    return PmseCompression(compressor, threshold);
+}
+
+StringData PmseCompression::compressorName() const {
+    switch (_compressor) {
+        case PmseCompressor::kSnappy:
+            return "snappy";
+        case PmseCompressor::kZlib:
+            return "zlib";
+        default:
+            return "none";
+    }
+}
+
+bool PmseCompression::compress(const char* data, uint64_t size, std::vector<char>* out) const {
+    if (!enabled() || size < _threshold || size > std::numeric_limits<uint32_t>::max())
+        return false;
+    size_t compressedSize = 0;
+    switch (_compressor) {
+        case PmseCompressor::kSnappy:
+            out->resize(sizeof(CompressedHeader) + snappy::MaxCompressedLength(size));
+            snappy::RawCompress(data, size, out->data() + sizeof(CompressedHeader), &compressedSize);
+            break;
+        case PmseCompressor::kZlib: {
+            uLongf destLen = compressBound(size);
+            out->resize(sizeof(CompressedHeader) + destLen);
+            if (compress2(reinterpret_cast<Bytef*>(out->data() + sizeof(CompressedHeader)), &destLen,
+                          reinterpret_cast<const Bytef*>(data), size, Z_DEFAULT_COMPRESSION) != Z_OK)
+                return false;
+            compressedSize = destLen;
+            break;
+        }
+        default:
+            return false;
+    }
+    if (sizeof(CompressedHeader) + compressedSize >= size)
+        return false;
+    CompressedHeader header = {static_cast<uint32_t>(size), static_cast<uint32_t>(_compressor)};
+    memcpy(out->data(), &header, sizeof(header));
+    out->resize(sizeof(header) + compressedSize);
+    return true;
+}
+
+uint64_t PmseCompression::rawSize(const char* data) {
+    CompressedHeader header;
+    memcpy(&header, data, sizeof(header));
+    return header.rawSize;
+}
+
+bool PmseCompression::decompress(const char* data, uint64_t size, char* out) {
+    CompressedHeader header;
+    if (size < sizeof(header))
+        return false;
+    memcpy(&header, data, sizeof(header));
+    const char* payload = data + sizeof(header);
+    uint64_t payloadSize = size - sizeof(header);
+    switch (static_cast<PmseCompressor>(header.compressor)) {
+        case PmseCompressor::kSnappy: {
+            // Damaged payload must not write past buffer sized from header
+            size_t length;
+            return snappy::GetUncompressedLength(payload, payloadSize, &length) &&
+                   length == header.rawSize &&
+                   snappy::RawUncompress(payload, payloadSize, out);
+        }
+        case PmseCompressor::kZlib: {
+            uLongf destLen = header.rawSize;
+            return uncompress(reinterpret_cast<Bytef*>(out), &destLen,
+                              reinterpret_cast<const Bytef*>(payload), payloadSize) == Z_OK &&
+                   destLen == header.rawSize;
+        }
+        default:
+            return false;
+    }
+}
+
+}  // namespace mongo
@@ -0,0 +1,102 @@
+/*
+ * Copyright 2014-2018, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SRC_PMSE_COMPRESSION_H_
+#define SRC_PMSE_COMPRESSION_H_
+
+#include <cstdint>
+#include <vector>
+
+#include "mongo/base/status_with.h"
+#include "mongo/base/string_data.h"
+#include "mongo/bson/bsonobj.h"
+
+namespace mongo {
+
+const uint64_t COMPRESSION_DEFAULT_THRESHOLD = 256;
+
+enum class PmseCompressor : uint32_t {
+    kNone = 0,
+    kSnappy = 1,
+    kZlib = 2
+};
+
+/*
+ * Prepended to every compressed payload, so record can be decompressed
+ * without knowing options of its collection.
+ */
+struct CompressedHeader {
+    uint32_t rawSize;
+    uint32_t compressor;
+};
+
+/*
+ * Per-collection record compression, configured by storageEngine.pmse
+ * collection options: {compressor: "snappy"|"zlib"|"none", compressionThreshold: <bytes>}.
+ */
+class PmseCompression {
+ public:
+    PmseCompression() = default;
+    PmseCompression(PmseCompressor compressor, uint64_t threshold);
+
+    static StatusWith<PmseCompression> parse(const BSONObj& options);
+
+    bool enabled() const {
+        return _compressor != PmseCompressor::kNone;
+    }
+
+    StringData compressorName() const;
+
+    /*
+     * Returns false when record should stay raw: compression is disabled,
+     * record is below threshold or compressed form would not be smaller.
+     */
+    bool compress(const char* data, uint64_t size, std::vector<char>* out) const;
+
+    /*
+     * Size is not checked, callers must make sure data holds header
+     */
+    static uint64_t rawSize(const char* data);
+
+    /*
+     * Output buffer has to hold rawSize(data) bytes. Returns false for
+     * truncated or damaged payload.
+     */
+    static bool decompress(const char* data, uint64_t size, char* out);
+
+ private:
+    PmseCompressor _compressor = PmseCompressor::kNone;
+    uint64_t _threshold = COMPRESSION_DEFAULT_THRESHOLD;
+};
+
+}  // namespace mongo
+#endif  // SRC_PMSE_COMPRESSION_H_
@@ -32,10 +32,18 @@
 
 #define MONGO_LOG_DEFAULT_COMPONENT ::mongo::logger::LogComponent::kStorage
 
+#include "pmse_catalog.h"
+#include "pmse_change.h"
 #include "pmse_engine.h"
+#include "pmse_group_commit.h"
+#include "pmse_list_int_ptr.h"
+#include "pmse_prefetch.h"
 #include "pmse_record_store.h"
+#include "pmse_slab_allocator.h"
 #include "pmse_sorted_data_interface.h"
+#include "pmse_tree.h"
 
+#include <algorithm>
 #include <cstdlib>
 #include <string>
 
@@ -45,17 +53,56 @@
 #include "mongo/db/storage/record_store.h"
 #include "mongo/stdx/memory.h"
 #include "mongo/db/catalog/collection_options.h"
+#include "mongo/db/server_parameters.h"
 #include "mongo/util/log.h"
 
 #include <boost/algorithm/string/predicate.hpp>
 
 namespace mongo {
 
+/*
+ * Keep all collections and indexes in one pool instead of a pool per ident
+ */
+MONGO_EXPORT_STARTUP_SERVER_PARAMETER(pmseSharedPool, bool, false);
+MONGO_EXPORT_STARTUP_SERVER_PARAMETER(pmseSharedPoolSizeMB, int, 4096);
+
+/*
+ * Apply all writes of unit of work in one transaction of shared pool
+ */
+MONGO_EXPORT_STARTUP_SERVER_PARAMETER(pmseWriteUnitTransactions, bool, false);
+
+/*
+ * Acknowledge record writes before they reach PMEM and apply them in
+ * background every pmseGroupCommitIntervalMs, journaled writes still wait
+ */
+MONGO_EXPORT_STARTUP_SERVER_PARAMETER(pmseRelaxedDurability, bool, false);
+MONGO_EXPORT_STARTUP_SERVER_PARAMETER(pmseGroupCommitIntervalMs, int, 100);
+
+/*
+ * Documents of at least this many bytes are copied to PMEM with
+ * non-temporal stores, 0 disables them
+ */
+MONGO_EXPORT_STARTUP_SERVER_PARAMETER(pmseNonTemporalCopyThreshold, int, 4096);
+
+/*
+ * Number of records and index keys scans prefetch ahead of the one
+ * returned, 0 disables prefetching
+ */
+MONGO_EXPORT_STARTUP_SERVER_PARAMETER(pmsePrefetchDistance, int, 4);
+
+/*
+ * Index separator keys keep only leading fields needed to tell leaves apart
+ */
+MONGO_EXPORT_STARTUP_SERVER_PARAMETER(pmseIndexSuffixTruncation, bool, true);
+
 PmseEngine::PmseEngine(std::string dbpath) : _dbPath(dbpath) {
     if(!boost::algorithm::ends_with(dbpath, "/")) {
         _dbPath = _dbPath +"/";
     }
     std::string path = _dbPath + _kIdentFilename.toString();
+    PmseListIntPtr::setNonTemporalThreshold(std::max(pmseNonTemporalCopyThreshold, 0));
+    PmsePrefetch::setDistance(std::max(pmsePrefetchDistance, 0));
+    PmseTree::setSuffixTruncation(pmseIndexSuffixTruncation);
     if (!boost::filesystem::exists(path)) {
         pop = pool<ListRoot>::create(path, "pmse_identlist", 4 * PMEMOBJ_MIN_POOL,
                                      0664);
@@ -83,12 +130,30 @@ PmseEngine::PmseEngine(std::string dbpath) : _dbPath(dbpath) {
         _needCheck = false;
     }
     _identList->resetState();
+    if (pmseSharedPool) {
+        _catalog = stdx::make_unique<PmseCatalog>(_dbPath + SHARED_POOL_FILENAME,
+                                                  static_cast<uint64_t>(pmseSharedPoolSizeMB) << 20);
+    }
+    if (pmseWriteUnitTransactions && !_catalog)
+        warning() << "pmseWriteUnitTransactions requires pmseSharedPool, ignoring";
+    _writeUnitTransactions = pmseWriteUnitTransactions && _catalog;
+    if (pmseRelaxedDurability) {
+        if (_needCheck) {
+            warning() << "Unclean shutdown detected, in relaxed durability mode writes acknowledged "
+                      << "without journaling may be lost while their index keys were kept; "
+                      << "run validate with full: true and reIndex collections it reports";
+        }
+        _groupCommit = stdx::make_unique<PmseGroupCommit>(std::max(pmseGroupCommitIntervalMs, 1));
+    }
 }
 
 PmseEngine::~PmseEngine() {
+    _groupCommit.reset();
     for (auto p : _poolHandler) {
+        PmseSlabAllocator::unregisterClasses(p.second);
         p.second.close();
     }
+    _catalog.reset();
     pop.close();
 }
 
@@ -98,7 +163,11 @@ Status PmseEngine::createRecordStore(OperationContext* opCtx, StringData ns, Str
     auto status = Status::OK();
     try {
         _identList->insertKV(ident.toString().c_str(), ns.toString().c_str());
-        auto record_store = stdx::make_unique<PmseRecordStore>(ns, ident, options, _dbPath, &_poolHandler);
+        auto record_store = stdx::make_unique<PmseRecordStore>(ns, ident, options, _dbPath, &_poolHandler,
+                                                               false, _catalog.get(),
+                                                               _groupCommit.get());
+        if (_catalog)
+            opCtx->recoveryUnit()->registerChange(new CatalogEntryChange(_catalog.get(), ident));
     } catch(std::exception &e) {
         status = Status(ErrorCodes::OutOfDiskSpace, e.what());
     }
@@ -110,18 +179,32 @@ std::unique_ptr<RecordStore> PmseEngine::getRecordStore(OperationContext* opCtx,
                                                         StringData ident,
                                                         const CollectionOptions& options) {
     persistent_ptr<PmseMap<InitData>> _mapper;
-    pool<root> mapPoolOld;
-    try {
-        mapPoolOld = pool<root>((_poolHandler).at(ident.toString()));
-    } catch (std::exception &e) {}
-
-    if (mapPoolOld.get_handle()) {
-        _mapper = mapPoolOld.get_root()->kvmap_root_ptr;
+    if (_catalog) {
+        _mapper = _catalog->getEntry(ident)->mapper;
+    } else {
+        pool<root> mapPoolOld;
+        try {
+            mapPoolOld = pool<root>((_poolHandler).at(ident.toString()));
+        } catch (std::exception &e) {}
+        if (mapPoolOld.get_handle())
+            _mapper = mapPoolOld.get_root()->kvmap_root_ptr;
+    }
+    if (_mapper) {
         _mapper->storeCounters();
     }
     _identList->update(ident.toString().c_str(), ns.toString().c_str());
-    return stdx::make_unique<PmseRecordStore>(ns, ident, options, _dbPath,
-                                              &_poolHandler, (_needCheck ? true : false));
+    auto recordStore = stdx::make_unique<PmseRecordStore>(ns, ident, options, _dbPath,
+                                                          &_poolHandler,
+                                                          (_needCheck ? true : false),
+                                                          _catalog.get(), _groupCommit.get(),
+                                                          _writeUnitTransactions);
+    // Indexes of collection are opened after it and buffer writes like it
+    stdx::lock_guard<stdx::mutex> lock(_pmutex);
+    if (recordStore->deferredWrites())
+        _deferredNamespaces.insert(ns.toString());
+    else
+        _deferredNamespaces.erase(ns.toString());
+    return std::move(recordStore);
 }
 
 Status PmseEngine::createSortedDataInterface(OperationContext* opCtx,
@@ -130,7 +213,10 @@ Status PmseEngine::createSortedDataInterface(OperationContext* opCtx,
     stdx::lock_guard<stdx::mutex> lock(_pmutex);
     try {
         _identList->insertKV(ident.toString().c_str(), "");
-        auto sorted_data_interface = PmseSortedDataInterface(ident, desc, _dbPath, &_poolHandler);
+        PmseSortedDataInterface sorted_data_interface(ident, desc, _dbPath, &_poolHandler,
+                                                      _catalog.get());
+        if (_catalog)
+            opCtx->recoveryUnit()->registerChange(new CatalogEntryChange(_catalog.get(), ident));
     } catch (std::exception &e) {
         return Status(ErrorCodes::OutOfDiskSpace, e.what());
     }
@@ -140,18 +226,31 @@ Status PmseEngine::createSortedDataInterface(OperationContext* opCtx,
 SortedDataInterface* PmseEngine::getSortedDataInterface(OperationContext* opCtx,
                                                         StringData ident,
                                                         const IndexDescriptor* desc) {
-    return new PmseSortedDataInterface(ident, desc, _dbPath, &_poolHandler);
+    bool deferredWrites;
+    {
+        stdx::lock_guard<stdx::mutex> lock(_pmutex);
+        deferredWrites = _deferredNamespaces.count(desc->parentNS()) > 0;
+    }
+    return new PmseSortedDataInterface(ident, desc, _dbPath, &_poolHandler, _catalog.get(),
+                                       deferredWrites);
 }
 
 Status PmseEngine::dropIdent(OperationContext* opCtx, StringData ident) {
     stdx::lock_guard<stdx::mutex> lock(_pmutex);
     boost::filesystem::path path(_dbPath);
     _identList->deleteKV(ident.toString().c_str());
+    if (_catalog) {
+        _catalog->drop(ident);
+        boost::filesystem::remove(path.string() + ident.toString() + ".cold");
+        return Status::OK();
+    }
     if (_poolHandler.count(ident.toString()) > 0) {
+        PmseSlabAllocator::unregisterClasses(_poolHandler[ident.toString()]);
         _poolHandler[ident.toString()].close();
         _poolHandler.erase(ident.toString());
     }
     boost::filesystem::remove_all(path.string() + ident.toString());
+    boost::filesystem::remove(path.string() + ident.toString() + ".cold");
     return Status::OK();
 }
 
@@ -58,6 +58,8 @@
 namespace mongo {
 
 class JournalListener;
+class PmseCatalog;
+class PmseGroupCommit;
 
 using namespace pmem::obj;
 
@@ -73,7 +75,7 @@ class PmseEngine : public KVEngine {
     virtual ~PmseEngine();
 
     virtual RecoveryUnit* newRecoveryUnit() {
-        return new PmseRecoveryUnit();
+        return new PmseRecoveryUnit(_groupCommit.get());
     }
 
     virtual Status createRecordStore(OperationContext* opCtx,
@@ -147,7 +149,11 @@ class PmseEngine : public KVEngine {
  private:
     stdx::mutex _pmutex;
     bool _needCheck;
+    bool _writeUnitTransactions;
     std::map<std::string, pool_base> _poolHandler;
+    std::unordered_set<std::string> _deferredNamespaces;  // Collections buffering writes of units
+    std::unique_ptr<PmseCatalog> _catalog;
+    std::unique_ptr<PmseGroupCommit> _groupCommit;
     std::shared_ptr<void> _catalogInfo;
     std::string _dbPath;
     const StringData _kIdentFilename = "pmkv.pm";
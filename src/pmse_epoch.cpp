@@ -0,0 +1,90 @@
+/*
+ * Copyright 2014-2018, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define MONGO_LOG_DEFAULT_COMPONENT ::mongo::logger::LogComponent::kStorage
+
+#include "pmse_epoch.h"
+
+#include "mongo/stdx/thread.h"
+#include "mongo/util/time_support.h"
+
+namespace mongo {
+
+PmseEpochManager::PmseEpochManager() : _instance(curTimeMicros64()) {}
+
+PmseEpochManager& PmseEpochManager::get() {
+    static PmseEpochManager manager;
+    return manager;
+}
+
+int PmseEpochManager::pin() {
+    uint64_t start = _nextSlot.fetch_add(1);
+    while (true) {
+        uint64_t epoch = _epoch.load();
+        for (int i = 0; i < EPOCH_SLOTS; i++) {
+            int slot = (start + i) % EPOCH_SLOTS;
+            uint64_t expected = 0;
+            if (_slots[slot].compare_exchange_strong(expected, epoch))
+                return slot;
+        }
+        // More readers than slots, wait until one of them leaves
+        stdx::this_thread::yield();
+    }
+}
+
+void PmseEpochManager::unpin(int slot) {
+    _slots[slot].store(0);
+}
+
+uint64_t PmseEpochManager::retireEpoch() {
+    return _epoch.fetch_add(1);
+}
+
+/*
+ * Reader which pinned epoch later than retireEpoch() returned it could not
+ * reach the payload, it was unlinked before epoch advanced.
+ */
+bool PmseEpochManager::isSafe(uint64_t epoch) {
+    if (epoch < _safe.load())
+        return true;
+    uint64_t oldest = _epoch.load();
+    for (int i = 0; i < EPOCH_SLOTS; i++) {
+        uint64_t pinned = _slots[i].load();
+        if (pinned && pinned < oldest)
+            oldest = pinned;
+    }
+    uint64_t safe = _safe.load();
+    while (safe < oldest && !_safe.compare_exchange_weak(safe, oldest)) {}
+    return epoch < oldest;
+}
+
+}  // namespace mongo
@@ -0,0 +1,90 @@
+/*
+ * Copyright 2014-2018, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SRC_PMSE_EPOCH_H_
+#define SRC_PMSE_EPOCH_H_
+
+#include <atomic>
+#include <cstdint>
+
+namespace mongo {
+
+const int EPOCH_SLOTS = 8192;
+
+/*
+ * Epoch-based reclamation of PMEM payloads. Readers pin current epoch
+ * before they follow pointers into pool and keep it as long as they may
+ * hold RecordData pointing into PMEM. Writers tag unlinked payloads with
+ * retireEpoch() and free them once isSafe() says no pinned reader is older.
+ * Pinning and reading take no locks.
+ */
+class PmseEpochManager {
+ public:
+    static PmseEpochManager& get();
+
+    /*
+     * Pins current epoch, returns slot to unpin
+     */
+    int pin();
+
+    void unpin(int slot);
+
+    /*
+     * Advances epoch, returned epoch tags payloads unlinked before the call
+     */
+    uint64_t retireEpoch();
+
+    /*
+     * True when no pinned reader can see payloads retired with epoch
+     */
+    bool isSafe(uint64_t epoch);
+
+    /*
+     * Differs between runs, persistent structures compare it to detect
+     * first use after restart, when retired payloads can be freed at once
+     */
+    uint64_t instance() const {
+        return _instance;
+    }
+
+ private:
+    PmseEpochManager();
+
+    const uint64_t _instance;
+    std::atomic<uint64_t> _epoch{1};
+    std::atomic<uint64_t> _safe{0};  // Epochs below it are known to be safe
+    std::atomic<uint64_t> _nextSlot{0};
+    std::atomic<uint64_t> _slots[EPOCH_SLOTS];  // Pinned epoch, 0 when slot is free
+};
+
+}  // namespace mongo
+#endif  // SRC_PMSE_EPOCH_H_
@@ -0,0 +1,112 @@
+/*
+ * Copyright 2014-2018, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define MONGO_LOG_DEFAULT_COMPONENT ::mongo::logger::LogComponent::kStorage
+
+#include "pmse_group_commit.h"
+#include "pmse_record_store.h"
+
+#include <algorithm>
+#include <chrono>
+
+#include "mongo/util/concurrency/thread_name.h"
+#include "mongo/util/log.h"
+
+namespace mongo {
+
+PmseGroupCommit::PmseGroupCommit(uint64_t intervalMillis)
+    : _intervalMillis(intervalMillis), _thread(&PmseGroupCommit::run, this) {}
+
+PmseGroupCommit::~PmseGroupCommit() {
+    {
+        stdx::lock_guard<stdx::mutex> lock(_mutex);
+        _dead = true;
+        _condition.notify_all();
+    }
+    _thread.join();
+}
+
+void PmseGroupCommit::registerRecordStore(PmseRecordStore* recordStore) {
+    stdx::lock_guard<stdx::mutex> lock(_storesMutex);
+    _recordStores.insert(recordStore);
+}
+
+void PmseGroupCommit::unregisterRecordStore(PmseRecordStore* recordStore) {
+    stdx::unique_lock<stdx::mutex> lock(_storesMutex);
+    _recordStores.erase(recordStore);
+    _storesCondition.wait(lock, [this] { return !_storesInUse; });
+}
+
+void PmseGroupCommit::flush() {
+    stdx::unique_lock<stdx::mutex> lock(_mutex);
+    // Pass which is already running may have missed writes of this caller
+    uint64_t target = _completedPass + (_passRunning ? 2 : 1);
+    _requestedPass = std::max(_requestedPass, target);
+    _condition.notify_all();
+    _condition.wait(lock, [this, target] { return _completedPass >= target || _dead; });
+}
+
+void PmseGroupCommit::run() {
+    setThreadName("PmseGroupCommit");
+    stdx::unique_lock<stdx::mutex> lock(_mutex);
+    while (!_dead) {
+        _condition.wait_for(lock, std::chrono::milliseconds(_intervalMillis), [this] {
+            return _dead || _requestedPass > _completedPass;
+        });
+        _passRunning = true;
+        lock.unlock();
+        std::set<PmseRecordStore*> recordStores;
+        {
+            stdx::lock_guard<stdx::mutex> storesLock(_storesMutex);
+            recordStores = _recordStores;
+            _storesInUse = true;
+        }
+        for (auto recordStore : recordStores) {
+            try {
+                recordStore->flushPending();
+            } catch (std::exception& e) {
+                log() << "Group commit: " << e.what();
+            }
+        }
+        {
+            stdx::lock_guard<stdx::mutex> storesLock(_storesMutex);
+            _storesInUse = false;
+            _storesCondition.notify_all();
+        }
+        lock.lock();
+        _passRunning = false;
+        _completedPass++;
+        _condition.notify_all();
+    }
+}
+
+}  // namespace mongo
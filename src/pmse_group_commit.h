@@ -0,0 +1,86 @@
+/*
+ * Copyright 2014-2018, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SRC_PMSE_GROUP_COMMIT_H_
+#define SRC_PMSE_GROUP_COMMIT_H_
+
+#include <cstdint>
+#include <set>
+
+#include "mongo/stdx/condition_variable.h"
+#include "mongo/stdx/mutex.h"
+#include "mongo/stdx/thread.h"
+
+namespace mongo {
+
+class PmseRecordStore;
+
+/*
+ * Relaxed durability mode. Record writes of committed units are kept in
+ * DRAM and applied to PMEM by one thread every interval, so many units share
+ * fences of one transaction. flush() forces a pass and is used to honour
+ * journaled write concern.
+ */
+class PmseGroupCommit {
+ public:
+    explicit PmseGroupCommit(uint64_t intervalMillis);
+
+    ~PmseGroupCommit();
+
+    void registerRecordStore(PmseRecordStore* recordStore);
+
+    void unregisterRecordStore(PmseRecordStore* recordStore);
+
+    /*
+     * Returns when writes committed before the call are in PMEM
+     */
+    void flush();
+
+ private:
+    void run();
+
+    const uint64_t _intervalMillis;
+    stdx::mutex _mutex;
+    stdx::condition_variable _condition;
+    stdx::mutex _storesMutex;
+    stdx::condition_variable _storesCondition;
+    std::set<PmseRecordStore*> _recordStores;
+    bool _storesInUse = false;  // Unregistering waits until pass stops using its copy of stores
+    uint64_t _requestedPass = 0;
+    uint64_t _completedPass = 0;
+    bool _passRunning = false;
+    bool _dead = false;
+    stdx::thread _thread;
+};
+
+}  // namespace mongo
+#endif  // SRC_PMSE_GROUP_COMMIT_H_
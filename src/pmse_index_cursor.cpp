@@ -33,10 +33,13 @@
 #define MONGO_LOG_DEFAULT_COMPONENT ::mongo::logger::LogComponent::kStorage
 
 #include "pmse_index_cursor.h"
+#include "pmse_prefetch.h"
 
+#include <algorithm>
 #include <shared_mutex>
 #include <limits>
 #include <list>
+#include <unordered_set>
 
 #include "mongo/util/log.h"
 
@@ -53,6 +56,24 @@ PmseCursor::PmseCursor(OperationContext* txn, bool isForward,
       _locateFoundDataEnd(false),
       _eofRestore(false) {}
 
+PmseCursor::~PmseCursor() {
+    unpin();
+}
+
+void PmseCursor::pin() {
+    if (_epochSlot < 0)
+        _epochSlot = PmseEpochManager::get().pin();
+}
+
+void PmseCursor::unpin() {
+    _positioned = false;
+    _endValid = false;
+    if (_epochSlot >= 0) {
+        PmseEpochManager::get().unpin(_epochSlot);
+        _epochSlot = -1;
+    }
+}
+
     // Find entry in tree which is equal or bigger to input entry
     // Locates input cursor on that entry
     // Sets _locateFoundDataEnd when result is after last entry in tree
@@ -65,8 +86,7 @@ bool PmseCursor::lower_bound(IndexKeyEntry entry, CursorObject& cursor, std::lis
     while (!current->is_leaf) {
         i = 0;
         while (i < current->num_keys) {
-            IndexEntryComparison c(Ordering::make(_ordering));
-            cmp = c.compare(entry, IndexKeyEntry(current->keys[i].getBSON(), RecordId(current->keys[i].loc)));
+            cmp = IndexKeyEntry_PM::compareEntries(entry, current->keys[i], _ordering);
             if (cmp >= 0) {
                 i++;
             } else {
@@ -80,15 +100,16 @@ bool PmseCursor::lower_bound(IndexKeyEntry entry, CursorObject& cursor, std::lis
     }
     locks.push_back(&(current->_pmutex));
     i = 0;
-    IndexEntryComparison c(Ordering::make(_ordering));
 
-    while (i < current->num_keys && c.compare(entry, IndexKeyEntry(current->keys[i].getBSON(), RecordId(current->keys[i].loc))) > 0) {
+    while (i < current->num_keys && IndexKeyEntry_PM::compareEntries(entry, current->keys[i], _ordering) > 0) {
             i++;
     }
     // Iterated to end of node without finding bigger value
     // It means: return next
     if (i == current->num_keys) {
         if (current->next) {
+            current->next->_pmutex.lock_shared();
+            locks.push_back(&(current->next->_pmutex));
             cursor.node = current->next;
             cursor.index = 0;
             return true;
@@ -106,14 +127,19 @@ bool PmseCursor::lower_bound(IndexKeyEntry entry, CursorObject& cursor, std::lis
 bool PmseCursor::atOrPastEndPointAfterSeeking() {
     if (_isEOF)
         return true;
+    return pastEndState((_cursor.node->keys[_cursor.index]).getBSON(),
+                        (_cursor.node->keys[_cursor.index]).loc);
+}
+
+bool PmseCursor::pastEndState(const BSONObj& key, int64_t loc) {
     if (!_endState)
         return false;
     int cmp;
-    cmp = (_cursor.node->keys[_cursor.index]).getBSON().woCompare(_endState->query.key, _ordering, false);
+    cmp = key.woCompare(_endState->query.key, _ordering, false);
     if (cmp == 0) {
-        if ((_cursor.node->keys[_cursor.index]).loc < _endState->query.loc.repr()) {
+        if (loc < _endState->query.loc.repr()) {
             cmp = -1;
-        } else if ((_cursor.node->keys[_cursor.index]).loc > _endState->query.loc.repr()) {
+        } else if (loc > _endState->query.loc.repr()) {
             cmp = 1;
             } else {
                 cmp = 0;
@@ -152,8 +178,7 @@ void PmseCursor::locate(const BSONObj& key, const RecordId& loc, std::list<pmem:
             _cursor.node = locateCursor.node;
             _cursor.index = locateCursor.index;
             int cmp;
-            IndexEntryComparison c(Ordering::make(_ordering));
-            cmp = c.compare(IndexKeyEntry(_cursor.node->keys[_cursor.index].getBSON(), RecordId(_cursor.node->keys[_cursor.index].loc)), query);
+            cmp = IndexKeyEntry_PM::compareEntries(query, _cursor.node->keys[_cursor.index], _ordering);
 
             if (cmp) {
                 moveToNext(locks);
@@ -174,6 +199,10 @@ void PmseCursor::seekEndCursor() {
 
     if (!_endState || !_tree->_root)
         return;
+    pin();
+    _endPosition = boost::none;
+    _endNode = nullptr;
+    _endValid = true;
     std::list<pmem::obj::shared_mutex*> locks;
     found = lower_bound(_endState->query, endCursor, locks);
     if (_locateFoundDataEnd) {
@@ -215,15 +244,30 @@ void PmseCursor::seekEndCursor() {
             }
         }
     }
-    if ( found ) {
-        _endPosition = IndexKeyEntry(endCursor.node->keys[endCursor.index].getBSON(),
+    if ( found && endCursor.node ) {
+        _endPosition = IndexKeyEntry(endCursor.node->keys[endCursor.index].getBSON().getOwned(),
                                     RecordId(endCursor.node->keys[endCursor.index].loc));
+        _endNode = endCursor.node;
+        _endVersion = endCursor.node->version;
     }
     unlockTree(locks);
 }
 
+/*
+ * Node must be pinned
+ */
+bool PmseCursor::unchanged(persistent_ptr<PmseTreeNode> node, uint64_t version) {
+    node->_pmutex.lock_shared();
+    bool same = node->version == version;
+    node->_pmutex.unlock_shared();
+    return same;
+}
+
 
 void PmseCursor::setEndPosition(const BSONObj& key, bool inclusive) {
+    // Batch was cut at previous end position
+    resetBatch();
+    _positioned = false;
     if (key.isEmpty()) {
         // This means scan to end of index.
         _endState = boost::none;
@@ -246,18 +290,28 @@ boost::optional<IndexKeyEntry> PmseCursor::next(
                 RequestedInfo parts = kKeyAndLoc) {
     std::list<pmem::obj::shared_mutex *> locks;
 
+    if (_batchPos < _batch.size() && !_batchKeys && (parts & kWantKey))
+        keyBatch();
+    if (_batchPos < _batch.size())
+        return nextFromBatch(parts);
+    if (_batchAtEnd) {
+        _isEOF = true;
+        return {};
+    }
     if (_tree->_root == nullptr)
         return {};
-    locate(_cursorKey, RecordId(_cursorId), locks);
-    if (!_cursor.node) {
-            unlockTree(locks);
-            return boost::none;
+    pin();
+    if (!advanceInPlace(locks)) {
+        locate(_cursorKey, RecordId(_cursorId), locks);
+        if (!_cursor.node) {
+                unlockTree(locks);
+                return boost::none;
+        }
+        IndexKeyEntry current(_cursorKey, RecordId(_cursorId));
+        if (IndexKeyEntry_PM::compareEntries(current, _cursor.node->keys[_cursor.index], _ordering) == 0)
+            moveToNext(locks);
     }
-    IndexEntryComparison c(Ordering::make(_ordering));
-    if ( c.compare(IndexKeyEntry(_cursorKey, RecordId(_cursorId)),
-                    IndexKeyEntry((_cursor.node->keys[_cursor.index]).getBSON(),
-                                    RecordId((_cursor.node->keys[_cursor.index]).loc))) == 0)
-        moveToNext(locks);
+    _positioned = false;
     if (!_cursor.node) {
         unlockTree(locks);
         return boost::none;
@@ -268,19 +322,184 @@ boost::optional<IndexKeyEntry> PmseCursor::next(
         unlockTree(locks);
         return {};
     }
-    if (_cursor.node.raw_ptr()->off != 0) {
-            _cursorKey = _cursor.node->keys[_cursor.index].getBSON();
-            _cursorId = _cursor.node->keys[_cursor.index].loc;
-            // remember next value
-        } else {
-            _eofRestore = true;
+    if (_cursor.node.raw_ptr()->off == 0) {
+        _eofRestore = true;
+        unlockTree(locks);
+        return {};
+    }
+    fillBatch(parts);
+    unlockTree(locks);
+    return nextFromBatch(parts);
+}
+
+/*
+ * Copies entries of locked leaf from _cursor on, up to end position. Cursor
+ * stays on last copied entry, so next leaf is reached without locating.
+ * Keys are read only when requested or compared with end position.
+ */
+void PmseCursor::fillBatch(RequestedInfo parts) {
+    resetBatch();
+    _batchKeys = parts & kWantKey;
+    _batchStart = _cursor.index;
+    auto node = _cursor.node;
+    int64_t last = _cursor.index;
+    int64_t numKeys = node->num_keys;
+    // Keys are separate allocations, prefetch them distance entries ahead
+    int64_t distance = (_batchKeys || _endState) ? PmsePrefetch::distance() : 0;
+    int64_t step = _forward ? 1 : -1;
+    for (int64_t j = 0; j < distance; j++) {
+        int64_t ahead = last + j * step;
+        if (ahead < 0 || ahead >= numKeys)
+            break;
+        PmsePrefetch::line(node->keys[ahead].data.get());
+    }
+    persistent_ptr<char> previousKey = nullptr;
+    size_t previousOffset = 0;
+    for (int64_t i = _cursor.index; _forward ? i < numKeys : i >= 0; i += step) {
+        int64_t ahead = i + distance * step;
+        if (distance > 0 && ahead >= 0 && ahead < numKeys)
+            PmsePrefetch::line(node->keys[ahead].data.get());
+        int64_t loc = node->keys[i].loc;
+        // Entry at _cursor was already checked
+        if (i != last && _endState && pastEndState(node->keys[i].getBSON(), loc)) {
+            _batchAtEnd = true;
+            break;
+        }
+        if (!_batchKeys) {
+            _batch.emplace_back(BSONObj(), RecordId(loc));
+        } else if (node->keys[i].data != previousKey) {
+            // Run of entries sharing key is copied once
+            BSONObj key = node->keys[i].getBSON();
+            previousKey = node->keys[i].data;
+            previousOffset = _batchData.size();
+            _batchData.insert(_batchData.end(), key.objdata(), key.objdata() + key.objsize());
+        }
+        if (_batchKeys)
+            _batchOffsets.emplace_back(previousOffset, loc);
+        _cursor.index = i;
+    }
+    if (_batchKeys) {
+        for (auto& offset : _batchOffsets)
+            _batch.emplace_back(BSONObj(_batchData.data() + offset.first), RecordId(offset.second));
+    } else {
+        _batchFirstKey = node->keys[_batchStart].getBSON().getOwned();
+        _batchLastKey = node->keys[_cursor.index].getBSON().getOwned();
+    }
+    _cursorVersion = node->version;
+    _positioned = true;
+}
+
+/*
+ * Drops copied entries, position is kept in last returned key
+ */
+void PmseCursor::resetBatch() {
+    _cursorKey = _cursorKey.getOwned();
+    _batch.clear();
+    _batchData.clear();
+    _batchOffsets.clear();
+    _batchPos = 0;
+    _batchAtEnd = false;
+    _batchKeys = true;
+    _batchFirstKey = BSONObj();
+    _batchLastKey = BSONObj();
+}
+
+/*
+ * Gives keys to rest of batch copied without them, for caller which asks
+ * for keys now. They are read from leaf while it is unchanged. Otherwise
+ * batch is copied again from its first key, without entries returned already.
+ */
+void PmseCursor::keyBatch() {
+    if (_positioned) {
+        auto node = _cursor.node;
+        node->_pmutex.lock_shared();
+        if (node->version == _cursorVersion) {
+            int64_t step = _forward ? 1 : -1;
+            for (size_t i = 0; i < _batch.size(); i++) {
+                BSONObj key = node->keys[_batchStart + i * step].getBSON();
+                _batchOffsets.emplace_back(_batchData.size(), _batch[i].loc.repr());
+                _batchData.insert(_batchData.end(), key.objdata(), key.objdata() + key.objsize());
+            }
+            node->_pmutex.unlock_shared();
+            for (size_t i = 0; i < _batch.size(); i++)
+                _batch[i].key = BSONObj(_batchData.data() + _batchOffsets[i].first);
+            _batchKeys = true;
+            return;
         }
-    IndexKeyEntry entry((_cursor.node->keys[_cursor.index]).getBSON(),
-                        RecordId((_cursor.node->keys[_cursor.index]).loc));
+        node->_pmutex.unlock_shared();
+    }
+
+    std::unordered_set<int64_t> returned;
+    for (size_t i = 0; i < _batchPos; i++)
+        returned.insert(_batch[i].loc.repr());
+    BSONObj firstKey = _batchFirstKey;
+    RecordId firstLoc = _batch.front().loc;
+    BSONObj lastKey = _batchLastKey;
+    RecordId lastLoc = _batch.back().loc;
+    resetBatch();
+    _positioned = false;
+    // Scan continues after old batch when nothing is left of it
+    _cursorKey = lastKey;
+    _cursorId = lastLoc.repr();
+    if (_tree->_root == nullptr)
+        return;
+    std::list<pmem::obj::shared_mutex*> locks;
+    pin();
+    locate(firstKey, firstLoc, locks);
+    if (_isEOF || !_cursor.node || _cursor.node.raw_ptr()->off == 0) {
+        unlockTree(locks);
+        return;
+    }
+    fillBatch(kKeyAndLoc);
     unlockTree(locks);
+    auto copied = [&](const IndexKeyEntry& entry) {
+        int cmp = entry.key.woCompare(lastKey, _ordering, false);
+        if (cmp == 0)
+            cmp = entry.loc < lastLoc ? -1 : (entry.loc > lastLoc ? 1 : 0);
+        return (_forward ? cmp <= 0 : cmp >= 0) && returned.count(entry.loc.repr());
+    };
+    _batch.erase(std::remove_if(_batch.begin(), _batch.end(), copied), _batch.end());
+}
+
+/*
+ * Keys of batch copied without them are not returned, position is kept in
+ * last key of batch once all its entries are returned
+ */
+boost::optional<IndexKeyEntry> PmseCursor::nextFromBatch(RequestedInfo parts) {
+    const IndexKeyEntry& entry = _batch[_batchPos++];
+    if (_batchKeys || _batchPos == _batch.size()) {
+        _cursorKey = _batchKeys ? entry.key : _batchLastKey;
+        _cursorId = entry.loc.repr();
+    }
+    if (!(parts & kWantKey))
+        return IndexKeyEntry(BSONObj(), entry.loc);
     return entry;
 }
 
+IndexKeyEntry PmseCursor::currentEntry(RequestedInfo parts) {
+    IndexKeyEntry_PM& entry = _cursor.node->keys[_cursor.index];
+    return IndexKeyEntry((parts & kWantKey) ? entry.getBSON() : BSONObj(), RecordId(entry.loc));
+}
+
+/*
+ * Moves from last returned entry without descending from root, possible when
+ * its leaf was not modified since. Returns false when caller has to locate it.
+ */
+bool PmseCursor::advanceInPlace(std::list<pmem::obj::shared_mutex*>& locks) {
+    if (!_positioned)
+        return false;
+    _cursor.node->_pmutex.lock_shared();
+    locks.push_back(&(_cursor.node->_pmutex));
+    if (_cursor.node->version != _cursorVersion) {
+        unlockTree(locks);
+        return false;
+    }
+    moveToNext(locks);
+    if (_cursor.node && atOrPastEndPointAfterSeeking())
+        _isEOF = true;
+    return true;
+}
+
 void PmseCursor::moveToNext(std::list<pmem::obj::shared_mutex*>& locks) {
     persistent_ptr<PmseTreeNode> node;
     if (_forward) {
@@ -299,6 +518,8 @@ void PmseCursor::moveToNext(std::list<pmem::obj::shared_mutex*>& locks) {
                 locks.push_back(&(node->_pmutex));
                 _cursor.node = _cursor.node->next;
                 _cursor.index = 0;
+                if (PmsePrefetch::distance() > 0)
+                    PmsePrefetch::line(_cursor.node->next.get());
             } else {
                 _cursor.node = nullptr;
             }
@@ -319,6 +540,8 @@ void PmseCursor::moveToNext(std::list<pmem::obj::shared_mutex*>& locks) {
                 locks.push_back(&(node->_pmutex));
                 _cursor.node = _cursor.node->previous;
                 _cursor.index = _cursor.node->num_keys - 1;
+                if (PmsePrefetch::distance() > 0)
+                    PmsePrefetch::line(_cursor.node->previous.get());
             } else {
                 _cursor.node = nullptr;
             }
@@ -342,10 +565,15 @@ boost::optional<IndexKeyEntry> PmseCursor::seek(const BSONObj& key,
     if (!_tree->_root)
         return {};
     std::list<pmem::obj::shared_mutex*> locks;
+    pin();
+    resetBatch();
+    _positioned = false;
 
     if (key.isEmpty()) {
         if (inclusive) {
-            _cursor.node = _first;
+            _cursor.node = _tree->_first;
+            _cursor.node->_pmutex.lock_shared();
+            locks.push_back(&(_cursor.node->_pmutex));
             _cursor.index = 0;
         } else {
             _cursor.node = _last;
@@ -364,13 +592,14 @@ boost::optional<IndexKeyEntry> PmseCursor::seek(const BSONObj& key,
         _cursorKey = _cursor.node->keys[_cursor.index].getBSON();
         _cursorId = _cursor.node->keys[_cursor.index].loc;
         // remember next value
+        _cursorVersion = _cursor.node->version;
+        _positioned = true;
     } else {
         _eofRestore = true;
         unlockTree(locks);
         return {};
     }
-    IndexKeyEntry entry((_cursor.node->keys[_cursor.index]).getBSON(),
-                        RecordId((_cursor.node->keys[_cursor.index]).loc));
+    IndexKeyEntry entry = currentEntry(parts);
     unlockTree(locks);
     return entry;
 }
@@ -383,6 +612,9 @@ boost::optional<IndexKeyEntry> PmseCursor::seek(const IndexSeekPoint& seekPoint,
     const BSONObj query = IndexEntryComparison::makeQueryObject(seekPoint, _forward);
     auto discriminator = RecordId::min();
     std::list<pmem::obj::shared_mutex*> locks;
+    pin();
+    resetBatch();
+    _positioned = false;
     locate(query, _forward ? RecordId::min() : RecordId::max(), locks);
 
     if (_isEOF) {
@@ -394,13 +626,14 @@ boost::optional<IndexKeyEntry> PmseCursor::seek(const IndexSeekPoint& seekPoint,
         _cursorKey = _cursor.node->keys[_cursor.index].getBSON();
         _cursorId = _cursor.node->keys[_cursor.index].loc;
         // remember next value
+        _cursorVersion = _cursor.node->version;
+        _positioned = true;
     } else {
         _eofRestore = true;
         unlockTree(locks);
         return {};
     }
-    IndexKeyEntry entry((_cursor.node->keys[_cursor.index]).getBSON(),
-                        RecordId((_cursor.node->keys[_cursor.index]).loc));
+    IndexKeyEntry entry = currentEntry(parts);
     unlockTree(locks);
     return entry;
 }
@@ -408,22 +641,70 @@ boost::optional<IndexKeyEntry> PmseCursor::seek(const IndexSeekPoint& seekPoint,
 boost::optional<IndexKeyEntry> PmseCursor::seekExact(
                 const BSONObj& key, RequestedInfo parts = kKeyAndLoc) {
     auto kv = seek(key, true, kKeyAndLoc);
-    if (kv && kv->key.woCompare(key, BSONObj(), false) == 0)
+    if (kv && kv->key.woCompare(key, BSONObj(), false) == 0) {
+        if (!(parts & kWantKey))
+            kv->key = BSONObj();
         return kv;
+    }
     return boost::none;
 }
 
-void PmseCursor::save() {}
+/*
+ * Rest of batch without keys cannot be located, it is returned as copied
+ */
+void PmseCursor::leavePosition() {
+    if (_batchKeys || _batchPos == _batch.size())
+        resetBatch();
+    _positioned = false;
+}
+
+/*
+ * Epoch is not held across yields. Saved leaves are checked while still
+ * pinned, restore keeps them only when no node was retired in between.
+ */
+void PmseCursor::save() {
+    if (_epochSlot < 0)
+        return;
+    _savedRetired = _tree->retiredNodes();
+    if (_endValid && _endNode && !unchanged(_endNode, _endVersion))
+        _endValid = false;
+    if (_positioned && !unchanged(_cursor.node, _cursorVersion))
+        leavePosition();
+    PmseEpochManager::get().unpin(_epochSlot);
+    _epochSlot = -1;
+}
 
-void PmseCursor::saveUnpositioned() {}
+void PmseCursor::saveUnpositioned() {
+    resetBatch();
+    unpin();
+}
 
+/*
+ * Locates end position and cursor again only when their leaves changed
+ */
 void PmseCursor::restore() {
-    seekEndCursor();
+    pin();
+    if (_tree->retiredNodes() != _savedRetired) {
+        _endValid = false;
+        if (_positioned)
+            leavePosition();
+    }
+    if (_endState && !(_endValid && (!_endNode || unchanged(_endNode, _endVersion))))
+        seekEndCursor();
+    if (_positioned && !unchanged(_cursor.node, _cursorVersion))
+        leavePosition();
     if (_eofRestore)
         return;
 }
 
-void PmseCursor::detachFromOperationContext() {}
+/*
+ * Cursor may stay detached for long, pinned epoch would hold back reclamation
+ */
+void PmseCursor::detachFromOperationContext() {
+    if (_batchKeys || _batchPos == _batch.size())
+        resetBatch();
+    unpin();
+}
 
 void PmseCursor::reattachToOperationContext(OperationContext* opCtx) {}
 
@@ -33,9 +33,13 @@
 #ifndef SRC_PMSE_INDEX_CURSOR_H_
 #define SRC_PMSE_INDEX_CURSOR_H_
 
+#include <utility>
+#include <vector>
+
 #include "mongo/db/storage/sorted_data_interface.h"
 #include "mongo/db/storage/key_string.h"
 
+#include "pmse_epoch.h"
 #include "pmse_tree.h"
 
 #define MONGO_LOG_DEFAULT_COMPONENT ::mongo::logger::LogComponent::kStorage
@@ -50,6 +54,8 @@ class PmseCursor final : public SortedDataInterface::Cursor {
                persistent_ptr<PmseTree> tree, const BSONObj& ordering,
                const bool unique);
 
+    ~PmseCursor();
+
     void setEndPosition(const BSONObj& key, bool inclusive);
 
     virtual boost::optional<IndexKeyEntry> next(RequestedInfo parts);
@@ -100,6 +106,17 @@ class PmseCursor final : public SortedDataInterface::Cursor {
     void seekEndCursor();
     bool lower_bound(IndexKeyEntry entry, CursorObject& cursor, std::list<pmem::obj::shared_mutex*>& locks);
     void moveToNext(std::list<pmem::obj::shared_mutex*>& locks);
+    bool advanceInPlace(std::list<pmem::obj::shared_mutex*>& locks);
+    void fillBatch(RequestedInfo parts);
+    void resetBatch();
+    void keyBatch();
+    boost::optional<IndexKeyEntry> nextFromBatch(RequestedInfo parts);
+    IndexKeyEntry currentEntry(RequestedInfo parts);
+    bool pastEndState(const BSONObj& key, int64_t loc);
+    bool unchanged(persistent_ptr<PmseTreeNode> node, uint64_t version);
+    void leavePosition();
+    void pin();
+    void unpin();
     bool atOrPastEndPointAfterSeeking();
     bool atEndPoint();
     const bool _forward;
@@ -119,10 +136,40 @@ class PmseCursor final : public SortedDataInterface::Cursor {
         IndexKeyEntry query;
     };
     boost::optional<EndState> _endState;
+    /*
+     * Leaf of _endPosition and its version, _endValid is cleared when epoch
+     * is unpinned and node may be gone
+     */
+    persistent_ptr<PmseTreeNode> _endNode;
+    uint64_t _endVersion = 0;
+    bool _endValid = false;
     BSONObj _cursorKey;
     int64_t _cursorId;
     bool _locateFoundDataEnd;
     bool _eofRestore;
+    /*
+     * Cursor stays on _cursor between calls while version of its leaf is
+     * unchanged. Pinned epoch keeps retired leaves from being freed meanwhile,
+     * across a yield the retired node count of tree does.
+     */
+    bool _positioned = false;
+    uint64_t _cursorVersion = 0;
+    int _epochSlot = -1;
+    uint64_t _savedRetired = 0;  // Retired nodes of tree when save unpinned epoch
+    /*
+     * Entries of current leaf copied to DRAM under one lock, keys of _batch
+     * point into _batchData. When keys were not requested only locations are
+     * copied, with first and last key of batch to locate it again.
+     */
+    std::vector<IndexKeyEntry> _batch;
+    std::vector<char> _batchData;
+    std::vector<std::pair<size_t, int64_t>> _batchOffsets;
+    size_t _batchPos = 0;
+    bool _batchAtEnd = false;  // End position follows last entry of _batch
+    bool _batchKeys = true;
+    int64_t _batchStart = 0;  // Index of first entry of _batch in its leaf
+    BSONObj _batchFirstKey;
+    BSONObj _batchLastKey;
 };
 }  // namespace mongo
 
@@ -32,8 +32,15 @@
 
 #define MONGO_LOG_DEFAULT_COMPONENT ::mongo::logger::LogComponent::kStorage
 
+#include "pmse_art.h"
+#include "pmse_cold_tier.h"
+#include "pmse_compression.h"
 #include "pmse_engine.h"
+#include "pmse_record_cache.h"
+#include "pmse_version_store.h"
+#include "pmse_write_set.h"
 
+#include <algorithm>
 #include <string>
 
 #include "mongo/base/init.h"
@@ -43,11 +50,32 @@
 #include "mongo/db/storage/kv/kv_storage_engine.h"
 #include "mongo/db/storage/storage_options.h"
 #include "mongo/util/log.h"
+#include "mongo/util/mongoutils/str.h"
 
 namespace mongo {
 
 namespace {
 const std::string storeName = "pmse";
+
+const char* const collectionOptionNames[] = {"compressor", "compressionThreshold",
+                                             "recordCacheSize", "coldAfterSeconds",
+                                             "deferredWrites", "snapshotReads"};
+const char* const indexOptionNames[] = {"indexType"};
+
+/*
+ * Rejects options not read by any parser, so misspelled ones are not ignored
+ */
+template <size_t N>
+Status checkOptionNames(const BSONObj& options, const char* const (&names)[N]) {
+    for (auto&& elem : options) {
+        if (std::find(names, names + N, elem.fieldNameStringData()) == names + N) {
+            return Status(ErrorCodes::InvalidOptions,
+                          str::stream() << "Unknown pmse storage option: "
+                                        << elem.fieldNameStringData());
+        }
+    }
+    return Status::OK();
+}
 }
 
 namespace {
@@ -67,6 +95,32 @@ class PmseEngineFactory : public StorageEngine::Factory {
         return storeName;
     }
 
+    virtual Status validateCollectionStorageOptions(const BSONObj& options) const {
+        Status status = checkOptionNames(options, collectionOptionNames);
+        if (!status.isOK())
+            return status;
+        status = PmseCompression::parse(options).getStatus();
+        if (!status.isOK())
+            return status;
+        status = PmseRecordCache::parseSize(options).getStatus();
+        if (!status.isOK())
+            return status;
+        status = PmseColdTier::parseColdAfter(options).getStatus();
+        if (!status.isOK())
+            return status;
+        status = PmseRecordWriteSet::parseEnabled(options).getStatus();
+        if (!status.isOK())
+            return status;
+        return PmseVersionStore::parseEnabled(options).getStatus();
+    }
+
+    virtual Status validateIndexStorageOptions(const BSONObj& options) const {
+        Status status = checkOptionNames(options, indexOptionNames);
+        if (!status.isOK())
+            return status;
+        return PmseArt::parseEnabled(options).getStatus();
+    }
+
     virtual Status validateMetadata(const StorageEngineMetadata& metadata,
                                     const StorageGlobalParams& params) const {
         // TODO( ): Implement validateMetadata
@@ -0,0 +1,142 @@
+/*
+ * Copyright 2014-2018, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SRC_PMSE_KEY_COMPARE_H_
+#define SRC_PMSE_KEY_COMPARE_H_
+
+#include <cmath>
+#include <cstring>
+
+#include "mongo/bson/bsonobj.h"
+#include "mongo/bson/oid.h"
+#include "mongo/db/record_id.h"
+
+namespace mongo {
+
+/*
+ * Comparison of single-field index keys without BSONElement::woCompare.
+ * Most indexes are {x: 1} over int, long, double, ObjectId or string, for
+ * keys with both values of one of these types comparison is one integer
+ * compare or memcmp. Other keys, query keys with exclusive bounds (field
+ * name is not empty) and NaN go through IndexEntryComparison.
+ */
+class PmseKeyCompare {
+ public:
+    /*
+     * Sets result and returns true when both keys have single field of same
+     * supported type. Result is for ascending order.
+     */
+    static bool singleField(const BSONObj& left, const BSONObj& right, int& result) {
+        BSONElement l = left.firstElement();
+        BSONElement r = right.firstElement();
+        if (l.type() != r.type() || l.fieldNameSize() != 1 || r.fieldNameSize() != 1 ||
+            left.objsize() != l.size() + BSON_OVERHEAD ||
+            right.objsize() != r.size() + BSON_OVERHEAD)
+            return false;
+        switch (l.type()) {
+            case NumberInt:
+                result = Int32Codec::compare(l, r);
+                return true;
+            case NumberLong:
+                result = Int64Codec::compare(l, r);
+                return true;
+            case NumberDouble:
+                if (std::isnan(l._numberDouble()) || std::isnan(r._numberDouble()))
+                    return false;
+                result = DoubleCodec::compare(l, r);
+                return true;
+            case jstOID:
+                result = OIDCodec::compare(l, r);
+                return true;
+            case String:
+                result = StringCodec::compare(l, r);
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    /*
+     * Same as IndexEntryComparison: keys first, then locations unless one
+     * of them is null
+     */
+    static int withLocations(int keyResult, const RecordId& left, const RecordId& right) {
+        if (keyResult || left.isNull() || right.isNull())
+            return keyResult;
+        return left.compare(right);
+    }
+
+ private:
+    // Empty object plus terminating EOO
+    static const int BSON_OVERHEAD = 5;
+
+    /*
+     * Codecs compare values of one type in their fixed-width form
+     */
+    struct Int32Codec {
+        static int compare(const BSONElement& l, const BSONElement& r) {
+            return sign(l._numberInt(), r._numberInt());
+        }
+    };
+
+    struct Int64Codec {
+        static int compare(const BSONElement& l, const BSONElement& r) {
+            return sign(l._numberLong(), r._numberLong());
+        }
+    };
+
+    struct DoubleCodec {
+        static int compare(const BSONElement& l, const BSONElement& r) {
+            return sign(l._numberDouble(), r._numberDouble());
+        }
+    };
+
+    struct OIDCodec {
+        static int compare(const BSONElement& l, const BSONElement& r) {
+            return sign(memcmp(l.value(), r.value(), OID::kOIDSize), 0);
+        }
+    };
+
+    struct StringCodec {
+        static int compare(const BSONElement& l, const BSONElement& r) {
+            return l.valueStringData().compare(r.valueStringData());
+        }
+    };
+
+    template <typename T>
+    static int sign(T left, T right) {
+        return left < right ? -1 : (right < left ? 1 : 0);
+    }
+};
+
+}  // namespace mongo
+#endif  // SRC_PMSE_KEY_COMPARE_H_
@@ -0,0 +1,82 @@
+/*
+ * Copyright 2014-2018, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SRC_PMSE_LAYOUT_H_
+#define SRC_PMSE_LAYOUT_H_
+
+#include <libpmemobj.h>
+#include <libpmemobj++/pool.hpp>
+
+#include <string>
+
+#include "mongo/util/assert_util.h"
+#include "mongo/util/log.h"
+
+namespace mongo {
+
+/*
+ * Layout names of pools, changed whenever persistent structures stored in
+ * them change. Layout of previous format is kept to tell such pools apart
+ * from damaged ones.
+ */
+const char* const PMSE_MAPPER_LAYOUT = "pmse_mapper_v2";
+const char* const PMSE_MAPPER_OLD_LAYOUT = "pmse_mapper";
+const char* const PMSE_INDEX_LAYOUT = "pmse_index_v2";
+const char* const PMSE_INDEX_OLD_LAYOUT = "pmse_index";
+const char* const PMSE_SHARED_LAYOUT = "pmse_shared_v2";
+const char* const PMSE_SHARED_OLD_LAYOUT = "pmse_shared";
+
+class PmseLayout {
+ public:
+    /*
+     * Opens pool of current layout. Pool of previous layout is refused with
+     * UnsupportedFormat instead of being read with wrong structures.
+     */
+    template <typename T>
+    static pmem::obj::pool<T> open(const std::string& path, const char* layout,
+                                   const char* oldLayout) {
+        try {
+            return pmem::obj::pool<T>::open(path, layout);
+        } catch (std::exception&) {
+            if (pmemobj_check(path.c_str(), oldLayout) < 0)
+                throw;
+        }
+        std::string msg = "PMSE pool " + path + " was created by older version with layout " +
+                          oldLayout + ", its format is not supported by this version. " +
+                          "Dump data with older version and restore it into new dbpath";
+        log() << msg;
+        uasserted(ErrorCodes::UnsupportedFormat, msg);
+    }
+};
+
+}  // namespace mongo
+#endif  // SRC_PMSE_LAYOUT_H_
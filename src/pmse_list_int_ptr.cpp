@@ -34,6 +34,11 @@
 
 #include "pmse_change.h"
 #include "pmse_list_int_ptr.h"
+#include "pmse_map.h"
+#include "pmse_recovery_unit.h"
+#include "pmse_slab_allocator.h"
+
+#include <libpmem.h>
 
 #include "mongo/db/storage/recovery_unit.h"
 
@@ -41,6 +46,8 @@
 
 namespace mongo {
 
+std::atomic<uint64_t> PmseListIntPtr::_nonTemporalThreshold{4096};
+
 PmseListIntPtr::PmseListIntPtr() : _counter(1) {
     _pop = pool_by_vptr(this);
 }
@@ -52,14 +59,94 @@ void PmseListIntPtr::setPool() {
     _pop = pool_by_vptr(this);
 }
 
+void PmseListIntPtr::setNonTemporalThreshold(uint64_t bytes) {
+    _nonTemporalThreshold = bytes;
+}
+
+/*
+ * Large payloads bypass the cache, so copying them neither reads the
+ * destination lines nor evicts hot data. No drain is done here: transaction
+ * commit flushes the new allocation and drains once before the record
+ * becomes visible in its list.
+ */
+void PmseListIntPtr::copyPayload(char* dest, const char* data, uint64_t size) {
+    uint64_t threshold = _nonTemporalThreshold.load(std::memory_order_relaxed);
+    if (threshold && size >= threshold) {
+        pmem_memcpy_nodrain(dest, data, size);
+    } else {
+        memcpy(dest, data, size);
+    }
+}
+
 uint64_t PmseListIntPtr::size() {
     return _size;
 }
 
-void PmseListIntPtr::insertKV(const persistent_ptr<KVPair> &key,
-                              const persistent_ptr<InitData> &value, bool insertToFront) {
+/*
+ * Payload is copied into the pair when it fits its inline capacity and
+ * allowInline is set, otherwise separate allocation is made. Has to be called
+ * within transaction, previous out-of-line payload must be already released by caller.
+ */
+void PmseListIntPtr::setPayload(const persistent_ptr<KVPair> &key, const char* data,
+                                uint64_t size, uint64_t flags, bool allowInline) {
+    uint64_t recordFlags = flags & (RECORD_COMPRESSED | RECORD_COLD);
+    if (allowInline && sizeof(InitData::size) + size <= key->inlineCapacity) {
+        pmemobj_tx_add_range_direct(key->inlineData(), sizeof(InitData::size) + size);
+        InitData* record = reinterpret_cast<InitData*>(key->inlineData());
+        record->size = size;
+        memcpy(record->data, data, size);
+        key->ptr = nullptr;
+        key->flags = recordFlags | RECORD_INLINE;
+    } else {
+        persistent_ptr<InitData> obj = PmseSlabAllocator::allocate(pmemobj_pool_by_oid(key.raw()),
+                                                                      size);
+        obj->size = size;
+        copyPayload(obj->data, data, size);
+        key->ptr = obj;
+        key->flags = recordFlags;
+    }
+}
+
+bool PmseListIntPtr::setReservedPayload(pool_base& pop, KVPair* key, const char* data,
+                                        uint64_t size, uint64_t flags,
+                                        pobj_action* actions, int* count) {
+    uint64_t recordFlags = flags & (RECORD_COMPRESSED | RECORD_COLD);
+    InitData* record;
+    if (sizeof(InitData::size) + size <= key->inlineCapacity) {
+        record = reinterpret_cast<InitData*>(key->inlineData());
+        key->ptr = nullptr;
+        recordFlags |= RECORD_INLINE;
+    } else {
+        PMEMoid obj = PmseSlabAllocator::reserve(pop, size, &actions[*count]);
+        if (OID_IS_NULL(obj))
+            return false;
+        (*count)++;
+        record = static_cast<InitData*>(pmemobj_direct(obj));
+        *key->ptr.raw_ptr() = obj;
+    }
+    record->size = size;
+    copyPayload(record->data, data, size);
+    key->flags = recordFlags;
+    // No-op for lines already written back by non-temporal copy
+    pop.flush(record, sizeof(InitData::size) + size);
+    return true;
+}
+
+void PmseListIntPtr::linkReserved(KVPair* key, PMEMoid oid, pobj_action* actions, int* count) {
+    PMEMoid* link = _head != nullptr ? _tail->next.raw_ptr() : _head.raw_ptr();
+    PMEMoid* tail = _tail.raw_ptr();
+    pmemobj_set_value(_pop.get_handle(), &actions[(*count)++], &link->pool_uuid_lo, oid.pool_uuid_lo);
+    pmemobj_set_value(_pop.get_handle(), &actions[(*count)++], &link->off, oid.off);
+    pmemobj_set_value(_pop.get_handle(), &actions[(*count)++], &tail->pool_uuid_lo, oid.pool_uuid_lo);
+    pmemobj_set_value(_pop.get_handle(), &actions[(*count)++], &tail->off, oid.off);
+    pmemobj_set_value(_pop.get_handle(), &actions[(*count)++],
+                      const_cast<uint64_t*>(&_size.get_ro()), _size + 1);
+    pmemobj_set_value(_pop.get_handle(), &actions[(*count)++],
+                      const_cast<uint64_t*>(&_dataSize.get_ro()), _dataSize + key->dataSize());
+}
+
+void PmseListIntPtr::insertKV(const persistent_ptr<KVPair> &key, bool insertToFront) {
         if (insertToFront) {
-            key->ptr = value;
             key->next = nullptr;
             if (_head != nullptr) {
                 key->next = _head;
@@ -70,7 +157,6 @@ void PmseListIntPtr::insertKV(const persistent_ptr<KVPair> &key,
             }
             _size++;
         } else {
-            key->ptr = value;
             key->next = nullptr;
             if (_head != nullptr) {
                 _tail->next = key;
@@ -81,18 +167,19 @@ void PmseListIntPtr::insertKV(const persistent_ptr<KVPair> &key,
             }
             _size++;
         }
-        _dataSize += value->size;
+        _dataSize += key->dataSize();
 }
 
 int64_t PmseListIntPtr::deleteKV(uint64_t key,
                                  persistent_ptr<KVPair> &deleted,
-                                 OperationContext* txn) {
+                                 OperationContext* txn,
+                                 PmseMap<InitData> *mapper) {
     auto before = _head;
     int64_t sizeFreed = 0;
     for (auto rec = _head; rec != nullptr; rec = rec->next) {
         if (rec->idValue == key) {
             transaction::exec_tx(_pop, [this, &deleted, &before,
-                                       &sizeFreed, &rec, &txn] {
+                                       &sizeFreed, &rec, &txn, mapper] {
                 if (before != _head) {
                     before->next = rec->next;
                     if (before->next == nullptr)
@@ -115,13 +202,20 @@ int64_t PmseListIntPtr::deleteKV(uint64_t key,
                 }
                 _size--;
                 deleted = rec;
+                InitData* record = deleted->record();
+                uint64_t dataSize = deleted->dataSize();
                 if (txn) {
-                    auto rd = RecordData(deleted->ptr->data, deleted->ptr->size);
-                    txn->recoveryUnit()->registerChange(new RemoveChange(_pop, (deleted->ptr).get(), rd.size()));
+                    PmseRecoveryUnit::emplaceChange<RemoveChange>(
+                        txn, PmseRecoveryUnit::changeArena(txn), _pop, mapper, record,
+                        dataSize, static_cast<uint64_t>(deleted->flags));
+                }
+                _dataSize -= dataSize;
+                if (deleted->isInline()) {
+                    sizeFreed = sizeof(InitData::size) + record->size;
+                } else {
+                    // Freed when pair is reused, readers may still copy it
+                    sizeFreed = pmemobj_alloc_usable_size(deleted->ptr.raw());
                 }
-                _dataSize -= deleted->ptr->size;
-                sizeFreed = pmemobj_alloc_usable_size(deleted->ptr.raw());
-                delete_persistent<InitData>(deleted->ptr);
             });
             break;
         } else {
@@ -140,10 +234,10 @@ bool PmseListIntPtr::hasKey(uint64_t key) {
     return false;
 }
 
-bool PmseListIntPtr::find(uint64_t key, persistent_ptr<InitData> *item_ptr) {
+bool PmseListIntPtr::find(uint64_t key, InitData **item_ptr) {
     for (auto rec = _head; rec != nullptr; rec = rec->next) {
         if (rec->idValue == key) {
-            *item_ptr = rec->ptr;
+            *item_ptr = rec->record();
             return true;
         }
     }
@@ -162,26 +256,40 @@ bool PmseListIntPtr::getPair(uint64_t key, persistent_ptr<KVPair> *item_ptr) {
     return false;
 }
 
-void PmseListIntPtr::update(uint64_t key,
-                            const persistent_ptr<InitData> &value, OperationContext* txn) {
+/*
+ * Returns size of replaced payload or -1 when key was not found.
+ */
+int64_t PmseListIntPtr::update(uint64_t key, const char* data, uint64_t size,
+                               uint64_t flags, OperationContext* txn,
+                               PmseMap<InitData> *mapper) {
     for (auto rec = _head; rec != nullptr; rec = rec->next) {
         if (rec->idValue == key) {
-            if (rec->ptr != nullptr) {
+            int64_t previousSize = 0;
+            persistent_ptr<InitData> replaced = nullptr;
+            InitData* record = rec->record();
+            if (record != nullptr) {
+                previousSize = rec->dataSize();
                 if (txn) {
-                    txn->recoveryUnit()->registerChange(new UpdateChange(_pop, key, (rec->ptr).get(), rec->ptr->size));
-                }
-                try {
-                    transaction::exec_tx(_pop, [&rec] {
-                        delete_persistent<InitData>(rec->ptr);
-                    });
-                } catch(std::exception &e) {
-                    log() << e.what();
+                    PmseRecoveryUnit::emplaceChange<UpdateChange>(
+                        txn, PmseRecoveryUnit::changeArena(txn), _pop, mapper, key, record,
+                        static_cast<uint64_t>(previousSize), static_cast<uint64_t>(rec->flags));
                 }
+                if (!rec->isInline())
+                    replaced = rec->ptr;
             }
-            rec->ptr = value;
-            return;
+            // Inline payload is overwritten in place, readers copy it under list
+            // mutex. Out-of-line one may be read without locks, so it is
+            // replaced and retired.
+            setPayload(rec, data, size, flags, rec->isInline());
+            // Retired after it is unlinked, readers pinned later cannot reach it.
+            // Caller's transaction is open, its failure aborts whole update.
+            if (replaced != nullptr)
+                mapper->retire(replaced);
+            _dataSize = _dataSize + rec->dataSize() - previousSize;
+            return previousSize;
         }
     }
+    return -1;
 }
 
 void PmseListIntPtr::clear(OperationContext* txn, PmseMap<InitData> *_mapper) {
@@ -190,14 +298,19 @@ void PmseListIntPtr::clear(OperationContext* txn, PmseMap<InitData> *_mapper) {
     transaction::exec_tx(_pop, [this, txn, _mapper] {
         for (auto rec = _head; rec != nullptr;) {
             if (txn)
-                txn->recoveryUnit()->registerChange(new TruncateChange(_pop, _mapper, RecordId(rec->idValue),
-                                                                       rec->ptr.get(), rec->ptr->size));
+                PmseRecoveryUnit::emplaceChange<TruncateChange>(
+                    txn, PmseRecoveryUnit::changeArena(txn), _pop, _mapper,
+                    RecordId(rec->idValue), rec->record(), rec->dataSize(),
+                    static_cast<uint64_t>(rec->flags));
             auto temp = rec->next;
+            if (!rec->isInline())
+                delete_persistent<InitData>(rec->ptr);
             delete_persistent<KVPair>(rec);
             rec = temp;
         }
         _head = nullptr;
         _size = 0;
+        _dataSize = 0;
     });
 }
 
@@ -41,13 +41,33 @@
 #include <libpmemobj++/transaction.hpp>
 #include <libpmemobj++/utils.hpp>
 
+#include <atomic>
+#include <cstring>
 #include <vector>
 
 #include "mongo/db/operation_context.h"
 
+#include "pmse_compression.h"
+
 using namespace pmem::obj;
 
 namespace mongo {
+
+const uint64_t INLINE_RECORD_MAX_SIZE = 96;  // Bigger payloads get separate allocation
+const uint64_t RECORD_INLINE = 1;
+const uint64_t RECORD_COMPRESSED = 2;
+const uint64_t RECORD_COLD = 4;
+const int PUBLISH_MAX_ACTIONS = 8;  // Reserved pair, its payload and link stores
+
+/*
+ * Payload of cold record, which points into cold tier file
+ */
+struct ColdLocator {
+    uint64_t offset;
+    uint64_t size;
+    uint64_t dataSize;
+};
+
 struct InitData {
     uint64_t size;
     char data[];
@@ -58,7 +78,34 @@ struct _pair {
     persistent_ptr<InitData> ptr;
     persistent_ptr<_pair> next;
     p<uint64_t> position;
-    p<uint64_t> isDeleted;
+    p<uint64_t> isDeleted;  // Retire epoch once pair is deleted, 0 while it is linked
+    p<uint64_t> flags;
+    p<uint64_t> inlineCapacity;  // Bytes allocated after pair for inline InitData
+
+    bool isInline() const {
+        return flags & RECORD_INLINE;
+    }
+
+    char* inlineData() {
+        return reinterpret_cast<char*>(this + 1);
+    }
+
+    InitData* record() {
+        return isInline() ? reinterpret_cast<InitData*>(inlineData()) : ptr.get();
+    }
+
+    /*
+     * Size of document as seen by user, stored payload may be compressed
+     */
+    uint64_t dataSize() {
+        InitData* data = record();
+        if (flags & RECORD_COLD) {
+            ColdLocator locator;
+            memcpy(&locator, data->data, sizeof(locator));
+            return locator.dataSize;
+        }
+        return (flags & RECORD_COMPRESSED) ? PmseCompression::rawSize(data->data) : data->size;
+    }
 };
 
 template<class InitData>
@@ -72,12 +119,33 @@ class PmseListIntPtr {
  public:
     PmseListIntPtr();
     ~PmseListIntPtr();
-    void insertKV(const persistent_ptr<KVPair> &key,
-                  const persistent_ptr<InitData> &value, bool insertToFront = false);
-    bool find(uint64_t key, persistent_ptr<InitData> *item_ptr);
+    static void setPayload(const persistent_ptr<KVPair> &key, const char* data,
+                           uint64_t size, uint64_t flags = 0, bool allowInline = true);
+    /*
+     * Out-of-line payloads of at least this many bytes are copied with
+     * non-temporal stores, 0 disables it
+     */
+    static void setNonTemporalThreshold(uint64_t bytes);
+    void insertKV(const persistent_ptr<KVPair> &key, bool insertToFront = false);
+    /*
+     * Fills pair reserved with pmemobj_reserve, out-of-line payload is
+     * reserved into actions[*count]. Written ranges are flushed but not
+     * drained, publish orders them. Returns false when payload cannot be reserved.
+     */
+    static bool setReservedPayload(pool_base& pop, KVPair* key, const char* data,
+                                   uint64_t size, uint64_t flags,
+                                   pobj_action* actions, int* count);
+    /*
+     * Appends to actions the stores linking reserved pair at the tail, list
+     * mutex must be held until they are published or canceled
+     */
+    void linkReserved(KVPair* key, PMEMoid oid, pobj_action* actions, int* count);
+    bool find(uint64_t key, InitData **item_ptr);
     bool getPair(uint64_t key, persistent_ptr<KVPair> *item_ptr);
-    void update(uint64_t key, const persistent_ptr<InitData> &value, OperationContext* txn);
-    int64_t deleteKV(uint64_t key, persistent_ptr<KVPair> &deleted, OperationContext* txn);
+    int64_t update(uint64_t key, const char* data, uint64_t size,
+                   uint64_t flags, OperationContext* txn, PmseMap<InitData> *mapper);
+    int64_t deleteKV(uint64_t key, persistent_ptr<KVPair> &deleted, OperationContext* txn,
+                     PmseMap<InitData> *mapper);
     bool hasKey(uint64_t key);
     void clear(OperationContext* txn, PmseMap<InitData> *_mapper);
     void setPool();
@@ -89,6 +157,8 @@ class PmseListIntPtr {
     persistent_ptr<KVPair> getHead() {
         return _head;
     }
+    static void copyPayload(char* dest, const char* data, uint64_t size);
+    static std::atomic<uint64_t> _nonTemporalThreshold;
     persistent_ptr<KVPair> _head;
     persistent_ptr<KVPair> _tail;
     persistent_ptr<KVPair> _deleted;
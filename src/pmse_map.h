@@ -35,6 +35,8 @@
 
 #include "pmse_list_int_ptr.h"
 #include "pmse_change.h"
+#include "pmse_epoch.h"
+#include "pmse_recovery_unit.h"
 
 #include <libpmemobj++/p.hpp>
 #include <libpmemobj++/pext.hpp>
@@ -44,19 +46,39 @@
 #include <libpmemobj++/detail/pexceptions.hpp>
 #include <libpmemobj++/make_persistent_array_atomic.hpp>
 
+#include <algorithm>
 #include <atomic>
 #include <limits>
+#include <string>
 
 namespace mongo {
 
 const uint64_t CAPPED_SIZE = 1;
 const uint64_t HASHMAP_SIZE = 10'000'000u;
+const uint64_t SHARED_HASHMAP_SIZE = 1u << 17;  // Lists of map in shared pool, ~13MB with mutexes
+const uint64_t FREE_LISTS_PER_TX = 1024;  // Lists freed by one transaction on drop
 
 class PmseRecordCursor;
+class PmseRecordStore;
+
+const uint64_t RETIRE_BATCH_SIZE = 64;
+
+/*
+ * Payloads replaced by updates, freed once readers which could see them
+ * are gone. Batches are persistent, so payloads retired before a crash are
+ * freed when pool is opened again.
+ */
+struct PmseRetiredBatch {
+    p<uint64_t> epoch;  // Newest retire epoch of payloads in batch
+    p<uint64_t> count;
+    persistent_ptr<InitData> payloads[RETIRE_BATCH_SIZE];
+    persistent_ptr<PmseRetiredBatch> next;
+};
 
 template<typename T>
 class PmseMap {
     friend PmseRecordCursor;
+    friend PmseRecordStore;
 
  public:
     PmseMap() = delete;
@@ -71,19 +93,83 @@ class PmseMap {
         deinitialize();
     }
 
-    uint64_t insert(persistent_ptr<T> value) {
-        auto id = getNextId();
+    uint64_t insert(const char* data, uint64_t size, uint64_t flags = 0) {
+        auto id = getNextId(size);
         if (!id) {
             return 0;
         }
+        PmseListIntPtr::setPayload(id, data, size, flags);
         stdx::lock_guard<pmem::obj::mutex> lock(_listMutex[id->idValue % _size]);
-        if (!insertKV(id, value)) {
+        if (!insertKV(id)) {
             return 0;
         }
         _hashmapSize.fetch_add(1);
         return id->idValue;
     }
 
+    /*
+     * Inserts record with reserve/publish actions: pair and payload are
+     * reserved and written outside of transaction, then published together
+     * with link stores through redo log, so nothing is undo-logged. Returns 0
+     * when caller has to use insert, which reuses deleted pairs no reader can
+     * see anymore. Must not be called within transaction.
+     */
+    uint64_t publishInsert(const char* data, uint64_t size, uint64_t flags = 0) {
+        {
+            stdx::lock_guard<pmem::obj::mutex> guard(_pmutex);
+            if (canReuseDeleted())
+                return 0;
+        }
+        if (_counter == std::numeric_limits<uint64_t>::max())
+            return 0;
+        pobj_action actions[PUBLISH_MAX_ACTIONS];
+        int count = 0;
+        uint64_t capacity = inlineCapacity(size);
+        PMEMoid oid = pmemobj_reserve(pop.get_handle(), &actions[count],
+                                      sizeof(KVPair) + capacity, 0);
+        if (OID_IS_NULL(oid))
+            return 0;
+        count++;
+        auto pair = static_cast<KVPair*>(pmemobj_direct(oid));
+        memset(static_cast<void*>(pair), 0, sizeof(KVPair));
+        uint64_t id = _counter.fetch_add(1);
+        pair->idValue = id;
+        pair->inlineCapacity = capacity;
+        if (!PmseListIntPtr::setReservedPayload(pop, pair, data, size, flags, actions, &count)) {
+            pmemobj_cancel(pop.get_handle(), actions, count);
+            return 0;
+        }
+        pop.flush(pair, sizeof(KVPair));
+        stdx::lock_guard<pmem::obj::mutex> lock(_listMutex[id % _size]);
+        _list[id % _size].linkReserved(pair, oid, actions, &count);
+        if (pmemobj_publish(pop.get_handle(), actions, count) != 0) {
+            pmemobj_cancel(pop.get_handle(), actions, count);
+            return 0;
+        }
+        _hashmapSize.fetch_add(1);
+        return id;
+    }
+
+    /*
+     * Reserves id of record written later with insertWithId
+     */
+    uint64_t reserveId() {
+        if (_counter == std::numeric_limits<uint64_t>::max())
+            return 0;
+        return _counter.fetch_add(1);
+    }
+
+    bool insertWithId(uint64_t id, const char* data, uint64_t size, uint64_t flags = 0) {
+        auto pair = allocatePair(size);
+        pair->idValue = id;
+        PmseListIntPtr::setPayload(pair, data, size, flags);
+        stdx::lock_guard<pmem::obj::mutex> lock(_listMutex[id % _size]);
+        if (!insertKV(pair))
+            return false;
+        _hashmapSize.fetch_add(1);
+        return true;
+    }
+
     uint64_t getCappedFirstId() {
         if (isCapped())
             return getFirstPtr(0)->idValue;
@@ -101,9 +187,9 @@ class PmseMap {
         return false;
     }
 
-    bool insertKV(const persistent_ptr<KVPair> &id, persistent_ptr<T> value) {  // internal use
+    bool insertKV(const persistent_ptr<KVPair> &id) {  // internal use
         try {
-            _list[id->idValue % _size].insertKV(id, value);
+            _list[id->idValue % _size].insertKV(id);
         } catch (std::exception &e) {
             std::cout << "KVMapper: " << e.what() << std::endl;
             return false;
@@ -111,9 +197,12 @@ class PmseMap {
         return true;  // correctly added
     }
 
-    bool insertToFrontKV(const persistent_ptr<KVPair> &id, persistent_ptr<T> value) {  // internal use
+    bool insertToFront(uint64_t id, const char* data, uint64_t size, uint64_t flags = 0) {  // internal use
         try {
-            _list[id->idValue % _size].insertKV(id, value, true);
+            auto pair = allocatePair(size);
+            pair->idValue = id;
+            PmseListIntPtr::setPayload(pair, data, size, flags);
+            _list[id % _size].insertKV(pair, true);
         } catch (std::exception &e) {
             std::cout << "KVMapper: " << e.what() << std::endl;
             return false;
@@ -121,21 +210,20 @@ class PmseMap {
         return true;  // correctly added
     }
 
-    bool updateKV(uint64_t id, persistent_ptr<T> value, OperationContext* txn = nullptr) {
-        try {
-            _list[id % _size].update(id, value, txn);
-        } catch (std::exception &e) {
-            std::cout << "KVMapper: " << e.what() << std::endl;
-            return false;
-        }
-        return true;
+    /*
+     * Returns size of replaced payload, -1 when id is not found. Must be
+     * called in transaction, errors abort it and are passed on.
+     */
+    int64_t updateKV(uint64_t id, const char* data, uint64_t size,
+                     OperationContext* txn = nullptr, uint64_t flags = 0) {
+        return _list[id % _size].update(id, data, size, flags, txn, this);
     }
 
     bool hasId(uint64_t id) {
         return _list[id % _size].hasKey(id);
     }
 
-    bool find(uint64_t id, persistent_ptr<T> *value) {
+    bool find(uint64_t id, T **value) {
         return _list[id % _size].find(id, value);
     }
 
@@ -146,7 +234,7 @@ class PmseMap {
     bool remove(uint64_t id, OperationContext* txn = nullptr) {
         _hashmapSize.fetch_sub(1);
         persistent_ptr<KVPair> toDeleted;
-        _list[id % _size].deleteKV(id, toDeleted, txn);
+        _list[id % _size].deleteKV(id, toDeleted, txn, this);
         moveToDeleted(toDeleted, _deleted);
         return true;
     }
@@ -175,6 +263,78 @@ class PmseMap {
         delete_persistent<pmem::obj::mutex[]>(_listMutex, _size);
     }
 
+    /*
+     * Frees pairs and payloads of lists from begin to end. Map stays
+     * consistent after each call, so drop can spread lists over several
+     * transactions before freeAll.
+     */
+    void freeLists(uint64_t begin, uint64_t end) {
+        for (uint64_t i = begin; i < end && i < _size; i++) {
+            _list[i].clear(nullptr, this);
+        }
+    }
+
+    /*
+     * Frees all pairs and payloads, used when ident is dropped from shared pool.
+     * Must be called within transaction.
+     */
+    void freeAll() {
+        for (int i = 0; i < _size; i++) {
+            _list[i].clear(nullptr, this);
+        }
+        for (auto cur = _deleted; cur != nullptr;) {
+            auto next = cur->next;
+            if (!cur->isInline() && cur->ptr != nullptr)
+                delete_persistent<InitData>(cur->ptr);
+            delete_persistent<KVPair>(cur);
+            cur = next;
+        }
+        _deleted = nullptr;
+        _deletedInRun = 0;
+        releaseRetired();
+    }
+
+    /*
+     * Hands payload unlinked by current transaction over to reclamation.
+     * Must be called within transaction.
+     */
+    void retire(const persistent_ptr<InitData>& payload) {
+        uint64_t epoch = PmseEpochManager::get().retireEpoch();
+        stdx::lock_guard<pmem::obj::mutex> guard(_pmutex);
+        if (_retired == nullptr || _retired->count == RETIRE_BATCH_SIZE) {
+            reclaimRetired();
+            if (_retired == nullptr || _retired->count == RETIRE_BATCH_SIZE) {
+                auto batch = make_persistent<PmseRetiredBatch>();
+                batch->count = 0;
+                batch->next = _retired;
+                _retired = batch;
+            }
+        }
+        _retired->payloads[_retired->count] = payload;
+        _retired->count = _retired->count + 1;
+        _retired->epoch = epoch;
+    }
+
+    /*
+     * Frees all retired payloads. Must be called within transaction.
+     */
+    void releaseRetired() {
+        freeRetired(_retired);
+        _retired = nullptr;
+    }
+
+    /*
+     * On first open after restart no reader can see retired payloads, epochs
+     * they were tagged with belong to previous run. Must be called within transaction.
+     */
+    void openRetired() {
+        if (_instance == PmseEpochManager::get().instance())
+            return;
+        _instance = PmseEpochManager::get().instance();
+        releaseRetired();
+        _deletedInRun = 0;
+    }
+
     uint64_t fillment() {
         if (_isCapped)
             return _list[0].size();
@@ -184,7 +344,7 @@ class PmseMap {
     bool truncate(OperationContext* txn) {
         bool status = true;
         try {
-            txn->recoveryUnit()->registerChange(new DropListChange(pop, _list, _size));
+            PmseRecoveryUnit::emplaceChange<DropListChange>(txn, pop, _list, _size);
             delete_persistent_atomic<PmseListIntPtr[]>(_list, _size);
             initialize(true);
             _counter = 1;
@@ -223,17 +383,28 @@ class PmseMap {
         return _maxDocuments;
     }
 
+    /*
+     * Pair keeps its payload until it is reused, isDeleted holds epoch it
+     * was unlinked in
+     */
     void moveToDeleted(persistent_ptr<KVPair> &item, persistent_ptr<KVPair> &list) {
+        uint64_t epoch = PmseEpochManager::get().retireEpoch();
         stdx::lock_guard<pmem::obj::mutex> guard(_pmutex);
-        if (list != nullptr) {
-            item->next = list;
-            item->isDeleted = true;
-            list = item;
-        } else {
-            item->next = nullptr;
-            item->isDeleted = true;
-            list = item;
-        }
+        item->next = list;
+        item->isDeleted = epoch;
+        list = item;
+        _deletedInRun++;
+    }
+
+    /*
+     * Copies current payload of pair with its flags. Inline payloads are
+     * updated in place under list mutex, so readers copy them under it.
+     */
+    uint64_t copyRecord(const persistent_ptr<KVPair>& pair, std::string* out) {
+        stdx::lock_guard<pmem::obj::mutex> lock(_listMutex[pair->idValue % _size]);
+        InitData* record = pair->record();
+        out->assign(record->data, record->size);
+        return pair->flags;
     }
 
     int getHashmapSize() {
@@ -244,19 +415,23 @@ class PmseMap {
         uint64_t countedSize = 0;
         uint64_t deletedSize = 0;
         uint64_t recoveredDataSize = 0;
+        uint64_t maxId = 0;
         for(int i = 0; i < _size; i++) {
             countedSize += _list[i].size();
             recoveredDataSize += _list[i].getDataSize();
+            for (auto item = getFirstPtr(i); item != nullptr; item = item->next)
+                maxId = std::max(maxId, static_cast<uint64_t>(item->idValue));
         }
         _dataSize = recoveredDataSize;
         _hashmapSize = countedSize;
         auto cur = _deleted;
         while(cur) {
             deletedSize++;
+            maxId = std::max(maxId, static_cast<uint64_t>(cur->idValue));
             cur = cur->next;
         }
-        // TODO(kfilipek): consider deep recovery (count all physical elements on lists and find max id)
-        _counter = _hashmapSize + deletedSize;
+        // Ids reserved by deferred writes of aborted units leave gaps
+        _counter = std::max(_hashmapSize + deletedSize, maxId + 1);
     }
 
     void restoreCounters() {
@@ -292,6 +467,10 @@ class PmseMap {
 
     pmem::obj::mutex _pmutex;
     persistent_ptr<KVPair> _deleted;
+    persistent_ptr<PmseRetiredBatch> _retired;
+    p<uint64_t> _instance;  // Run which last opened map
+    // Pairs at head of _deleted unlinked by this run, older ones no reader can see
+    std::atomic<uint64_t> _deletedInRun = {0};
 
     persistent_ptr<KVPair> getFirstPtr(int listNumber) {
         if (listNumber < _size)
@@ -299,26 +478,87 @@ class PmseMap {
         return {};
     }
 
-    persistent_ptr<KVPair> getNextId() {
+    /*
+     * Small payloads get pair with inline space, so no separate allocation
+     * is needed for them. Must be called within transaction.
+     */
+    persistent_ptr<KVPair> allocatePair(uint64_t dataSize) {
+        uint64_t capacity = inlineCapacity(dataSize);
+        persistent_ptr<KVPair> pair(pmemobj_tx_zalloc(sizeof(KVPair) + capacity, 1));
+        pair->inlineCapacity = capacity;
+        return pair;
+    }
+
+    static uint64_t inlineCapacity(uint64_t dataSize) {
+        return dataSize <= INLINE_RECORD_MAX_SIZE ?
+               sizeof(InitData::size) + INLINE_RECORD_MAX_SIZE : 0;
+    }
+
+    /*
+     * Head of deleted pairs is reused only when no reader can still see it.
+     * Must be called under _pmutex.
+     */
+    bool canReuseDeleted() {
+        if (_deleted == nullptr)
+            return false;
+        return _deletedInRun == 0 || PmseEpochManager::get().isSafe(_deleted->isDeleted);
+    }
+
+    /*
+     * Frees batches of payloads no reader can see, from the newest safe one
+     * to the oldest. Must be called within transaction.
+     */
+    void reclaimRetired() {
+        persistent_ptr<PmseRetiredBatch> newer = nullptr;
+        for (auto batch = _retired; batch != nullptr; newer = batch, batch = batch->next) {
+            if (!PmseEpochManager::get().isSafe(batch->epoch))
+                continue;
+            if (newer != nullptr)
+                newer->next = nullptr;
+            else
+                _retired = nullptr;
+            freeRetired(batch);
+            break;
+        }
+    }
+
+    static void freeRetired(persistent_ptr<PmseRetiredBatch> batch) {
+        while (batch != nullptr) {
+            auto next = batch->next;
+            for (uint64_t i = 0; i < batch->count; i++)
+                delete_persistent<InitData>(batch->payloads[i]);
+            delete_persistent<PmseRetiredBatch>(batch);
+            batch = next;
+        }
+    }
+
+    persistent_ptr<KVPair> getNextId(uint64_t dataSize) {
         persistent_ptr<KVPair> temp = nullptr;
-        if (_deleted == nullptr) {
-            if (_counter == std::numeric_limits<uint64_t>::max()) {
-                return nullptr;
-            }
-            auto newId = _counter.fetch_add(1);
-            try {
-                temp = make_persistent<KVPair>();
-                temp->idValue = newId;
-            } catch (std::exception &e) {
-                std::cout << "Next id generation: " << e.what() << std::endl;
-                return nullptr;
-            }
-        } else {
+        {
             stdx::lock_guard<pmem::obj::mutex> guard(_pmutex);
-            temp = _deleted;
-            _deleted = _deleted->next;
-            temp->isDeleted = false;
-            return temp;
+            if (canReuseDeleted()) {
+                temp = _deleted;
+                _deleted = _deleted->next;
+                temp->isDeleted = 0;
+                if (_deletedInRun > 0)
+                    _deletedInRun--;
+                if (!temp->isInline() && temp->ptr != nullptr) {
+                    delete_persistent<InitData>(temp->ptr);
+                    temp->ptr = nullptr;
+                }
+                return temp;
+            }
+        }
+        if (_counter == std::numeric_limits<uint64_t>::max()) {
+            return nullptr;
+        }
+        auto newId = _counter.fetch_add(1);
+        try {
+            temp = allocatePair(dataSize);
+            temp->idValue = newId;
+        } catch (std::exception &e) {
+            std::cout << "Next id generation: " << e.what() << std::endl;
+            return nullptr;
         }
         return temp;
     }
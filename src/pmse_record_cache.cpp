@@ -0,0 +1,177 @@
+/*
+ * Copyright 2014-2018, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define MONGO_LOG_DEFAULT_COMPONENT ::mongo::logger::LogComponent::kStorage
+
+#include "pmse_record_cache.h"
+
+#include <cstring>
+
+#include "mongo/bson/bsonelement.h"
+
+namespace mongo {
+
+PmseRecordCache::PmseRecordCache(uint64_t capacityBytes) : _capacity(capacityBytes) {
+    uint64_t sets = 1;
+    while (sets * CACHE_WAYS * CACHE_AVERAGE_ENTRY_SIZE < _capacity)
+        sets <<= 1;
+    _setMask = sets - 1;
+    _sets.reset(new Set[sets]);
+}
+
+StatusWith<uint64_t> PmseRecordCache::parseSize(const BSONObj& options) {
+    BSONElement elem = options["recordCacheSize"];
+    if (elem.eoo())
+        return 0;
+    if (!elem.isNumber() || elem.numberLong() < 0) {
+        return Status(ErrorCodes::BadValue, "recordCacheSize must be a non-negative number");
+    }
+    return static_cast<uint64_t>(elem.numberLong());
+}
+
+bool PmseRecordCache::lookup(const RecordId& id, RecordData* rd) {
+    Set& set = setFor(id);
+    {
+        stdx::lock_guard<stdx::mutex> lock(set.mutex);
+        for (auto& slot : set.slots) {
+            if (!slot.id.isNull() && slot.id == id) {
+                slot.referenced = true;
+                *rd = RecordData(slot.data, slot.size);
+                _hits.fetch_add(1, std::memory_order_relaxed);
+                return true;
+            }
+        }
+    }
+    _misses.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
+
+void PmseRecordCache::insert(const RecordId& id, const RecordData& data, uint64_t generation) {
+    uint64_t size = data.size();
+    if (size > _capacity / CACHE_MAX_ENTRY_FRACTION)
+        return;
+    Set& set = setFor(id);
+    if (set.generation.load() != generation)
+        return;
+    RecordData owned = data.getOwned();
+    SharedBuffer buffer = std::move(owned).releaseBuffer();
+
+    stdx::lock_guard<stdx::mutex> lock(set.mutex);
+    if (set.generation.load() != generation)
+        return;
+    int64_t victim = -1;
+    for (uint64_t i = 0; i < CACHE_WAYS && victim < 0; i++) {
+        if (!set.slots[i].id.isNull() && set.slots[i].id == id)
+            victim = i;
+    }
+    for (uint64_t i = 0; i < CACHE_WAYS && victim < 0; i++) {
+        if (set.slots[i].id.isNull())
+            victim = i;
+    }
+    if (victim < 0) {
+        while (set.slots[set.hand].referenced) {
+            set.slots[set.hand].referenced = false;
+            set.hand = (set.hand + 1) % CACHE_WAYS;
+        }
+        victim = set.hand;
+        set.hand = (set.hand + 1) % CACHE_WAYS;
+    }
+    Slot& slot = set.slots[victim];
+    uint64_t freed = slot.id.isNull() ? 0 : slot.size;
+    if (_usedBytes.load() - freed + size > _capacity)
+        return;
+    if (!slot.id.isNull() && !(slot.id == id))
+        _evictions.fetch_add(1, std::memory_order_relaxed);
+    _usedBytes.fetch_add(size);
+    _usedBytes.fetch_sub(freed);
+    slot.id = id;
+    slot.data = std::move(buffer);
+    slot.size = static_cast<int>(size);
+    slot.referenced = false;
+    _inserts.fetch_add(1, std::memory_order_relaxed);
+}
+
+void PmseRecordCache::removeSlot(Slot& slot) {
+    _usedBytes.fetch_sub(slot.size);
+    slot = Slot();
+}
+
+void PmseRecordCache::invalidate(const RecordId& id) {
+    Set& set = setFor(id);
+    stdx::lock_guard<stdx::mutex> lock(set.mutex);
+    set.generation.fetch_add(1);
+    for (auto& slot : set.slots) {
+        if (!slot.id.isNull() && slot.id == id) {
+            removeSlot(slot);
+            _invalidations.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+}
+
+void PmseRecordCache::clear() {
+    for (uint64_t i = 0; i <= _setMask; i++) {
+        Set& set = _sets[i];
+        stdx::lock_guard<stdx::mutex> lock(set.mutex);
+        set.generation.fetch_add(1);
+        for (auto& slot : set.slots) {
+            if (!slot.id.isNull())
+                removeSlot(slot);
+        }
+    }
+}
+
+void PmseRecordCache::recordLatency(bool hit, Clock::time_point start) {
+    uint64_t nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        Clock::now() - start).count();
+    (hit ? _hitNanos : _missNanos).fetch_add(nanos, std::memory_order_relaxed);
+}
+
+void PmseRecordCache::appendStats(BSONObjBuilder* result) const {
+    uint64_t hits = _hits.load();
+    uint64_t misses = _misses.load();
+    BSONObjBuilder stats(result->subobjStart("recordCache"));
+    stats.appendNumber("maxBytes", static_cast<long long>(_capacity));
+    stats.appendNumber("bytesCached", static_cast<long long>(_usedBytes.load()));
+    stats.appendNumber("hits", static_cast<long long>(hits));
+    stats.appendNumber("misses", static_cast<long long>(misses));
+    stats.append("hitRate", hits + misses ? static_cast<double>(hits) / (hits + misses) : 0.0);
+    stats.appendNumber("inserts", static_cast<long long>(_inserts.load()));
+    stats.appendNumber("evictions", static_cast<long long>(_evictions.load()));
+    stats.appendNumber("invalidations", static_cast<long long>(_invalidations.load()));
+    stats.appendNumber("avgHitLatencyNanos",
+                       static_cast<long long>(hits ? _hitNanos.load() / hits : 0));
+    stats.appendNumber("avgMissLatencyNanos",
+                       static_cast<long long>(misses ? _missNanos.load() / misses : 0));
+    stats.done();
+}
+
+}  // namespace mongo
@@ -0,0 +1,127 @@
+/*
+ * Copyright 2014-2018, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SRC_PMSE_RECORD_CACHE_H_
+#define SRC_PMSE_RECORD_CACHE_H_
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+
+#include "mongo/base/status_with.h"
+#include "mongo/bson/bsonobj.h"
+#include "mongo/bson/bsonobjbuilder.h"
+#include "mongo/db/record_id.h"
+#include "mongo/db/storage/record_data.h"
+#include "mongo/stdx/mutex.h"
+#include "mongo/util/shared_buffer.h"
+
+namespace mongo {
+
+const uint64_t CACHE_WAYS = 8;
+const uint64_t CACHE_AVERAGE_ENTRY_SIZE = 512;  // Used only to size the table
+const uint64_t CACHE_MAX_ENTRY_FRACTION = 16;  // Bigger records are not cached
+
+/*
+ * Bounded DRAM cache of hot documents, keyed by RecordId. Table is
+ * set-associative with CLOCK eviction inside each set. Each set has its own
+ * mutex, held by lookups only to copy buffer reference out of the slot, so
+ * the many sets act as sharded lock. Every invalidation bumps generation of
+ * its set, so readers which fetched record from PMEM before the invalidation
+ * cannot put stale copy into the cache.
+ */
+class PmseRecordCache {
+ public:
+    using Clock = std::chrono::steady_clock;
+
+    explicit PmseRecordCache(uint64_t capacityBytes);
+
+    /*
+     * Parses recordCacheSize from storageEngine.pmse collection options, 0 disables cache
+     */
+    static StatusWith<uint64_t> parseSize(const BSONObj& options);
+
+    uint64_t generation(const RecordId& id) const {
+        return setFor(id).generation.load();
+    }
+
+    bool lookup(const RecordId& id, RecordData* rd);
+
+    /*
+     * Copies data unless it is already owned; skipped when generation has changed
+     */
+    void insert(const RecordId& id, const RecordData& data, uint64_t generation);
+
+    void invalidate(const RecordId& id);
+
+    void clear();
+
+    void recordLatency(bool hit, Clock::time_point start);
+
+    void appendStats(BSONObjBuilder* result) const;
+
+ private:
+    struct Slot {
+        RecordId id;  // Null when slot is empty
+        SharedBuffer data;
+        int size = 0;
+        bool referenced = false;
+    };
+
+    struct Set {
+        stdx::mutex mutex;
+        std::atomic<uint64_t> generation{0};
+        uint64_t hand = 0;
+        Slot slots[CACHE_WAYS];
+    };
+
+    Set& setFor(const RecordId& id) const {
+        return _sets[static_cast<uint64_t>(id.repr()) & _setMask];
+    }
+
+    void removeSlot(Slot& slot);
+
+    const uint64_t _capacity;
+    uint64_t _setMask;
+    std::unique_ptr<Set[]> _sets;
+    std::atomic<uint64_t> _usedBytes{0};
+    std::atomic<uint64_t> _hits{0};
+    std::atomic<uint64_t> _misses{0};
+    std::atomic<uint64_t> _inserts{0};
+    std::atomic<uint64_t> _evictions{0};
+    std::atomic<uint64_t> _invalidations{0};
+    std::atomic<uint64_t> _hitNanos{0};
+    std::atomic<uint64_t> _missNanos{0};
+};
+
+}  // namespace mongo
+#endif  // SRC_PMSE_RECORD_CACHE_H_
@@ -32,8 +32,16 @@
 
 #define MONGO_LOG_DEFAULT_COMPONENT ::mongo::logger::LogComponent::kStorage
 
+#include "pmse_catalog.h"
 #include "pmse_change.h"
+#include "pmse_epoch.h"
+#include "pmse_group_commit.h"
+#include "pmse_layout.h"
+#include "pmse_prefetch.h"
 #include "pmse_record_store.h"
+#include "pmse_recovery_unit.h"
+#include "pmse_slab_allocator.h"
+#include "pmse_version_store.h"
 
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/operations.hpp>
@@ -41,13 +49,22 @@
 #include <libpmemobj++/mutex.hpp>
 #include <libpmemobj++/transaction.hpp>
 
+#include <algorithm>
 #include <cstdlib>
+#include <cstring>
+#include <limits>
 #include <map>
 #include <string>
 #include <utility>
+#include <vector>
 
+#include "mongo/db/concurrency/write_conflict_exception.h"
+#include "mongo/db/namespace_string.h"
 #include "mongo/db/storage/record_store.h"
+#include "mongo/util/concurrency/thread_name.h"
 #include "mongo/util/log.h"
+#include "mongo/util/scopeguard.h"
+#include "mongo/util/time_support.h"
 #include "mongo/db/storage/recovery_unit.h"
 #include "mongo/db/operation_context.h"
 
@@ -60,11 +77,31 @@ PmseRecordStore::PmseRecordStore(StringData ns,
                                  const CollectionOptions& options,
                                  StringData dbpath,
                                  std::map<std::string, pool_base> *pool_handler,
-                                 bool recoveryNeeded)
+                                 bool recoveryNeeded,
+                                 PmseCatalog* catalog,
+                                 PmseGroupCommit* groupCommit,
+                                 bool writeUnitTransactions)
     : RecordStore(ns), _cappedCallback(nullptr),
       _options(options), _dbPath(dbpath) {
     log() << "ns: " << ns;
-    if (pool_handler->count(ident.toString()) > 0) {
+    auto compression = PmseCompression::parse(options.storageEngine.getObjectField(storeName));
+    if (compression.isOK()) {
+        _compression = compression.getValue();
+    } else {
+        log() << "Invalid compression options, storing records raw: " << compression.getStatus();
+    }
+    auto cacheSize = PmseRecordCache::parseSize(options.storageEngine.getObjectField(storeName));
+    if (cacheSize.isOK() && cacheSize.getValue() > 0)
+        _cache = stdx::make_unique<PmseRecordCache>(cacheSize.getValue());
+    persistent_ptr<PmseCatalogEntry> catalogEntry;
+    if (catalog) {
+        _mapPool = catalog->getPool();
+        if (ns.toString() == "local.startup_log" && catalog->hasEntry(ident)) {
+            log() << "Delete old startup log";
+            catalog->drop(ident);
+        }
+        catalogEntry = catalog->getEntry(ident);
+    } else if (pool_handler->count(ident.toString()) > 0) {
         _mapPool = pool<root>((*pool_handler)[ident.toString()]);
     } else {
         std::string filepath = _dbPath.toString() + ident.toString();
@@ -78,7 +115,7 @@ PmseRecordStore::PmseRecordStore(StringData ns,
         std::string mapper_filename = _dbPath.toString() + ident.toString();
         if (!boost::filesystem::exists(mapper_filename.c_str())) {
             try {
-                _mapPool = pool<root>::create(mapper_filename, "pmse_mapper",
+                _mapPool = pool<root>::create(mapper_filename, PMSE_MAPPER_LAYOUT,
                                               (isSystemCollection(ns) ? 10 : 300)
                                               * PMEMOBJ_MIN_POOL, 0664);
             } catch (std::exception &e) {
@@ -87,27 +124,32 @@ PmseRecordStore::PmseRecordStore(StringData ns,
             }
         } else {
             try {
-                _mapPool = pool<root>::open(mapper_filename, "pmse_mapper");
+                _mapPool = PmseLayout::open<root>(mapper_filename, PMSE_MAPPER_LAYOUT,
+                                                  PMSE_MAPPER_OLD_LAYOUT);
             } catch (std::exception &e) {
                 log() << "Error handled: " << e.what();
                 throw;
             }
         }
+        PmseSlabAllocator::registerClasses(_mapPool);
         pool_handler->insert(std::pair<std::string, pool_base>(ident.toString(),
                                                                _mapPool));
     }
-    auto mapper_root = _mapPool.get_root();
-    if (!mapper_root->kvmap_root_ptr) {
-        transaction::exec_tx(_mapPool, [mapper_root, options, ns] {
-            mapper_root->kvmap_root_ptr = make_persistent<PmseMap<InitData>>(options.capped,
-                                                                             options.cappedMaxDocs,
-                                                                             options.cappedSize,
-                                                                             isSystemCollection(ns));
+    persistent_ptr<PmseMap<InitData>>& mapperRoot = catalog ? catalogEntry->mapper
+                                                            : pool<root>(_mapPool).get_root()->kvmap_root_ptr;
+    if (!mapperRoot) {
+        uint64_t hashmapSize = catalog ? SHARED_HASHMAP_SIZE : HASHMAP_SIZE;
+        transaction::exec_tx(_mapPool, [&mapperRoot, options, ns, hashmapSize] {
+            mapperRoot = make_persistent<PmseMap<InitData>>(options.capped,
+                                                            options.cappedMaxDocs,
+                                                            options.cappedSize,
+                                                            isSystemCollection(ns),
+                                                            hashmapSize);
         });
-        _mapper = mapper_root->kvmap_root_ptr;
+        _mapper = mapperRoot;
         _mapper->initialize(true);
     } else {
-        _mapper = mapper_root->kvmap_root_ptr;
+        _mapper = mapperRoot;
         if (_mapper->isInitialized()) {
             _mapper->initialize(false);
         } else {
@@ -119,8 +161,61 @@ PmseRecordStore::PmseRecordStore(StringData ns,
             } else {
                 _mapper->restoreCounters();
             }
+            _mapper->openRetired();
         });
     }
+    if (_mapper->isCapped() && NamespaceString::oplog(ns)) {
+        _truncateMarkers = stdx::make_unique<PmseTruncateMarkers>(_mapper);
+        loadTruncateMarkers();
+        _cappedTrimmer = stdx::thread(&PmseRecordStore::cappedTrimmerThread, this);
+    }
+    auto coldAfter = PmseColdTier::parseColdAfter(options.storageEngine.getObjectField(storeName));
+    uint64_t coldAfterSeconds = coldAfter.isOK() && !_mapper->isCapped() ? coldAfter.getValue() : 0;
+    std::string coldFilename = _dbPath.toString() + ident.toString() + ".cold";
+    if (coldAfterSeconds > 0 || boost::filesystem::exists(coldFilename)) {
+        // Existing file has to be opened even if tiering is off, it still holds records
+        _coldTier = stdx::make_unique<PmseColdTier>(coldFilename, coldAfterSeconds);
+        if (coldAfterSeconds > 0)
+            _coldMigrator = stdx::thread(&PmseRecordStore::coldMigratorThread, this);
+    }
+    auto deferredWrites = PmseRecordWriteSet::parseEnabled(
+        options.storageEngine.getObjectField(storeName));
+    // Write unit transactions apply buffered writes of all structures of unit together
+    _deferredWrites = ((deferredWrites.isOK() && deferredWrites.getValue()) ||
+                       writeUnitTransactions) && !_mapper->isCapped();
+    auto snapshotReads = PmseVersionStore::parseEnabled(
+        options.storageEngine.getObjectField(storeName));
+    if (snapshotReads.isOK() && snapshotReads.getValue() && !_mapper->isCapped()) {
+        // Versions are saved when writes of unit reach PMEM at commit
+        _versions = stdx::make_unique<PmseVersionStore>();
+        _deferredWrites = true;
+    }
+    if (groupCommit && !_mapper->isCapped() && !_versions && !isInternalNamespace(ns)) {
+        _deferredWrites = true;
+        _groupCommit = groupCommit;
+        _groupCommit->registerRecordStore(this);
+    }
+}
+
+PmseRecordStore::~PmseRecordStore() {
+    if (_groupCommit) {
+        _groupCommit->unregisterRecordStore(this);
+        try {
+            flushPending();
+        } catch (std::exception &e) {
+            log() << "Cannot apply pending writes: " << e.what();
+        }
+    }
+    if (_truncateMarkers) {
+        _truncateMarkers->kill();
+        _cappedTrimmer.join();
+    }
+    if (_coldTier) {
+        _coldTier->kill();
+        if (_coldMigrator.joinable())
+            _coldMigrator.join();
+    }
+    _mapper->storeCounters();
 }
 
 StatusWith<RecordId> PmseRecordStore::insertRecord(OperationContext* txn,
@@ -132,15 +227,33 @@ StatusWith<RecordId> PmseRecordStore::insertRecord(OperationContext* txn,
         return StatusWith<RecordId>(ErrorCodes::BadValue,
                                     "object to insert exceeds cappedMaxSize");
     }
-    persistent_ptr<InitData> obj;
+    if (auto writeSet = this->writeSet(txn)) {
+        uint64_t id = _mapper->reserveId();
+        if (!id)
+            return StatusWith<RecordId>(ErrorCodes::OperationFailed,
+                                        "Null record Id!");
+        writeSet->insert(id, data, len);
+        if (_coldTier)
+            _coldTier->markAccessed(RecordId(id));
+        return StatusWith<RecordId>(RecordId(id));
+    }
+    std::vector<char> compressed;
+    uint64_t flags = 0;
+    const char* payload = data;
+    uint64_t payloadSize = len;
+    if (_compression.compress(data, len, &compressed)) {
+        payload = compressed.data();
+        payloadSize = compressed.size();
+        flags = RECORD_COMPRESSED;
+    }
     uint64_t id = 0;
     try {
-        transaction::exec_tx(_mapPool, [this, &obj, len, data, &id] {
-            obj = pmemobj_tx_alloc(sizeof(InitData::size) + len, 1);
-            obj->size = len;
-            memcpy(obj->data, data, len);
-            id = _mapper->insert(obj);
-        });
+        id = _mapper->publishInsert(payload, payloadSize, flags);
+        if (!id) {
+            transaction::exec_tx(_mapPool, [this, payload, payloadSize, flags, &id] {
+                id = _mapper->insert(payload, payloadSize, flags);
+            });
+        }
     } catch (std::exception &e) {
         log() << "RecordStore: " << e.what();
         return StatusWith<RecordId>(ErrorCodes::OperationFailed,
@@ -149,9 +262,17 @@ StatusWith<RecordId> PmseRecordStore::insertRecord(OperationContext* txn,
     if (!id)
         return StatusWith<RecordId>(ErrorCodes::OperationFailed,
                                     "Null record Id!");
+    if (_coldTier)
+        _coldTier->markAccessed(RecordId(id));
     _mapper->changeSize(len);
-    txn->recoveryUnit()->registerChange(new InsertChange(_mapper, RecordId(id), len));
-    deleteCappedAsNeeded(txn);
+    PmseRecoveryUnit::emplaceChange<InsertChange>(txn, _mapper, RecordId(id), len);
+    invalidateCached(txn, RecordId(id));
+    if (_truncateMarkers) {
+        PmseRecoveryUnit::emplaceChange<MarkerInsertChange>(txn, _truncateMarkers.get(),
+                                                            RecordId(id), len);
+    } else {
+        deleteCappedAsNeeded(txn);
+    }
     while (_mapper->dataSize() > _storageSize) {
         _storageSize =  _storageSize + baseSize;
     }
@@ -161,21 +282,39 @@ StatusWith<RecordId> PmseRecordStore::insertRecord(OperationContext* txn,
 Status PmseRecordStore::updateRecord(OperationContext* txn, const RecordId& oldLocation,
                                      const char* data, int len, bool enforceQuota,
                                      UpdateNotifier* notifier) {
-    persistent_ptr<InitData> obj;
+    if (auto writeSet = this->writeSet(txn)) {
+        writeSet->update(oldLocation.repr(), data, len);
+        invalidateCached(txn, oldLocation);
+        if (_coldTier)
+            _coldTier->markAccessed(oldLocation);
+        return Status::OK();
+    }
+    std::vector<char> compressed;
+    uint64_t flags = 0;
+    const char* payload = data;
+    uint64_t payloadSize = len;
+    if (_compression.compress(data, len, &compressed)) {
+        payload = compressed.data();
+        payloadSize = compressed.size();
+        flags = RECORD_COMPRESSED;
+    }
     stdx::lock_guard<pmem::obj::mutex> lock(_mapper->_listMutex[oldLocation.repr() % _mapper->getHashmapSize()]);
     try {
-        transaction::exec_tx(_mapPool, [&obj, len, data, txn, oldLocation, this] {
-            obj = pmemobj_tx_alloc(sizeof(InitData::size) + len, 1);
-            obj->size = len;
-            memcpy(obj->data, data, len);
-            _mapper->updateKV(oldLocation.repr(), obj, txn);
-            _mapper->changeSize(obj->size - len);
-            deleteCappedAsNeeded(txn);
+        transaction::exec_tx(_mapPool, [len, payload, payloadSize, flags, txn, oldLocation, this] {
+            int64_t replacedSize = _mapper->updateKV(oldLocation.repr(), payload, payloadSize,
+                                                     txn, flags);
+            if (replacedSize >= 0)
+                _mapper->changeSize(len - replacedSize);
+            if (!_truncateMarkers)
+                deleteCappedAsNeeded(txn);
         });
     } catch (std::exception &e) {
         log() << e.what();
         return Status(ErrorCodes::BadValue, e.what());
     }
+    invalidateCached(txn, oldLocation);
+    if (_coldTier)
+        _coldTier->markAccessed(oldLocation);
     while (_mapper->dataSize() > _storageSize) {
         _storageSize =  _storageSize + baseSize;
     }
@@ -184,11 +323,18 @@ Status PmseRecordStore::updateRecord(OperationContext* txn, const RecordId& oldL
 
 void PmseRecordStore::deleteRecord(OperationContext* txn,
                                    const RecordId& dl) {
+    if (auto writeSet = this->writeSet(txn)) {
+        writeSet->remove(dl.repr());
+        invalidateCached(txn, dl);
+        return;
+    }
     stdx::lock_guard<pmem::obj::mutex> lock(_mapper->_listMutex[dl.repr() % _mapper->getHashmapSize()]);
     persistent_ptr<KVPair> p;
     if (_mapper->getPair(dl.repr(), &p)) {
+        int64_t size = p->dataSize();
         _mapper->remove((uint64_t) dl.repr(), txn);
-        _mapper->changeSize(-p->ptr->size);
+        _mapper->changeSize(-size);
+        invalidateCached(txn, dl);
     }
 }
 
@@ -204,24 +350,115 @@ void PmseRecordStore::cappedTruncateAfter(OperationContext* txn, RecordId end,
         rec = cursor.next();
     while (rec != boost::none) {
         RecordId id(rec->id);
-        RecordData data(rec->data);
+        RecordData data(rec->data.getOwned());
         rec = cursor.next();
         if (_cappedCallback) {
             deleteRecord(txn, id);
             _cappedCallback->aboutToDeleteCapped(txn, id, data);
         }
     }
+    if (_truncateMarkers)
+        loadTruncateMarkers();
 }
 
 bool PmseRecordStore::findRecord(OperationContext* txn, const RecordId& loc,
                                  RecordData* rd) const {
-    persistent_ptr<InitData> obj;
-    if (_mapper->find((uint64_t) loc.repr(), &obj)) {
-        invariant(obj != nullptr);
-        *rd = RecordData(obj->data, obj->size);
+    if (txn)
+        PmseRecoveryUnit::pinReads(txn);
+    if (_coldTier)
+        _coldTier->markAccessed(loc);
+    PmseBufferedRecord buffered;
+    if (findBuffered(txn, loc.repr(), &buffered)) {
+        if (buffered.op == PmseBufferedRecord::Op::kDelete)
+            return false;
+        *rd = RecordData(buffered.data.data(), buffered.data.size()).getOwned();
         return true;
     }
-    return false;
+    if (!_cache)
+        return snapshotRecord(txn, loc, readRecord(loc, rd), rd);
+    auto start = PmseRecordCache::Clock::now();
+    if (_cache->lookup(loc, rd)) {
+        _cache->recordLatency(true, start);
+        return snapshotRecord(txn, loc, true, rd);
+    }
+    uint64_t generation = _cache->generation(loc);
+    bool found = readRecord(loc, rd);
+    if (found)
+        _cache->insert(loc, *rd, generation);
+    _cache->recordLatency(false, start);
+    return snapshotRecord(txn, loc, found, rd);
+}
+
+/*
+ * Replaces state just read from PMEM with the one snapshot of txn sees
+ */
+bool PmseRecordStore::snapshotRecord(OperationContext* txn, const RecordId& loc, bool found,
+                                     RecordData* rd) const {
+    std::string version;
+    switch (snapshotLookup(txn, loc.repr(), &version)) {
+        case PmseVersionStore::Visibility::kLive:
+            return found;
+        case PmseVersionStore::Visibility::kVersion:
+            *rd = RecordData(version.data(), version.size()).getOwned();
+            return true;
+        default:
+            return false;
+    }
+}
+
+PmseVersionStore::Visibility PmseRecordStore::snapshotLookup(OperationContext* txn, uint64_t id,
+                                                             std::string* data) const {
+    if (!_versions || !txn)
+        return PmseVersionStore::Visibility::kLive;
+    auto ru = dynamic_cast<PmseRecoveryUnit*>(txn->recoveryUnit());
+    if (!ru)
+        return PmseVersionStore::Visibility::kLive;
+    return _versions->lookup(id, ru->snapshot(), data);
+}
+
+bool PmseRecordStore::readRecord(const RecordId& loc, RecordData* rd) const {
+    persistent_ptr<KVPair> pair;
+    if (!_mapper->getPair((uint64_t) loc.repr(), &pair))
+        return false;
+    InitData* obj = pair->record();
+    invariant(obj != nullptr);
+    uint64_t flags = pair->flags;
+    const char* data = obj->data;
+    uint64_t size = obj->size;
+    std::string inlineCopy;
+    bool copied = pair->isInline();
+    if (copied) {
+        flags = _mapper->copyRecord(pair, &inlineCopy);
+        data = inlineCopy.data();
+        size = inlineCopy.size();
+    }
+    bool isCold = flags & RECORD_COLD;
+    SharedBuffer coldBuffer;
+    if (isCold) {
+        ColdLocator locator;
+        memcpy(&locator, obj->data, sizeof(locator));
+        coldBuffer = SharedBuffer::allocate(locator.size);
+        uassert(ErrorCodes::FileStreamFailed, "Cannot read cold record",
+                _coldTier && _coldTier->read(locator.offset, locator.size, coldBuffer.get()));
+        data = coldBuffer.get();
+        size = locator.size;
+    }
+    if (flags & RECORD_COMPRESSED) {
+        uassert(ErrorCodes::DataCorruption, "Compressed record is truncated",
+                size >= sizeof(CompressedHeader));
+        uint64_t rawSize = PmseCompression::rawSize(data);
+        SharedBuffer buffer = SharedBuffer::allocate(rawSize);
+        uassert(ErrorCodes::DataCorruption, "Cannot decompress record",
+                PmseCompression::decompress(data, size, buffer.get()));
+        *rd = RecordData(std::move(buffer), rawSize);
+    } else if (isCold) {
+        *rd = RecordData(std::move(coldBuffer), size);
+    } else if (copied) {
+        *rd = RecordData(data, size).getOwned();
+    } else {
+        *rd = RecordData(data, size);
+    }
+    return true;
 }
 
 void PmseRecordStore::deleteCappedAsNeeded(OperationContext* txn) {
@@ -229,13 +466,433 @@ void PmseRecordStore::deleteCappedAsNeeded(OperationContext* txn) {
         uint64_t idToDelete = _mapper->getCappedFirstId();
         RecordId id(idToDelete);
         RecordData data;
-        findRecord(txn, id, &data);
+        readRecord(id, &data);
         _mapper->remove(idToDelete);
         _mapper->changeSize(-data.size());
+        invalidateCached(txn, id);
         uassertStatusOK(_cappedCallback->aboutToDeleteCapped(txn, id, data));
     }
 }
 
+PmseRecordWriteSet* PmseRecordStore::writeSet(OperationContext* txn) {
+    if (!_deferredWrites || !txn)
+        return nullptr;
+    auto ru = dynamic_cast<PmseRecoveryUnit*>(txn->recoveryUnit());
+    if (!ru)
+        return nullptr;
+    return static_cast<PmseRecordWriteSet*>(ru->getWriteSet(this, [this, ru] {
+        return stdx::make_unique<PmseRecordWriteSet>(this, _versions ? ru->snapshot() : 0, ru);
+    }));
+}
+
+const PmseRecordWriteSet* PmseRecordStore::bufferedWrites(OperationContext* txn) const {
+    if (!_deferredWrites || !txn)
+        return nullptr;
+    auto ru = dynamic_cast<PmseRecoveryUnit*>(txn->recoveryUnit());
+    return ru ? static_cast<const PmseRecordWriteSet*>(ru->findWriteSet(this)) : nullptr;
+}
+
+bool PmseRecordStore::findBuffered(OperationContext* txn, uint64_t id,
+                                   PmseBufferedRecord* record) const {
+    if (!_deferredWrites)
+        return false;
+    if (auto writeSet = bufferedWrites(txn)) {
+        if (auto buffered = writeSet->find(id)) {
+            *record = *buffered;
+            return true;
+        }
+    }
+    return !_pending.empty() && _pending.find(id, record);
+}
+
+bool PmseRecordStore::nextBufferedInsert(OperationContext* txn, uint64_t after, bool forward,
+                                         uint64_t* id, std::string* data) const {
+    if (!_deferredWrites)
+        return false;
+    bool found = false;
+    auto writeSet = bufferedWrites(txn);
+    if (writeSet) {
+        auto& records = writeSet->records();
+        auto it = forward ? records.upper_bound(after) : records.lower_bound(after);
+        while (forward ? it != records.end() : it != records.begin()) {
+            if (!forward)
+                --it;
+            if (it->second.op == PmseBufferedRecord::Op::kInsert) {
+                *id = it->first;
+                *data = it->second.data;
+                found = true;
+                break;
+            }
+            if (forward)
+                ++it;
+        }
+    }
+    // Committed inserts, unless this unit has deleted or rewritten them since
+    uint64_t pendingId = after;
+    std::string pendingData;
+    while (!_pending.empty() && _pending.nextInsert(pendingId, forward, &pendingId, &pendingData)) {
+        if (found && (forward ? pendingId > *id : pendingId < *id))
+            break;
+        const PmseBufferedRecord* own = writeSet ? writeSet->find(pendingId) : nullptr;
+        if (own && own->op == PmseBufferedRecord::Op::kDelete)
+            continue;
+        *id = pendingId;
+        *data = own ? own->data : pendingData;
+        found = true;
+        break;
+    }
+    // Records deleted after snapshot of txn was taken
+    auto ru = _versions && txn ? dynamic_cast<PmseRecoveryUnit*>(txn->recoveryUnit()) : nullptr;
+    uint64_t versionId = after;
+    std::string versionData;
+    while (ru && _versions->nextDeleted(versionId, forward, ru->snapshot(),
+                                        &versionId, &versionData)) {
+        if (found && (forward ? versionId > *id : versionId < *id))
+            break;
+        const PmseBufferedRecord* own = writeSet ? writeSet->find(versionId) : nullptr;
+        if (own && own->op == PmseBufferedRecord::Op::kDelete)
+            continue;
+        *id = versionId;
+        *data = own ? own->data : versionData;
+        found = true;
+        break;
+    }
+    return found;
+}
+
+/*
+ * Commits of collection are serialized by its owner, first committer of a
+ * record wins and later ones fail with write conflict
+ */
+void PmseRecordStore::checkWriteSet(const PmseRecordWriteSet& writeSet) {
+    if (!_versions)
+        return;
+    for (auto& entry : writeSet.records()) {
+        if (_versions->committedAfter(entry.first, writeSet.snapshot()))
+            throw WriteConflictException();
+    }
+}
+
+/*
+ * Saves states replaced by unit in version store before its writes reach
+ * PMEM, they stay invisible until unit ends its commit. Writes handed to
+ * group commit are merged at publish.
+ */
+void PmseRecordStore::applyWriteSet(PmseRecordWriteSet& writeSet, bool revertible) {
+    if (_groupCommit)
+        return;
+    if (_versions || revertible) {
+        uint64_t timestamp = _versions ? writeSet.unit()->commitTimestamp() : 0;
+        writeSet.timestamp() = timestamp;
+        for (auto& entry : writeSet.records()) {
+            auto op = entry.second.op;
+            RecordData previous;
+            bool existed = op != PmseBufferedRecord::Op::kInsert &&
+                           readRecord(RecordId(entry.first), &previous);
+            std::string data = existed ? std::string(previous.data(), previous.size())
+                                       : std::string();
+            if (revertible && op == PmseBufferedRecord::Op::kInsert)
+                writeSet.undo()[entry.first] = {PmseBufferedRecord::Op::kDelete, std::string()};
+            else if (revertible && existed)
+                writeSet.undo()[entry.first] = {op == PmseBufferedRecord::Op::kDelete
+                                                    ? PmseBufferedRecord::Op::kInsert
+                                                    : PmseBufferedRecord::Op::kUpdate,
+                                                data};
+            if (_versions)
+                _versions->install(entry.first, timestamp, existed, std::move(data),
+                                   op != PmseBufferedRecord::Op::kDelete);
+        }
+    }
+    applyRecords(writeSet.records());
+}
+
+void PmseRecordStore::revertWriteSet(PmseRecordWriteSet& writeSet) {
+    applyRecords(writeSet.undo());
+    if (_cache) {
+        for (auto& entry : writeSet.undo())
+            _cache->invalidate(RecordId(entry.first));
+    }
+}
+
+void PmseRecordStore::abandonWriteSet(PmseRecordWriteSet& writeSet) {
+    if (!_versions || !writeSet.timestamp())
+        return;
+    for (auto& entry : writeSet.records())
+        _versions->abandon(entry.first, writeSet.timestamp());
+}
+
+void PmseRecordStore::publishWriteSet(const PmseRecordWriteSet& writeSet) {
+    if (_versions) {
+        _versions->collect(PmseSnapshotManager::get().oldestSnapshot());
+        return;
+    }
+    if (!_groupCommit)
+        return;
+    for (auto& entry : writeSet.records()) {
+        const PmseBufferedRecord& record = entry.second;
+        int64_t size = record.data.size();
+        if (record.op == PmseBufferedRecord::Op::kInsert) {
+            _pending.merge(entry.first, record, 1, size);
+            continue;
+        }
+        int64_t currentSize = 0;
+        bool exists = false;
+        PmseBufferedRecord pending;
+        persistent_ptr<KVPair> pair;
+        if (_pending.find(entry.first, &pending)) {
+            exists = pending.op != PmseBufferedRecord::Op::kDelete;
+            currentSize = pending.data.size();
+        } else if (_mapper->getPair(entry.first, &pair)) {
+            exists = true;
+            currentSize = pair->dataSize();
+        }
+        if (!exists)
+            _pending.merge(entry.first, record, 0, 0);
+        else if (record.op == PmseBufferedRecord::Op::kDelete)
+            _pending.merge(entry.first, record, -1, -currentSize);
+        else
+            _pending.merge(entry.first, record, 0, size - currentSize);
+    }
+}
+
+/*
+ * Batch ends even when it cannot be applied, failing batch kept for retry
+ * would block every later one
+ */
+void PmseRecordStore::flushPending() {
+    stdx::lock_guard<stdx::mutex> owner(_writeOwner);
+    auto batch = _pending.beginApply();
+    if (!batch)
+        return;
+    ON_BLOCK_EXIT([this] { _pending.endApply(); });
+    try {
+        applyRecords(*batch);
+    } catch (std::exception& e) {
+        error() << "Group commit of " << ns() << " lost " << batch->size()
+                << " acknowledged writes: " << e.what();
+        throw;
+    }
+}
+
+/*
+ * Applies buffered writes in one transaction, sorted by hash list and id so
+ * consecutive writes touch the same list.
+ */
+void PmseRecordStore::applyRecords(const std::map<uint64_t, PmseBufferedRecord>& records) {
+    const uint64_t lists = _mapper->getHashmapSize();
+    typedef std::pair<uint64_t, const PmseBufferedRecord*> Entry;
+    std::vector<Entry> ordered;
+    ordered.reserve(records.size());
+    for (auto& entry : records)
+        ordered.emplace_back(entry.first, &entry.second);
+    std::sort(ordered.begin(), ordered.end(), [lists](const Entry& a, const Entry& b) {
+        if (a.first % lists != b.first % lists)
+            return a.first % lists < b.first % lists;
+        return a.first < b.first;
+    });
+    int64_t sizeChange = 0;
+    transaction::exec_tx(_mapPool, [this, lists, &ordered, &sizeChange] {
+        std::vector<char> compressed;
+        for (auto& entry : ordered) {
+            uint64_t id = entry.first;
+            const PmseBufferedRecord* record = entry.second;
+            if (record->op == PmseBufferedRecord::Op::kDelete) {
+                stdx::lock_guard<pmem::obj::mutex> lock(_mapper->_listMutex[id % lists]);
+                persistent_ptr<KVPair> pair;
+                if (_mapper->getPair(id, &pair)) {
+                    sizeChange -= pair->dataSize();
+                    _mapper->remove(id);
+                }
+                continue;
+            }
+            const char* payload = record->data.data();
+            uint64_t payloadSize = record->data.size();
+            uint64_t flags = 0;
+            if (_compression.compress(payload, payloadSize, &compressed)) {
+                payload = compressed.data();
+                payloadSize = compressed.size();
+                flags = RECORD_COMPRESSED;
+            }
+            if (record->op == PmseBufferedRecord::Op::kInsert) {
+                uassert(ErrorCodes::OperationFailed, "Cannot apply buffered insert",
+                        _mapper->insertWithId(id, payload, payloadSize, flags));
+                sizeChange += record->data.size();
+                continue;
+            }
+            stdx::lock_guard<pmem::obj::mutex> lock(_mapper->_listMutex[id % lists]);
+            int64_t replacedSize = _mapper->updateKV(id, payload, payloadSize, nullptr, flags);
+            if (replacedSize >= 0)
+                sizeChange += static_cast<int64_t>(record->data.size()) - replacedSize;
+        }
+    });
+    _mapper->changeSize(sizeChange);
+    while (_mapper->dataSize() > _storageSize) {
+        _storageSize =  _storageSize + baseSize;
+    }
+}
+
+void PmseRecordStore::invalidateCached(OperationContext* txn, const RecordId& loc) {
+    if (!_cache)
+        return;
+    _cache->invalidate(loc);
+    PmseRecoveryUnit::emplaceChange<RecordCacheInvalidateChange>(txn, _cache.get(), loc);
+}
+
+void PmseRecordStore::loadTruncateMarkers() {
+    _truncateMarkers->clear();
+    PmseRecordCursor cursor(_mapper, true);
+    while (auto record = cursor.next()) {
+        _truncateMarkers->recordInserted(record->id, record->data.size());
+    }
+}
+
+void PmseRecordStore::cappedTrimmerThread() {
+    setThreadName("PmseCappedTrimmer");
+    while (true) {
+        _truncateMarkers->awaitHasExcessOrDead();
+        if (_truncateMarkers->isDead())
+            break;
+        if (!reclaimExcessRecords())
+            sleepmillis(100);
+    }
+}
+
+/*
+ * Reclaims oldest ranges of records, one transaction per truncate marker.
+ */
+bool PmseRecordStore::reclaimExcessRecords() {
+    while (auto marker = _truncateMarkers->oldestMarkerIfExcess()) {
+        int64_t reclaimed = 0;
+        int64_t reclaimedSize = 0;
+        try {
+            stdx::lock_guard<stdx::mutex> owner(_writeOwner);
+            stdx::lock_guard<pmem::obj::mutex> lock(_mapper->_listMutex[0]);
+            transaction::exec_tx(_mapPool, [this, &marker, &reclaimed, &reclaimedSize] {
+                while (reclaimed < marker->records && _mapper->fillment() > 0) {
+                    uint64_t idToDelete = _mapper->getCappedFirstId();
+                    persistent_ptr<KVPair> pair;
+                    if (_mapper->getPair(idToDelete, &pair))
+                        reclaimedSize += pair->dataSize();
+                    _mapper->remove(idToDelete);
+                    if (_cache)
+                        _cache->invalidate(RecordId(idToDelete));
+                    reclaimed++;
+                    if (idToDelete == static_cast<uint64_t>(marker->lastRecord.repr()))
+                        break;
+                }
+            });
+        } catch (std::exception &e) {
+            log() << "Capped trimmer: " << e.what();
+            return false;
+        }
+        _mapper->changeSize(-reclaimedSize);
+        _truncateMarkers->popOldestMarker(reclaimed);
+    }
+    return true;
+}
+
+void PmseRecordStore::coldMigratorThread() {
+    setThreadName("PmseColdMigrator");
+    _coldTier->startRevolution();
+    uint64_t hand = 1;
+    while (_coldTier->waitForNextStep())
+        hand = migrateColdRecords(hand);
+}
+
+/*
+ * Moves clock hand over next slice of ids, so it passes all of them in
+ * COLD_CLOCK_STEPS steps. Out-of-line payloads not read during last
+ * revolution are collected, inline records are skipped, moving them would
+ * not free any PMEM. Returns id where next step starts.
+ */
+uint64_t PmseRecordStore::migrateColdRecords(uint64_t hand) {
+    uint64_t end = _mapper->_counter.load();
+    uint64_t last = std::min(end, hand + end / COLD_CLOCK_STEPS + 1);
+    std::vector<ColdCandidate> batch;
+    uint64_t batchBytes = 0;
+    uint64_t id = hand;
+    for (; id < last && !_coldTier->isDead(); id++) {
+        {
+            stdx::lock_guard<pmem::obj::mutex> lock(
+                _mapper->_listMutex[id % _mapper->getHashmapSize()]);
+            persistent_ptr<KVPair> pair;
+            if (!_mapper->getPair(id, &pair) || pair == nullptr)
+                continue;
+            InitData* record = pair->record();
+            if (pair->flags & RECORD_COLD) {
+                ColdLocator locator;
+                memcpy(&locator, record->data, sizeof(locator));
+                _coldTier->noteLive(locator.offset, locator.size);
+                continue;
+            }
+            if (pair->isInline() || _coldTier->wasAccessed(RecordId(id)))
+                continue;
+            batch.push_back({id, pair->flags, pair->dataSize(),
+                             std::string(record->data, record->size), 0});
+            batchBytes += record->size;
+        }
+        if (batchBytes >= COLD_BATCH_BYTES) {
+            switchToCold(&batch);
+            batchBytes = 0;
+        }
+    }
+    switchToCold(&batch);
+    if (id < end || _coldTier->isDead())
+        return id;
+    _coldTier->endRevolution();
+    _coldTier->startRevolution();
+    return 1;
+}
+
+/*
+ * Payloads are appended and synced before any pair is switched to its locator.
+ * Pair is switched only when its payload is still the one that was written out.
+ */
+void PmseRecordStore::switchToCold(std::vector<ColdCandidate>* batch) {
+    if (batch->empty())
+        return;
+    for (auto& candidate : *batch) {
+        if (!_coldTier->append(candidate.payload.data(), candidate.payload.size(),
+                               &candidate.offset)) {
+            batch->clear();
+            return;
+        }
+    }
+    if (!_coldTier->sync()) {
+        batch->clear();
+        return;
+    }
+    uint64_t migrated = 0;
+    uint64_t migratedBytes = 0;
+    for (auto& candidate : *batch) {
+        stdx::lock_guard<stdx::mutex> owner(_writeOwner);
+        stdx::lock_guard<pmem::obj::mutex> lock(
+            _mapper->_listMutex[candidate.id % _mapper->getHashmapSize()]);
+        persistent_ptr<KVPair> pair;
+        if (!_mapper->getPair(candidate.id, &pair) || pair->isInline() ||
+            pair->flags != candidate.flags)
+            continue;
+        InitData* record = pair->record();
+        if (record->size != candidate.payload.size() ||
+            memcmp(record->data, candidate.payload.data(), record->size) != 0)
+            continue;
+        ColdLocator locator = {candidate.offset, candidate.payload.size(), candidate.dataSize};
+        try {
+            transaction::exec_tx(_mapPool, [this, &candidate, &locator] {
+                _mapper->updateKV(candidate.id, reinterpret_cast<const char*>(&locator),
+                                  sizeof(locator), nullptr, candidate.flags | RECORD_COLD);
+            });
+        } catch (std::exception &e) {
+            log() << "Cold tier: " << e.what();
+            continue;
+        }
+        migrated++;
+        migratedBytes += candidate.payload.size();
+    }
+    _coldTier->recordMigrated(migrated, migratedBytes);
+    batch->clear();
+}
+
 Status PmseRecordStore::insertRecordsWithDocWriter(OperationContext* txn,
                                                    const DocWriter* const* docs,
                                                    const Timestamp* timestamps,
@@ -295,8 +952,16 @@ void PmseRecordStore::waitForAllEarlierOplogWritesToBeVisible(OperationContext*
     log() << "Not implemented: waitForAllEarlierOplogWritesToBeVisible";
 }
 
-PmseRecordCursor::PmseRecordCursor(persistent_ptr<PmseMap<InitData>> mapper, bool forward)
-    : _forward(forward),
+PmseRecordCursor::PmseRecordCursor(persistent_ptr<PmseMap<InitData>> mapper, bool forward,
+                                   PmseRecordCache* cache, PmseColdTier* coldTier,
+                                   const PmseRecordStore* recordStore,
+                                   OperationContext* txn)
+    : _cache(cache),
+      _coldTier(coldTier),
+      _recordStore(recordStore),
+      _txn(txn),
+      _lastBufferedId(forward ? 0 : std::numeric_limits<uint64_t>::max()),
+      _forward(forward),
       _lastMoveWasRestore(false) {
     _mapper = mapper;
     _before = nullptr;
@@ -305,6 +970,7 @@ PmseRecordCursor::PmseRecordCursor(persistent_ptr<PmseMap<InitData>> mapper, boo
 
 void PmseRecordCursor::moveToNext(bool inNext) {
     auto cursor = _cur;
+    bool sameList = false;
     auto listNumber = (_actualListNumber == -1 ? 0 : static_cast<int64_t>(_actualListNumber));
     if (listNumber != -1 && _lastMoveWasRestore) {  // Cursor points to wrong position
         _lastMoveWasRestore = false;
@@ -331,6 +997,7 @@ void PmseRecordCursor::moveToNext(bool inNext) {
         if (cursor != nullptr) {
             if (cursor->next != nullptr) {
                 cursor = cursor->next;
+                sameList = true;
             } else {
                 cursor = nullptr;
                 while (cursor == nullptr && listNumber < _mapper->_size) {
@@ -357,6 +1024,7 @@ void PmseRecordCursor::moveToNext(bool inNext) {
     if (inNext) {
         _cur = cursor;
         _actualListNumber = listNumber;
+        prefetchAhead(sameList);
     }
     if (_cur != nullptr)
         _position = _cur->position;
@@ -364,6 +1032,30 @@ void PmseRecordCursor::moveToNext(bool inNext) {
         _eof = true;
 }
 
+/*
+ * Keeps _ahead up to prefetch distance pairs after _cur in its list. Each
+ * step prefetches one more pair, and payload of pair prefetched in earlier
+ * step, so no prefetch waits for the line it was issued for.
+ */
+void PmseRecordCursor::prefetchAhead(bool sameList) {
+    int distance = PmsePrefetch::distance();
+    if (distance <= 0 || _cur == nullptr)
+        return;
+    if (sameList && _aheadCount > 0) {
+        _aheadCount--;
+    } else {
+        _ahead = _cur;
+        _aheadCount = 0;
+    }
+    while (_aheadCount < distance && _ahead->next != nullptr) {
+        if (_aheadCount > 0 && !_ahead->isInline())
+            PmsePrefetch::line(_ahead->ptr.get());
+        _ahead = _ahead->next;
+        _aheadCount++;
+        PmsePrefetch::line(_ahead.get());
+    }
+}
+
 Status PmseRecordStore::validate(OperationContext* txn,
                                  ValidateCmdLevel level,
                                  ValidateAdaptor* adaptor,
@@ -399,41 +1091,177 @@ Status PmseRecordStore::validate(OperationContext* txn,
     return Status::OK();
 }
 
+PmseRecordCursor::~PmseRecordCursor() {
+    unpinReads();
+}
+
+/*
+ * Cursors used without operation context hold their own pin
+ */
+void PmseRecordCursor::pinReads() {
+    if (_txn)
+        PmseRecoveryUnit::pinReads(_txn);
+    else if (_epochSlot < 0)
+        _epochSlot = PmseEpochManager::get().pin();
+}
+
+void PmseRecordCursor::unpinReads() {
+    if (_epochSlot >= 0) {
+        PmseEpochManager::get().unpin(_epochSlot);
+        _epochSlot = -1;
+    }
+}
+
 boost::optional<Record> PmseRecordCursor::next() {
-    if (_eof)
-        return boost::none;
+    pinReads();
+    if (!_forward && !_bufferedDone) {
+        if (auto record = nextBuffered())
+            return record;
+    }
+    if (_pendingSeek) {
+        if (_mapper->getPair(_pendingSeek->repr(), &_cur) && _cur != nullptr)
+            _position = _cur->position;
+        _pendingSeek = boost::none;
+    }
+    while (!_eof) {
+        if (_forward)
+            moveToNext();
+        else
+            moveBackward();
+        if (_cur == nullptr || _eof) {
+            _eof = true;
+            break;
+        }
+        _position = _cur->position;
+        RecordId a((int64_t) _cur->idValue);
+        PmseBufferedRecord buffered;
+        if (_recordStore && _recordStore->findBuffered(_txn, _cur->idValue, &buffered)) {
+            if (buffered.op != PmseBufferedRecord::Op::kDelete)
+                return {{a, RecordData(buffered.data.data(), buffered.data.size()).getOwned()}};
+            continue;
+        }
+        RecordData data = currentData();
+        std::string version;
+        auto visibility = _recordStore ? _recordStore->snapshotLookup(_txn, _cur->idValue, &version)
+                                       : PmseVersionStore::Visibility::kLive;
+        if (visibility == PmseVersionStore::Visibility::kLive)
+            return {{a, data}};
+        if (visibility == PmseVersionStore::Visibility::kVersion)
+            return {{a, RecordData(version.data(), version.size()).getOwned()}};
+    }
     if (_forward)
-        moveToNext();
-    else
-        moveBackward();
-    if (_cur == nullptr || _eof) {
-        _eof = true;
+        return nextBuffered();
+    return boost::none;
+}
+
+/*
+ * Returns next buffered insert, in id order
+ */
+boost::optional<Record> PmseRecordCursor::nextBuffered() {
+    uint64_t id;
+    std::string data;
+    if (!_recordStore ||
+        !_recordStore->nextBufferedInsert(_txn, _lastBufferedId, _forward, &id, &data)) {
+        if (!_forward)
+            _bufferedDone = true;
         return boost::none;
     }
-    _position = _cur->position;
-    RecordId a((int64_t) _cur->idValue);
-    RecordData b(_cur->ptr->data, _cur->ptr->size);
-    return {{a, b}};
+    _lastBufferedId = id;
+    return {{RecordId(id), RecordData(data.data(), data.size()).getOwned()}};
 }
 
 boost::optional<Record> PmseRecordCursor::seekExact(const RecordId& id) {
-    persistent_ptr<InitData> obj = nullptr;
+    pinReads();
+    if (_coldTier)
+        _coldTier->markAccessed(id);
+    PmseBufferedRecord buffered;
+    if (_recordStore && _recordStore->findBuffered(_txn, id.repr(), &buffered)) {
+        if (buffered.op == PmseBufferedRecord::Op::kDelete)
+            return boost::none;
+        return {{id, RecordData(buffered.data.data(), buffered.data.size()).getOwned()}};
+    }
+    auto record = seekCurrent(id);
+    std::string version;
+    auto visibility = _recordStore ? _recordStore->snapshotLookup(_txn, id.repr(), &version)
+                                   : PmseVersionStore::Visibility::kLive;
+    if (visibility == PmseVersionStore::Visibility::kLive)
+        return record;
+    if (visibility == PmseVersionStore::Visibility::kVersion)
+        return {{id, RecordData(version.data(), version.size()).getOwned()}};
+    return boost::none;
+}
+
+/*
+ * Reads id from cache, PMEM is walked only on miss. Cursor is moved to pair
+ * of cached record when next is called.
+ */
+boost::optional<Record> PmseRecordCursor::seekCurrent(const RecordId& id) {
+    uint64_t generation = _cache ? _cache->generation(id) : 0;
+    auto start = PmseRecordCache::Clock::now();
+    RecordData data;
+    if (_cache && _cache->lookup(id, &data)) {
+        _cache->recordLatency(true, start);
+        _pendingSeek = id;
+        return {{id, data}};
+    }
+    _pendingSeek = boost::none;
     bool status = _mapper->getPair(id.repr(), &_cur);
-    if (_cur == nullptr || _cur->ptr == nullptr) {
+    if (_cur == nullptr) {
         return boost::none;
     }
-    obj = _cur->ptr;
+    InitData* obj = _cur->record();
     if (!status || !obj) {
         return boost::none;
     }
     _position = _cur->position;
     RecordId a(id.repr());
-    RecordData b(obj->data, obj->size);
-    return {{a, b}};
+    if (!_cache)
+        return {{a, currentData()}};
+    data = currentData();
+    _cache->insert(id, data, generation);
+    _cache->recordLatency(false, start);
+    return {{a, data}};
+}
+
+RecordData PmseRecordCursor::currentData() {
+    InitData* record = _cur->record();
+    uint64_t flags = _cur->flags;
+    const char* data = record->data;
+    uint64_t size = record->size;
+    if (_cur->isInline()) {
+        flags = _mapper->copyRecord(_cur, &_inlineScratch);
+        data = _inlineScratch.data();
+        size = _inlineScratch.size();
+    }
+    if (flags & RECORD_COLD) {
+        ColdLocator locator;
+        memcpy(&locator, record->data, sizeof(locator));
+        _coldScratch.resize(locator.size);
+        uassert(ErrorCodes::FileStreamFailed, "Cannot read cold record",
+                _coldTier && _coldTier->read(locator.offset, locator.size, _coldScratch.data()));
+        data = _coldScratch.data();
+        size = locator.size;
+    }
+    if (!(flags & RECORD_COMPRESSED))
+        return RecordData(data, size);
+    uassert(ErrorCodes::DataCorruption, "Compressed record is truncated",
+            size >= sizeof(CompressedHeader));
+    uint64_t rawSize = PmseCompression::rawSize(data);
+    _scratch.resize(rawSize);
+    uassert(ErrorCodes::DataCorruption, "Cannot decompress record",
+            PmseCompression::decompress(data, size, _scratch.data()));
+    return RecordData(_scratch.data(), rawSize);
 }
 
+/*
+ * Pairs prefetched ahead may be deleted and freed while cursor is saved,
+ * prefetching starts again from _cur after restore
+ */
 void PmseRecordCursor::save() {
     _positionCheck = true;
+    _ahead = nullptr;
+    _aheadCount = 0;
+    unpinReads();
 }
 
 bool PmseRecordCursor::restore() {
@@ -453,6 +1281,8 @@ bool PmseRecordCursor::restore() {
 
 void PmseRecordCursor::saveUnpositioned() {
     _eof = true;
+    _ahead = nullptr;
+    _aheadCount = 0;
 }
 
 void PmseRecordCursor::moveToLast() {
@@ -539,5 +1369,13 @@ bool PmseRecordStore::isSystemCollection(const StringData& ns) {
            ns.toString() == "_mdb_catalog";
 }
 
+/*
+ * Catalog, replication state and users must reach PMEM before they are
+ * acknowledged, group commit skips them
+ */
+bool PmseRecordStore::isInternalNamespace(const StringData& ns) {
+    return ns == "_mdb_catalog" || ns.startsWith("local.") || ns.startsWith("admin.");
+}
+
 }  // namespace mongo
 
@@ -33,7 +33,13 @@
 #ifndef SRC_PMSE_RECORD_STORE_H_
 #define SRC_PMSE_RECORD_STORE_H_
 
+#include "pmse_cold_tier.h"
+#include "pmse_compression.h"
 #include "pmse_map.h"
+#include "pmse_record_cache.h"
+#include "pmse_truncate_markers.h"
+#include "pmse_version_store.h"
+#include "pmse_write_set.h"
 
 #include <libpmemobj++/p.hpp>
 #include <libpmemobj++/pext.hpp>
@@ -42,15 +48,21 @@
 #include <cmath>
 #include <string>
 #include <map>
+#include <vector>
 
 #include "mongo/platform/basic.h"
 #include "mongo/db/catalog/collection_options.h"
 #include "mongo/db/storage/capped_callback.h"
 #include "mongo/db/storage/record_store.h"
 #include "mongo/stdx/memory.h"
+#include "mongo/stdx/thread.h"
 
 namespace mongo {
 
+class PmseCatalog;
+class PmseGroupCommit;
+class PmseRecordStore;
+
 namespace {
 const std::string storeName = "pmse";
 const uint64_t baseSize = 20480;
@@ -58,7 +70,12 @@ const uint64_t baseSize = 20480;
 
 class PmseRecordCursor final : public SeekableRecordCursor {
  public:
-    PmseRecordCursor(persistent_ptr<PmseMap<InitData>> mapper, bool forward);
+    PmseRecordCursor(persistent_ptr<PmseMap<InitData>> mapper, bool forward,
+                     PmseRecordCache* cache = nullptr, PmseColdTier* coldTier = nullptr,
+                     const PmseRecordStore* recordStore = nullptr,
+                     OperationContext* txn = nullptr);
+
+    ~PmseRecordCursor();
 
     boost::optional<Record> next();
 
@@ -68,21 +85,39 @@ class PmseRecordCursor final : public SeekableRecordCursor {
 
     bool restore() final;
 
-    void detachFromOperationContext() final {}
+    void detachFromOperationContext() final {
+        _txn = nullptr;
+    }
 
-    void reattachToOperationContext(OperationContext* txn) final {}
+    void reattachToOperationContext(OperationContext* txn) final {
+        _txn = txn;
+    }
 
     void saveUnpositioned();
 
  private:
+    void pinReads();
+    void unpinReads();
     void moveToNext(bool inNext = true);
+    void prefetchAhead(bool sameList);
     void moveToLast();
     void moveBackward();
     bool checkPosition();
+    RecordData currentData();
+    boost::optional<Record> nextBuffered();
+    boost::optional<Record> seekCurrent(const RecordId& id);
 
     persistent_ptr<PmseMap<InitData>> _mapper;
+    PmseRecordCache* _cache;
+    PmseColdTier* _coldTier;
+    const PmseRecordStore* _recordStore;
+    OperationContext* _txn;
+    int _epochSlot = -1;  // Own pin when cursor reads without operation context
+    uint64_t _lastBufferedId;  // Buffered inserts are returned after PMEM ones, or before in reverse
+    bool _bufferedDone = false;
     persistent_ptr<KVPair> _before;
     persistent_ptr<KVPair> _cur;
+    boost::optional<RecordId> _pendingSeek;  // Record returned from cache, _cur not moved yet
     p<bool> _eof = false;
     p<bool> _isCapped;
     p<bool> _forward;
@@ -90,6 +125,11 @@ class PmseRecordCursor final : public SeekableRecordCursor {
     p<bool> _positionCheck;
     p<int64_t> _actualListNumber = -1;
     p<uint64_t> _position;
+    std::vector<char> _scratch;  // Decompressed record, valid until cursor moves
+    std::vector<char> _coldScratch;
+    std::string _inlineScratch;  // Inline record copied under list mutex
+    persistent_ptr<KVPair> _ahead;  // Last prefetched pair, _aheadCount pairs after _cur
+    int _aheadCount = 0;
 };
 
 class PmseRecordStore : public RecordStore {
@@ -98,11 +138,12 @@ class PmseRecordStore : public RecordStore {
                     const CollectionOptions& options,
                     StringData dbpath,
                     std::map<std::string, pool_base> *pool_handler,
-                    bool recoveryNeeded = false);
+                    bool recoveryNeeded = false,
+                    PmseCatalog* catalog = nullptr,
+                    PmseGroupCommit* groupCommit = nullptr,
+                    bool writeUnitTransactions = false);
 
-    ~PmseRecordStore() {
-        _mapper->storeCounters();
-    }
+    ~PmseRecordStore();
 
     virtual const char* name() const {
         return storeName.c_str();
@@ -111,11 +152,11 @@ class PmseRecordStore : public RecordStore {
     virtual void setCappedCallback(CappedCallback* cb);
 
     virtual long long dataSize(OperationContext* txn) const {
-        return _mapper->dataSize();
+        return _mapper->dataSize() + _pending.sizeChange();
     }
 
     virtual long long numRecords(OperationContext* txn) const {
-        return (int64_t)_mapper->fillment();
+        return (int64_t)_mapper->fillment() + _pending.countChange();
     }
 
     virtual bool isCapped() const {
@@ -166,13 +207,22 @@ class PmseRecordStore : public RecordStore {
 
     std::unique_ptr<SeekableRecordCursor> getCursor(OperationContext* txn,
                                                     bool forward) const final {
-        return stdx::make_unique<PmseRecordCursor>(_mapper, forward);
+        return stdx::make_unique<PmseRecordCursor>(_mapper, forward, _cache.get(),
+                                                   _coldTier.get(), this, txn);
     }
 
     virtual Status truncate(OperationContext* txn) {
+        if (auto writeSet = this->writeSet(txn))
+            writeSet->clear();
+        if (_versions)
+            _versions->clear();
         if (!_mapper->truncate(txn)) {
             return Status(ErrorCodes::OperationFailed, "Truncate error");
         }
+        if (_truncateMarkers)
+            _truncateMarkers->clear();
+        if (_cache)
+            _cache->clear();
         return Status::OK();
     }
 
@@ -191,10 +241,23 @@ class PmseRecordStore : public RecordStore {
             result->appendNumber("capped", true);
             result->appendNumber("maxSize", floor(_mapper->getMax() / scale));
             result->appendNumber("max", _mapper->getMaxSize());
+            if (_truncateMarkers) {
+                result->appendNumber("truncateMarkers",
+                                     static_cast<long long>(_truncateMarkers->numMarkers()));
+                result->appendNumber("recordsReclaimedInBackground",
+                                     static_cast<long long>(_truncateMarkers->reclaimedRecords()));
+            }
         } else {
             result->appendNumber("capped", false);
         }
+        result->append("compressor", _compression.compressorName());
+        if (_cache)
+            _cache->appendStats(result);
+        if (_coldTier)
+            _coldTier->appendStats(result);
         result->appendNumber("numInserts", _mapper->fillment());
+        if (_versions)
+            result->appendNumber("snapshotVersions", static_cast<long long>(_versions->versions()));
     }
 
     virtual Status touch(OperationContext* txn, BSONObjBuilder* output) const {
@@ -217,15 +280,93 @@ class PmseRecordStore : public RecordStore {
                             ValidateResults* results,
                             BSONObjBuilder* output);
 
+    /*
+     * Looks id up in writes of current unit of work and in committed writes
+     * waiting for group commit. Returns false when PMEM holds current state.
+     */
+    bool findBuffered(OperationContext* txn, uint64_t id, PmseBufferedRecord* record) const;
+
+    /*
+     * Finds closest buffered insert after id in given direction
+     */
+    bool nextBufferedInsert(OperationContext* txn, uint64_t after, bool forward,
+                            uint64_t* id, std::string* data) const;
+
+    /*
+     * Tells which state of id snapshot of txn sees, must be called after
+     * id is read from PMEM
+     */
+    PmseVersionStore::Visibility snapshotLookup(OperationContext* txn, uint64_t id,
+                                                std::string* data) const;
+
+    void checkWriteSet(const PmseRecordWriteSet& writeSet);
+
+    void applyWriteSet(PmseRecordWriteSet& writeSet, bool revertible);
+
+    void revertWriteSet(PmseRecordWriteSet& writeSet);
+
+    void abandonWriteSet(PmseRecordWriteSet& writeSet);
+
+    void publishWriteSet(const PmseRecordWriteSet& writeSet);
+
+    /*
+     * Pool which write sets of this store join at commit, nullptr when they
+     * are handed to group commit
+     */
+    PMEMobjpool* writeSetPool() {
+        return _groupCommit ? nullptr : _mapPool.get_handle();
+    }
+
+    /*
+     * Pending writes of group commit have their own lock
+     */
+    stdx::mutex* writeOwner() {
+        return _groupCommit ? nullptr : &_writeOwner;
+    }
+
+    bool deferredWrites() const {
+        return _deferredWrites;
+    }
+
+    /*
+     * Applies committed writes waiting for group commit
+     */
+    void flushPending();
+
  private:
+    PmseRecordWriteSet* writeSet(OperationContext* txn);
+    const PmseRecordWriteSet* bufferedWrites(OperationContext* txn) const;
+    void applyRecords(const std::map<uint64_t, PmseBufferedRecord>& records);
+    bool snapshotRecord(OperationContext* txn, const RecordId& loc, bool found,
+                        RecordData* rd) const;
+    bool readRecord(const RecordId& loc, RecordData* rd) const;
+    void invalidateCached(OperationContext* txn, const RecordId& loc);
     void deleteCappedAsNeeded(OperationContext* txn);
+    void loadTruncateMarkers();
+    void cappedTrimmerThread();
+    bool reclaimExcessRecords();
+    void coldMigratorThread();
+    uint64_t migrateColdRecords(uint64_t hand);
+    void switchToCold(std::vector<ColdCandidate>* batch);
     static bool isSystemCollection(const StringData& ns);
+    static bool isInternalNamespace(const StringData& ns);
     CappedCallback* _cappedCallback;
     int64_t _storageSize = baseSize;
     CollectionOptions _options;
+    PmseCompression _compression;
     const StringData _dbPath;
-    pool<root> _mapPool;
+    pool_base _mapPool;
     persistent_ptr<PmseMap<InitData>> _mapper;
+    std::unique_ptr<PmseTruncateMarkers> _truncateMarkers;
+    std::unique_ptr<PmseRecordCache> _cache;
+    std::unique_ptr<PmseColdTier> _coldTier;
+    stdx::thread _coldMigrator;
+    stdx::thread _cappedTrimmer;
+    stdx::mutex _writeOwner;
+    bool _deferredWrites = false;
+    PmseGroupCommit* _groupCommit = nullptr;
+    PmsePendingWrites _pending;
+    std::unique_ptr<PmseVersionStore> _versions;
 };
 }  // namespace mongo
 #endif  // SRC_PMSE_RECORD_STORE_H_
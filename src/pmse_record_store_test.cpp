@@ -30,9 +30,11 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <atomic>
 #include <memory>
 #include <sstream>
 #include <string>
+#include <vector>
 
 #include "mongo/platform/basic.h"
 #include "mongo/base/checked_cast.h"
@@ -41,15 +43,22 @@
 #include "mongo/bson/bsonobjbuilder.h"
 #include "mongo/db/concurrency/write_conflict_exception.h"
 #include "mongo/db/json.h"
+#include "mongo/db/modules/pmse/src/pmse_catalog.h"
+#include "mongo/db/modules/pmse/src/pmse_group_commit.h"
 #include "mongo/db/modules/pmse/src/pmse_record_store.h"
+#include "mongo/db/modules/pmse/src/pmse_recovery_unit.h"
 #include "mongo/db/operation_context_noop.h"
 #include "mongo/db/storage/kv/kv_prefix.h"
 #include "mongo/db/storage/record_store_test_harness.h"
+#include "mongo/platform/random.h"
 #include "mongo/stdx/memory.h"
+#include "mongo/stdx/thread.h"
 #include "mongo/unittest/temp_dir.h"
 #include "mongo/unittest/unittest.h"
 #include "mongo/util/fail_point.h"
+#include "mongo/util/log.h"
 #include "mongo/util/scopeguard.h"
+#include "mongo/util/time_support.h"
 
 namespace mongo {
 
@@ -234,4 +243,685 @@ TEST(PmseRecordStoreTest, CappedCursorYieldFirst) {
     ASSERT(!cursor->next());
 }
 
+TEST(PmseRecordStoreTest, OplogTrimmedInBackground) {
+    unique_ptr<RecordStoreHarnessHelper> harnessHelper(newRecordStoreHarnessHelper());
+    unique_ptr<RecordStore> rs(harnessHelper->newCappedRecordStore("local.oplog.pmse", 1000, -1));
+    ServiceContext::UniqueOperationContext opCtx(harnessHelper->newOperationContext());
+    const string data(100, 'a');
+
+    for (int i = 0; i < 100; i++) {
+        WriteUnitOfWork uow(opCtx.get());
+        StatusWith<RecordId> res =
+            rs->insertRecord(opCtx.get(), data.c_str(), data.size(), Timestamp(), false);
+        ASSERT_OK(res.getStatus());
+        uow.commit();
+    }
+
+    // Writers do not delete anything, oplog is trimmed by background thread
+    for (int i = 0; i < 500 && rs->dataSize(opCtx.get()) > 1000; i++) {
+        sleepmillis(10);
+    }
+    ASSERT_LTE(rs->dataSize(opCtx.get()), 1000);
+    ASSERT_GT(rs->numRecords(opCtx.get()), 0);
+}
+
+TEST(PmseRecordStoreTest, UpdateAcrossInlineThreshold) {
+    const auto harnessHelper(newRecordStoreHarnessHelper());
+    unique_ptr<RecordStore> rs(harnessHelper->newNonCappedRecordStore());
+    ServiceContext::UniqueOperationContext opCtx(harnessHelper->newOperationContext());
+    const string small(10, 'a');
+    const string big(1000, 'b');
+
+    RecordId id;
+    {
+        WriteUnitOfWork uow(opCtx.get());
+        StatusWith<RecordId> res =
+            rs->insertRecord(opCtx.get(), small.c_str(), small.size(), Timestamp(), false);
+        ASSERT_OK(res.getStatus());
+        id = res.getValue();
+        uow.commit();
+    }
+    {
+        WriteUnitOfWork uow(opCtx.get());
+        ASSERT_OK(rs->updateRecord(opCtx.get(), id, big.c_str(), big.size(), false, NULL));
+        uow.commit();
+    }
+    ASSERT_EQUALS(big, string(rs->dataFor(opCtx.get(), id).data(), big.size()));
+    ASSERT_EQUALS(static_cast<long long>(big.size()), rs->dataSize(opCtx.get()));
+    {
+        // Rolled back update restores previous out-of-line payload
+        WriteUnitOfWork uow(opCtx.get());
+        ASSERT_OK(rs->updateRecord(opCtx.get(), id, small.c_str(), small.size(), false, NULL));
+    }
+    ASSERT_EQUALS(big, string(rs->dataFor(opCtx.get(), id).data(), big.size()));
+    ASSERT_EQUALS(static_cast<long long>(big.size()), rs->dataSize(opCtx.get()));
+}
+
+TEST(PmseRecordStoreTest, InlineUpdateInPlace) {
+    const auto harnessHelper(newRecordStoreHarnessHelper());
+    unique_ptr<RecordStore> rs(harnessHelper->newNonCappedRecordStore());
+    ServiceContext::UniqueOperationContext opCtx(harnessHelper->newOperationContext());
+    const string first(10, 'a');
+    const string second(20, 'b');
+    const string third(30, 'c');
+
+    RecordId id;
+    {
+        WriteUnitOfWork uow(opCtx.get());
+        StatusWith<RecordId> res =
+            rs->insertRecord(opCtx.get(), first.c_str(), first.size(), Timestamp(), false);
+        ASSERT_OK(res.getStatus());
+        id = res.getValue();
+        uow.commit();
+    }
+    {
+        WriteUnitOfWork uow(opCtx.get());
+        ASSERT_OK(rs->updateRecord(opCtx.get(), id, second.c_str(), second.size(), false, NULL));
+        uow.commit();
+    }
+    RecordData data = rs->dataFor(opCtx.get(), id);
+    ASSERT_EQUALS(second, string(data.data(), data.size()));
+    {
+        // Rolled back update rewrites previous inline payload in place again
+        WriteUnitOfWork uow(opCtx.get());
+        ASSERT_OK(rs->updateRecord(opCtx.get(), id, third.c_str(), third.size(), false, NULL));
+    }
+    data = rs->dataFor(opCtx.get(), id);
+    ASSERT_EQUALS(second, string(data.data(), data.size()));
+    ASSERT_EQUALS(static_cast<long long>(second.size()), rs->dataSize(opCtx.get()));
+}
+
+TEST(PmseRecordStoreTest, PublishedInsertsAndRollback) {
+    const auto harnessHelper(newRecordStoreHarnessHelper());
+    unique_ptr<RecordStore> rs(harnessHelper->newNonCappedRecordStore());
+    ServiceContext::UniqueOperationContext opCtx(harnessHelper->newOperationContext());
+    const string small(10, 'a');
+    const string big(10000, 'b');
+
+    RecordId smallId, bigId;
+    {
+        WriteUnitOfWork uow(opCtx.get());
+        StatusWith<RecordId> res =
+            rs->insertRecord(opCtx.get(), small.c_str(), small.size(), Timestamp(), false);
+        ASSERT_OK(res.getStatus());
+        smallId = res.getValue();
+        res = rs->insertRecord(opCtx.get(), big.c_str(), big.size(), Timestamp(), false);
+        ASSERT_OK(res.getStatus());
+        bigId = res.getValue();
+        uow.commit();
+    }
+    ASSERT_EQUALS(small, string(rs->dataFor(opCtx.get(), smallId).data(), small.size()));
+    ASSERT_EQUALS(big, string(rs->dataFor(opCtx.get(), bigId).data(), big.size()));
+    {
+        // Rolled back insert is removed again
+        WriteUnitOfWork uow(opCtx.get());
+        ASSERT_OK(rs->insertRecord(opCtx.get(), big.c_str(), big.size(),
+                                   Timestamp(), false).getStatus());
+    }
+    ASSERT_EQUALS(2, rs->numRecords(opCtx.get()));
+    ASSERT_EQUALS(static_cast<long long>(small.size() + big.size()), rs->dataSize(opCtx.get()));
+    {
+        // Deleted pair is reused by the next insert
+        WriteUnitOfWork uow(opCtx.get());
+        rs->deleteRecord(opCtx.get(), smallId);
+        StatusWith<RecordId> res =
+            rs->insertRecord(opCtx.get(), small.c_str(), small.size(), Timestamp(), false);
+        ASSERT_OK(res.getStatus());
+        smallId = res.getValue();
+        uow.commit();
+    }
+    ASSERT_EQUALS(2, rs->numRecords(opCtx.get()));
+    ASSERT_EQUALS(small, string(rs->dataFor(opCtx.get(), smallId).data(), small.size()));
+}
+
+TEST(PmseRecordStoreTest, ChangeArenaReusedAcrossUnits) {
+    const auto harnessHelper(newRecordStoreHarnessHelper());
+    unique_ptr<RecordStore> rs(harnessHelper->newNonCappedRecordStore());
+    ServiceContext::UniqueOperationContext opCtx(harnessHelper->newOperationContext());
+    const string doc(1000, 'a');
+    const int records = 50;
+
+    std::vector<RecordId> ids;
+    {
+        WriteUnitOfWork uow(opCtx.get());
+        for (int i = 0; i < records; i++) {
+            StatusWith<RecordId> res =
+                rs->insertRecord(opCtx.get(), doc.c_str(), doc.size(), Timestamp(), false);
+            ASSERT_OK(res.getStatus());
+            ids.push_back(res.getValue());
+        }
+        uow.commit();
+    }
+    auto updateAll = [&] {
+        WriteUnitOfWork uow(opCtx.get());
+        for (auto& id : ids)
+            ASSERT_OK(rs->updateRecord(opCtx.get(), id, doc.c_str(), doc.size(), false, NULL));
+        uow.commit();
+    };
+    PmseChangeArena& arena = PmseRecoveryUnit::changeArena(opCtx.get());
+    updateAll();
+    uint64_t blocks = arena.blockAllocations();
+    ASSERT_GREATER_THAN(blocks, 0U);
+    // Same unit again reuses blocks of the previous one
+    updateAll();
+    ASSERT_EQUALS(blocks, arena.blockAllocations());
+    ASSERT_EQUALS(doc, string(rs->dataFor(opCtx.get(), ids.back()).data(), doc.size()));
+}
+
+TEST(PmseRecordStoreTest, CompressedRecords) {
+    const auto harnessHelper(newRecordStoreHarnessHelper());
+    ServiceContext::UniqueOperationContext opCtx(harnessHelper->newOperationContext());
+    unittest::TempDir dbpath("pmse_compression");
+    const string path = dbpath.path() + "/";
+    CollectionOptions options;
+    options.storageEngine = BSON("pmse" << BSON("compressor" << "snappy"
+                                                << "compressionThreshold" << 64));
+    std::map<std::string, pool_base> poolHandler;
+    PmseRecordStore rs("a.b", "pool_compressed", options, path, &poolHandler);
+    const string small(10, 'a');
+    const string big(4096, 'b');
+
+    RecordId smallId;
+    RecordId bigId;
+    {
+        WriteUnitOfWork uow(opCtx.get());
+        StatusWith<RecordId> res =
+            rs.insertRecord(opCtx.get(), small.c_str(), small.size(), Timestamp(), false);
+        ASSERT_OK(res.getStatus());
+        smallId = res.getValue();
+        res = rs.insertRecord(opCtx.get(), big.c_str(), big.size(), Timestamp(), false);
+        ASSERT_OK(res.getStatus());
+        bigId = res.getValue();
+        uow.commit();
+    }
+    ASSERT_EQUALS(static_cast<long long>(small.size() + big.size()), rs.dataSize(opCtx.get()));
+    ASSERT_EQUALS(big, string(rs.dataFor(opCtx.get(), bigId).data(), big.size()));
+
+    auto cursor = rs.getCursor(opCtx.get(), true);
+    int found = 0;
+    while (auto record = cursor->next()) {
+        const string& expected = record->id == bigId ? big : small;
+        ASSERT_EQUALS(static_cast<int>(expected.size()), record->data.size());
+        ASSERT_EQUALS(expected, string(record->data.data(), record->data.size()));
+        found++;
+    }
+    ASSERT_EQUALS(2, found);
+
+    const string updated(4096, 'c');
+    {
+        WriteUnitOfWork uow(opCtx.get());
+        ASSERT_OK(rs.updateRecord(opCtx.get(), bigId, updated.c_str(), updated.size(), false, NULL));
+        uow.commit();
+    }
+    ASSERT_EQUALS(updated, string(rs.dataFor(opCtx.get(), bigId).data(), updated.size()));
+    ASSERT_EQUALS(static_cast<long long>(small.size() + updated.size()), rs.dataSize(opCtx.get()));
+}
+
+TEST(PmseRecordStoreTest, CompressionOptionsValidated) {
+    ASSERT_OK(PmseCompression::parse(BSON("compressor" << "zlib")).getStatus());
+    ASSERT_NOT_OK(PmseCompression::parse(BSON("compressor" << "lz4")).getStatus());
+    ASSERT_NOT_OK(PmseCompression::parse(BSON("compressionThreshold" << -1)).getStatus());
+}
+
+TEST(PmseRecordStoreTest, RecordCacheInvalidatedByWriters) {
+    const auto harnessHelper(newRecordStoreHarnessHelper());
+    ServiceContext::UniqueOperationContext opCtx(harnessHelper->newOperationContext());
+    unittest::TempDir dbpath("pmse_record_cache");
+    const string path = dbpath.path() + "/";
+    CollectionOptions options;
+    options.storageEngine = BSON("pmse" << BSON("recordCacheSize" << 1024 * 1024));
+    std::map<std::string, pool_base> poolHandler;
+    PmseRecordStore rs("a.b", "pool_cached", options, path, &poolHandler);
+
+    RecordId id;
+    {
+        WriteUnitOfWork uow(opCtx.get());
+        StatusWith<RecordId> res = rs.insertRecord(opCtx.get(), "abc", 4, Timestamp(), false);
+        ASSERT_OK(res.getStatus());
+        id = res.getValue();
+        uow.commit();
+    }
+    ASSERT_EQUALS(string("abc"), rs.dataFor(opCtx.get(), id).data());
+    ASSERT_EQUALS(string("abc"), rs.dataFor(opCtx.get(), id).data());
+    {
+        WriteUnitOfWork uow(opCtx.get());
+        ASSERT_OK(rs.updateRecord(opCtx.get(), id, "xyz", 4, false, NULL));
+        uow.commit();
+    }
+    ASSERT_EQUALS(string("xyz"), rs.dataFor(opCtx.get(), id).data());
+    {
+        WriteUnitOfWork uow(opCtx.get());
+        rs.deleteRecord(opCtx.get(), id);
+        uow.commit();
+    }
+    RecordData data;
+    ASSERT_FALSE(rs.findRecord(opCtx.get(), id, &data));
+
+    BSONObjBuilder stats;
+    rs.appendCustomStats(opCtx.get(), &stats, 1);
+    BSONObj cacheStats = stats.obj()["recordCache"].Obj();
+    ASSERT_GTE(cacheStats["hits"].numberLong(), 1);
+    ASSERT_GTE(cacheStats["invalidations"].numberLong(), 2);
+}
+
+TEST(PmseRecordStoreTest, ColdRecordsMovedToFile) {
+    const auto harnessHelper(newRecordStoreHarnessHelper());
+    ServiceContext::UniqueOperationContext opCtx(harnessHelper->newOperationContext());
+    unittest::TempDir dbpath("pmse_cold_tier");
+    const string path = dbpath.path() + "/";
+    CollectionOptions options;
+    options.storageEngine = BSON("pmse" << BSON("coldAfterSeconds" << 1));
+    std::map<std::string, pool_base> poolHandler;
+    PmseRecordStore rs("a.b", "pool_tiered", options, path, &poolHandler);
+    const string data(1000, 'a');
+
+    RecordId id;
+    {
+        WriteUnitOfWork uow(opCtx.get());
+        StatusWith<RecordId> res =
+            rs.insertRecord(opCtx.get(), data.c_str(), data.size(), Timestamp(), false);
+        ASSERT_OK(res.getStatus());
+        id = res.getValue();
+        uow.commit();
+    }
+
+    long long migrated = 0;
+    for (int i = 0; i < 500 && migrated == 0; i++) {
+        sleepmillis(10);
+        BSONObjBuilder stats;
+        rs.appendCustomStats(opCtx.get(), &stats, 1);
+        migrated = stats.obj()["coldTier"]["migratedRecords"].numberLong();
+    }
+    ASSERT_EQUALS(1, migrated);
+    ASSERT_EQUALS(static_cast<long long>(data.size()), rs.dataSize(opCtx.get()));
+    ASSERT_EQUALS(data, string(rs.dataFor(opCtx.get(), id).data(), data.size()));
+    auto cursor = rs.getCursor(opCtx.get(), true);
+    auto record = cursor->next();
+    ASSERT(record);
+    ASSERT_EQUALS(data, string(record->data.data(), record->data.size()));
+}
+
+TEST(PmseRecordStoreTest, SharedPoolCatalog) {
+    const auto harnessHelper(newRecordStoreHarnessHelper());
+    ServiceContext::UniqueOperationContext opCtx(harnessHelper->newOperationContext());
+    unittest::TempDir dbpath("pmse_shared_pool");
+    const string path = dbpath.path() + "/";
+    CollectionOptions options;
+    std::map<std::string, pool_base> poolHandler;
+    const string data = "shared";
+    RecordId id;
+    {
+        PmseCatalog catalog(path + SHARED_POOL_FILENAME, 32 * PMEMOBJ_MIN_POOL);
+        PmseRecordStore rs1("a.b", "shared_1", options, path, &poolHandler, false, &catalog);
+        PmseRecordStore rs2("a.c", "shared_2", options, path, &poolHandler, false, &catalog);
+        {
+            WriteUnitOfWork uow(opCtx.get());
+            StatusWith<RecordId> res =
+                rs1.insertRecord(opCtx.get(), data.c_str(), data.size() + 1, Timestamp(), false);
+            ASSERT_OK(res.getStatus());
+            id = res.getValue();
+            uow.commit();
+        }
+        ASSERT_EQUALS(1, rs1.numRecords(opCtx.get()));
+        ASSERT_EQUALS(0, rs2.numRecords(opCtx.get()));
+    }
+
+    PmseCatalog catalog(path + SHARED_POOL_FILENAME, 32 * PMEMOBJ_MIN_POOL);
+    {
+        PmseRecordStore rs1("a.b", "shared_1", options, path, &poolHandler, false, &catalog);
+        ASSERT_EQUALS(1, rs1.numRecords(opCtx.get()));
+        ASSERT_EQUALS(data, rs1.dataFor(opCtx.get(), id).data());
+    }
+    catalog.drop("shared_1");
+    PmseRecordStore rs1("a.b", "shared_1", options, path, &poolHandler, false, &catalog);
+    ASSERT_EQUALS(0, rs1.numRecords(opCtx.get()));
+}
+
+TEST(PmseRecordStoreTest, WriteUnitTransaction) {
+    unittest::TempDir dbpath("pmse_write_unit");
+    const string path = dbpath.path() + "/";
+    CollectionOptions options;
+    std::map<std::string, pool_base> poolHandler;
+    PmseCatalog catalog(path + SHARED_POOL_FILENAME, 32 * PMEMOBJ_MIN_POOL);
+    PmseRecordStore rs("a.b", "write_unit", options, path, &poolHandler, false, &catalog,
+                       nullptr, true);
+    OperationContextNoop opCtx(new PmseRecoveryUnit());
+    OperationContextNoop otherCtx(new PmseRecoveryUnit());
+    const string data = "unit";
+
+    RecordId id;
+    {
+        WriteUnitOfWork uow(&opCtx);
+        for (int i = 0; i < 3; i++) {
+            ASSERT_OK(rs.insertRecord(&opCtx, data.c_str(), data.size() + 1,
+                                      Timestamp(), false).getStatus());
+        }
+        int seen = 0;
+        for (auto cursor = rs.getCursor(&opCtx, true); cursor->next();)
+            seen++;
+        ASSERT_EQUALS(3, seen);
+        // Writes of units are buffered, concurrent writers do not wait for each other
+        WriteUnitOfWork other(&otherCtx);
+        StatusWith<RecordId> res =
+            rs.insertRecord(&otherCtx, data.c_str(), data.size() + 1, Timestamp(), false);
+        ASSERT_OK(res.getStatus());
+        id = res.getValue();
+        other.commit();
+    }
+    ASSERT_EQUALS(1, rs.numRecords(&opCtx));
+    ASSERT_EQUALS(data, rs.dataFor(&opCtx, id).data());
+    auto cursor = rs.getCursor(&opCtx, true);
+    auto record = cursor->next();
+    ASSERT(record);
+    ASSERT_EQUALS(id, record->id);
+    ASSERT_FALSE(cursor->next());
+}
+
+TEST(PmseRecordStoreTest, SnapshotReadsIsolation) {
+    unittest::TempDir dbpath("pmse_snapshot_reads");
+    const string path = dbpath.path() + "/";
+    CollectionOptions options;
+    options.storageEngine = BSON("pmse" << BSON("snapshotReads" << true));
+    std::map<std::string, pool_base> poolHandler;
+    PmseRecordStore rs("a.b", "pool_snapshot", options, path, &poolHandler);
+    OperationContextNoop writer(new PmseRecoveryUnit());
+    OperationContextNoop reader(new PmseRecoveryUnit());
+    const string first = "first";
+    const string second = "second";
+
+    RecordId id;
+    {
+        WriteUnitOfWork uow(&writer);
+        StatusWith<RecordId> res =
+            rs.insertRecord(&writer, first.c_str(), first.size() + 1, Timestamp(), false);
+        ASSERT_OK(res.getStatus());
+        id = res.getValue();
+        uow.commit();
+    }
+    ASSERT_EQUALS(first, rs.dataFor(&reader, id).data());
+
+    RecordId added;
+    {
+        WriteUnitOfWork uow(&writer);
+        ASSERT_OK(rs.updateRecord(&writer, id, second.c_str(), second.size() + 1, false, NULL));
+        StatusWith<RecordId> res =
+            rs.insertRecord(&writer, second.c_str(), second.size() + 1, Timestamp(), false);
+        ASSERT_OK(res.getStatus());
+        added = res.getValue();
+        uow.commit();
+    }
+    // Reader keeps its snapshot
+    RecordData data;
+    ASSERT_EQUALS(first, rs.dataFor(&reader, id).data());
+    ASSERT_FALSE(rs.findRecord(&reader, added, &data));
+    {
+        auto cursor = rs.getCursor(&reader, true);
+        auto record = cursor->next();
+        ASSERT(record);
+        ASSERT_EQUALS(id, record->id);
+        ASSERT_EQUALS(first, record->data.data());
+        ASSERT_FALSE(cursor->next());
+    }
+
+    // Update based on old snapshot loses to committed one
+    {
+        WriteUnitOfWork uow(&reader);
+        ASSERT_OK(rs.updateRecord(&reader, id, first.c_str(), first.size() + 1, false, NULL));
+        ASSERT_THROWS(uow.commit(), WriteConflictException);
+    }
+    ASSERT_EQUALS(second, rs.dataFor(&reader, id).data());
+    ASSERT_TRUE(rs.findRecord(&reader, added, &data));
+
+    // Deleted record stays visible to older snapshot
+    {
+        WriteUnitOfWork uow(&writer);
+        rs.deleteRecord(&writer, id);
+        uow.commit();
+    }
+    ASSERT_EQUALS(second, rs.dataFor(&reader, id).data());
+    {
+        auto cursor = rs.getCursor(&reader, true);
+        int records = 0;
+        while (cursor->next())
+            records++;
+        ASSERT_EQUALS(2, records);
+    }
+    reader.recoveryUnit()->abandonSnapshot();
+    ASSERT_FALSE(rs.findRecord(&reader, id, &data));
+    ASSERT_EQUALS(1, rs.numRecords(&reader));
+}
+
+/*
+ * Conflict on one collection fails unit before any of its collections
+ * publishes a version
+ */
+TEST(PmseRecordStoreTest, SnapshotReadsConflictAcrossCollections) {
+    unittest::TempDir dbpath("pmse_snapshot_conflict");
+    const string path = dbpath.path() + "/";
+    CollectionOptions options;
+    options.storageEngine = BSON("pmse" << BSON("snapshotReads" << true));
+    std::map<std::string, pool_base> poolHandler;
+    PmseRecordStore first("a.b", "pool_snapshot_first", options, path, &poolHandler);
+    PmseRecordStore second("a.c", "pool_snapshot_second", options, path, &poolHandler);
+    OperationContextNoop writer(new PmseRecoveryUnit());
+    OperationContextNoop reader(new PmseRecoveryUnit());
+    const string before = "before";
+    const string after = "after";
+
+    RecordId firstId, secondId;
+    {
+        WriteUnitOfWork uow(&writer);
+        firstId = first.insertRecord(&writer, before.c_str(), before.size() + 1,
+                                     Timestamp(), false).getValue();
+        secondId = second.insertRecord(&writer, before.c_str(), before.size() + 1,
+                                       Timestamp(), false).getValue();
+        uow.commit();
+    }
+    ASSERT_EQUALS(before, first.dataFor(&reader, firstId).data());
+    {
+        WriteUnitOfWork uow(&writer);
+        ASSERT_OK(second.updateRecord(&writer, secondId, after.c_str(), after.size() + 1,
+                                      false, NULL));
+        uow.commit();
+    }
+    {
+        WriteUnitOfWork uow(&reader);
+        ASSERT_OK(first.updateRecord(&reader, firstId, after.c_str(), after.size() + 1,
+                                     false, NULL));
+        ASSERT_OK(second.updateRecord(&reader, secondId, after.c_str(), after.size() + 1,
+                                      false, NULL));
+        ASSERT_THROWS(uow.commit(), WriteConflictException);
+    }
+    ASSERT_EQUALS(before, first.dataFor(&writer, firstId).data());
+    {
+        WriteUnitOfWork uow(&writer);
+        ASSERT_OK(first.updateRecord(&writer, firstId, after.c_str(), after.size() + 1,
+                                     false, NULL));
+        uow.commit();
+    }
+    ASSERT_EQUALS(after, first.dataFor(&writer, firstId).data());
+}
+
+TEST(PmseRecordStoreTest, DeferredWritesAppliedAtCommit) {
+    unittest::TempDir dbpath("pmse_deferred_writes");
+    const string path = dbpath.path() + "/";
+    CollectionOptions options;
+    options.storageEngine = BSON("pmse" << BSON("deferredWrites" << true));
+    std::map<std::string, pool_base> poolHandler;
+    PmseRecordStore rs("a.b", "pool_deferred", options, path, &poolHandler);
+    OperationContextNoop opCtx(new PmseRecoveryUnit());
+    const string first = "first";
+    const string second = "second";
+
+    RecordId kept;
+    {
+        WriteUnitOfWork uow(&opCtx);
+        StatusWith<RecordId> res =
+            rs.insertRecord(&opCtx, first.c_str(), first.size() + 1, Timestamp(), false);
+        ASSERT_OK(res.getStatus());
+        kept = res.getValue();
+        ASSERT_EQUALS(0, rs.numRecords(&opCtx));
+        ASSERT_EQUALS(first, rs.dataFor(&opCtx, kept).data());
+        auto cursor = rs.getCursor(&opCtx, true);
+        auto record = cursor->next();
+        ASSERT(record);
+        ASSERT_EQUALS(kept, record->id);
+        ASSERT_FALSE(cursor->next());
+        uow.commit();
+    }
+    ASSERT_EQUALS(1, rs.numRecords(&opCtx));
+    ASSERT_EQUALS(static_cast<long long>(first.size() + 1), rs.dataSize(&opCtx));
+
+    {
+        WriteUnitOfWork uow(&opCtx);
+        ASSERT_OK(rs.updateRecord(&opCtx, kept, second.c_str(), second.size() + 1,
+                                  false, nullptr));
+        ASSERT_EQUALS(second, rs.dataFor(&opCtx, kept).data());
+        rs.deleteRecord(&opCtx, kept);
+        RecordData data;
+        ASSERT_FALSE(rs.findRecord(&opCtx, kept, &data));
+        ASSERT_OK(rs.insertRecord(&opCtx, second.c_str(), second.size() + 1,
+                                  Timestamp(), false).getStatus());
+    }
+    ASSERT_EQUALS(1, rs.numRecords(&opCtx));
+    ASSERT_EQUALS(first, rs.dataFor(&opCtx, kept).data());
+
+    {
+        WriteUnitOfWork uow(&opCtx);
+        ASSERT_OK(rs.updateRecord(&opCtx, kept, second.c_str(), second.size() + 1,
+                                  false, nullptr));
+        uow.commit();
+    }
+    ASSERT_EQUALS(second, rs.dataFor(&opCtx, kept).data());
+    ASSERT_EQUALS(static_cast<long long>(second.size() + 1), rs.dataSize(&opCtx));
+    ASSERT_OK(PmseRecordWriteSet::parseEnabled(BSON("deferredWrites" << false)).getStatus());
+    ASSERT_NOT_OK(PmseRecordWriteSet::parseEnabled(BSON("deferredWrites" << 1)).getStatus());
+}
+
+TEST(PmseRecordStoreTest, GroupCommitAppliesOnDurableWait) {
+    unittest::TempDir dbpath("pmse_group_commit");
+    const string path = dbpath.path() + "/";
+    CollectionOptions options;
+    std::map<std::string, pool_base> poolHandler;
+    PmseGroupCommit groupCommit(1000 * 1000);
+    PmseRecordStore rs("a.b", "pool_group_commit", options, path, &poolHandler,
+                       false, nullptr, &groupCommit);
+    OperationContextNoop opCtx(new PmseRecoveryUnit(&groupCommit));
+    const string data = "relaxed";
+
+    RecordId id;
+    {
+        WriteUnitOfWork uow(&opCtx);
+        StatusWith<RecordId> res =
+            rs.insertRecord(&opCtx, data.c_str(), data.size() + 1, Timestamp(), false);
+        ASSERT_OK(res.getStatus());
+        id = res.getValue();
+        uow.commit();
+    }
+    ASSERT_EQUALS(1, rs.numRecords(&opCtx));
+    ASSERT_EQUALS(data, rs.dataFor(&opCtx, id).data());
+    {
+        BSONObjBuilder stats;
+        rs.appendCustomStats(&opCtx, &stats, 1);
+        ASSERT_EQUALS(0, stats.obj()["numInserts"].numberLong());
+    }
+    ASSERT(opCtx.recoveryUnit()->waitUntilDurable());
+    {
+        BSONObjBuilder stats;
+        rs.appendCustomStats(&opCtx, &stats, 1);
+        ASSERT_EQUALS(1, stats.obj()["numInserts"].numberLong());
+    }
+    ASSERT_EQUALS(1, rs.numRecords(&opCtx));
+    ASSERT_EQUALS(static_cast<long long>(data.size() + 1), rs.dataSize(&opCtx));
+    ASSERT_EQUALS(data, rs.dataFor(&opCtx, id).data());
+}
+
+/*
+ * Readers copy records while writers replace and delete them, payloads must
+ * not be freed under readers
+ */
+TEST(PmseRecordStoreTest, ConcurrentReadersAndDeleters) {
+    unittest::TempDir dbpath("pmse_epoch_stress");
+    const string path = dbpath.path() + "/";
+    std::map<std::string, pool_base> poolHandler;
+    PmseRecordStore rs("a.b", "pool_epoch", CollectionOptions(), path, &poolHandler);
+    const int kWriters = 2;
+    const int kReaders = 4;
+    const int kRecordsPerWriter = 64;
+    const int kWriterOps = 5000;
+
+    std::vector<std::vector<RecordId>> owned(kWriters);
+    {
+        OperationContextNoop opCtx(new PmseRecoveryUnit());
+        for (int w = 0; w < kWriters; w++) {
+            for (int i = 0; i < kRecordsPerWriter; i++) {
+                const string doc(16, 'a' + w);
+                WriteUnitOfWork uow(&opCtx);
+                StatusWith<RecordId> res =
+                    rs.insertRecord(&opCtx, doc.c_str(), doc.size(), Timestamp(), false);
+                ASSERT_OK(res.getStatus());
+                owned[w].push_back(res.getValue());
+                uow.commit();
+            }
+        }
+    }
+    std::atomic<int64_t> maxId{owned.back().back().repr()};
+    std::atomic<int> writersDone{0};
+    std::atomic<int64_t> corrupted{0};
+
+    std::vector<stdx::thread> threads;
+    for (int w = 0; w < kWriters; w++) {
+        threads.emplace_back([&, w] {
+            OperationContextNoop opCtx(new PmseRecoveryUnit());
+            PseudoRandom random(w);
+            for (int op = 0; op < kWriterOps; op++) {
+                auto& id = owned[w][random.nextInt32(kRecordsPerWriter)];
+                // Sizes cross inline capacity, so both payload kinds are replaced
+                const string doc(1 + random.nextInt32(2048), 'a' + random.nextInt32(26));
+                WriteUnitOfWork uow(&opCtx);
+                if (op % 4 == 0) {
+                    rs.deleteRecord(&opCtx, id);
+                    StatusWith<RecordId> res =
+                        rs.insertRecord(&opCtx, doc.c_str(), doc.size(), Timestamp(), false);
+                    ASSERT_OK(res.getStatus());
+                    id = res.getValue();
+                    int64_t seen = maxId.load();
+                    while (seen < id.repr() && !maxId.compare_exchange_weak(seen, id.repr())) {}
+                } else {
+                    ASSERT_OK(rs.updateRecord(&opCtx, id, doc.c_str(), doc.size(), false, NULL));
+                }
+                uow.commit();
+            }
+            writersDone.fetch_add(1);
+        });
+    }
+    for (int r = 0; r < kReaders; r++) {
+        threads.emplace_back([&, r] {
+            OperationContextNoop opCtx(new PmseRecoveryUnit());
+            PseudoRandom random(kWriters + r);
+            int64_t count = 0;
+            while (writersDone.load() < kWriters) {
+                RecordData data;
+                RecordId id(1 + random.nextInt64(maxId.load()));
+                if (rs.findRecord(&opCtx, id, &data)) {
+                    const char* doc = data.data();
+                    for (int i = 1; i < data.size(); i++) {
+                        if (doc[i] != doc[0]) {
+                            corrupted.fetch_add(1);
+                            break;
+                        }
+                    }
+                }
+                if (++count % 100 == 0)
+                    opCtx.recoveryUnit()->abandonSnapshot();
+            }
+            opCtx.recoveryUnit()->abandonSnapshot();
+        });
+    }
+    for (auto& thread : threads)
+        thread.join();
+
+    ASSERT_EQUALS(0, corrupted.load());
+}
+
 }  // namespace mongo
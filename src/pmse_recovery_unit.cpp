@@ -32,49 +32,251 @@
 
 #define MONGO_LOG_DEFAULT_COMPONENT ::mongo::logger::LogComponent::kStorage
 
+#include <libpmemobj.h>
+#include <libpmemobj++/transaction.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+
+#include "mongo/db/concurrency/write_conflict_exception.h"
+#include "mongo/db/operation_context.h"
 #include "mongo/util/log.h"
 
+#include "pmse_epoch.h"
+#include "pmse_group_commit.h"
 #include "pmse_recovery_unit.h"
+#include "pmse_version_store.h"
+
+using pmem::obj::transaction;
 
 namespace mongo {
 
+void* PmseChangeArena::allocate(size_t size) {
+    const size_t alignment = alignof(std::max_align_t);
+    size = (size + alignment - 1) & ~(alignment - 1);
+    if (size > kBlockSize) {
+        _oversized.emplace_back(new char[size]);
+        _blockAllocations++;
+        return _oversized.back().get();
+    }
+    if (_block < _blocks.size() && _offset + size > kBlockSize) {
+        _block++;
+        _offset = 0;
+    }
+    if (_block == _blocks.size()) {
+        _blocks.emplace_back(new char[kBlockSize]);
+        _blockAllocations++;
+    }
+    void* memory = _blocks[_block].get() + _offset;
+    _offset += size;
+    return memory;
+}
+
+void PmseChangeArena::reset() {
+    _oversized.clear();
+    _block = 0;
+    _offset = 0;
+}
+
+PmseRecoveryUnit::~PmseRecoveryUnit() {
+    releaseChanges();
+    releaseSnapshot();
+}
+
+uint64_t PmseRecoveryUnit::nextSnapshotId() {
+    static std::atomic<uint64_t> snapshotId{1};
+    return snapshotId.fetch_add(1);
+}
+
+uint64_t PmseRecoveryUnit::snapshot() {
+    if (!_hasSnapshot) {
+        _snapshot = PmseSnapshotManager::get().openSnapshot();
+        _hasSnapshot = true;
+    }
+    return _snapshot;
+}
+
+void PmseRecoveryUnit::pinReads(OperationContext* txn) {
+    auto ru = dynamic_cast<PmseRecoveryUnit*>(txn->recoveryUnit());
+    if (ru && ru->_epochSlot < 0)
+        ru->_epochSlot = PmseEpochManager::get().pin();
+}
+
+/*
+ * Next read opens new snapshot, versions kept for this one can be freed
+ */
+void PmseRecoveryUnit::releaseSnapshot() {
+    if (_hasSnapshot) {
+        PmseSnapshotManager::get().closeSnapshot(_snapshot);
+        _hasSnapshot = false;
+    }
+    if (_epochSlot >= 0) {
+        PmseEpochManager::get().unpin(_epochSlot);
+        _epochSlot = -1;
+    }
+    _mySnapshotId = nextSnapshotId();
+}
+
+/*
+ * Destroys changes of ended unit and makes arena reusable
+ */
+void PmseRecoveryUnit::releaseChanges() {
+    for (auto& change : _changes) {
+        if (change.second)
+            change.first->~Change();
+        else
+            delete change.first;
+    }
+    _changes.clear();
+    _arena.reset();
+}
+
+uint64_t PmseRecoveryUnit::commitTimestamp() {
+    if (!_commitTimestamp)
+        _commitTimestamp = PmseSnapshotManager::get().beginCommit();
+    return _commitTimestamp;
+}
+
+void PmseRecoveryUnit::endCommit() {
+    if (_commitTimestamp) {
+        PmseSnapshotManager::get().endCommit(_commitTimestamp);
+        _commitTimestamp = 0;
+    }
+}
+
+/*
+ * Owners are taken in address order, so concurrent commits do not deadlock,
+ * and every write set is checked before anything reaches PMEM. Write sets of
+ * one pool are applied in one transaction. Pools are separate transactions
+ * unless pool is shared, so when a later one fails the committed ones are
+ * reverted before error is passed on.
+ */
+void PmseRecoveryUnit::applyWriteSets() {
+    std::vector<PMEMobjpool*> pools;
+    std::vector<stdx::mutex*> owners;
+    for (auto& writeSet : _writeSets) {
+        pools.push_back(writeSet.second->pool());
+        if (auto owner = writeSet.second->owner())
+            owners.push_back(owner);
+    }
+    std::sort(pools.begin(), pools.end());
+    pools.erase(std::unique(pools.begin(), pools.end()), pools.end());
+    std::sort(owners.begin(), owners.end());
+    owners.erase(std::unique(owners.begin(), owners.end()), owners.end());
+    std::vector<stdx::unique_lock<stdx::mutex>> locks;
+    for (auto owner : owners)
+        locks.emplace_back(*owner);
+    for (auto& writeSet : _writeSets)
+        writeSet.second->check();
+    std::vector<PmseWriteSet*> committed;
+    try {
+        for (size_t i = 0; i < pools.size(); i++) {
+            PMEMobjpool* pop = pools[i];
+            bool revertible = i + 1 < pools.size();
+            std::vector<PmseWriteSet*> group;
+            for (auto& writeSet : _writeSets) {
+                if (writeSet.second->pool() == pop)
+                    group.push_back(writeSet.second.get());
+            }
+            if (pop) {
+                pool_base base(pop);
+                transaction::exec_tx(base, [&group, revertible] {
+                    for (auto writeSet : group)
+                        writeSet->apply(revertible);
+                });
+                committed.insert(committed.end(), group.begin(), group.end());
+                continue;
+            }
+            for (auto writeSet : group) {
+                writeSet->apply(revertible);
+                committed.push_back(writeSet);
+            }
+        }
+    } catch (...) {
+        for (auto it = committed.rbegin(); it != committed.rend(); ++it) {
+            try {
+                (*it)->revert();
+            } catch (std::exception& e) {
+                error() << "Cannot revert buffered writes of failed commit: " << e.what();
+            }
+        }
+        for (auto& writeSet : _writeSets)
+            writeSet.second->abandon();
+        endCommit();
+        throw;
+    }
+    endCommit();
+    for (auto& writeSet : _writeSets)
+        writeSet.second->publish();
+}
+
+/*
+ * Write conflicts and errors of buffered writes reach caller unchanged, only
+ * conflicts are retried
+ */
 void PmseRecoveryUnit::commitUnitOfWork() {
+    try {
+        applyWriteSets();
+    } catch (const WriteConflictException&) {
+        abortUnitOfWork();
+        throw;
+    } catch (std::exception& e) {
+        log() << "Cannot apply buffered writes: " << e.what();
+        abortUnitOfWork();
+        throw;
+    }
+    _writeSets.clear();
+    _inUnitOfWork = false;
+    releaseSnapshot();
     try {
         auto end = _changes.end();
         for (auto it = _changes.begin(); it != end; ++it) {
-            (*it)->commit();
+            it->first->commit();
         }
-        _changes.clear();
+        releaseChanges();
     } catch (...) {
+        releaseChanges();
         throw;
     }
 }
 
 void PmseRecoveryUnit::abortUnitOfWork() {
+    _inUnitOfWork = false;
+    _writeSets.clear();
+    releaseSnapshot();
     try {
         auto end = _changes.rend();
         for (auto it = _changes.rbegin(); it != end; ++it) {
-            (*it)->rollback();
+            it->first->rollback();
         }
-        _changes.clear();
+        releaseChanges();
     } catch (...) {
+        releaseChanges();
         throw;
     }
 }
-void PmseRecoveryUnit::beginUnitOfWork(OperationContext* opCtx) {}
+
+void PmseRecoveryUnit::beginUnitOfWork(OperationContext* opCtx) {
+    _inUnitOfWork = true;
+}
 
 bool PmseRecoveryUnit::waitUntilDurable() {
+    if (_groupCommit)
+        _groupCommit->flush();
     return true;
 }
 
-void PmseRecoveryUnit::abandonSnapshot() {}
+void PmseRecoveryUnit::abandonSnapshot() {
+    releaseSnapshot();
+}
 
 SnapshotId PmseRecoveryUnit::getSnapshotId() const {
-    return SnapshotId();
+    return SnapshotId(_mySnapshotId);
 }
 
 void PmseRecoveryUnit::registerChange(Change* change) {
-    _changes.push_back(ChangePtr(change));
+    _changes.emplace_back(change, false);
 }
 
 void* PmseRecoveryUnit::writingPtr(void* data, size_t len) {
@@ -33,15 +33,166 @@
 #ifndef SRC_PMSE_RECOVERY_UNIT_H_
 #define SRC_PMSE_RECOVERY_UNIT_H_
 
+#include <libpmemobj++/pool.hpp>
+
+#include <memory>
+#include <utility>
 #include <vector>
 
+#include "mongo/base/checked_cast.h"
+#include "mongo/db/operation_context.h"
 #include "mongo/db/storage/recovery_unit.h"
+#include "mongo/stdx/mutex.h"
 
 namespace mongo {
 
+using pmem::obj::pool_base;
+
+class PmseGroupCommit;
+
+/*
+ * Bump allocator for changes of unit of work and their payload copies.
+ * Blocks are kept when unit ends, so steady state unit does no malloc.
+ */
+class PmseChangeArena {
+ public:
+    void* allocate(size_t size);
+
+    /*
+     * Makes all allocated memory reusable, objects must be already destroyed
+     */
+    void reset();
+
+    /*
+     * Number of blocks allocated from heap since arena was created
+     */
+    uint64_t blockAllocations() const {
+        return _blockAllocations;
+    }
+
+ private:
+    static const size_t kBlockSize = 64 * 1024;
+    std::vector<std::unique_ptr<char[]>> _blocks;
+    std::vector<std::unique_ptr<char[]>> _oversized;
+    size_t _block = 0;
+    size_t _offset = 0;
+    uint64_t _blockAllocations = 0;
+};
+
+/*
+ * Writes buffered in DRAM and applied to PMEM when unit of work commits
+ */
+class PmseWriteSet {
+ public:
+    virtual ~PmseWriteSet() = default;
+
+    /*
+     * Pool whose transaction apply joins, write sets of one pool are applied
+     * in one transaction. Nullptr when apply uses its own transaction or does
+     * not write to PMEM.
+     */
+    virtual PMEMobjpool* pool() const = 0;
+
+    /*
+     * Taken by unit from conflict check until write set is published, so no
+     * other writer commits in between or changes structure which undo log
+     * may restore. Nullptr when nothing needs to be serialized.
+     */
+    virtual stdx::mutex* owner() const = 0;
+
+    /*
+     * Throws WriteConflictException when writes collide with ones committed
+     * since unit read them. Every write set is checked before any is applied.
+     */
+    virtual void check() {}
+
+    /*
+     * Writes buffered state to PMEM. Revertible is set when a later pool of
+     * unit may still fail, apply then keeps what revert needs.
+     */
+    virtual void apply(bool revertible) = 0;
+
+    /*
+     * Undoes apply whose transaction committed before later pool failed
+     */
+    virtual void revert() {}
+
+    /*
+     * Drops DRAM state kept by apply when unit fails
+     */
+    virtual void abandon() {}
+
+    /*
+     * Makes writes visible once every pool committed, must not fail
+     */
+    virtual void publish() {}
+};
+
 class PmseRecoveryUnit : public RecoveryUnit {
  public:
-    PmseRecoveryUnit() = default;
+    explicit PmseRecoveryUnit(PmseGroupCommit* groupCommit = nullptr)
+        : _groupCommit(groupCommit), _mySnapshotId(nextSnapshotId()) {}
+
+    ~PmseRecoveryUnit();
+
+    /*
+     * Registers change constructed in arena of recovery unit of txn,
+     * it is destroyed without free when unit ends
+     */
+    template <typename T, typename... Args>
+    static void emplaceChange(OperationContext* txn, Args&&... args) {
+        auto ru = checked_cast<PmseRecoveryUnit*>(txn->recoveryUnit());
+        void* memory = ru->_arena.allocate(sizeof(T));
+        ru->_changes.emplace_back(new (memory) T(std::forward<Args>(args)...), true);
+    }
+
+    /*
+     * Arena of recovery unit of txn, for payload copies kept by changes
+     */
+    static PmseChangeArena& changeArena(OperationContext* txn) {
+        return checked_cast<PmseRecoveryUnit*>(txn->recoveryUnit())->_arena;
+    }
+
+    /*
+     * Returns write set buffered for owner in current unit of work,
+     * creating it with factory when needed. Returns nullptr outside of
+     * unit of work, writes are then applied immediately.
+     */
+    template <typename F>
+    PmseWriteSet* getWriteSet(const void* owner, F factory) {
+        if (!_inUnitOfWork)
+            return nullptr;
+        if (auto writeSet = findWriteSet(owner))
+            return writeSet;
+        _writeSets.emplace_back(owner, factory());
+        return _writeSets.back().second.get();
+    }
+
+    /*
+     * Commit timestamp whose writes reads of this unit see. Opened on first
+     * use and kept until snapshot is abandoned or unit of work ends.
+     */
+    uint64_t snapshot();
+
+    /*
+     * Commit timestamp shared by versioned write sets of committing unit,
+     * invisible to snapshots until every write set is applied
+     */
+    uint64_t commitTimestamp();
+
+    /*
+     * Pins reader epoch, so record payloads read without copying are not
+     * freed until snapshot is abandoned or unit of work ends
+     */
+    static void pinReads(OperationContext* txn);
+
+    PmseWriteSet* findWriteSet(const void* owner) const {
+        for (auto& writeSet : _writeSets) {
+            if (writeSet.first == owner)
+                return writeSet.second.get();
+        }
+        return nullptr;
+    }
 
     virtual void beginUnitOfWork(OperationContext* opCtx);
 
@@ -62,9 +213,24 @@ class PmseRecoveryUnit : public RecoveryUnit {
     virtual void setRollbackWritesDisabled();
 
  private:
-    typedef std::shared_ptr<Change> ChangePtr;
-    typedef std::vector<ChangePtr> Changes;
+    static uint64_t nextSnapshotId();
+    void applyWriteSets();
+    void endCommit();
+    void releaseChanges();
+    void releaseSnapshot();
+
+    // Change and whether it lives in arena
+    typedef std::vector<std::pair<Change*, bool>> Changes;
     Changes _changes;
+    PmseChangeArena _arena;
+    PmseGroupCommit* _groupCommit;
+    bool _inUnitOfWork = false;
+    std::vector<std::pair<const void*, std::unique_ptr<PmseWriteSet>>> _writeSets;
+    bool _hasSnapshot = false;
+    uint64_t _snapshot = 0;
+    uint64_t _commitTimestamp = 0;
+    uint64_t _mySnapshotId;
+    int _epochSlot = -1;
 };
 
 }  // namespace mongo
@@ -0,0 +1,105 @@
+/*
+ * Copyright 2014-2018, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define MONGO_LOG_DEFAULT_COMPONENT ::mongo::logger::LogComponent::kStorage
+
+#include "pmse_slab_allocator.h"
+
+#include <algorithm>
+#include <string>
+
+#include "mongo/util/log.h"
+
+namespace mongo {
+
+stdx::mutex PmseSlabAllocator::_mutex;
+std::unordered_set<PMEMobjpool*> PmseSlabAllocator::_registered;
+
+void PmseSlabAllocator::registerClasses(pool_base& pop) {
+    for (uint64_t i = 0; i < SLAB_CLASS_COUNT; i++) {
+        pobj_alloc_class_desc desc = {};
+        desc.unit_size = SLAB_CLASS_SIZES[i];
+        desc.units_per_block = std::min(std::max(SLAB_RUN_SIZE / SLAB_CLASS_SIZES[i],
+                                                 static_cast<uint64_t>(16)),
+                                        SLAB_MAX_UNITS);
+        desc.header_type = POBJ_HEADER_NONE;
+        std::string query = "heap.alloc_class." +
+                            std::to_string(SLAB_FIRST_CLASS_ID + i) + ".desc";
+        if (pmemobj_ctl_set(pop.get_handle(), query.c_str(), &desc) != 0) {
+            log() << "Cannot register allocation class of size " << SLAB_CLASS_SIZES[i]
+                  << ": " << pmemobj_errormsg() << ", using default allocator";
+            return;
+        }
+    }
+    stdx::lock_guard<stdx::mutex> lock(_mutex);
+    _registered.insert(pop.get_handle());
+}
+
+void PmseSlabAllocator::unregisterClasses(pool_base& pop) {
+    stdx::lock_guard<stdx::mutex> lock(_mutex);
+    _registered.erase(pop.get_handle());
+}
+
+persistent_ptr<InitData> PmseSlabAllocator::allocate(PMEMobjpool* pop, uint64_t dataSize) {
+    uint64_t size = sizeof(InitData::size) + dataSize;
+    int64_t slabClass = findClass(pop, size);
+    if (slabClass < 0)
+        return persistent_ptr<InitData>(pmemobj_tx_alloc(size, 1));
+    return persistent_ptr<InitData>(pmemobj_tx_xalloc(size, 1,
+                                    POBJ_CLASS_ID(SLAB_FIRST_CLASS_ID + slabClass)));
+}
+
+PMEMoid PmseSlabAllocator::reserve(pool_base& pop, uint64_t dataSize, pobj_action* act) {
+    uint64_t size = sizeof(InitData::size) + dataSize;
+    int64_t slabClass = findClass(pop.get_handle(), size);
+    if (slabClass < 0)
+        return pmemobj_reserve(pop.get_handle(), act, size, 0);
+    return pmemobj_xreserve(pop.get_handle(), act, size, 0,
+                            POBJ_CLASS_ID(SLAB_FIRST_CLASS_ID + slabClass));
+}
+
+/*
+ * Class for size, -1 when it goes to default heap
+ */
+int64_t PmseSlabAllocator::findClass(PMEMobjpool* pop, uint64_t size) {
+    {
+        stdx::lock_guard<stdx::mutex> lock(_mutex);
+        if (!_registered.count(pop))
+            return -1;
+    }
+    auto slabClass = std::lower_bound(SLAB_CLASS_SIZES, SLAB_CLASS_SIZES + SLAB_CLASS_COUNT, size);
+    if (slabClass == SLAB_CLASS_SIZES + SLAB_CLASS_COUNT)
+        return -1;
+    return slabClass - SLAB_CLASS_SIZES;
+}
+
+}  // namespace mongo
@@ -0,0 +1,91 @@
+/*
+ * Copyright 2014-2018, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SRC_PMSE_SLAB_ALLOCATOR_H_
+#define SRC_PMSE_SLAB_ALLOCATOR_H_
+
+#include "pmse_list_int_ptr.h"
+
+#include <libpmemobj.h>
+#include <libpmemobj++/persistent_ptr.hpp>
+#include <libpmemobj++/pool.hpp>
+
+#include <unordered_set>
+
+#include "mongo/stdx/mutex.h"
+
+namespace mongo {
+
+const uint64_t SLAB_CLASS_SIZES[] = {64, 128, 192, 256, 384, 512, 768, 1024,
+                                     1536, 2048, 3072, 4096, 6144, 8192, 12288, 16384};
+const uint64_t SLAB_CLASS_COUNT = sizeof(SLAB_CLASS_SIZES) / sizeof(SLAB_CLASS_SIZES[0]);
+const unsigned SLAB_FIRST_CLASS_ID = 200;  // Lower ids are taken by PMDK built-in classes
+const uint64_t SLAB_RUN_SIZE = 256 * 1024;
+const uint64_t SLAB_MAX_UNITS = 1024;
+
+/*
+ * Size-class allocator for document payloads. Each collection pool registers
+ * its own allocation classes with header-less units, so PMDK serves payloads
+ * from per-thread runs where allocation and free are a single bitmap update.
+ * Payloads bigger than the biggest class go to the default heap, as do
+ * payloads of pools where registration failed.
+ */
+class PmseSlabAllocator {
+ public:
+    static void registerClasses(pool_base& pop);
+
+    /*
+     * Forgets classes of pool, must be called before pool is closed
+     */
+    static void unregisterClasses(pool_base& pop);
+
+    /*
+     * Allocates InitData for dataSize bytes of payload in pool of current
+     * transaction, must be called within transaction
+     */
+    static persistent_ptr<InitData> allocate(PMEMobjpool* pop, uint64_t dataSize);
+
+    /*
+     * Reserves InitData for dataSize bytes of payload into act, it stays
+     * unreachable until act is published. Returns OID_NULL on failure.
+     */
+    static PMEMoid reserve(pool_base& pop, uint64_t dataSize, pobj_action* act);
+
+ private:
+    static int64_t findClass(PMEMobjpool* pop, uint64_t size);
+
+    static stdx::mutex _mutex;
+    static std::unordered_set<PMEMobjpool*> _registered;  // Pools with classes registered
+};
+
+}  // namespace mongo
+#endif  // SRC_PMSE_SLAB_ALLOCATOR_H_
@@ -32,8 +32,13 @@
 
 #define MONGO_LOG_DEFAULT_COMPONENT ::mongo::logger::LogComponent::kStorage
 
+#include "pmse_art_cursor.h"
+#include "pmse_buffered_cursor.h"
+#include "pmse_catalog.h"
 #include "pmse_change.h"
 #include "pmse_index_cursor.h"
+#include "pmse_layout.h"
+#include "pmse_recovery_unit.h"
 #include "pmse_sorted_data_interface.h"
 
 #include <boost/filesystem.hpp>
@@ -45,6 +50,7 @@
 #include <string>
 #include <utility>
 
+#include "mongo/db/concurrency/write_conflict_exception.h"
 #include "mongo/util/log.h"
 
 namespace mongo {
@@ -54,29 +60,56 @@ const int TempKeyMaxSize = 1024;
 PmseSortedDataInterface::PmseSortedDataInterface(StringData ident,
                                                  const IndexDescriptor* desc,
                                                  StringData dbpath,
-                                                 std::map<std::string, pool_base> *pool_handler)
-    : _dbpath(dbpath), _desc(*desc) {
+                                                 std::map<std::string, pool_base> *pool_handler,
+                                                 PmseCatalog* catalog,
+                                                 bool deferredWrites)
+    : _dbpath(dbpath), _desc(*desc), _deferredWrites(deferredWrites) {
     try {
-        if (pool_handler->count(ident.toString()) > 0) {
-            _pm_pool = pool<PmseTree>((*pool_handler)[ident.toString()]);
-        } else {
-            std::string filepath = _dbpath.toString() + ident.toString();
-            if (desc->parentNS() == "local.startup_log" &&
-                boost::filesystem::exists(filepath)) {
-                log() << "Delete old startup log";
-                boost::filesystem::remove_all(filepath);
+        if (catalog) {
+            _pm_pool = catalog->getPool();
+            auto entry = catalog->getEntry(ident);
+            if (!entry->tree) {
+                transaction::exec_tx(_pm_pool, [&entry] {
+                    entry->tree = make_persistent<PmseTree>();
+                });
             }
-            if (!boost::filesystem::exists(filepath)) {
-                _pm_pool = pool<PmseTree>::create(filepath.c_str(), "pmse_index",
-                                                  (isSystemCollection(desc->parentNS()) ? 10 : 30)
-                                                  * PMEMOBJ_MIN_POOL, 0664);
+            _tree = entry->tree;
+        } else {
+            if (pool_handler->count(ident.toString()) > 0) {
+                _pm_pool = pool<PmseTree>((*pool_handler)[ident.toString()]);
             } else {
-                _pm_pool = pool<PmseTree>::open(filepath.c_str(), "pmse_index");
+                std::string filepath = _dbpath.toString() + ident.toString();
+                if (desc->parentNS() == "local.startup_log" &&
+                    boost::filesystem::exists(filepath)) {
+                    log() << "Delete old startup log";
+                    boost::filesystem::remove_all(filepath);
+                }
+                if (!boost::filesystem::exists(filepath)) {
+                    _pm_pool = pool<PmseTree>::create(filepath.c_str(), PMSE_INDEX_LAYOUT,
+                                                      (isSystemCollection(desc->parentNS()) ? 10 : 30)
+                                                      * PMEMOBJ_MIN_POOL, 0664);
+                } else {
+                    _pm_pool = PmseLayout::open<PmseTree>(filepath, PMSE_INDEX_LAYOUT,
+                                                          PMSE_INDEX_OLD_LAYOUT);
+                }
+                pool_handler->insert(std::pair<std::string, pool_base>(ident.toString(),
+                                                                       _pm_pool));
             }
-            pool_handler->insert(std::pair<std::string, pool_base>(ident.toString(),
-                                                                   _pm_pool));
+            _tree = pool<PmseTree>(_pm_pool).get_root();
         }
-        _tree = _pm_pool.get_root();
+        auto art = PmseArt::parseEnabled(
+            desc->infoObj().getObjectField("storageEngine").getObjectField("pmse"));
+        bool useArt = art.isOK() && art.getValue();
+        bool artIgnored = false;
+        transaction::exec_tx(_pm_pool, [this, useArt, &artIgnored] {
+            _tree->open();
+            if (useArt)
+                artIgnored = !_tree->useArt();
+        });
+        if (artIgnored)
+            warning() << "Index " << desc->indexName() << " of " << desc->parentNS()
+                      << " has indexType \"art\" but already holds B+ tree entries, "
+                      << "it stays B+ tree until it is rebuilt";
     } catch (std::exception &e) {
         log() << "Error handled: " << e.what();
         throw Status(ErrorCodes::CannotCreateIndex, "Cannot create/open pool while creating index");
@@ -100,11 +133,22 @@ Status PmseSortedDataInterface::insert(OperationContext* txn,
             << key.objsize() << ' ' << key;
         return Status(ErrorCodes::KeyTooLong, msg);
     }
+    if (auto writeSet = this->writeSet(txn)) {
+        if (!dupsAllowed) {
+            status = checkDuplicate(txn, *writeSet, key, loc);
+            if (!status.isOK())
+                return status;
+        }
+        writeSet->insert(key, loc, dupsAllowed);
+        return status;
+    }
     try {
         IndexKeyEntry entry(key.getOwned(), loc);
         status = _tree->insert(_pm_pool, entry, _desc.keyPattern(), dupsAllowed);
         if (status == Status::OK()) {
-            txn->recoveryUnit()->registerChange(new InsertIndexChange(_tree, _pm_pool, key, loc, dupsAllowed, &_desc));
+            PmseRecoveryUnit::emplaceChange<InsertIndexChange>(
+                txn, PmseRecoveryUnit::changeArena(txn), _tree, _pm_pool, key, loc,
+                dupsAllowed, &_desc);
         }
     } catch (std::exception &e) {
         log() << e.what();
@@ -117,6 +161,10 @@ Status PmseSortedDataInterface::insert(OperationContext* txn,
  */
 void PmseSortedDataInterface::unindex(OperationContext* txn, const BSONObj& key,
                                       const RecordId& loc, bool dupsAllowed) {
+    if (auto writeSet = this->writeSet(txn)) {
+        writeSet->remove(key, loc, dupsAllowed);
+        return;
+    }
     bool status = true;
     IndexKeyEntry entry(key.getOwned(), loc);
     try {
@@ -124,7 +172,9 @@ void PmseSortedDataInterface::unindex(OperationContext* txn, const BSONObj& key,
            status = _tree->remove(_pm_pool, entry, dupsAllowed, _desc.keyPattern());
         });
 	    if (status == true) {
-            txn->recoveryUnit()->registerChange(new RemoveIndexChange(_tree, _pm_pool, key, loc, dupsAllowed, _desc.keyPattern()));
+            PmseRecoveryUnit::emplaceChange<RemoveIndexChange>(
+                txn, PmseRecoveryUnit::changeArena(txn), _tree, _pm_pool, key, loc,
+                dupsAllowed, &_desc);
         }
     } catch (std::exception &e) {
         log() << e.what();
@@ -137,13 +187,138 @@ Status PmseSortedDataInterface::dupKeyCheck(OperationContext* txn,
     return Status::OK();
 }
 
+/*
+ * Committed entries with key count unless unit removed them
+ */
+Status PmseSortedDataInterface::checkDuplicate(OperationContext* txn,
+                                               const PmseIndexWriteSet& writeSet,
+                                               const BSONObj& key, const RecordId& loc) const {
+    bool duplicate = writeSet.insertedElsewhere(key, loc);
+    auto cursor = newTreeCursor(txn, true);
+    for (auto entry = cursor->seek(key, true, SortedDataInterface::Cursor::kKeyAndLoc);
+         !duplicate && entry && entry->key.woCompare(key, BSONObj(), false) == 0;
+         entry = cursor->next(SortedDataInterface::Cursor::kKeyAndLoc)) {
+        duplicate = entry->loc != loc && !writeSet.removed(*entry);
+    }
+    if (!duplicate)
+        return Status::OK();
+    StringBuilder sb;
+    sb << "E11000 duplicate key error ";
+    sb << "dup key: " << key.toString();
+    return Status(ErrorCodes::DuplicateKey, sb.str());
+}
+
+PmseIndexWriteSet* PmseSortedDataInterface::writeSet(OperationContext* txn) {
+    if (!_deferredWrites || !txn)
+        return nullptr;
+    auto ru = dynamic_cast<PmseRecoveryUnit*>(txn->recoveryUnit());
+    if (!ru)
+        return nullptr;
+    return static_cast<PmseIndexWriteSet*>(ru->getWriteSet(this, [this] {
+        return stdx::make_unique<PmseIndexWriteSet>(this, Ordering::make(_desc.keyPattern()));
+    }));
+}
+
+const PmseIndexWriteSet* PmseSortedDataInterface::bufferedWrites(OperationContext* txn) const {
+    if (!_deferredWrites || !txn)
+        return nullptr;
+    auto ru = dynamic_cast<PmseRecoveryUnit*>(txn->recoveryUnit());
+    return ru ? static_cast<const PmseIndexWriteSet*>(ru->findWriteSet(this)) : nullptr;
+}
+
+/*
+ * Removals go first, so unit which moves unique key between records does
+ * not collide with itself
+ */
+void PmseSortedDataInterface::applyWriteSet(const PmseIndexWriteSet& writeSet) {
+    transaction::exec_tx(_pm_pool, [this, &writeSet] {
+        for (auto& buffered : writeSet.keys()) {
+            if (buffered.second.insert)
+                continue;
+            IndexKeyEntry entry(buffered.first.key, buffered.first.loc);
+            _tree->remove(_pm_pool, entry, buffered.second.dupsAllowed, _desc.keyPattern());
+        }
+        for (auto& buffered : writeSet.keys()) {
+            if (!buffered.second.insert)
+                continue;
+            IndexKeyEntry entry(buffered.first.key, buffered.first.loc);
+            uassertStatusOK(_tree->insert(_pm_pool, entry, _desc.keyPattern(),
+                                          buffered.second.dupsAllowed));
+        }
+    });
+}
+
+/*
+ * Unique key checked when unit buffered it may have been committed by other
+ * unit since, retry then reports duplicate key
+ */
+void PmseSortedDataInterface::checkWriteSet(const PmseIndexWriteSet& writeSet) const {
+    for (auto& buffered : writeSet.keys()) {
+        if (!buffered.second.insert || buffered.second.dupsAllowed)
+            continue;
+        if (!checkDuplicate(nullptr, writeSet, buffered.first.key, buffered.first.loc).isOK())
+            throw WriteConflictException();
+    }
+}
+
+/*
+ * Inserts are undone first, so restored unique key does not collide with
+ * entry unit moved it to
+ */
+void PmseSortedDataInterface::revertWriteSet(const PmseIndexWriteSet& writeSet) {
+    transaction::exec_tx(_pm_pool, [this, &writeSet] {
+        for (auto& buffered : writeSet.keys()) {
+            if (!buffered.second.insert)
+                continue;
+            IndexKeyEntry entry(buffered.first.key, buffered.first.loc);
+            _tree->remove(_pm_pool, entry, buffered.second.dupsAllowed, _desc.keyPattern());
+        }
+        for (auto& buffered : writeSet.keys()) {
+            if (buffered.second.insert)
+                continue;
+            IndexKeyEntry entry(buffered.first.key, buffered.first.loc);
+            uassertStatusOK(_tree->insert(_pm_pool, entry, _desc.keyPattern(),
+                                          buffered.second.dupsAllowed));
+        }
+    });
+}
+
 std::unique_ptr<SortedDataInterface::Cursor> PmseSortedDataInterface::newCursor(
                 OperationContext* txn, bool isForward) const {
+    auto cursor = newTreeCursor(txn, isForward);
+    if (!_deferredWrites)
+        return cursor;
+    return stdx::make_unique<PmseBufferedCursor>(txn, isForward, this, std::move(cursor),
+                                                 _desc.keyPattern());
+}
+
+std::unique_ptr<SortedDataInterface::Cursor> PmseSortedDataInterface::newTreeCursor(
+                OperationContext* txn, bool isForward) const {
+    if (_tree->art())
+        return stdx::make_unique<PmseArtCursor>(txn, isForward, _tree->art(),
+                                                _desc.keyPattern());
     return stdx::make_unique <PmseCursor> (txn, isForward, _tree,
                                            _desc.keyPattern(),
                                            _desc.unique());
 }
 
+long long PmseSortedDataInterface::countRange(OperationContext* txn,
+                                             const BSONObj& startKey, bool startInclusive,
+                                             const BSONObj& endKey, bool endInclusive) const {
+    if (_tree->art()) {
+        Ordering ordering = Ordering::make(_desc.keyPattern());
+        KeyString start(KeyString::Version::V1, startKey, ordering,
+                        startInclusive ? KeyString::kExclusiveBefore : KeyString::kExclusiveAfter);
+        KeyString end(KeyString::Version::V1, endKey, ordering,
+                      endInclusive ? KeyString::kExclusiveAfter : KeyString::kExclusiveBefore);
+        return _tree->art()->countRange(StringData(start.getBuffer(), start.getSize()),
+                                        StringData(end.getBuffer(), end.getSize()));
+    }
+    IndexKeyEntry start(startKey, startInclusive ? RecordId::min() : RecordId::max());
+    IndexKeyEntry end(endKey, endInclusive ? RecordId::max() : RecordId::min());
+    return _tree->countRange(&start, &end, _desc.keyPattern());
+}
+
 class PmseSortedDataBuilderInterface : public SortedDataBuilderInterface {
     MONGO_DISALLOW_COPYING(PmseSortedDataBuilderInterface);
  public:
@@ -34,6 +34,7 @@
 #define SRC_PMSE_SORTED_DATA_INTERFACE_H_
 
 #include "pmse_tree.h"
+#include "pmse_write_set.h"
 
 #include <libpmemobj.h>
 #include <libpmemobj++/persistent_ptr.hpp>
@@ -46,14 +47,19 @@
 #include "mongo/db/storage/sorted_data_interface.h"
 #include "mongo/db/index/index_descriptor.h"
 #include "mongo/bson/bsonobj_comparator.h"
+#include "mongo/stdx/mutex.h"
 
 namespace mongo {
 
+class PmseCatalog;
+
 class PmseSortedDataInterface : public SortedDataInterface {
  public:
     PmseSortedDataInterface(StringData ident, const IndexDescriptor* desc,
                             StringData dbpath, std::map<std::string,
-                            pool_base> *pool_handler);
+                            pool_base> *pool_handler,
+                            PmseCatalog* catalog = nullptr,
+                            bool deferredWrites = false);
 
     virtual SortedDataBuilderInterface* getBulkBuilder(OperationContext* txn,
                                                        bool dupsAllowed);
@@ -80,8 +86,7 @@ class PmseSortedDataInterface : public SortedDataInterface {
     }
 
     virtual long long getSpaceUsedBytes(OperationContext* txn) const {
-        // TODO(kfilipek): Implement getSpaceUsedBytes
-        return 0;
+        return _tree->spaceUsed();
     }
 
     virtual bool isEmpty(OperationContext* txn) {
@@ -95,12 +100,45 @@ class PmseSortedDataInterface : public SortedDataInterface {
     std::unique_ptr<SortedDataInterface::Cursor> newCursor(
                     OperationContext* txn, bool isForward) const;
 
+    /*
+     * Number of entries with keys between startKey and endKey, counted by
+     * walking leaves without returning entries. Keys have no field names.
+     */
+    long long countRange(OperationContext* txn, const BSONObj& startKey, bool startInclusive,
+                         const BSONObj& endKey, bool endInclusive) const;
+
+    /*
+     * Index writes buffered by unit of txn, nullptr when there are none
+     */
+    const PmseIndexWriteSet* bufferedWrites(OperationContext* txn) const;
+
+    void checkWriteSet(const PmseIndexWriteSet& writeSet) const;
+
+    void applyWriteSet(const PmseIndexWriteSet& writeSet);
+
+    void revertWriteSet(const PmseIndexWriteSet& writeSet);
+
+    PMEMobjpool* writeSetPool() {
+        return _pm_pool.get_handle();
+    }
+
+    stdx::mutex* writeOwner() {
+        return &_writeOwner;
+    }
+
  private:
+    PmseIndexWriteSet* writeSet(OperationContext* txn);
+    Status checkDuplicate(OperationContext* txn, const PmseIndexWriteSet& writeSet,
+                          const BSONObj& key, const RecordId& loc) const;
+    std::unique_ptr<SortedDataInterface::Cursor> newTreeCursor(OperationContext* txn,
+                                                               bool isForward) const;
     static bool isSystemCollection(const StringData& ns);
     StringData _dbpath;
-    pool<PmseTree> _pm_pool;
+    pool_base _pm_pool;
     persistent_ptr<PmseTree> _tree;
     IndexDescriptor _desc;
+    stdx::mutex _writeOwner;
+    bool _deferredWrites;  // Writes of units are buffered like records of collection
 };
 }  // namespace mongo
 #endif  // SRC_PMSE_SORTED_DATA_INTERFACE_H_
@@ -30,8 +30,12 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <atomic>
+#include <cmath>
+#include <limits>
 #include <memory>
 #include <string>
+#include <vector>
 
 #include "mongo/platform/basic.h"
 #include "mongo/base/init.h"
@@ -48,9 +52,13 @@
 #include "mongo/db/storage/record_store_test_harness.h"
 #include "mongo/db/concurrency/write_conflict_exception.h"
 #include "mongo/stdx/memory.h"
+#include "mongo/stdx/thread.h"
 #include "mongo/unittest/temp_dir.h"
 #include "mongo/unittest/unittest.h"
+#include "mongo/util/log.h"
 
+#include "mongo/db/modules/pmse/src/pmse_epoch.h"
+#include "mongo/db/modules/pmse/src/pmse_key_compare.h"
 #include "mongo/db/modules/pmse/src/pmse_record_store.h"
 #include "mongo/db/modules/pmse/src/pmse_recovery_unit.h"
 #include "mongo/db/modules/pmse/src/pmse_sorted_data_interface.h"
@@ -74,28 +82,51 @@ class PmseSortedDataInterfaceHarnessHelper final
 
     std::unique_ptr<SortedDataInterface> newSortedDataInterface(
         bool unique) final {
+        return newIndex(unique, BSONObj());
+    }
+
+    /*
+     * Index stored in adaptive radix tree
+     */
+    std::unique_ptr<SortedDataInterface> newArtSortedDataInterface(bool unique) {
+        return newIndex(unique, BSON("pmse" << BSON("indexType" << "art")));
+    }
+
+    /*
+     * Index whose writes are buffered by units until commit
+     */
+    std::unique_ptr<SortedDataInterface> newDeferredSortedDataInterface(bool unique) {
+        return newIndex(unique, BSONObj(), true);
+    }
+
+    std::unique_ptr<RecoveryUnit> newRecoveryUnit() final {
+        return stdx::make_unique<PmseRecoveryUnit>();
+    }
+
+ private:
+    std::unique_ptr<SortedDataInterface> newIndex(bool unique, const BSONObj& storageEngine,
+                                                  bool deferredWrites = false) {
         std::string ns = "test.pmse";
         OperationContextNoop opCtx(newRecoveryUnit().release());
         BSONObj spec;
 
         spec = BSON("key" << BSON("a" << 1) << "name"
                           << "testIndex"
-                          << "ns" << ns << "unique" << unique);
+                          << "ns" << ns << "unique" << unique
+                          << "storageEngine" << storageEngine);
 
         IndexDescriptor desc(NULL, "", spec);
 
         std::map<std::string, pool_base> pool_handler;
 
+        // Each index gets own pool, tests may use several at once
         return stdx::make_unique<PmseSortedDataInterface>(
-            "pool_test", &desc, _dbpath.path() + "/", &pool_handler);
-    }
-
-    std::unique_ptr<RecoveryUnit> newRecoveryUnit() final {
-        return stdx::make_unique<PmseRecoveryUnit>();
+            "pool_test" + std::to_string(_indexes++), &desc, _dbpath.path() + "/", &pool_handler,
+            deferredWrites);
     }
 
- private:
     unittest::TempDir _dbpath;
+    int _indexes = 0;
 };
 
 std::unique_ptr<HarnessHelper> makeHarnessHelper() {
@@ -106,4 +137,689 @@ MONGO_INITIALIZER(RegisterHarnessFactory)(InitializerContext* const) {
     mongo::registerHarnessHelperFactory(makeHarnessHelper);
     return Status::OK();
 }
+
+/*
+ * Range scan advances within leaves without descending from root and locates
+ * position again when its leaf changes
+ */
+TEST(PmseSortedDataInterfaceTest, RangeScanStaysPositioned) {
+    const auto harnessHelper(newSortedDataInterfaceHarnessHelper());
+    const std::unique_ptr<SortedDataInterface> sorted(harnessHelper->newSortedDataInterface(false));
+    const ServiceContext::UniqueOperationContext opCtx(harnessHelper->newOperationContext());
+    const int kKeys = 20000;
+    {
+        WriteUnitOfWork uow(opCtx.get());
+        for (int i = 0; i < kKeys; i++)
+            ASSERT_OK(sorted->insert(opCtx.get(), BSON("" << i), RecordId(i + 1), false));
+        uow.commit();
+    }
+
+    {
+        auto cursor = sorted->newCursor(opCtx.get());
+        int count = 0;
+        for (auto entry = cursor->seek(BSON("" << 0), true); entry; entry = cursor->next()) {
+            ASSERT_EQUALS(RecordId(count + 1), entry->loc);
+            count++;
+        }
+        ASSERT_EQUALS(kKeys, count);
+    }
+
+    // Entry following position is removed between calls
+    auto cursor = sorted->newCursor(opCtx.get());
+    auto entry = cursor->seek(BSON("" << 100), true);
+    ASSERT(entry);
+    ASSERT_EQUALS(RecordId(101), entry->loc);
+    {
+        WriteUnitOfWork uow(opCtx.get());
+        sorted->unindex(opCtx.get(), BSON("" << 101), RecordId(102), false);
+        uow.commit();
+    }
+    entry = cursor->next();
+    ASSERT(entry);
+    ASSERT_EQUALS(RecordId(103), entry->loc);
+    entry = cursor->next();
+    ASSERT(entry);
+    ASSERT_EQUALS(RecordId(104), entry->loc);
+}
+
+/*
+ * Entries are served from copied leaf, end position cuts the copy
+ */
+TEST(PmseSortedDataInterfaceTest, LeafBatchHonorsEndPosition) {
+    const auto harnessHelper(newSortedDataInterfaceHarnessHelper());
+    const std::unique_ptr<SortedDataInterface> sorted(harnessHelper->newSortedDataInterface(false));
+    const ServiceContext::UniqueOperationContext opCtx(harnessHelper->newOperationContext());
+    {
+        WriteUnitOfWork uow(opCtx.get());
+        for (int i = 0; i < 100; i++)
+            ASSERT_OK(sorted->insert(opCtx.get(), BSON("" << i), RecordId(i + 1), false));
+        uow.commit();
+    }
+
+    for (bool forward : {true, false}) {
+        auto cursor = sorted->newCursor(opCtx.get(), forward);
+        const int step = forward ? 1 : -1;
+        cursor->setEndPosition(BSON("" << (forward ? 60 : 40)), true);
+        auto entry = cursor->seek(BSON("" << 50), true);
+        for (int i = 50; i != (forward ? 56 : 44); i += step) {
+            ASSERT(entry);
+            ASSERT_BSONOBJ_EQ(BSON("" << i), entry->key);
+            entry = cursor->next();
+        }
+        // Moving end position before buffered entries stops cursor at once
+        cursor->setEndPosition(BSON("" << (forward ? 56 : 44)), false);
+        ASSERT_FALSE(cursor->next());
+    }
+}
+
+/*
+ * Restore keeps position when its leaf is unchanged and locates it again
+ * when the leaf was modified during yield
+ */
+TEST(PmseSortedDataInterfaceTest, SaveRestoreChecksLeafVersion) {
+    const auto harnessHelper(newSortedDataInterfaceHarnessHelper());
+    const std::unique_ptr<SortedDataInterface> sorted(harnessHelper->newSortedDataInterface(false));
+    const ServiceContext::UniqueOperationContext opCtx(harnessHelper->newOperationContext());
+    {
+        WriteUnitOfWork uow(opCtx.get());
+        for (int i = 0; i < 100; i++)
+            ASSERT_OK(sorted->insert(opCtx.get(), BSON("" << i), RecordId(i + 1), false));
+        uow.commit();
+    }
+
+    auto cursor = sorted->newCursor(opCtx.get());
+    cursor->setEndPosition(BSON("" << 20), true);
+    auto entry = cursor->seek(BSON("" << 10), true);
+    ASSERT(entry);
+    ASSERT_EQUALS(RecordId(11), entry->loc);
+
+    // Modified leaf far from cursor
+    cursor->save();
+    {
+        WriteUnitOfWork uow(opCtx.get());
+        sorted->unindex(opCtx.get(), BSON("" << 90), RecordId(91), false);
+        uow.commit();
+    }
+    cursor->restore();
+    entry = cursor->next();
+    ASSERT(entry);
+    ASSERT_EQUALS(RecordId(12), entry->loc);
+
+    // Modified leaf of cursor
+    cursor->save();
+    {
+        WriteUnitOfWork uow(opCtx.get());
+        sorted->unindex(opCtx.get(), BSON("" << 12), RecordId(13), false);
+        uow.commit();
+    }
+    cursor->restore();
+    entry = cursor->next();
+    ASSERT(entry);
+    ASSERT_EQUALS(RecordId(14), entry->loc);
+
+    int last = 0;
+    while (entry) {
+        last = entry->key.firstElement().numberInt();
+        entry = cursor->next();
+    }
+    ASSERT_EQUALS(20, last);
+}
+
+/*
+ * Saved cursors give their epoch slots back, more of them than there are
+ * slots can wait for restore
+ */
+TEST(PmseSortedDataInterfaceTest, SavedCursorsReleaseEpoch) {
+    const auto harnessHelper(newSortedDataInterfaceHarnessHelper());
+    const std::unique_ptr<SortedDataInterface> sorted(harnessHelper->newSortedDataInterface(false));
+    const ServiceContext::UniqueOperationContext opCtx(harnessHelper->newOperationContext());
+    {
+        WriteUnitOfWork uow(opCtx.get());
+        for (int i = 0; i < 10; i++)
+            ASSERT_OK(sorted->insert(opCtx.get(), BSON("" << i), RecordId(i + 1), false));
+        uow.commit();
+    }
+
+    std::vector<std::unique_ptr<SortedDataInterface::Cursor>> cursors;
+    for (int i = 0; i <= EPOCH_SLOTS; i++) {
+        cursors.push_back(sorted->newCursor(opCtx.get()));
+        ASSERT(cursors.back()->seek(BSON("" << 0), true));
+        cursors.back()->save();
+    }
+    for (auto& cursor : cursors) {
+        cursor->restore();
+        auto entry = cursor->next();
+        ASSERT(entry);
+        ASSERT_EQUALS(RecordId(2), entry->loc);
+        cursor->save();
+    }
+}
+
+TEST(PmseSortedDataInterfaceTest, CountRangeAndRequestedInfo) {
+    const auto harnessHelper(newSortedDataInterfaceHarnessHelper());
+    const std::unique_ptr<SortedDataInterface> sorted(harnessHelper->newSortedDataInterface(false));
+    const ServiceContext::UniqueOperationContext opCtx(harnessHelper->newOperationContext());
+    auto pmseSorted = checked_cast<PmseSortedDataInterface*>(sorted.get());
+    const int kKeys = 20000;
+    {
+        WriteUnitOfWork uow(opCtx.get());
+        for (int i = 0; i < kKeys; i++) {
+            // Two entries per key
+            ASSERT_OK(sorted->insert(opCtx.get(), BSON("" << i / 2), RecordId(i + 1), true));
+        }
+        uow.commit();
+    }
+
+    ASSERT_EQUALS(kKeys, pmseSorted->countRange(opCtx.get(), BSON("" << 0), true,
+                                                BSON("" << kKeys), true));
+    ASSERT_EQUALS(10, pmseSorted->countRange(opCtx.get(), BSON("" << 100), true,
+                                             BSON("" << 104), true));
+    ASSERT_EQUALS(6, pmseSorted->countRange(opCtx.get(), BSON("" << 100), false,
+                                            BSON("" << 104), false));
+    ASSERT_EQUALS(0, pmseSorted->countRange(opCtx.get(), BSON("" << kKeys), true,
+                                            BSON("" << kKeys + 10), true));
+
+    // Key is not built when only location is requested
+    auto cursor = sorted->newCursor(opCtx.get());
+    auto entry = cursor->seek(BSON("" << 100), true, SortedDataInterface::Cursor::kWantLoc);
+    ASSERT(entry);
+    ASSERT(entry->key.isEmpty());
+    ASSERT_EQUALS(RecordId(201), entry->loc);
+    entry = cursor->next(SortedDataInterface::Cursor::kWantLoc);
+    ASSERT(entry);
+    ASSERT(entry->key.isEmpty());
+    ASSERT_EQUALS(RecordId(202), entry->loc);
+    entry = cursor->next();
+    ASSERT(entry);
+    ASSERT_BSONOBJ_EQ(BSON("" << 101), entry->key);
+    entry = cursor->seekExact(BSON("" << 7), SortedDataInterface::Cursor::kWantLoc);
+    ASSERT(entry);
+    ASSERT(entry->key.isEmpty());
+    ASSERT_EQUALS(RecordId(15), entry->loc);
+
+    // Validation counts entries by walking leaves too
+    long long numKeys = 0;
+    sorted->fullValidate(opCtx.get(), &numKeys, nullptr);
+    ASSERT_EQUALS(kKeys, numKeys);
+
+    // Batch copied without keys gives keys to caller asking for them later
+    cursor = sorted->newCursor(opCtx.get());
+    entry = cursor->seek(BSON("" << 200), true, SortedDataInterface::Cursor::kWantLoc);
+    ASSERT_EQUALS(RecordId(401), entry->loc);
+    entry = cursor->next(SortedDataInterface::Cursor::kWantLoc);
+    ASSERT_EQUALS(RecordId(402), entry->loc);
+    entry = cursor->next(SortedDataInterface::Cursor::kWantLoc);
+    ASSERT_EQUALS(RecordId(403), entry->loc);
+    entry = cursor->next();
+    ASSERT_BSONOBJ_EQ(BSON("" << 201), entry->key);
+    ASSERT_EQUALS(RecordId(404), entry->loc);
+
+    // Also when its leaf changed while cursor was saved
+    cursor = sorted->newCursor(opCtx.get());
+    entry = cursor->seek(BSON("" << 300), true, SortedDataInterface::Cursor::kWantLoc);
+    ASSERT_EQUALS(RecordId(601), entry->loc);
+    entry = cursor->next(SortedDataInterface::Cursor::kWantLoc);
+    ASSERT_EQUALS(RecordId(602), entry->loc);
+    entry = cursor->next(SortedDataInterface::Cursor::kWantLoc);
+    ASSERT_EQUALS(RecordId(603), entry->loc);
+    cursor->save();
+    {
+        WriteUnitOfWork uow(opCtx.get());
+        ASSERT_OK(sorted->insert(opCtx.get(), BSON("" << 301), RecordId(kKeys + 1), true));
+        sorted->unindex(opCtx.get(), BSON("" << 302), RecordId(605), true);
+        uow.commit();
+    }
+    cursor->restore();
+    entry = cursor->next();
+    ASSERT_BSONOBJ_EQ(BSON("" << 301), entry->key);
+    ASSERT_EQUALS(RecordId(604), entry->loc);
+    entry = cursor->next();
+    ASSERT_BSONOBJ_EQ(BSON("" << 301), entry->key);
+    ASSERT_EQUALS(RecordId(kKeys + 1), entry->loc);
+    entry = cursor->next();
+    ASSERT_BSONOBJ_EQ(BSON("" << 302), entry->key);
+    ASSERT_EQUALS(RecordId(606), entry->loc);
+}
+
+TEST(PmseSortedDataInterfaceTest, AppendsAtRightEdge) {
+    const auto harnessHelper(newSortedDataInterfaceHarnessHelper());
+    const std::unique_ptr<SortedDataInterface> sorted(harnessHelper->newSortedDataInterface(true));
+    const ServiceContext::UniqueOperationContext opCtx(harnessHelper->newOperationContext());
+    const int kKeys = 20000;
+    {
+        WriteUnitOfWork uow(opCtx.get());
+        for (int i = 0; i < kKeys; i++) {
+            // Every other key, gaps are filled below
+            ASSERT_OK(sorted->insert(opCtx.get(), BSON("" << 2 * i), RecordId(2 * i + 1), false));
+        }
+        uow.commit();
+    }
+
+    {
+        WriteUnitOfWork uow(opCtx.get());
+        // Duplicate of last key is rejected by append path too
+        ASSERT_EQUALS(ErrorCodes::DuplicateKey,
+                      sorted->insert(opCtx.get(), BSON("" << 2 * (kKeys - 1)),
+                                     RecordId(2 * kKeys + 1), false).code());
+        for (int i = 0; i < kKeys; i += 100) {
+            ASSERT_OK(sorted->insert(opCtx.get(), BSON("" << 2 * i + 1), RecordId(2 * i + 2), false));
+        }
+        uow.commit();
+    }
+
+    ASSERT_EQUALS(kKeys + kKeys / 100, sorted->numEntries(opCtx.get()));
+    auto cursor = sorted->newCursor(opCtx.get());
+    int previous = -1;
+    int count = 0;
+    for (auto entry = cursor->seek(BSONObj(), true); entry; entry = cursor->next()) {
+        int key = entry->key.firstElement().numberInt();
+        ASSERT_GREATER_THAN(key, previous);
+        ASSERT_EQUALS(RecordId(key + 1), entry->loc);
+        previous = key;
+        count++;
+    }
+    ASSERT_EQUALS(kKeys + kKeys / 100, count);
+}
+
+TEST(PmseSortedDataInterfaceTest, CompoundKeySeparatorsTruncated) {
+    const auto harnessHelper(newSortedDataInterfaceHarnessHelper());
+    const ServiceContext::UniqueOperationContext opCtx(harnessHelper->newOperationContext());
+    const int kKeys = 20000;
+    const std::string tenant(64, 't');
+    const std::string payload(64, 'p');
+    long long sizes[2];
+    for (int truncate = 0; truncate < 2; truncate++) {
+        PmseTree::setSuffixTruncation(truncate == 1);
+        const std::unique_ptr<SortedDataInterface> sorted(
+            harnessHelper->newSortedDataInterface(false));
+        {
+            WriteUnitOfWork uow(opCtx.get());
+            for (int i = 0; i < kKeys; i++) {
+                // {tenant, ts, payload}, long prefix shared by all keys
+                ASSERT_OK(sorted->insert(opCtx.get(),
+                                         BSON("" << tenant << "" << i % 1000 << "" << payload),
+                                         RecordId(i + 1), true));
+            }
+            uow.commit();
+        }
+        sizes[truncate] = sorted->getSpaceUsedBytes(opCtx.get());
+        ASSERT_GREATER_THAN(sizes[truncate], 0);
+
+        // Every entry is reachable by seek through truncated separators
+        auto cursor = sorted->newCursor(opCtx.get());
+        for (int i = 0; i < kKeys; i += 97) {
+            auto entry = cursor->seek(BSON("" << tenant << "" << i % 1000 << "" << payload), true);
+            ASSERT(entry);
+            BSONObjIterator it(entry->key);
+            it.next();
+            ASSERT_EQUALS(i % 1000, it.next().numberInt());
+        }
+        ASSERT_EQUALS(kKeys, sorted->numEntries(opCtx.get()));
+    }
+    PmseTree::setSuffixTruncation(true);
+    log() << "compound index size: " << sizes[0] << " bytes full separators, "
+          << sizes[1] << " bytes truncated separators";
+    ASSERT_LESS_THAN(sizes[1], sizes[0]);
+}
+
+TEST(PmseSortedDataInterfaceTest, DuplicateKeysShareStorage) {
+    const auto harnessHelper(newSortedDataInterfaceHarnessHelper());
+    const ServiceContext::UniqueOperationContext opCtx(harnessHelper->newOperationContext());
+    const int kEntries = 20000;
+    const int kValues = 5;
+    const std::unique_ptr<SortedDataInterface> duplicates(
+        harnessHelper->newSortedDataInterface(false));
+    const std::unique_ptr<SortedDataInterface> distinct(
+        harnessHelper->newSortedDataInterface(false));
+    auto statusKey = [](int value) {
+        // Same size for all values
+        return BSON("" << std::string(60, 's') + std::to_string(10000 + value));
+    };
+    {
+        WriteUnitOfWork uow(opCtx.get());
+        for (int i = 0; i < kEntries; i++) {
+            ASSERT_OK(duplicates->insert(opCtx.get(), statusKey(i % kValues), RecordId(i + 1), true));
+            ASSERT_OK(distinct->insert(opCtx.get(), statusKey(i % 10000), RecordId(i + 1), true));
+        }
+        uow.commit();
+    }
+    long long sharedSize = duplicates->getSpaceUsedBytes(opCtx.get());
+    long long distinctSize = distinct->getSpaceUsedBytes(opCtx.get());
+    log() << "index of " << kValues << " keys: " << sharedSize << " bytes, of "
+          << 10000 << " keys: " << distinctSize << " bytes";
+    ASSERT_LESS_THAN(sharedSize, distinctSize);
+
+    // Remove every other entry of first value, shared key stays for the rest
+    {
+        WriteUnitOfWork uow(opCtx.get());
+        for (int i = 0; i < kEntries; i += 2 * kValues) {
+            duplicates->unindex(opCtx.get(), statusKey(0), RecordId(i + 1), true);
+        }
+        uow.commit();
+    }
+    ASSERT_EQUALS(kEntries - kEntries / (2 * kValues), duplicates->numEntries(opCtx.get()));
+
+    // Scan emits every (key, loc) pair of each value in location order
+    auto cursor = duplicates->newCursor(opCtx.get());
+    for (int value = 0; value < kValues; value++) {
+        int count = 0;
+        RecordId previous;
+        for (auto entry = cursor->seek(statusKey(value), true);
+             entry && entry->key.binaryEqual(statusKey(value)); entry = cursor->next()) {
+            ASSERT_EQUALS(value, (entry->loc.repr() - 1) % kValues);
+            ASSERT_GREATER_THAN(entry->loc, previous);
+            previous = entry->loc;
+            count++;
+        }
+        ASSERT_EQUALS(value == 0 ? kEntries / kValues / 2 : kEntries / kValues, count);
+    }
+}
+
+/*
+ * Writers insert and remove entries of few duplicate keys concurrently, so
+ * splits and merges move runs of entries sharing key between leaves
+ */
+TEST(PmseSortedDataInterfaceTest, ConcurrentDuplicateKeysAcrossSplits) {
+    const auto harnessHelper(newSortedDataInterfaceHarnessHelper());
+    const std::unique_ptr<SortedDataInterface> sorted(harnessHelper->newSortedDataInterface(false));
+    const int kThreads = 4;
+    const int kOps = 5000;
+    const int kValues = 3;
+    auto key = [](int64_t loc) {
+        return BSON("" << std::string(40, 'k') + std::to_string(loc % kValues));
+    };
+    // Entry i of thread is removed again at insert i + 10, when i is even
+    auto removed = [](int64_t loc) {
+        int64_t i = (loc - 1) % kOps;
+        return i % 2 == 0 && i + 10 < kOps;
+    };
+    std::atomic<int> failures{0};
+    std::vector<stdx::thread> threads;
+    for (int t = 0; t < kThreads; t++) {
+        threads.emplace_back([&, t] {
+            OperationContextNoop opCtx(new PmseRecoveryUnit());
+            for (int i = 0; i < kOps; i++) {
+                int64_t loc = t * kOps + i + 1;
+                WriteUnitOfWork uow(&opCtx);
+                if (!sorted->insert(&opCtx, key(loc), RecordId(loc), true).isOK())
+                    failures.fetch_add(1);
+                if (i >= 10 && removed(loc - 10))
+                    sorted->unindex(&opCtx, key(loc - 10), RecordId(loc - 10), true);
+                uow.commit();
+            }
+        });
+    }
+    for (auto& thread : threads)
+        thread.join();
+    ASSERT_EQUALS(0, failures.load());
+
+    const ServiceContext::UniqueOperationContext opCtx(harnessHelper->newOperationContext());
+    int64_t expected = 0;
+    for (int64_t loc = 1; loc <= kThreads * kOps; loc++) {
+        if (!removed(loc))
+            expected++;
+    }
+    ASSERT_EQUALS(expected, sorted->numEntries(opCtx.get()));
+    auto cursor = sorted->newCursor(opCtx.get());
+    int64_t count = 0;
+    for (auto entry = cursor->seek(BSONObj(), true); entry; entry = cursor->next()) {
+        ASSERT_FALSE(removed(entry->loc.repr()));
+        ASSERT_BSONOBJ_EQ(key(entry->loc.repr()), entry->key);
+        count++;
+    }
+    ASSERT_EQUALS(expected, count);
+
+    // Last entries of each key free it
+    {
+        WriteUnitOfWork uow(opCtx.get());
+        for (int64_t loc = 1; loc <= kThreads * kOps; loc++) {
+            if (!removed(loc))
+                sorted->unindex(opCtx.get(), key(loc), RecordId(loc), true);
+        }
+        uow.commit();
+    }
+    ASSERT(sorted->isEmpty(opCtx.get()));
+}
+
+TEST(PmseSortedDataInterfaceTest, SingleFieldCompareMatchesGeneric) {
+    std::vector<BSONObj> keys;
+    for (int value : {-5, 0, 7, std::numeric_limits<int>::max()})
+        keys.push_back(BSON("" << value));
+    for (long long value : {-(1LL << 40), 0LL, 7LL, 1LL << 40})
+        keys.push_back(BSON("" << value));
+    for (double value : {-1.5, -0.0, 0.0, 7.0, std::numeric_limits<double>::infinity(),
+                         std::nan("")})
+        keys.push_back(BSON("" << value));
+    for (int i = 0; i < 3; i++)
+        keys.push_back(BSON("" << OID::gen()));
+    for (const std::string& value : {std::string(), std::string("a"), std::string("ab"),
+                                     std::string("b"), std::string("a\0b", 3)})
+        keys.push_back(BSON("" << value));
+    keys.push_back(BSON("" << 1 << "" << 2));
+    keys.push_back(BSON("x" << 7));
+    const std::vector<RecordId> locs = {RecordId(), RecordId(1), RecordId(2)};
+
+    int specialized = 0;
+    for (const BSONObj& ordering : {BSON("a" << 1), BSON("a" << -1)}) {
+        IndexEntryComparison generic(Ordering::make(ordering));
+        for (const BSONObj& left : keys) {
+            for (const BSONObj& right : keys) {
+                if (left.nFields() != right.nFields())
+                    continue;
+                for (const RecordId& leftLoc : locs) {
+                    for (const RecordId& rightLoc : locs) {
+                        int result;
+                        if (!PmseKeyCompare::singleField(left, right, result))
+                            continue;
+                        if (ordering.firstElement().number() < 0)
+                            result = -result;
+                        result = PmseKeyCompare::withLocations(result, leftLoc, rightLoc);
+                        int expected = generic.compare(IndexKeyEntry(left, leftLoc),
+                                                       IndexKeyEntry(right, rightLoc));
+                        ASSERT_EQUALS(expected < 0, result < 0);
+                        ASSERT_EQUALS(expected > 0, result > 0);
+                        specialized++;
+                    }
+                }
+            }
+        }
+    }
+    ASSERT_GREATER_THAN(specialized, 0);
+}
+
+std::unique_ptr<SortedDataInterface> newArtIndex(SortedDataInterfaceHarnessHelper* harnessHelper,
+                                                 bool unique) {
+    return checked_cast<PmseSortedDataInterfaceHarnessHelper*>(harnessHelper)
+        ->newArtSortedDataInterface(unique);
+}
+
+TEST(PmseSortedDataInterfaceTest, ArtIndexSeeksAndScans) {
+    const auto harnessHelper(newSortedDataInterfaceHarnessHelper());
+    const std::unique_ptr<SortedDataInterface> sorted(newArtIndex(harnessHelper.get(), false));
+    const ServiceContext::UniqueOperationContext opCtx(harnessHelper->newOperationContext());
+    ASSERT(sorted->isEmpty(opCtx.get()));
+    auto key = [](int i) {
+        return BSON("" << "/files/" + std::to_string(i % 10) + "/" + std::to_string(1000 + i));
+    };
+    const int kKeys = 1000;
+    {
+        WriteUnitOfWork uow(opCtx.get());
+        for (int i = 0; i < kKeys; i++) {
+            ASSERT_OK(sorted->insert(opCtx.get(), key(i), RecordId(i + 1), true));
+            // Same key again with other location
+            ASSERT_OK(sorted->insert(opCtx.get(), key(i), RecordId(kKeys + i + 1), true));
+        }
+        uow.commit();
+    }
+    ASSERT_EQUALS(2 * kKeys, sorted->numEntries(opCtx.get()));
+    ASSERT_GREATER_THAN(sorted->getSpaceUsedBytes(opCtx.get()), 0);
+
+    // Full scans in both directions return entries in order
+    for (bool forward : {true, false}) {
+        auto cursor = sorted->newCursor(opCtx.get(), forward);
+        boost::optional<IndexKeyEntry> previous;
+        int count = 0;
+        for (auto entry = cursor->seek(BSONObj(), true); entry; entry = cursor->next()) {
+            if (previous) {
+                int cmp = previous->key.woCompare(entry->key);
+                if (cmp == 0)
+                    cmp = previous->loc < entry->loc ? -1 : 1;
+                ASSERT_EQUALS(forward, cmp < 0);
+            }
+            previous = entry;
+            count++;
+        }
+        ASSERT_EQUALS(2 * kKeys, count);
+    }
+
+    auto cursor = sorted->newCursor(opCtx.get());
+    auto entry = cursor->seekExact(key(37), SortedDataInterface::Cursor::kWantLoc);
+    ASSERT(entry);
+    ASSERT(entry->key.isEmpty());
+    ASSERT_EQUALS(RecordId(38), entry->loc);
+    entry = cursor->next();
+    ASSERT(entry);
+    ASSERT_BSONOBJ_EQ(key(37), entry->key);
+    ASSERT_EQUALS(RecordId(kKeys + 38), entry->loc);
+    ASSERT_FALSE(cursor->seekExact(BSON("" << "/files/3/"), SortedDataInterface::Cursor::kWantLoc));
+
+    // Exclusive seek and end position inside one directory
+    cursor->setEndPosition(key(57), true);
+    entry = cursor->seek(key(7), false);
+    int count = 0;
+    for (; entry; entry = cursor->next())
+        count++;
+    ASSERT_EQUALS(10, count);
+    auto reverse = sorted->newCursor(opCtx.get(), false);
+    reverse->setEndPosition(key(7), false);
+    count = 0;
+    for (entry = reverse->seek(key(57), true); entry; entry = reverse->next())
+        count++;
+    ASSERT_EQUALS(10, count);
+    ASSERT_EQUALS(10, checked_cast<PmseSortedDataInterface*>(sorted.get())
+                          ->countRange(opCtx.get(), key(7), false, key(57), true));
+
+    // Removed entries are skipped by cursor positioned before them
+    entry = cursor->seek(key(100), true);
+    ASSERT(entry);
+    {
+        WriteUnitOfWork uow(opCtx.get());
+        sorted->unindex(opCtx.get(), key(100), RecordId(kKeys + 101), true);
+        sorted->unindex(opCtx.get(), key(110), RecordId(111), true);
+        uow.commit();
+    }
+    cursor->setEndPosition(BSONObj(), true);
+    entry = cursor->next();
+    ASSERT(entry);
+    ASSERT_BSONOBJ_EQ(key(110), entry->key);
+    ASSERT_EQUALS(RecordId(kKeys + 111), entry->loc);
+    ASSERT_EQUALS(2 * kKeys - 2, sorted->numEntries(opCtx.get()));
+
+    // Entry inserted after position while cursor was saved is returned next
+    cursor->save();
+    {
+        WriteUnitOfWork uow(opCtx.get());
+        ASSERT_OK(sorted->insert(opCtx.get(), key(110), RecordId(3 * kKeys), true));
+        uow.commit();
+    }
+    cursor->restore();
+    entry = cursor->next();
+    ASSERT(entry);
+    ASSERT_BSONOBJ_EQ(key(110), entry->key);
+    ASSERT_EQUALS(RecordId(3 * kKeys), entry->loc);
+    entry = cursor->next();
+    ASSERT(entry);
+    ASSERT_BSONOBJ_EQ(key(120), entry->key);
+    ASSERT_EQUALS(RecordId(121), entry->loc);
+
+    {
+        WriteUnitOfWork uow(opCtx.get());
+        sorted->unindex(opCtx.get(), key(110), RecordId(3 * kKeys), true);
+        for (int i = 0; i < kKeys; i++) {
+            sorted->unindex(opCtx.get(), key(i), RecordId(i + 1), true);
+            sorted->unindex(opCtx.get(), key(i), RecordId(kKeys + i + 1), true);
+        }
+        uow.commit();
+    }
+    ASSERT(sorted->isEmpty(opCtx.get()));
+    ASSERT_FALSE(sorted->newCursor(opCtx.get())->seek(BSONObj(), true));
+
+    // Unique index rejects same key with other location
+    const std::unique_ptr<SortedDataInterface> unique(newArtIndex(harnessHelper.get(), true));
+    {
+        WriteUnitOfWork uow(opCtx.get());
+        ASSERT_OK(unique->insert(opCtx.get(), key(1), RecordId(1), false));
+        ASSERT_OK(unique->insert(opCtx.get(), key(11), RecordId(2), false));
+        ASSERT_OK(unique->insert(opCtx.get(), key(1), RecordId(1), false));
+        ASSERT_EQUALS(ErrorCodes::DuplicateKey,
+                      unique->insert(opCtx.get(), key(1), RecordId(3), false));
+        uow.commit();
+    }
+    ASSERT_EQUALS(2, unique->numEntries(opCtx.get()));
+}
+
+/*
+ * Long keys sharing most of their bytes are found by both radix tree and
+ * B+ tree indexes
+ */
+TEST(PmseSortedDataInterfaceTest, ArtIndexLongStringKeys) {
+    const auto harnessHelper(newSortedDataInterfaceHarnessHelper());
+    const ServiceContext::UniqueOperationContext opCtx(harnessHelper->newOperationContext());
+    const int kKeys = 20000;
+    auto url = [](int i) {
+        return BSON("" << "https://www.example.com/catalog/products/category-" +
+                              std::to_string(i % 50) + "/item-" + std::to_string(i * 7919 % kKeys));
+    };
+    for (bool art : {true, false}) {
+        const std::unique_ptr<SortedDataInterface> sorted(
+            art ? newArtIndex(harnessHelper.get(), true)
+                : harnessHelper->newSortedDataInterface(true));
+        {
+            WriteUnitOfWork uow(opCtx.get());
+            for (int i = 0; i < kKeys; i++)
+                ASSERT_OK(sorted->insert(opCtx.get(), url(i), RecordId(i + 1), false));
+            uow.commit();
+        }
+        auto cursor = sorted->newCursor(opCtx.get());
+        for (int i = 0; i < kKeys; i++) {
+            auto entry = cursor->seekExact(url(i), SortedDataInterface::Cursor::kWantLoc);
+            ASSERT(entry);
+            ASSERT_EQUALS(RecordId(i + 1), entry->loc);
+        }
+        ASSERT_EQUALS(kKeys, sorted->numEntries(opCtx.get()));
+    }
+}
+
+/*
+ * Unique key committed by other unit after insert checked it fails commit
+ * with write conflict before any index of unit is written
+ */
+TEST(PmseSortedDataInterfaceTest, DeferredUniqueKeyCheckedAtCommit) {
+    const auto harnessHelper(newSortedDataInterfaceHarnessHelper());
+    auto helper = checked_cast<PmseSortedDataInterfaceHarnessHelper*>(harnessHelper.get());
+    const std::unique_ptr<SortedDataInterface> unique(helper->newDeferredSortedDataInterface(true));
+    const std::unique_ptr<SortedDataInterface> other(helper->newDeferredSortedDataInterface(false));
+    const ServiceContext::UniqueOperationContext first(harnessHelper->newOperationContext());
+    const ServiceContext::UniqueOperationContext second(harnessHelper->newOperationContext());
+    const BSONObj key = BSON("" << 1);
+
+    {
+        WriteUnitOfWork uow(first.get());
+        ASSERT_OK(other->insert(first.get(), key, RecordId(1), true));
+        ASSERT_OK(unique->insert(first.get(), key, RecordId(1), false));
+        {
+            WriteUnitOfWork concurrent(second.get());
+            ASSERT_OK(unique->insert(second.get(), key, RecordId(2), false));
+            concurrent.commit();
+        }
+        ASSERT_THROWS(uow.commit(), WriteConflictException);
+    }
+    ASSERT(other->isEmpty(first.get()));
+    ASSERT_EQUALS(1, unique->numEntries(first.get()));
+    {
+        WriteUnitOfWork uow(first.get());
+        ASSERT_EQUALS(ErrorCodes::DuplicateKey,
+                      unique->insert(first.get(), key, RecordId(1), false));
+    }
+}
 }  // namespace mongo
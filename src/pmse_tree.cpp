@@ -35,6 +35,8 @@
 #include "pmse_tree.h"
 #include "pmse_sorted_data_interface.h"
 #include "pmse_change.h"
+#include "pmse_epoch.h"
+#include "pmse_key_compare.h"
 
 #include <list>
 #include <utility>
@@ -49,12 +51,20 @@
 
 namespace mongo {
 
+std::atomic<bool> PmseTree::_suffixTruncation{true};
 
-int64_t IndexKeyEntry_PM::compareEntries(IndexKeyEntry& leftEntry,
+int64_t IndexKeyEntry_PM::compareEntries(const IndexKeyEntry& leftEntry,
                                          IndexKeyEntry_PM& rightEntry,
                                          const BSONObj& ordering) {
+    BSONObj rightKey = rightEntry.getBSON();
+    int result;
+    if (PmseKeyCompare::singleField(leftEntry.key, rightKey, result)) {
+        if (ordering.firstElement().number() < 0)
+            result = -result;
+        return PmseKeyCompare::withLocations(result, leftEntry.loc, RecordId(rightEntry.loc));
+    }
     IndexEntryComparison c(Ordering::make(ordering));
-    return c.compare(leftEntry, IndexKeyEntry(rightEntry.getBSON(), RecordId(rightEntry.loc)));
+    return c.compare(leftEntry, IndexKeyEntry(rightKey, RecordId(rightEntry.loc)));
 }
 
 BSONObj IndexKeyEntry_PM::getBSON() {
@@ -64,6 +74,8 @@ BSONObj IndexKeyEntry_PM::getBSON() {
 
 bool PmseTree::remove(pool_base pop, IndexKeyEntry& entry,
                       bool dupsAllowed, const BSONObj& ordering) {
+    if (_art)
+        return _art->remove(entry.key, entry.loc, ordering);
     persistent_ptr<PmseTreeNode> node;
     uint64_t i;
     int64_t cmp;
@@ -257,6 +269,14 @@ persistent_ptr<PmseTreeNode> PmseTree::redistributeNodes(
      */
     n->num_keys++;
     neighbor->num_keys--;
+    if (n->is_leaf) {
+        if (neighbor_index != -1)
+            unshareKeys(neighbor, n);
+        else
+            unshareKeys(n, neighbor);
+    }
+    touch(n);
+    touch(neighbor);
     return root;
 }
 
@@ -336,6 +356,9 @@ persistent_ptr<PmseTreeNode> PmseTree::coalesceNodes(
             n->next->previous = neighbor;
         }
         neighbor->next = n->next;
+        if (n == _last)
+            _last = neighbor;
+        touch(neighbor);
     }
 
     if (neighbor_index == -1) {
@@ -349,8 +372,7 @@ persistent_ptr<PmseTreeNode> PmseTree::coalesceNodes(
        i = neighbor_index;
     }
     root = deleteEntry(pop, k_prime_temp, n->parent, i);
-    delete_persistent<IndexKeyEntry_PM[TREE_ORDER]>(n->keys);
-    delete_persistent<PmseTreeNode>(n);
+    retireNode(n);
     return root;
 }
 
@@ -403,10 +425,11 @@ persistent_ptr<PmseTreeNode> PmseTree::adjustRoot(
         // If it is a leaf (has no children),
         // then the whole tree is empty.
         new_root = nullptr;
+        _first = nullptr;
+        _last = nullptr;
     }
 
-    delete_persistent<IndexKeyEntry_PM[TREE_ORDER]>(root->keys);
-    delete_persistent<PmseTreeNode>(root);
+    retireNode(root);
     return new_root;
 }
 
@@ -418,7 +441,7 @@ persistent_ptr<PmseTreeNode> PmseTree::removeEntryFromNode(
     // Remove the key and shift other keys accordingly.
     IndexKeyEntry_PM entryPM;
     entryPM = (node->keys[i]);
-    pmemobj_tx_free(entryPM.data.raw());
+    releaseKey(entryPM.data);
 
     for (++i; i < node->num_keys; i++) {
         node->keys[i - 1] = node->keys[i];
@@ -437,6 +460,7 @@ persistent_ptr<PmseTreeNode> PmseTree::removeEntryFromNode(
             node->children_array[i] = nullptr;
     }
     node->num_keys--;
+    touch(node);
 
     return node;
 }
@@ -452,6 +476,7 @@ persistent_ptr<PmseTreeNode> PmseTree::makeTreeRoot(IndexKeyEntry& entry) {
     n->next = nullptr;
     n->previous = nullptr;
     n->parent = nullptr;
+    touch(n);
     return n;
 }
 
@@ -581,10 +606,13 @@ Status PmseTree::insertKeyIntoLeaf(persistent_ptr<PmseTreeNode> node,
         node->keys[i] = node->keys[i - 1];
     }
 
-    node->keys[insertion_point].data = pmemobj_tx_alloc(entry.key.objsize(), 1);
-    memcpy(static_cast<void*>((node->keys[insertion_point]).data.get()), entry.key.objdata(), entry.key.objsize());
+    node->keys[insertion_point].data = allocateLeafKey(
+                    entry.key,
+                    insertion_point > 0 ? &node->keys[insertion_point - 1] : nullptr,
+                    insertion_point < node->num_keys ? &node->keys[insertion_point + 1] : nullptr);
     node->keys[insertion_point].loc = entry.loc.repr();
     node->num_keys = node->num_keys + 1;
+    touch(node);
     return Status::OK();
 }
 
@@ -606,7 +634,6 @@ persistent_ptr<PmseTreeNode> PmseTree::splitFullNodeAndInsert(
                 IndexKeyEntry& entry, const BSONObj& _ordering,
                 std::list<pmem::obj::shared_mutex*>& locks) {
     persistent_ptr<PmseTreeNode> new_leaf;
-    IndexKeyEntry_PM new_entry;
     uint64_t insertion_index = 0;
     uint64_t i, j, split;
     persistent_ptr<PmseTreeNode> new_root;
@@ -617,7 +644,14 @@ persistent_ptr<PmseTreeNode> PmseTree::splitFullNodeAndInsert(
                     IndexKeyEntry_PM::compareEntries(entry, node->keys[insertion_index], _ordering) > 0) {
        insertion_index++;
     }
-    split = cut(TREE_ORDER);
+    /*
+     * Keys appended at right edge never go to left half again,
+     * leave it full and start new leaf with appended key only
+     */
+    if (node->next == nullptr && insertion_index == node->num_keys)
+        split = TREE_ORDER;
+    else
+        split = cut(TREE_ORDER);
 
     /*
      * Copy from existing to temp, leaving space for inserted one
@@ -631,8 +665,10 @@ persistent_ptr<PmseTreeNode> PmseTree::splitFullNodeAndInsert(
     /*
      * Fill free slot with inserted key
      */
-    temp_keys_array[insertion_index].data = pmemobj_tx_alloc(entry.key.objsize(), 1);
-    memcpy(static_cast<void*>((temp_keys_array[insertion_index]).data.get()), entry.key.objdata(), entry.key.objsize());
+    temp_keys_array[insertion_index].data = allocateLeafKey(
+                    entry.key,
+                    insertion_index > 0 ? &temp_keys_array[insertion_index - 1] : nullptr,
+                    insertion_index < TREE_ORDER ? &temp_keys_array[insertion_index + 1] : nullptr);
     temp_keys_array[insertion_index].loc = entry.loc.repr();
     /*
      * Now copy from temp array to new and to old
@@ -658,13 +694,21 @@ persistent_ptr<PmseTreeNode> PmseTree::splitFullNodeAndInsert(
     }
     node->next = new_leaf;
     new_leaf->previous = node;
+    unshareKeys(node, new_leaf);
+    touch(node);
+    touch(new_leaf);
 
     /*
      * Update parents
      */
     new_leaf->parent = node->parent;
-    new_entry = new_leaf->keys[0];
-    new_root = insertIntoNodeParent(pop, _root, node, new_entry, new_leaf);
+    IndexKeyEntry separator(new_leaf->keys[0].getBSON(), RecordId(new_leaf->keys[0].loc));
+    BSONObj truncated;
+    if (_suffixTruncation.load(std::memory_order_relaxed) &&
+        shortestSeparator(node->keys[node->num_keys - 1].getBSON(), separator.key, _ordering,
+                          truncated))
+        separator = IndexKeyEntry(truncated, RecordId::min());
+    new_root = insertIntoNodeParent(pop, _root, node, separator, new_leaf);
     if(new_root!=_root)
     {
         new_root->_pmutex.lock();
@@ -693,16 +737,16 @@ uint64_t PmseTree::getLeftIndex(persistent_ptr<PmseTreeNode> parent,
 persistent_ptr<PmseTreeNode> PmseTree::insertKeyIntoNode(
                 pool_base pop, persistent_ptr<PmseTreeNode> root,
                 persistent_ptr<PmseTreeNode> n, uint64_t left_index,
-                IndexKeyEntry_PM& new_key, persistent_ptr<PmseTreeNode> right) {
+                const IndexKeyEntry& new_key, persistent_ptr<PmseTreeNode> right) {
     uint64_t i;
     for (i = n->num_keys; i > left_index; i--) {
         n->children_array[i + 1] = n->children_array[i];
         n->keys[i] = n->keys[i - 1];
     }
     n->children_array[left_index + 1] = right;
-    (n->keys[left_index]).data = pmemobj_tx_alloc(new_key.getBSON().objsize(), 1);
-    memcpy(static_cast<void*>((n->keys[left_index]).data.get()), new_key.data.get(), new_key.getBSON().objsize());
-    (n->keys[left_index]).loc = new_key.loc;
+    (n->keys[left_index]).data = pmemobj_tx_alloc(new_key.key.objsize(), 1);
+    memcpy(static_cast<void*>((n->keys[left_index]).data.get()), new_key.key.objdata(), new_key.key.objsize());
+    (n->keys[left_index]).loc = new_key.loc.repr();
 
     n->num_keys = n->num_keys + 1;
     return root;
@@ -711,7 +755,7 @@ persistent_ptr<PmseTreeNode> PmseTree::insertKeyIntoNode(
 persistent_ptr<PmseTreeNode> PmseTree::insertToNodeAfterSplit(
                 pool_base pop, persistent_ptr<PmseTreeNode> root,
                 persistent_ptr<PmseTreeNode> old_node, uint64_t left_index,
-                IndexKeyEntry_PM& new_key, persistent_ptr<PmseTreeNode> right) {
+                const IndexKeyEntry& new_key, persistent_ptr<PmseTreeNode> right) {
     uint64_t i = 0, j, split;
     IndexKeyEntry_PM k_prime;
     persistent_ptr<PmseTreeNode> new_node;
@@ -734,10 +778,10 @@ persistent_ptr<PmseTreeNode> PmseTree::insertToNodeAfterSplit(
     }
 
     temp_children_array[left_index + 1] = right;
-    (temp_keys_array[left_index]).data = pmemobj_tx_alloc(new_key.getBSON().objsize(), 1);
+    (temp_keys_array[left_index]).data = pmemobj_tx_alloc(new_key.key.objsize(), 1);
     memcpy(static_cast<void*>((temp_keys_array[left_index]).data.get()),
-                               new_key.data.get(), new_key.getBSON().objsize());
-    (temp_keys_array[left_index]).loc = new_key.loc;
+                               new_key.key.objdata(), new_key.key.objsize());
+    (temp_keys_array[left_index]).loc = new_key.loc.repr();
 
     split = cut(TREE_ORDER + 1);
     old_node->num_keys = 0;
@@ -761,7 +805,9 @@ persistent_ptr<PmseTreeNode> PmseTree::insertToNodeAfterSplit(
         child = new_node->children_array[i];
         child->parent = new_node;
     }
-    new_root = insertIntoNodeParent(pop, root, old_node, k_prime, new_node);
+    new_root = insertIntoNodeParent(pop, root, old_node,
+                                    IndexKeyEntry(k_prime.getBSON(), RecordId(k_prime.loc)),
+                                    new_node);
 
     IndexKeyEntry_PM entryPM = temp_keys_array[split-1];;
     if (entryPM.data)
@@ -776,7 +822,7 @@ persistent_ptr<PmseTreeNode> PmseTree::insertToNodeAfterSplit(
  */
 persistent_ptr<PmseTreeNode> PmseTree::insertIntoNodeParent(
                 pool_base pop, persistent_ptr<PmseTreeNode> root,
-                persistent_ptr<PmseTreeNode> left, IndexKeyEntry_PM& key,
+                persistent_ptr<PmseTreeNode> left, const IndexKeyEntry& key,
                 persistent_ptr<PmseTreeNode> right) {
     persistent_ptr<PmseTreeNode> parent = left->parent;
     uint64_t left_index;
@@ -810,12 +856,12 @@ persistent_ptr<PmseTreeNode> PmseTree::insertIntoNodeParent(
  */
 persistent_ptr<PmseTreeNode> PmseTree::allocateNewRoot(
                 pool_base pop, persistent_ptr<PmseTreeNode> left,
-                IndexKeyEntry_PM& new_key, persistent_ptr<PmseTreeNode> right) {
+                const IndexKeyEntry& new_key, persistent_ptr<PmseTreeNode> right) {
     persistent_ptr<PmseTreeNode> new_root;
     new_root = make_persistent<PmseTreeNode>(false);
-    (new_root->keys[0]).data = pmemobj_tx_alloc(new_key.getBSON().objsize(), 1);
-    memcpy(static_cast<void*>((new_root->keys[0]).data.get()), new_key.data.get(), new_key.getBSON().objsize());
-    (new_root->keys[0]).loc = new_key.loc;
+    (new_root->keys[0]).data = pmemobj_tx_alloc(new_key.key.objsize(), 1);
+    memcpy(static_cast<void*>((new_root->keys[0]).data.get()), new_key.key.objdata(), new_key.key.objsize());
+    (new_root->keys[0]).loc = new_key.loc.repr();
 
     new_root->children_array[0] = left;
     new_root->children_array[1] = right;
@@ -838,6 +884,8 @@ void PmseTree::unlockTree(std::list<pmem::obj::shared_mutex*>& locks) {
 
 Status PmseTree::insert(pool_base pop, IndexKeyEntry& entry,
                         const BSONObj& ordering, bool dupsAllowed) {
+    if (_art)
+        return _art->insert(pop, entry.key, entry.loc, ordering, dupsAllowed);
     persistent_ptr<PmseTreeNode> node;
     Status status = Status::OK();
     uint64_t i;
@@ -861,6 +909,10 @@ Status PmseTree::insert(pool_base pop, IndexKeyEntry& entry,
             return status;
         }
     }
+    if (_appending.load(std::memory_order_relaxed) &&
+        appendToLast(pop, entry, ordering, dupsAllowed, status)) {
+        return status;
+    }
     node = locateLeafWithKeyPM(_root, entry, ordering, locks, lockNode, true);
     /*
      * Duplicate key check
@@ -883,6 +935,8 @@ Status PmseTree::insert(pool_base pop, IndexKeyEntry& entry,
         }
     }
 
+    _appending = isAppend(node, entry, ordering, dupsAllowed);
+
     /*
      * There is place for new value
      */
@@ -927,20 +981,378 @@ Status PmseTree::insert(pool_base pop, IndexKeyEntry& entry,
 }
 
 uint64_t PmseTree::countElements() {
-    if (!isEmpty()) {
-        auto leaf = _first;
-        uint64_t counter = 0;
-        while (leaf) {
-            counter += leaf->num_keys;
-            leaf = leaf->next;
+    if (_art)
+        return _art->countElements();
+    return countRange(nullptr, nullptr, BSONObj());
+}
+
+/*
+ * Leaves ending within range add their num_keys, only boundary leaves
+ * compare keys. Missing start or end leaves range open on that side. Epoch
+ * is pinned, so leaves met while moving right stay allocated.
+ */
+uint64_t PmseTree::countRange(const IndexKeyEntry* start, const IndexKeyEntry* end,
+                              const BSONObj& ordering) {
+    uint64_t i;
+    uint64_t count = 0;
+    int slot = PmseEpochManager::get().pin();
+    persistent_ptr<PmseTreeNode> current = _root;
+    if (current == nullptr) {
+        PmseEpochManager::get().unpin(slot);
+        return 0;
+    }
+    current->_pmutex.lock_shared();
+    while (!current->is_leaf) {
+        i = 0;
+        while (start && i < current->num_keys &&
+               IndexKeyEntry_PM::compareEntries(*start, current->keys[i], ordering) >= 0) {
+            i++;
         }
-        return counter;
+        auto child = current->children_array[i];
+        child->_pmutex.lock_shared();
+        current->_pmutex.unlock_shared();
+        current = child;
     }
-    return 0;
+    i = 0;
+    while (start && i < current->num_keys &&
+           IndexKeyEntry_PM::compareEntries(*start, current->keys[i], ordering) > 0) {
+        i++;
+    }
+    while (true) {
+        uint64_t numKeys = current->num_keys;
+        if (i < numKeys) {
+            if (!end ||
+                IndexKeyEntry_PM::compareEntries(*end, current->keys[numKeys - 1], ordering) >= 0) {
+                count += numKeys - i;
+            } else {
+                while (IndexKeyEntry_PM::compareEntries(*end, current->keys[i], ordering) >= 0) {
+                    count++;
+                    i++;
+                }
+                break;
+            }
+        }
+        auto next = current->next;
+        if (next == nullptr)
+            break;
+        next->_pmutex.lock_shared();
+        current->_pmutex.unlock_shared();
+        current = next;
+        i = 0;
+    }
+    current->_pmutex.unlock_shared();
+    PmseEpochManager::get().unpin(slot);
+    return count;
+}
+
+uint64_t PmseTree::spaceUsed() {
+    if (_art)
+        return _art->spaceUsed();
+    if (isEmpty())
+        return 0;
+    return nodeSpace(_root);
+}
+
+uint64_t PmseTree::nodeSpace(persistent_ptr<PmseTreeNode> node) {
+    uint64_t size = sizeof(PmseTreeNode) + sizeof(IndexKeyEntry_PM[TREE_ORDER]);
+    for (uint64_t i = 0; i < node->num_keys; i++) {
+        uint64_t refs = sharedKeyRefs(node->keys[i].data);
+        // Shared key is counted in parts by entries pointing to it
+        if (refs)
+            size += (node->keys[i].getBSON().objsize() + sizeof(refs)) / refs;
+        else
+            size += node->keys[i].getBSON().objsize();
+    }
+    if (!node->is_leaf) {
+        for (uint64_t i = 0; i <= node->num_keys; i++) {
+            size += nodeSpace(node->children_array[i]);
+        }
+    }
+    return size;
 }
 
 bool PmseTree::isEmpty() {
+    if (_art)
+        return _art->isEmpty();
     return _first == nullptr;
 }
 
+/*
+ * Frees all nodes and keys, used when index is dropped from shared pool.
+ * Must be called within transaction.
+ */
+void PmseTree::freeAll() {
+    if (_art) {
+        _art->freeAll();
+        delete_persistent<PmseArt>(_art);
+        _art = nullptr;
+    }
+    if (_root)
+        freeNode(_root);
+    _root = nullptr;
+    _first = nullptr;
+    _last = nullptr;
+    _current = nullptr;
+    freeRetired(_retired);
+    _retired = nullptr;
+}
+
+void PmseTree::open() {
+    if (_instance == PmseEpochManager::get().instance())
+        return;
+    _instance = PmseEpochManager::get().instance();
+    _appending = false;
+    freeRetired(_retired);
+    _retired = nullptr;
+    // Versions left in nodes by previous runs stay below new range
+    _generation = _generation + 1;
+    _nextVersion = _generation << 40;
+}
+
+bool PmseTree::useArt() {
+    if (!_art && !_root)
+        _art = make_persistent<PmseArt>();
+    return _art != nullptr;
+}
+
+/*
+ * True when entry goes after all entries of rightmost leaf
+ */
+bool PmseTree::isAppend(persistent_ptr<PmseTreeNode> node, IndexKeyEntry& entry,
+                        const BSONObj& ordering, bool dupsAllowed) {
+    if (node->next != nullptr || node->num_keys == 0)
+        return false;
+    IndexKeyEntry_PM& last = node->keys[node->num_keys - 1];
+    if (dupsAllowed)
+        return IndexKeyEntry_PM::compareEntries(entry, last, ordering) > 0;
+    // Key itself must be greater, then it cannot be duplicate
+    return entry.key.woCompare(last.getBSON(), ordering, false) > 0;
+}
+
+/*
+ * Inserts entry into _last without descending from root when keys come in
+ * increasing order. _last only changes under lock of leaf it points to, so
+ * leaf locked and still equal to _last is rightmost one. Returns false
+ * when entry does not go to end of that leaf or leaf is full.
+ */
+bool PmseTree::appendToLast(pool_base pop, IndexKeyEntry& entry, const BSONObj& ordering,
+                            bool dupsAllowed, Status& status) {
+    int slot = PmseEpochManager::get().pin();
+    persistent_ptr<PmseTreeNode> node = _last;
+    if (node == nullptr) {
+        PmseEpochManager::get().unpin(slot);
+        return false;
+    }
+    node->_pmutex.lock();
+    bool append = node == _last && node->num_keys < TREE_ORDER &&
+                  isAppend(node, entry, ordering, dupsAllowed);
+    if (append) {
+        try {
+            transaction::exec_tx(pop, [this, &status, &node, &entry, ordering] {
+                status = insertKeyIntoLeaf(node, entry, ordering);
+            });
+        } catch (std::exception &e) {
+            log() << "Index: " << e.what();
+            status = Status(ErrorCodes::CommandFailed, e.what());
+        }
+    }
+    node->_pmutex.unlock();
+    PmseEpochManager::get().unpin(slot);
+    if (!append)
+        _appending = false;
+    return append;
+}
+
+/*
+ * Allocates key of new leaf entry. Entry with same key bytes as its
+ * neighbor shares neighbor's key, first duplicate of key not shared yet
+ * gets own copy other duplicates can share. Must be called within
+ * transaction.
+ */
+persistent_ptr<char> PmseTree::allocateLeafKey(const BSONObj& key, IndexKeyEntry_PM* left,
+                                               IndexKeyEntry_PM* right) {
+    bool duplicate = false;
+    for (auto neighbor : {left, right}) {
+        if (neighbor == nullptr || !key.binaryEqual(neighbor->getBSON()))
+            continue;
+        uint64_t refs = sharedKeyRefs(neighbor->data);
+        if (refs) {
+            char* counter = neighbor->data.get() + key.objsize();
+            pmemobj_tx_add_range_direct(counter, sizeof(refs));
+            refs++;
+            memcpy(counter, &refs, sizeof(refs));
+            return neighbor->data;
+        }
+        duplicate = true;
+    }
+    persistent_ptr<char> data;
+    if (duplicate) {
+        uint64_t refs = 1;
+        data = pmemobj_tx_alloc(key.objsize() + sizeof(refs), SHARED_KEY_TYPE);
+        memcpy(static_cast<void*>(data.get() + key.objsize()), &refs, sizeof(refs));
+    } else {
+        data = pmemobj_tx_alloc(key.objsize(), 1);
+    }
+    memcpy(static_cast<void*>(data.get()), key.objdata(), key.objsize());
+    return data;
+}
+
+/*
+ * Number of entries sharing key, 0 when key is not shared
+ */
+uint64_t PmseTree::sharedKeyRefs(persistent_ptr<char> data) {
+    if (pmemobj_type_num(data.raw()) != SHARED_KEY_TYPE)
+        return 0;
+    uint64_t refs;
+    memcpy(&refs, data.get() + BSONObj(data.get()).objsize(), sizeof(refs));
+    return refs;
+}
+
+/*
+ * Frees key of removed entry, shared key once no entry points to it.
+ * Must be called within transaction.
+ */
+void PmseTree::releaseKey(persistent_ptr<char> data) {
+    uint64_t refs = sharedKeyRefs(data);
+    if (refs > 1) {
+        char* counter = data.get() + BSONObj(data.get()).objsize();
+        pmemobj_tx_add_range_direct(counter, sizeof(refs));
+        refs--;
+        memcpy(counter, &refs, sizeof(refs));
+        return;
+    }
+    pmemobj_tx_free(data.raw());
+}
+
+/*
+ * Gives entries at start of right leaf own copy of key they share with end
+ * of left leaf, after entries moved between them. Counter of shared key is
+ * then changed only under lock of one leaf. Must be called within
+ * transaction, with both leaves locked.
+ */
+void PmseTree::unshareKeys(persistent_ptr<PmseTreeNode> left, persistent_ptr<PmseTreeNode> right) {
+    if (left->num_keys == 0 || right->num_keys == 0)
+        return;
+    persistent_ptr<char> data = left->keys[left->num_keys - 1].data;
+    uint64_t refs = sharedKeyRefs(data);
+    if (right->keys[0].data != data || refs == 0)
+        return;
+    uint64_t run = 0;
+    while (run < right->num_keys && right->keys[run].data == data)
+        run++;
+    BSONObj key(data.get());
+    char* counter = data.get() + key.objsize();
+    pmemobj_tx_add_range_direct(counter, sizeof(refs));
+    refs -= run;
+    memcpy(counter, &refs, sizeof(refs));
+
+    persistent_ptr<char> copy;
+    if (run > 1) {
+        copy = pmemobj_tx_alloc(key.objsize() + sizeof(run), SHARED_KEY_TYPE);
+        memcpy(static_cast<void*>(copy.get() + key.objsize()), &run, sizeof(run));
+    } else {
+        copy = pmemobj_tx_alloc(key.objsize(), 1);
+    }
+    memcpy(static_cast<void*>(copy.get()), key.objdata(), key.objsize());
+    for (uint64_t i = 0; i < run; i++)
+        right->keys[i].data = copy;
+}
+
+void PmseTree::setSuffixTruncation(bool enabled) {
+    _suffixTruncation = enabled;
+}
+
+/*
+ * Separator for leaves ending with left and starting with right: leading
+ * fields of right up to first one differing from left, remaining fields
+ * replaced by lowest value in their order. With lowest location it sorts
+ * after left and not after right. False when it is not shorter than right.
+ */
+bool PmseTree::shortestSeparator(const BSONObj& left, const BSONObj& right,
+                                 const BSONObj& ordering, BSONObj& separator) {
+    Ordering order = Ordering::make(ordering);
+    BSONObjIterator leftIt(left);
+    BSONObjIterator rightIt(right);
+    BSONObjBuilder builder;
+    bool differs = false;
+    for (int field = 0; rightIt.more(); field++) {
+        BSONElement element = rightIt.next();
+        if (!differs) {
+            differs = !leftIt.more() || leftIt.next().woCompare(element, false) != 0;
+            builder.appendAs(element, "");
+        } else if (order.get(field) < 0) {
+            builder.appendMaxKey("");
+        } else {
+            builder.appendMinKey("");
+        }
+    }
+    if (!differs)
+        return false;
+    separator = builder.obj();
+    return separator.objsize() < right.objsize();
+}
+
+void PmseTree::touch(persistent_ptr<PmseTreeNode> node) {
+    node->version = _nextVersion.fetch_add(1) + 1;
+}
+
+/*
+ * Node is already unlinked from tree. Must be called within transaction.
+ */
+void PmseTree::retireNode(persistent_ptr<PmseTreeNode> node) {
+    touch(node);
+    // Counted before its epoch is taken, cursor pinning after it sees the change
+    _retiredNodes.fetch_add(1);
+    uint64_t epoch = PmseEpochManager::get().retireEpoch();
+    stdx::lock_guard<pmem::obj::mutex> guard(_retireMutex);
+    reclaimRetired();
+    node->retiredEpoch = epoch;
+    node->next = _retired;
+    _retired = node;
+}
+
+/*
+ * Frees retired nodes from the newest one no cursor can see to the oldest
+ */
+void PmseTree::reclaimRetired() {
+    persistent_ptr<PmseTreeNode> newer = nullptr;
+    for (auto node = _retired; node != nullptr; newer = node, node = node->next) {
+        if (!PmseEpochManager::get().isSafe(node->retiredEpoch))
+            continue;
+        if (newer != nullptr)
+            newer->next = nullptr;
+        else
+            _retired = nullptr;
+        freeRetired(node);
+        break;
+    }
+}
+
+/*
+ * Keys of retired nodes were moved to other nodes or freed already
+ */
+void PmseTree::freeRetired(persistent_ptr<PmseTreeNode> node) {
+    while (node != nullptr) {
+        auto next = node->next;
+        delete_persistent<IndexKeyEntry_PM[TREE_ORDER]>(node->keys);
+        delete_persistent<PmseTreeNode>(node);
+        node = next;
+    }
+}
+
+void PmseTree::freeNode(persistent_ptr<PmseTreeNode> node) {
+    if (!node->is_leaf) {
+        for (uint64_t i = 0; i <= node->num_keys; i++) {
+            if (node->children_array[i])
+                freeNode(node->children_array[i]);
+        }
+    }
+    for (uint64_t i = 0; i < node->num_keys; i++) {
+        if (node->keys[i].data)
+            releaseKey(node->keys[i].data);
+    }
+    delete_persistent<IndexKeyEntry_PM[TREE_ORDER]>(node->keys);
+    delete_persistent<PmseTreeNode>(node);
+}
+
 }  // namespace mongo
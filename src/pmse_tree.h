@@ -44,8 +44,11 @@
 #include <libpmemobj++/shared_mutex.hpp>
 #include <libpmemobj++/mutex.hpp>
 
+#include <atomic>
+
 #include "mongo/db/storage/sorted_data_interface.h"
 #include "mongo/db/index/index_descriptor.h"
+#include "pmse_art.h"
 
 using namespace pmem::obj;
 
@@ -53,13 +56,19 @@ namespace mongo {
 
 const uint64_t TREE_ORDER = 7;  // number of elements in internal node
 const int64_t BSON_MIN_SIZE = 5;
+/*
+ * Type number of leaf key shared by run of equal entries, its BSON is
+ * followed by 8 byte count of entries pointing to it
+ */
+const uint64_t SHARED_KEY_TYPE = 2;
 
 const uint64_t MIN_END = 1;
 const uint64_t MAX_END = 2;
 
 struct IndexKeyEntry_PM {
  public:
-    static int64_t compareEntries(IndexKeyEntry& leftEntry, IndexKeyEntry_PM& rightEntry, const BSONObj& ordering);
+    static int64_t compareEntries(const IndexKeyEntry& leftEntry, IndexKeyEntry_PM& rightEntry,
+                                  const BSONObj& ordering);
 
     BSONObj getBSON();
     persistent_ptr<char> data;
@@ -91,6 +100,12 @@ struct PmseTreeNode {
     persistent_ptr<PmseTreeNode> parent = nullptr;
     p<bool> is_leaf = false;
     pmem::obj::shared_mutex _pmutex;
+    /*
+     * Stamp changed with every modification of keys of leaf, unique within
+     * tree. Cursor holding shared lock compares it to stay positioned.
+     */
+    uint64_t version = 0;
+    p<uint64_t> retiredEpoch = 0;
 };
 
 struct CursorObject {
@@ -109,9 +124,72 @@ class PmseTree {
 
     uint64_t countElements();
 
+    /*
+     * Bytes of PMEM taken by nodes and keys
+     */
+    uint64_t spaceUsed();
+
+    /*
+     * Counts entries from start to end, both inclusive, without copying them.
+     * Null start or end counts from first or to last entry.
+     */
+    uint64_t countRange(const IndexKeyEntry* start, const IndexKeyEntry* end,
+                        const BSONObj& ordering);
+
     bool isEmpty();
 
+    void freeAll();
+
+    /*
+     * Called when tree is opened. On first open after restart frees nodes
+     * retired by previous run and starts new range of node versions.
+     * Must be called within transaction.
+     */
+    void open();
+
+    /*
+     * Separator keys copied up on leaf split keep only leading fields
+     * needed to tell leaves apart, enabled by default
+     */
+    static void setSuffixTruncation(bool enabled);
+
+    /*
+     * Switches empty index to adaptive radix tree, which then takes all
+     * operations. False when index already holds B+ tree entries and stays
+     * B+ tree. Must be called within transaction.
+     */
+    bool useArt();
+
+    persistent_ptr<PmseArt> art() {
+        return _art;
+    }
+
+    /*
+     * Count of nodes retired by this run. Nodes kept by cursor which
+     * unpinned its epoch are still allocated while it is unchanged.
+     */
+    uint64_t retiredNodes() const {
+        return _retiredNodes.load();
+    }
+
  private:
+    static bool shortestSeparator(const BSONObj& left, const BSONObj& right,
+                                  const BSONObj& ordering, BSONObj& separator);
+    uint64_t nodeSpace(persistent_ptr<PmseTreeNode> node);
+    static persistent_ptr<char> allocateLeafKey(const BSONObj& key, IndexKeyEntry_PM* left,
+                                                IndexKeyEntry_PM* right);
+    static uint64_t sharedKeyRefs(persistent_ptr<char> data);
+    static void releaseKey(persistent_ptr<char> data);
+    static void unshareKeys(persistent_ptr<PmseTreeNode> left, persistent_ptr<PmseTreeNode> right);
+    void freeNode(persistent_ptr<PmseTreeNode> node);
+    void touch(persistent_ptr<PmseTreeNode> node);
+    void retireNode(persistent_ptr<PmseTreeNode> node);
+    void reclaimRetired();
+    void freeRetired(persistent_ptr<PmseTreeNode> node);
+    bool isAppend(persistent_ptr<PmseTreeNode> node, IndexKeyEntry& entry,
+                  const BSONObj& ordering, bool dupsAllowed);
+    bool appendToLast(pool_base pop, IndexKeyEntry& entry, const BSONObj& ordering,
+                      bool dupsAllowed, Status& status);
     pmem::obj::mutex globalMutex;
     void unlockTree(std::list<pmem::obj::shared_mutex*>& locks);
     bool nodeIsSafeForOperation(persistent_ptr<PmseTreeNode> node, bool insert);
@@ -141,21 +219,21 @@ class PmseTree {
                     std::list<pmem::obj::shared_mutex*>& locks);
     persistent_ptr<PmseTreeNode> insertIntoNodeParent(
                     pool_base pop, persistent_ptr<PmseTreeNode> root,
-                    persistent_ptr<PmseTreeNode> node, IndexKeyEntry_PM& new_key,
+                    persistent_ptr<PmseTreeNode> node, const IndexKeyEntry& new_key,
                     persistent_ptr<PmseTreeNode> new_leaf);
     persistent_ptr<PmseTreeNode> allocateNewRoot(
                     pool_base pop, persistent_ptr<PmseTreeNode> left,
-                    IndexKeyEntry_PM& new_key, persistent_ptr<PmseTreeNode> right);
+                    const IndexKeyEntry& new_key, persistent_ptr<PmseTreeNode> right);
     uint64_t getLeftIndex(persistent_ptr<PmseTreeNode> parent,
                           persistent_ptr<PmseTreeNode> left);
     persistent_ptr<PmseTreeNode> insertKeyIntoNode(
                     pool_base pop, persistent_ptr<PmseTreeNode> root,
                     persistent_ptr<PmseTreeNode> parent, uint64_t left_index,
-                    IndexKeyEntry_PM& new_key, persistent_ptr<PmseTreeNode> right);
+                    const IndexKeyEntry& new_key, persistent_ptr<PmseTreeNode> right);
     persistent_ptr<PmseTreeNode> insertToNodeAfterSplit(
                     pool_base pop, persistent_ptr<PmseTreeNode> root,
                     persistent_ptr<PmseTreeNode> old_node, uint64_t left_index,
-                    IndexKeyEntry_PM& new_key, persistent_ptr<PmseTreeNode> right);
+                    const IndexKeyEntry& new_key, persistent_ptr<PmseTreeNode> right);
     persistent_ptr<PmseTreeNode> adjustRoot(persistent_ptr<PmseTreeNode> root);
     persistent_ptr<PmseTreeNode> deleteEntry(pool_base pop, IndexKeyEntry& key,
                                              persistent_ptr<PmseTreeNode> node,
@@ -169,6 +247,19 @@ class PmseTree {
     persistent_ptr<PmseTreeNode> _first;
     persistent_ptr<PmseTreeNode> _last;
     BSONObj _ordering;
+    /*
+     * Nodes removed from tree, freed once no cursor pinned before their
+     * removal can be positioned on them. Linked through next.
+     */
+    persistent_ptr<PmseTreeNode> _retired;
+    pmem::obj::mutex _retireMutex;
+    p<uint64_t> _generation;
+    p<uint64_t> _instance;  // Run which last opened tree
+    persistent_ptr<PmseArt> _art;
+    std::atomic<uint64_t> _nextVersion = {0};
+    std::atomic<uint64_t> _retiredNodes = {0};
+    std::atomic<bool> _appending = {false};  // Last insert went to end of _last
+    static std::atomic<bool> _suffixTruncation;
 };
 
 }  // namespace mongo
@@ -0,0 +1,124 @@
+/*
+ * Copyright 2014-2018, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define MONGO_LOG_DEFAULT_COMPONENT ::mongo::logger::LogComponent::kStorage
+
+#include "pmse_truncate_markers.h"
+
+#include <algorithm>
+#include <limits>
+
+#include "mongo/util/log.h"
+
+namespace mongo {
+
+PmseTruncateMarkers::PmseTruncateMarkers(persistent_ptr<PmseMap<InitData>> mapper)
+    : _mapper(mapper) {
+    _minBytesPerMarker = std::max(static_cast<int64_t>(_mapper->getMax() / kMaxMarkers),
+                                  static_cast<int64_t>(1));
+    uint64_t maxDocs = _mapper->getMaxSize();
+    if (maxDocs != 0 && maxDocs < static_cast<uint64_t>(std::numeric_limits<int64_t>::max())) {
+        _minRecordsPerMarker = std::max(static_cast<int64_t>(maxDocs / kMaxMarkers),
+                                        static_cast<int64_t>(1));
+    } else {
+        _minRecordsPerMarker = 0;
+    }
+}
+
+void PmseTruncateMarkers::recordInserted(const RecordId& id, int64_t bytes) {
+    stdx::lock_guard<stdx::mutex> lock(_mutex);
+    _currentRecords++;
+    _currentBytes += bytes;
+    if (_currentBytes >= _minBytesPerMarker ||
+        (_minRecordsPerMarker && _currentRecords >= _minRecordsPerMarker)) {
+        _markers.emplace_back(_currentRecords, _currentBytes, id);
+        _currentRecords = 0;
+        _currentBytes = 0;
+    }
+    if (hasExcess_inlock())
+        _excessCond.notify_one();
+}
+
+boost::optional<PmseTruncateMarkers::Marker> PmseTruncateMarkers::oldestMarkerIfExcess() {
+    stdx::lock_guard<stdx::mutex> lock(_mutex);
+    if (!hasExcess_inlock())
+        return boost::none;
+    return _markers.front();
+}
+
+void PmseTruncateMarkers::popOldestMarker(int64_t reclaimedRecords) {
+    stdx::lock_guard<stdx::mutex> lock(_mutex);
+    if (!_markers.empty())
+        _markers.pop_front();
+    _reclaimedRecords += reclaimedRecords;
+}
+
+void PmseTruncateMarkers::clear() {
+    stdx::lock_guard<stdx::mutex> lock(_mutex);
+    _markers.clear();
+    _currentRecords = 0;
+    _currentBytes = 0;
+}
+
+void PmseTruncateMarkers::awaitHasExcessOrDead() {
+    stdx::unique_lock<stdx::mutex> lock(_mutex);
+    while (!_isDead && !hasExcess_inlock()) {
+        _excessCond.wait(lock);
+    }
+}
+
+void PmseTruncateMarkers::kill() {
+    stdx::lock_guard<stdx::mutex> lock(_mutex);
+    _isDead = true;
+    _excessCond.notify_one();
+}
+
+bool PmseTruncateMarkers::isDead() {
+    stdx::lock_guard<stdx::mutex> lock(_mutex);
+    return _isDead;
+}
+
+size_t PmseTruncateMarkers::numMarkers() {
+    stdx::lock_guard<stdx::mutex> lock(_mutex);
+    return _markers.size();
+}
+
+int64_t PmseTruncateMarkers::reclaimedRecords() {
+    stdx::lock_guard<stdx::mutex> lock(_mutex);
+    return _reclaimedRecords;
+}
+
+bool PmseTruncateMarkers::hasExcess_inlock() {
+    return !_markers.empty() && _mapper->removalIsNeeded();
+}
+
+}  // namespace mongo
@@ -0,0 +1,102 @@
+/*
+ * Copyright 2014-2018, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SRC_PMSE_TRUNCATE_MARKERS_H_
+#define SRC_PMSE_TRUNCATE_MARKERS_H_
+
+#include "pmse_map.h"
+
+#include <boost/optional.hpp>
+
+#include <deque>
+
+#include "mongo/db/record_id.h"
+#include "mongo/stdx/condition_variable.h"
+#include "mongo/stdx/mutex.h"
+
+namespace mongo {
+
+/*
+ * Truncate markers split capped collection into ranges of records
+ * which are reclaimed as a whole by background thread, so writers
+ * never have to delete anything inline. Markers live only in DRAM,
+ * they are rebuilt from the list when collection is opened.
+ */
+class PmseTruncateMarkers {
+ public:
+    struct Marker {
+        Marker(int64_t records, int64_t bytes, RecordId lastRecord)
+            : records(records), bytes(bytes), lastRecord(lastRecord) {}
+        int64_t records;
+        int64_t bytes;
+        RecordId lastRecord;
+    };
+
+    explicit PmseTruncateMarkers(persistent_ptr<PmseMap<InitData>> mapper);
+
+    void recordInserted(const RecordId& id, int64_t bytes);
+
+    boost::optional<Marker> oldestMarkerIfExcess();
+
+    void popOldestMarker(int64_t reclaimedRecords);
+
+    void clear();
+
+    void awaitHasExcessOrDead();
+
+    void kill();
+
+    bool isDead();
+
+    size_t numMarkers();
+
+    int64_t reclaimedRecords();
+
+ private:
+    bool hasExcess_inlock();
+
+    static const int64_t kMaxMarkers = 10;
+
+    persistent_ptr<PmseMap<InitData>> _mapper;
+    int64_t _minBytesPerMarker;
+    int64_t _minRecordsPerMarker;
+    stdx::mutex _mutex;
+    stdx::condition_variable _excessCond;
+    bool _isDead = false;
+    std::deque<Marker> _markers;
+    int64_t _currentRecords = 0;
+    int64_t _currentBytes = 0;
+    int64_t _reclaimedRecords = 0;
+};
+
+}  // namespace mongo
+#endif  // SRC_PMSE_TRUNCATE_MARKERS_H_
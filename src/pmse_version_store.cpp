@@ -0,0 +1,203 @@
+/*
+ * Copyright 2014-2018, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define MONGO_LOG_DEFAULT_COMPONENT ::mongo::logger::LogComponent::kStorage
+
+#include "pmse_version_store.h"
+
+#include <utility>
+
+#include "mongo/bson/bsonelement.h"
+
+namespace mongo {
+
+PmseSnapshotManager& PmseSnapshotManager::get() {
+    static PmseSnapshotManager manager;
+    return manager;
+}
+
+uint64_t PmseSnapshotManager::visible() const {
+    return _committing.empty() ? _clock : *_committing.begin() - 1;
+}
+
+uint64_t PmseSnapshotManager::openSnapshot() {
+    stdx::lock_guard<stdx::mutex> lock(_mutex);
+    uint64_t snapshot = visible();
+    _snapshots.insert(snapshot);
+    return snapshot;
+}
+
+void PmseSnapshotManager::closeSnapshot(uint64_t snapshot) {
+    stdx::lock_guard<stdx::mutex> lock(_mutex);
+    auto it = _snapshots.find(snapshot);
+    if (it != _snapshots.end())
+        _snapshots.erase(it);
+}
+
+uint64_t PmseSnapshotManager::beginCommit() {
+    stdx::lock_guard<stdx::mutex> lock(_mutex);
+    _committing.insert(++_clock);
+    return _clock;
+}
+
+void PmseSnapshotManager::endCommit(uint64_t timestamp) {
+    stdx::lock_guard<stdx::mutex> lock(_mutex);
+    _committing.erase(timestamp);
+}
+
+uint64_t PmseSnapshotManager::oldestSnapshot() {
+    stdx::lock_guard<stdx::mutex> lock(_mutex);
+    return _snapshots.empty() ? visible() : *_snapshots.begin();
+}
+
+StatusWith<bool> PmseVersionStore::parseEnabled(const BSONObj& options) {
+    BSONElement elem = options["snapshotReads"];
+    if (elem.eoo())
+        return false;
+    if (!elem.isBoolean())
+        return Status(ErrorCodes::BadValue, "snapshotReads must be a boolean");
+    return elem.boolean();
+}
+
+void PmseVersionStore::install(uint64_t id, uint64_t timestamp, bool existed,
+                               std::string data, bool exists) {
+    stdx::lock_guard<stdx::mutex> lock(_mutex);
+    auto inserted = _chains.emplace(id, Chain{0, existed, {}});
+    Chain& chain = inserted.first->second;
+    chain.versions.push_back({chain.liveTimestamp, timestamp, existed, std::move(data)});
+    chain.liveTimestamp = timestamp;
+    chain.liveExists = exists;
+    _versions++;
+    _collectQueue.emplace_back(timestamp, id);
+}
+
+void PmseVersionStore::abandon(uint64_t id, uint64_t timestamp) {
+    stdx::lock_guard<stdx::mutex> lock(_mutex);
+    auto it = _chains.find(id);
+    if (it == _chains.end() || it->second.liveTimestamp != timestamp)
+        return;
+    Chain& chain = it->second;
+    chain.liveTimestamp = chain.versions.back().start;
+    chain.liveExists = chain.versions.back().exists;
+    chain.versions.pop_back();
+    _versions--;
+    if (chain.versions.empty())
+        _chains.erase(it);
+}
+
+bool PmseVersionStore::committedAfter(uint64_t id, uint64_t snapshot) const {
+    stdx::lock_guard<stdx::mutex> lock(_mutex);
+    auto it = _chains.find(id);
+    return it != _chains.end() && it->second.liveTimestamp > snapshot;
+}
+
+const PmseVersionStore::Version* PmseVersionStore::visibleVersion(const Chain& chain,
+                                                                  uint64_t snapshot) const {
+    for (auto it = chain.versions.rbegin(); it != chain.versions.rend(); ++it) {
+        if (it->start <= snapshot && snapshot < it->end)
+            return &*it;
+    }
+    return nullptr;
+}
+
+PmseVersionStore::Visibility PmseVersionStore::lookup(uint64_t id, uint64_t snapshot,
+                                                      std::string* data) const {
+    stdx::lock_guard<stdx::mutex> lock(_mutex);
+    auto it = _chains.find(id);
+    if (it == _chains.end())
+        return Visibility::kLive;
+    const Chain& chain = it->second;
+    if (chain.liveTimestamp <= snapshot)
+        return chain.liveExists ? Visibility::kLive : Visibility::kAbsent;
+    const Version* version = visibleVersion(chain, snapshot);
+    if (!version || !version->exists)
+        return Visibility::kAbsent;
+    *data = version->data;
+    return Visibility::kVersion;
+}
+
+bool PmseVersionStore::nextDeleted(uint64_t after, bool forward, uint64_t snapshot,
+                                   uint64_t* id, std::string* data) const {
+    stdx::lock_guard<stdx::mutex> lock(_mutex);
+    auto it = forward ? _chains.upper_bound(after) : _chains.lower_bound(after);
+    while (forward ? it != _chains.end() : it != _chains.begin()) {
+        if (!forward)
+            --it;
+        const Chain& chain = it->second;
+        if (!chain.liveExists && chain.liveTimestamp > snapshot) {
+            const Version* version = visibleVersion(chain, snapshot);
+            if (version && version->exists) {
+                *id = it->first;
+                *data = version->data;
+                return true;
+            }
+        }
+        if (forward)
+            ++it;
+    }
+    return false;
+}
+
+/*
+ * Only chains with a version ended at or before oldest are visited. Entries
+ * of abandoned versions find nothing to free and are dropped.
+ */
+void PmseVersionStore::collect(uint64_t oldest) {
+    stdx::lock_guard<stdx::mutex> lock(_mutex);
+    while (!_collectQueue.empty() && _collectQueue.front().first <= oldest) {
+        auto it = _chains.find(_collectQueue.front().second);
+        _collectQueue.pop_front();
+        if (it == _chains.end())
+            continue;
+        Chain& chain = it->second;
+        while (!chain.versions.empty() && chain.versions.front().end <= oldest) {
+            chain.versions.pop_front();
+            _versions--;
+        }
+        if (chain.versions.empty() && chain.liveTimestamp <= oldest)
+            _chains.erase(it);
+    }
+}
+
+void PmseVersionStore::clear() {
+    stdx::lock_guard<stdx::mutex> lock(_mutex);
+    _chains.clear();
+    _collectQueue.clear();
+    _versions = 0;
+}
+
+uint64_t PmseVersionStore::versions() const {
+    stdx::lock_guard<stdx::mutex> lock(_mutex);
+    return _versions;
+}
+
+}  // namespace mongo
@@ -0,0 +1,165 @@
+/*
+ * Copyright 2014-2018, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SRC_PMSE_VERSION_STORE_H_
+#define SRC_PMSE_VERSION_STORE_H_
+
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+
+#include "mongo/base/status_with.h"
+#include "mongo/bson/bsonobj.h"
+#include "mongo/stdx/mutex.h"
+
+namespace mongo {
+
+/*
+ * Process wide commit clock. Commits of collections with snapshot reads get
+ * increasing timestamps, a snapshot sees every commit up to the oldest one
+ * still being applied.
+ */
+class PmseSnapshotManager {
+ public:
+    static PmseSnapshotManager& get();
+
+    /*
+     * Returns timestamp of newest fully applied commit and keeps versions
+     * it can see until closeSnapshot
+     */
+    uint64_t openSnapshot();
+
+    void closeSnapshot(uint64_t snapshot);
+
+    /*
+     * Returns timestamp of new commit, invisible to snapshots until endCommit
+     */
+    uint64_t beginCommit();
+
+    void endCommit(uint64_t timestamp);
+
+    /*
+     * Versions ended at or before returned timestamp are seen by no snapshot
+     */
+    uint64_t oldestSnapshot();
+
+ private:
+    uint64_t visible() const;
+
+    stdx::mutex _mutex;
+    uint64_t _clock = 0;
+    std::set<uint64_t> _committing;
+    std::multiset<uint64_t> _snapshots;
+};
+
+/*
+ * Previous states of records of one collection. PMEM keeps only current
+ * state, so a commit saves state it replaces together with timestamps it
+ * was valid between. Readers of older snapshots find it here without
+ * waiting for writers.
+ */
+class PmseVersionStore {
+ public:
+    enum class Visibility { kLive, kVersion, kAbsent };
+
+    /*
+     * Parses snapshotReads from storageEngine.pmse collection options
+     */
+    static StatusWith<bool> parseEnabled(const BSONObj& options);
+
+    /*
+     * Saves state of id replaced by commit with given timestamp, must be
+     * called before commit reaches PMEM
+     */
+    void install(uint64_t id, uint64_t timestamp, bool existed, std::string data, bool exists);
+
+    /*
+     * Drops version installed by commit which could not be applied
+     */
+    void abandon(uint64_t id, uint64_t timestamp);
+
+    /*
+     * True when id was committed after snapshot, writing it would lose that update
+     */
+    bool committedAfter(uint64_t id, uint64_t snapshot) const;
+
+    /*
+     * Tells which state of id snapshot sees. PMEM has to be read before the
+     * call, kLive means that read is valid, kVersion returns saved state.
+     */
+    Visibility lookup(uint64_t id, uint64_t snapshot, std::string* data) const;
+
+    /*
+     * Finds closest id after given one which is deleted in PMEM but still
+     * seen by snapshot
+     */
+    bool nextDeleted(uint64_t after, bool forward, uint64_t snapshot,
+                     uint64_t* id, std::string* data) const;
+
+    /*
+     * Frees versions no snapshot older than oldest can see
+     */
+    void collect(uint64_t oldest);
+
+    void clear();
+
+    uint64_t versions() const;
+
+ private:
+    struct Version {
+        uint64_t start;  // Valid from start up to end of next version or live state
+        uint64_t end;
+        bool exists;
+        std::string data;
+    };
+
+    struct Chain {
+        uint64_t liveTimestamp;
+        bool liveExists;
+        std::deque<Version> versions;  // Oldest first
+    };
+
+    const Version* visibleVersion(const Chain& chain, uint64_t snapshot) const;
+
+    mutable stdx::mutex _mutex;
+    std::map<uint64_t, Chain> _chains;
+    // End timestamp and id of every installed version. Commits of collection
+    // are serialized, so it is ordered by end timestamp.
+    std::deque<std::pair<uint64_t, uint64_t>> _collectQueue;
+    uint64_t _versions = 0;
+};
+
+}  // namespace mongo
+#endif  // SRC_PMSE_VERSION_STORE_H_
@@ -0,0 +1,256 @@
+/*
+ * Copyright 2014-2018, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define MONGO_LOG_DEFAULT_COMPONENT ::mongo::logger::LogComponent::kStorage
+
+#include "pmse_record_store.h"
+#include "pmse_sorted_data_interface.h"
+#include "pmse_write_set.h"
+
+#include "mongo/bson/bsonelement.h"
+
+namespace mongo {
+
+StatusWith<bool> PmseRecordWriteSet::parseEnabled(const BSONObj& options) {
+    BSONElement elem = options["deferredWrites"];
+    if (elem.eoo())
+        return false;
+    if (!elem.isBoolean())
+        return Status(ErrorCodes::BadValue, "deferredWrites must be a boolean");
+    return elem.boolean();
+}
+
+void PmseRecordWriteSet::insert(uint64_t id, const char* data, int len) {
+    _records[id] = {PmseBufferedRecord::Op::kInsert, std::string(data, len)};
+}
+
+void PmseRecordWriteSet::update(uint64_t id, const char* data, int len) {
+    auto it = _records.find(id);
+    if (it != _records.end() && it->second.op == PmseBufferedRecord::Op::kInsert) {
+        it->second.data.assign(data, len);
+        return;
+    }
+    _records[id] = {PmseBufferedRecord::Op::kUpdate, std::string(data, len)};
+}
+
+void PmseRecordWriteSet::remove(uint64_t id) {
+    auto it = _records.find(id);
+    if (it != _records.end() && it->second.op == PmseBufferedRecord::Op::kInsert) {
+        _records.erase(it);
+        return;
+    }
+    _records[id] = {PmseBufferedRecord::Op::kDelete, std::string()};
+}
+
+const PmseBufferedRecord* PmseRecordWriteSet::find(uint64_t id) const {
+    auto it = _records.find(id);
+    return it == _records.end() ? nullptr : &it->second;
+}
+
+PMEMobjpool* PmseRecordWriteSet::pool() const {
+    return _recordStore->writeSetPool();
+}
+
+stdx::mutex* PmseRecordWriteSet::owner() const {
+    return _recordStore->writeOwner();
+}
+
+void PmseRecordWriteSet::check() {
+    _recordStore->checkWriteSet(*this);
+}
+
+void PmseRecordWriteSet::apply(bool revertible) {
+    _undo.clear();
+    _recordStore->applyWriteSet(*this, revertible);
+}
+
+void PmseRecordWriteSet::revert() {
+    _recordStore->revertWriteSet(*this);
+}
+
+void PmseRecordWriteSet::abandon() {
+    _recordStore->abandonWriteSet(*this);
+}
+
+void PmseRecordWriteSet::publish() {
+    _recordStore->publishWriteSet(*this);
+}
+
+/*
+ * Reinserting removed entry only drops the removal
+ */
+void PmseIndexWriteSet::insert(const BSONObj& key, const RecordId& loc, bool dupsAllowed) {
+    IndexKeyEntry entry(key.getOwned(), loc);
+    auto it = _keys.find(entry);
+    if (it != _keys.end() && !it->second.insert) {
+        _keys.erase(it);
+        return;
+    }
+    _keys[entry] = {true, dupsAllowed};
+}
+
+void PmseIndexWriteSet::remove(const BSONObj& key, const RecordId& loc, bool dupsAllowed) {
+    IndexKeyEntry entry(key.getOwned(), loc);
+    auto it = _keys.find(entry);
+    if (it != _keys.end() && it->second.insert) {
+        _keys.erase(it);
+        return;
+    }
+    _keys[entry] = {false, dupsAllowed};
+}
+
+bool PmseIndexWriteSet::removed(const IndexKeyEntry& entry) const {
+    auto it = _keys.find(entry);
+    return it != _keys.end() && !it->second.insert;
+}
+
+bool PmseIndexWriteSet::insertedElsewhere(const BSONObj& key, const RecordId& loc) const {
+    for (auto it = _keys.lower_bound(IndexKeyEntry(key, RecordId::min()));
+         it != _keys.end() && it->first.key.woCompare(key, BSONObj(), false) == 0; ++it) {
+        if (it->second.insert && it->first.loc != loc)
+            return true;
+    }
+    return false;
+}
+
+PMEMobjpool* PmseIndexWriteSet::pool() const {
+    return _index->writeSetPool();
+}
+
+stdx::mutex* PmseIndexWriteSet::owner() const {
+    return _index->writeOwner();
+}
+
+void PmseIndexWriteSet::check() {
+    _index->checkWriteSet(*this);
+}
+
+void PmseIndexWriteSet::apply(bool revertible) {
+    _index->applyWriteSet(*this);
+}
+
+void PmseIndexWriteSet::revert() {
+    _index->revertWriteSet(*this);
+}
+
+bool PmsePendingWrites::resolve(uint64_t id, const PmseBufferedRecord** record) const {
+    auto it = _pending.find(id);
+    if (it == _pending.end()) {
+        it = _applying.find(id);
+        if (it == _applying.end())
+            return false;
+    }
+    *record = &it->second;
+    return true;
+}
+
+bool PmsePendingWrites::find(uint64_t id, PmseBufferedRecord* record) const {
+    stdx::lock_guard<stdx::mutex> lock(_mutex);
+    const PmseBufferedRecord* found;
+    if (!resolve(id, &found))
+        return false;
+    *record = *found;
+    return true;
+}
+
+bool PmsePendingWrites::nextInsert(uint64_t after, bool forward,
+                                   uint64_t* id, std::string* data) const {
+    stdx::lock_guard<stdx::mutex> lock(_mutex);
+    const PmseBufferedRecord* best = nullptr;
+    uint64_t bestId = 0;
+    for (auto records : {&_pending, &_applying}) {
+        auto it = forward ? records->upper_bound(after) : records->lower_bound(after);
+        while (forward ? it != records->end() : it != records->begin()) {
+            if (!forward)
+                --it;
+            const PmseBufferedRecord* current;
+            if (it->second.op == PmseBufferedRecord::Op::kInsert && resolve(it->first, &current) &&
+                current->op != PmseBufferedRecord::Op::kDelete) {
+                if (!best || (forward ? it->first < bestId : it->first > bestId)) {
+                    best = current;
+                    bestId = it->first;
+                }
+                break;
+            }
+            if (forward)
+                ++it;
+        }
+    }
+    if (!best)
+        return false;
+    *id = bestId;
+    *data = best->data;
+    return true;
+}
+
+void PmsePendingWrites::merge(uint64_t id, const PmseBufferedRecord& record,
+                              int64_t countChange, int64_t sizeChange) {
+    stdx::lock_guard<stdx::mutex> lock(_mutex);
+    auto it = _pending.find(id);
+    if (it != _pending.end() && it->second.op == PmseBufferedRecord::Op::kInsert) {
+        if (record.op == PmseBufferedRecord::Op::kDelete)
+            _pending.erase(it);
+        else
+            it->second.data = record.data;
+    } else {
+        _pending[id] = record;
+    }
+    _pendingCount += countChange;
+    _pendingSize += sizeChange;
+    _countChange += countChange;
+    _sizeChange += sizeChange;
+    _empty = _pending.empty() && _applying.empty();
+}
+
+const std::map<uint64_t, PmseBufferedRecord>* PmsePendingWrites::beginApply() {
+    stdx::lock_guard<stdx::mutex> lock(_mutex);
+    if (_pending.empty())
+        return nullptr;
+    _applying.swap(_pending);
+    _applyingCount = _pendingCount;
+    _applyingSize = _pendingSize;
+    _pendingCount = 0;
+    _pendingSize = 0;
+    return &_applying;
+}
+
+void PmsePendingWrites::endApply() {
+    stdx::lock_guard<stdx::mutex> lock(_mutex);
+    _applying.clear();
+    _countChange -= _applyingCount;
+    _sizeChange -= _applyingSize;
+    _applyingCount = 0;
+    _applyingSize = 0;
+    _empty = _pending.empty();
+}
+
+}  // namespace mongo
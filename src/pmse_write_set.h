@@ -0,0 +1,258 @@
+/*
+ * Copyright 2014-2018, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SRC_PMSE_WRITE_SET_H_
+#define SRC_PMSE_WRITE_SET_H_
+
+#include "pmse_recovery_unit.h"
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <string>
+
+#include "mongo/base/status_with.h"
+#include "mongo/bson/bsonobj.h"
+#include "mongo/bson/ordering.h"
+#include "mongo/db/storage/index_entry_comparison.h"
+#include "mongo/stdx/mutex.h"
+
+namespace mongo {
+
+class PmseRecordStore;
+class PmseSortedDataInterface;
+
+struct PmseBufferedRecord {
+    enum class Op { kInsert, kUpdate, kDelete };
+    Op op;
+    std::string data;  // Uncompressed document, empty for deletes
+};
+
+/*
+ * Record writes of one collection made in one unit of work. Nothing reaches
+ * PMEM before commit, so aborted units leave the pool untouched. Ids of new
+ * records are reserved up front, reads of the owning unit see buffered state.
+ */
+class PmseRecordWriteSet : public PmseWriteSet {
+ public:
+    /*
+     * Snapshot is the one unit reads at when collection has snapshot reads,
+     * its commit timestamp is then taken from unit
+     */
+    explicit PmseRecordWriteSet(PmseRecordStore* recordStore, uint64_t snapshot = 0,
+                                PmseRecoveryUnit* unit = nullptr)
+        : _recordStore(recordStore), _snapshot(snapshot), _unit(unit) {}
+
+    /*
+     * Parses deferredWrites from storageEngine.pmse collection options
+     */
+    static StatusWith<bool> parseEnabled(const BSONObj& options);
+
+    void insert(uint64_t id, const char* data, int len);
+
+    void update(uint64_t id, const char* data, int len);
+
+    void remove(uint64_t id);
+
+    void clear() {
+        _records.clear();
+    }
+
+    /*
+     * Returns buffered state of id, nullptr when unit did not touch it
+     */
+    const PmseBufferedRecord* find(uint64_t id) const;
+
+    const std::map<uint64_t, PmseBufferedRecord>& records() const {
+        return _records;
+    }
+
+    uint64_t snapshot() const {
+        return _snapshot;
+    }
+
+    PmseRecoveryUnit* unit() const {
+        return _unit;
+    }
+
+    /*
+     * Timestamp versions of applied writes were installed with, zero when
+     * none were
+     */
+    uint64_t& timestamp() {
+        return _timestamp;
+    }
+
+    /*
+     * Writes restoring states replaced by apply, kept when apply is revertible
+     */
+    std::map<uint64_t, PmseBufferedRecord>& undo() {
+        return _undo;
+    }
+
+    PMEMobjpool* pool() const override;
+
+    stdx::mutex* owner() const override;
+
+    void check() override;
+
+    void apply(bool revertible) override;
+
+    void revert() override;
+
+    void abandon() override;
+
+    void publish() override;
+
+ private:
+    PmseRecordStore* _recordStore;
+    uint64_t _snapshot;
+    PmseRecoveryUnit* _unit;
+    uint64_t _timestamp = 0;
+    std::map<uint64_t, PmseBufferedRecord> _records;
+    std::map<uint64_t, PmseBufferedRecord> _undo;
+};
+
+struct PmseBufferedKey {
+    bool insert;  // False when unit removes committed entry
+    bool dupsAllowed;
+};
+
+/*
+ * Index writes of one unit of work, applied together with its record writes
+ * at commit. Entries are kept in index order, cursors of owning unit merge
+ * them into entries read from tree.
+ */
+class PmseIndexWriteSet : public PmseWriteSet {
+ public:
+    typedef std::map<IndexKeyEntry, PmseBufferedKey, IndexEntryComparison> Keys;
+
+    PmseIndexWriteSet(PmseSortedDataInterface* index, const Ordering& ordering)
+        : _index(index), _keys(IndexEntryComparison(ordering)) {}
+
+    void insert(const BSONObj& key, const RecordId& loc, bool dupsAllowed);
+
+    void remove(const BSONObj& key, const RecordId& loc, bool dupsAllowed);
+
+    /*
+     * True when unit removed committed entry
+     */
+    bool removed(const IndexKeyEntry& entry) const;
+
+    /*
+     * True when unit inserted key with location other than loc
+     */
+    bool insertedElsewhere(const BSONObj& key, const RecordId& loc) const;
+
+    const Keys& keys() const {
+        return _keys;
+    }
+
+    PMEMobjpool* pool() const override;
+
+    stdx::mutex* owner() const override;
+
+    void check() override;
+
+    void apply(bool revertible) override;
+
+    void revert() override;
+
+ private:
+    PmseSortedDataInterface* _index;
+    Keys _keys;
+};
+
+/*
+ * Record writes of committed units which group commit has not applied to
+ * PMEM yet. Commits merge into pending map while the group commit thread
+ * applies previous batch, readers look into both.
+ */
+class PmsePendingWrites {
+ public:
+    bool empty() const {
+        return _empty.load();
+    }
+
+    /*
+     * Copies pending state of id, returns false when there is none
+     */
+    bool find(uint64_t id, PmseBufferedRecord* record) const;
+
+    /*
+     * Finds closest pending insert after id in given direction
+     */
+    bool nextInsert(uint64_t after, bool forward, uint64_t* id, std::string* data) const;
+
+    /*
+     * Adds committed write of id, count and size change are applied to
+     * collection statistics until the write reaches PMEM
+     */
+    void merge(uint64_t id, const PmseBufferedRecord& record,
+               int64_t countChange, int64_t sizeChange);
+
+    /*
+     * Moves pending writes to batch being applied. Returns nullptr when
+     * there is nothing to apply.
+     */
+    const std::map<uint64_t, PmseBufferedRecord>* beginApply();
+
+    /*
+     * Drops batch once it is applied to PMEM or failed to apply
+     */
+    void endApply();
+
+    int64_t countChange() const {
+        return _countChange.load();
+    }
+
+    int64_t sizeChange() const {
+        return _sizeChange.load();
+    }
+
+ private:
+    bool resolve(uint64_t id, const PmseBufferedRecord** record) const;
+
+    mutable stdx::mutex _mutex;
+    std::map<uint64_t, PmseBufferedRecord> _pending;
+    std::map<uint64_t, PmseBufferedRecord> _applying;
+    std::atomic<bool> _empty{true};
+    std::atomic<int64_t> _countChange{0};
+    std::atomic<int64_t> _sizeChange{0};
+    int64_t _pendingCount = 0;
+    int64_t _pendingSize = 0;
+    int64_t _applyingCount = 0;
+    int64_t _applyingSize = 0;
+};
+
+}  // namespace mongo
+#endif  // SRC_PMSE_WRITE_SET_H_
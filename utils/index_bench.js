@@ -0,0 +1,81 @@
+(function() {
+        db = db.getSiblingDB("pmse_bench");
+        var keys = (typeof benchKeys === "undefined") ? 100000 : benchKeys;
+        var seconds = (typeof benchSeconds === "undefined") ? 10 : benchSeconds;
+        var threads = (typeof benchThreads === "undefined") ? 8 : benchThreads;
+
+        function rate(count, start) {
+                return Math.round(count * 1000 / Math.max(new Date() - start, 1));
+        }
+
+        function insertKeys(coll, makeDoc) {
+                var start = new Date();
+                for (var i = 0; i < keys; i += 1000) {
+                        var bulk = coll.initializeOrderedBulkOp();
+                        for (var j = i; j < Math.min(i + 1000, keys); j++)
+                                bulk.insert(makeDoc(j));
+                        bulk.execute();
+                }
+                return rate(keys, start);
+        }
+
+        // Increasing keys, range scans and counts of B+ tree index
+        db.numbers.drop();
+        db.numbers.createIndex({k: 1});
+        print("index increasing inserts: " + insertKeys(db.numbers, function(i) {
+                return {_id: i, k: i};
+        }) + " docs/s");
+
+        var start = new Date();
+        var scanned = 0;
+        for (var from = 0; from < keys; from += 1000)
+                scanned += db.numbers.find({k: {$gte: from, $lt: from + 1000}}, {_id: 0, k: 1})
+                                  .hint({k: 1}).itcount();
+        print("index range scan: " + rate(scanned, start) + " keys/s");
+
+        start = new Date();
+        var counted = 0;
+        for (var from = 0; from < keys; from += 1000)
+                counted += db.numbers.find({k: {$gte: from, $lt: from + 1000}}).hint({k: 1}).count();
+        print("index count range: " + rate(counted, start) + " keys/s");
+
+        // Long keys sharing most of their bytes, radix tree against B+ tree
+        ["art", "btree"].forEach(function(type) {
+                var coll = db.getCollection("urls_" + type);
+                coll.drop();
+                coll.createIndex({url: 1}, {storageEngine: {pmse: {indexType: type}}});
+                var url = function(i) {
+                        return "https://www.example.com/catalog/products/category/" + (i % 100) + "/item/" + i;
+                };
+                var inserts = insertKeys(coll, function(i) {
+                        return {_id: i, url: url(i)};
+                });
+                var start = new Date();
+                for (var i = 0; i < keys; i++)
+                        coll.find({url: url(i)}, {_id: 0, url: 1}).hint({url: 1}).itcount();
+                print(type + " index of url keys: " + inserts + " inserts/s, " +
+                      rate(keys, start) + " seeks/s, " + coll.stats().indexSizes.url_1 + " bytes");
+        });
+
+        // Readers of documents replaced and deleted by concurrent writers
+        var res = benchRun({
+                ops: [
+                        {op: "findOne", ns: "pmse_bench.numbers",
+                         query: {_id: {"#RAND_INT": [0, keys]}}},
+                        {op: "update", ns: "pmse_bench.numbers",
+                         query: {_id: {"#RAND_INT": [0, keys]}},
+                         update: {$set: {pad: "x".repeat(200)}}},
+                        {op: "remove", ns: "pmse_bench.numbers",
+                         query: {_id: {"#RAND_INT": [0, keys]}}},
+                        {op: "insert", ns: "pmse_bench.numbers",
+                         doc: {k: {"#RAND_INT": [0, keys]}}}
+                ],
+                parallel: threads,
+                seconds: seconds,
+                host: db.getMongo().host
+        });
+        print("epoch stress: " + Math.round(res.update + res.delete + res.insert) + " writes/s, " +
+              Math.round(res.findOne) + " reads/s");
+
+        db.dropDatabase();
+})();
@@ -54,6 +54,8 @@ class Test:
         self.drop_before = -1
         self.create_after_drop = -1
         self.is_load = -1
+        self.field_length = -1
+        self.scan_proportion = -1.0
     def toJSON(self):
         return json.dumps(self, default=lambda o: o.__dict__, 
                           sort_keys=True, indent=4)
@@ -67,7 +69,8 @@ def getArgs(str):
 KEYWORDS = set(["THREADS", "JOURNALING", "RECORDS", "OPERATIONS",
                 "READ_PROPORTION", "LOAD",
                 "UPDATE_PROPORTION", "INSERT_PROPORTION", "YCSB_NUMA",
-                "SUITE", "ENDSUITE", "DROP_BEFORE", "CREATE_AFTER_DROP"]) #Add keyword if you need to extend implementation
+                "SUITE", "ENDSUITE", "DROP_BEFORE", "CREATE_AFTER_DROP", "FIELD_LENGTH",
+                "SCAN_PROPORTION"]) #Add keyword if you need to extend implementation
 
 # open meta file
 with open("test_suite.txt", "r") as configfile:
@@ -114,6 +117,10 @@ with open("test_suite.txt", "r") as configfile:
             configurations[len(configurations)-1].drop_before = 1
         elif splittedLine[0] == "CREATE_AFTER_DROP":
             configurations[len(configurations)-1].create_after_drop = 1
+        elif splittedLine[0] == "FIELD_LENGTH":
+            configurations[len(configurations)-1].field_length = args[0]
+        elif splittedLine[0] == "SCAN_PROPORTION":
+            configurations[len(configurations)-1].scan_proportion = args[0]
         elif splittedLine[0] == "ENDSUITE":
             continue
         else:
@@ -133,6 +140,8 @@ for conf in configurations:
     print '{:>20} {:<12}'.format("Update proportion: ", str(conf.update_proportion))
     print '{:>20} {:<12}'.format("Insert proportion: ", str(conf.insert_proportion))
     print '{:>20} {:<12}'.format("NUMA for YCSB: ", conf.ycsb_numa)
+    print '{:>20} {:<12}'.format("Field length: ", str(conf.field_length))
+    print '{:>20} {:<12}'.format("Scan proportion: ", str(conf.scan_proportion))
     print ""
     i = i + 1
 
@@ -157,6 +166,8 @@ with open(results_directory + '/configurations.json', 'w') as jsonconfig:
             test_description.write('{:>20} {:<12}'.format("Update proportion: ", str(conf.update_proportion)) + '\n')
             test_description.write('{:>20} {:<12}'.format("Insert proportion: ", str(conf.insert_proportion)) + '\n')
             test_description.write('{:>20} {:<12}'.format("NUMA for YCSB: ", conf.ycsb_numa) + '\n')
+            test_description.write('{:>20} {:<12}'.format("Field length: ", str(conf.field_length)) + '\n')
+            test_description.write('{:>20} {:<12}'.format("Scan proportion: ", str(conf.scan_proportion)) + '\n')
             test_description.write('\n')
         i = i + 1
 
@@ -192,7 +203,15 @@ for test in configurations:
             generated_commands.append(PATH_TO_MONGO + 'mongo ' + PATH_TO_MONGO + 'create_table.js')
 
         # DROP&CREATE BEFORE NEXT INSERTS
-        generated_commands.append(command_prefix + thread_no + command_suffix + ' ' + PATH_TO_YCSB)
+        command = command_prefix + thread_no + command_suffix + ' ' + PATH_TO_YCSB
+        if test.field_length != -1:
+            command += ' ' + test.field_length
+        if test.scan_proportion != -1.0:
+            # Field length goes before scan proportion, pass default when not set
+            if test.field_length == -1:
+                command += ' 100'
+            command += ' ' + test.scan_proportion
+        generated_commands.append(command)
 
 # Generate script
 with open('testplan.sh','w') as testplan:
@@ -3,7 +3,8 @@
 # ./run_workload.sh suite_name(string) workload_type(string) no_threads(uint) 
 #                   journal(bool) record_count(uint) operation_count(uint)
 #                   readproportion(uint) updateproportion(uint) insertproportion(uint)
-#                   numa_node(uint) ycsb_path
+#                   numa_node(uint) ycsb_path [field_length(uint)]
+#                   [scanproportion(uint)]
 #
 # workload_type can be: run or load according to YCSB documentation
 #
@@ -16,12 +17,28 @@ OLD_PATH=$(pwd)
 
 echo $0 $1 $2 $3 $4 $5 $6 $7 $8 $9 ${10}
 echo "Passed $# argumets to script"
-if [ $# -ne 11 ]; 
+if [ $# -ne 11 ] && [ $# -ne 12 ] && [ $# -ne 13 ];
 then
-	echo "Illegal number of parameters, should be 11. Check script documentation."
+	echo "Illegal number of parameters, should be 11, 12 or 13. Check script documentation."
 	exit 0
 fi
 
+# Each of 10 fields of YCSB document has field_length bytes, 100 by default
+if [ $# -ge 12 ];
+then
+	FIELD_LENGTH="-p fieldlength=${12}"
+else
+	FIELD_LENGTH=""
+fi
+
+# Proportion of short range scans, none by default
+if [ $# -eq 13 ];
+then
+	SCAN_PROPORTION="-p scanproportion=${13}"
+else
+	SCAN_PROPORTION=""
+fi
+
 if [ $4 = "true" ];
 then
 	JOURNALING=journaled
@@ -38,11 +55,11 @@ then
 	if [ ${10} -lt 0 ];
 	then
     	cd $YCSB_PATH
-	    ./bin/ycsb load mongodb -s -threads $3 -p hdrhistogram.percentiles=95,99,99.9,99.99 -p recordcount=$5 -p operationcount=$6 -p readproportion=$7 -p updateproportion=$8 -p insertproportion=$9 -P ./workloads/workloada -p mongodb.url=mongodb://localhost:27017/ycsb -p mongodb.writeConcern=$JOURNALING > $OLD_PATH/results/$1/load_$3.log
+	    ./bin/ycsb load mongodb -s -threads $3 -p hdrhistogram.percentiles=95,99,99.9,99.99 -p recordcount=$5 -p operationcount=$6 -p readproportion=$7 -p updateproportion=$8 -p insertproportion=$9 -P ./workloads/workloada -p mongodb.url=mongodb://localhost:27017/ycsb -p mongodb.writeConcern=$JOURNALING $FIELD_LENGTH $SCAN_PROPORTION > $OLD_PATH/results/$1/load_$3.log
 	    cd $OLD_PATH
 	else
 	    cd $YCSB_PATH
-    	numactl -N ${10} ./bin/ycsb load mongodb -s -threads $3 -p hdrhistogram.percentiles=95,99,99.9,99.99 -p recordcount=$5 -p operationcount=$6 -p readproportion=$7 -p updateproportion=$8 -p insertproportion=$9 -P ./workloads/workloada -p mongodb.url=mongodb://localhost:27017/ycsb -p mongodb.writeConcern=$JOURNALING > $OLD_PATH/results/$1/load_$3.log
+    	numactl -N ${10} ./bin/ycsb load mongodb -s -threads $3 -p hdrhistogram.percentiles=95,99,99.9,99.99 -p recordcount=$5 -p operationcount=$6 -p readproportion=$7 -p updateproportion=$8 -p insertproportion=$9 -P ./workloads/workloada -p mongodb.url=mongodb://localhost:27017/ycsb -p mongodb.writeConcern=$JOURNALING $FIELD_LENGTH $SCAN_PROPORTION > $OLD_PATH/results/$1/load_$3.log
         cd $OLD_PATH
 	fi
 else
@@ -51,11 +68,11 @@ else
 	if [ ${10} -lt 0 ];
 	then
 	    cd $YCSB_PATH
-    	./bin/ycsb run mongodb -s -threads $3 -p hdrhistogram.percentiles=95,99,99.9,99.99 -p recordcount=$5 -p operationcount=$6 -p readproportion=$7 -p updateproportion=$8 -p insertproportion=$9 -P ./workloads/workloada -p mongodb.url=mongodb://localhost:27017/ycsb -p mongodb.writeConcern=$JOURNALING > $OLD_PATH/results/$1/run_$3.log
+    	./bin/ycsb run mongodb -s -threads $3 -p hdrhistogram.percentiles=95,99,99.9,99.99 -p recordcount=$5 -p operationcount=$6 -p readproportion=$7 -p updateproportion=$8 -p insertproportion=$9 -P ./workloads/workloada -p mongodb.url=mongodb://localhost:27017/ycsb -p mongodb.writeConcern=$JOURNALING $FIELD_LENGTH $SCAN_PROPORTION > $OLD_PATH/results/$1/run_$3.log
     	cd $OLD_PATH
     else
         cd $YCSB_PATH
-        numactl -N ${10} ./bin/ycsb run mongodb -s -threads $3 -p hdrhistogram.percentiles=95,99,99.9,99.99 -p recordcount=$5 -p operationcount=$6 -p readproportion=$7 -p updateproportion=$8 -p insertproportion=$9 -P ./workloads/workloada -p mongodb.url=mongodb://localhost:27017/ycsb -p mongodb.writeConcern=$JOURNALING > $OLD_PATH/results/$1/run_$3.log
+        numactl -N ${10} ./bin/ycsb run mongodb -s -threads $3 -p hdrhistogram.percentiles=95,99,99.9,99.99 -p recordcount=$5 -p operationcount=$6 -p readproportion=$7 -p updateproportion=$8 -p insertproportion=$9 -P ./workloads/workloada -p mongodb.url=mongodb://localhost:27017/ycsb -p mongodb.writeConcern=$JOURNALING $FIELD_LENGTH $SCAN_PROPORTION > $OLD_PATH/results/$1/run_$3.log
         cd $OLD_PATH
     fi
 fi